@@ -376,6 +376,35 @@ static void matrixprpl_init(PurplePlugin *plugin)
             purple_account_option_bool_new(
                     _("Prefer Markdown over HTML"),
                     PRPL_ACCOUNT_OPT_PREFER_MARKDOWN, FALSE));
+    protocol_options = g_list_append(protocol_options,
+            purple_account_option_bool_new(
+                    _("Only load room members when they are needed"),
+                    PRPL_ACCOUNT_OPT_LAZY_LOAD_MEMBERS,
+                    DEFAULT_LAZY_LOAD_MEMBERS));
+    protocol_options = g_list_append(protocol_options,
+            purple_account_option_int_new(
+                    _("Time to spend handling updates before letting the UI "
+                      "respond (ms)"),
+                    PRPL_ACCOUNT_OPT_SYNC_SLICE_MS, DEFAULT_SYNC_SLICE_MS));
+    protocol_options = g_list_append(protocol_options,
+            purple_account_option_int_new(
+                    _("Keep retrying when the server is unavailable for (s)"),
+                    PRPL_ACCOUNT_OPT_SYNC_RETRY_SECONDS,
+                    DEFAULT_SYNC_RETRY_SECONDS));
+    protocol_options = g_list_append(protocol_options,
+            purple_account_option_bool_new(
+                    _("Use sliding sync (only load recently active rooms)"),
+                    PRPL_ACCOUNT_OPT_SLIDING_SYNC, DEFAULT_SLIDING_SYNC));
+    protocol_options = g_list_append(protocol_options,
+            purple_account_option_bool_new(
+                    _("Offer to save files which are sent to me"),
+                    PRPL_ACCOUNT_OPT_OFFER_FILES, DEFAULT_OFFER_FILES));
+#ifndef MATRIX_NO_HTTP2
+    protocol_options = g_list_append(protocol_options,
+            purple_account_option_bool_new(
+                    _("Use HTTP/2 with http:// home servers"),
+                    PRPL_ACCOUNT_OPT_HTTP2, DEFAULT_HTTP2));
+#endif
 
     prpl_info.protocol_options = protocol_options;
 }
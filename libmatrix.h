@@ -116,13 +116,39 @@
 #define PRPL_ACCOUNT_OPT_NEXT_BATCH "next_batch"
 #define PRPL_ACCOUNT_OPT_SKIP_OLD_MESSAGES "skip_old_messages"
 #define PRPL_ACCOUNT_OPT_PREFER_MARKDOWN "prefer_markdown"
+#define PRPL_ACCOUNT_OPT_LAZY_LOAD_MEMBERS "lazy_load_members"
+/* Longest we should spend on each slice of work applying a sync (ms) */
+#define PRPL_ACCOUNT_OPT_SYNC_SLICE_MS "sync_slice_ms"
+/* How long to keep retrying a failing /sync before giving up on the
+ * connection (seconds) */
+#define PRPL_ACCOUNT_OPT_SYNC_RETRY_SECONDS "sync_retry_seconds"
 /* Pickled account info from olm_pickle_account */
 #define PRPL_ACCOUNT_OPT_OLM_ACCOUNT_KEYS "olm_account_keys"
 /* Access token, after a login */
 #define PRPL_ACCOUNT_OPT_ACCESS_TOKEN "access_token"
+/* Id of the filter we use for /sync, and the definition it was created
+ * from (so that we can tell when it needs replacing) */
+#define PRPL_ACCOUNT_OPT_SYNC_FILTER_ID "sync_filter_id"
+#define PRPL_ACCOUNT_OPT_SYNC_FILTER "sync_filter"
+/* Use sliding sync instead of /sync */
+#define PRPL_ACCOUNT_OPT_SLIDING_SYNC "sliding_sync"
+/* Set if next_batch is a sliding sync 'pos' rather than a /sync token */
+#define PRPL_ACCOUNT_OPT_NEXT_BATCH_IS_POS "next_batch_is_pos"
+/* Sync token for the to-device messages, when using sliding sync */
+#define PRPL_ACCOUNT_OPT_TO_DEVICE_SINCE "to_device_since"
+/* Offer received files as file transfers, saved straight to disk */
+#define PRPL_ACCOUNT_OPT_OFFER_FILES "offer_file_transfers"
+/* Try HTTP/2 (h2c) when the homeserver url is plain http */
+#define PRPL_ACCOUNT_OPT_HTTP2 "http2"
 
 /* defaults for account options */
 #define DEFAULT_HOME_SERVER "https://matrix.org"
+#define DEFAULT_LAZY_LOAD_MEMBERS TRUE
+#define DEFAULT_SYNC_SLICE_MS 10
+#define DEFAULT_SYNC_RETRY_SECONDS 120
+#define DEFAULT_SLIDING_SYNC FALSE
+#define DEFAULT_OFFER_FILES FALSE
+#define DEFAULT_HTTP2 FALSE
 
 /* identifiers for the chat info / "components" */
 #define PRPL_CHAT_INFO_ROOM_ID "room_id"
@@ -23,7 +23,9 @@
 
 /* json-glib */
 #include <json-glib/json-glib.h>
-#include <http_parser.h>
+
+/* gio */
+#include <gio/gio.h>
 
 /* libpurple */
 #include <debug.h>
@@ -31,15 +33,45 @@
 #include <libpurple/version.h>
 
 #include "libmatrix.h"
+#include "matrix-http.h"
 #include "matrix-json.h"
 
+/* flags for matrix_api_start_full */
+
+/* don't parse the response body as JSON; the callback gets the raw body
+ * instead */
+#define MATRIX_API_FLAG_RAW_RESPONSE 0x1
+
+/* if an identical request is already in flight, share its response rather
+ * than making another. Only for requests without side effects (GETs). */
+#define MATRIX_API_FLAG_COALESCE 0x2
+
+/* a function which writes the (JSON) body of a request directly onto the
+ * end of the request buffer */
+typedef void (*MatrixApiBodyWriter)(MatrixJsonWriter *writer,
+        gpointer writer_data);
+
 struct _MatrixApiRequestData {
-    PurpleUtilFetchUrlData *purple_data;
+    MatrixHttpRequest *http_request;
+    struct _MatrixApiResponseParserData *response_data;
     MatrixConnectionData *conn;
+    guint flags;
     MatrixApiCallback callback;
     MatrixApiErrorCallback error_callback;
     MatrixApiBadResponseCallback bad_response_callback;
+    MatrixApiProgressCallback progress_callback;
+    MatrixApiDataCallback data_callback;
     gpointer user_data;
+
+    /* for coalesced requests: the key in conn->inflight_requests, if we are
+     * the request which is actually being made; the other requests waiting
+     * for our response; and the request we are waiting for, if we are one
+     * of those. */
+    gchar *coalesce_key;
+    GSList *followers;
+    struct _MatrixApiRequestData *leader;
+    /* set if we were cancelled while others were waiting for us */
+    gboolean cancelled;
 };
 
 
@@ -97,45 +129,87 @@ void matrix_api_bad_response(MatrixConnectionData *ma, gpointer user_data,
 
 /******************************************************************************
  *
- * HTTP response parsing
+ * HTTP response handling
+ *
+ * The transport (matrix-http.c) parses the response as it arrives, and hands
+ * us the headers and each piece of the body as soon as it has them.
  */
 
 
-#define HEADER_PARSING_STATE_LAST_WAS_VALUE 0
-#define HEADER_PARSING_STATE_LAST_WAS_FIELD 1
-
-typedef struct {
-    int header_parsing_state;
-    GString *current_header_name;
-    GString *current_header_value;
+typedef struct _MatrixApiResponseParserData {
+    int status_code;
     gchar *content_type;
     gboolean got_headers;
+    gboolean parse_json;
     JsonParser *json_parser;
+
+    /* the body, which is always nul-terminated. body_size is the size of
+     * the buffer. */
     char *body;
     size_t body_len;
+    size_t body_size;
+
+    /* the most we will preallocate for the body; also the most we will
+     * decompress it to */
+    gsize max_len;
+
+    /* for a compressed response: the decompressor, and whether it has seen
+     * the end of the compressed data */
+    GConverter *decompressor;
+    gboolean decompressor_finished;
+    gboolean bad_encoding;
 } MatrixApiResponseParserData;
 
 
+/* the response whose callback is being called, and whether another caller
+ * is still to be given it; see matrix_api_steal_body */
+static MatrixApiResponseParserData *_completing_response = NULL;
+static gboolean _completing_shared = FALSE;
+
+
 /** create a MatrixApiResponseParserData */
-static MatrixApiResponseParserData *_response_parser_data_new()
+static MatrixApiResponseParserData *_response_parser_data_new(
+        gboolean parse_json, gssize max_len)
 {
     MatrixApiResponseParserData *res = g_new0(MatrixApiResponseParserData, 1);
-    res->header_parsing_state = HEADER_PARSING_STATE_LAST_WAS_VALUE;
-    res->current_header_name = g_string_new("");
-    res->current_header_value = g_string_new("");
+    res->parse_json = parse_json;
     res->json_parser = json_parser_new();
+    res->max_len = max_len > 0 ? max_len : MATRIX_HTTP_DEFAULT_MAX_LEN;
     return res;
 }
 
+
+/**
+ * Make sure there is room for at least len more bytes of body (plus the
+ * nul). We double the buffer each time, so that a big body arriving in lots
+ * of small pieces doesn't get copied over and over.
+ */
+static void _response_body_reserve(MatrixApiResponseParserData *data,
+        gsize len)
+{
+    gsize needed = data->body_len + len + 1;
+    gsize new_size;
+
+    if(needed <= data->body_size)
+        return;
+
+    new_size = MAX(data->body_size * 2, 4096);
+    while(new_size < needed)
+        new_size *= 2;
+
+    data->body = g_realloc(data->body, new_size);
+    data->body_size = new_size;
+}
+
 /** free a MatrixApiResponseParserData */
 static void _response_parser_data_free(MatrixApiResponseParserData *data)
 {
     if(data == NULL)
         return;
 
-    g_string_free(data->current_header_name, TRUE);
-    g_string_free(data->current_header_value, TRUE);
     g_free(data->content_type);
+    if(data->decompressor)
+        g_object_unref(data->decompressor);
 
     /* free the JSON parser, and all of the node structures */
     if(data -> json_parser)
@@ -146,104 +220,204 @@ static void _response_parser_data_free(MatrixApiResponseParserData *data)
     g_free(data);
 }
 
-static void _handle_header_completed(MatrixApiResponseParserData *response_data)
-{
-    const gchar *name = response_data->current_header_name->str,
-            *value = response_data->current_header_value->str;
 
-    if(*name == '\0') {
-        /* nothing to do here */
-        return;
+static void _request_data_free(MatrixApiRequestData *data)
+{
+    if(data->coalesce_key != NULL) {
+        g_hash_table_remove(data->conn->inflight_requests,
+                data->coalesce_key);
+        g_free(data->coalesce_key);
     }
+    _response_parser_data_free(data->response_data);
+    g_free(data);
+}
+
+
+/**
+ * callback from the transport which handles a response header
+ */
+static void _handle_header(MatrixHttpRequest *http_request,
+        gpointer user_data, const gchar *name, const gchar *value)
+{
+    MatrixApiRequestData *data = user_data;
+    MatrixApiResponseParserData *response_data = data->response_data;
 
     if(purple_debug_is_verbose())
         purple_debug_info("matrixprpl", "Handling API response header %s: %s\n",
                 name, value);
 
-    if(strcmp(name, "Content-Type") == 0) {
+    if(g_ascii_strcasecmp(name, "Content-Type") == 0) {
         g_free(response_data->content_type);
         response_data->content_type = g_strdup(value);
+    } else if(g_ascii_strcasecmp(name, "Content-Encoding") == 0) {
+        /* we only ask for gzip and deflate. (HTTP's "deflate" is really
+         * zlib format.) */
+        if(response_data->decompressor != NULL) {
+            response_data->bad_encoding = TRUE;
+        } else if(g_ascii_strcasecmp(value, "gzip") == 0 ||
+                g_ascii_strcasecmp(value, "x-gzip") == 0) {
+            response_data->decompressor = G_CONVERTER(g_zlib_decompressor_new(
+                    G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+        } else if(g_ascii_strcasecmp(value, "deflate") == 0) {
+            response_data->decompressor = G_CONVERTER(g_zlib_decompressor_new(
+                    G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+        } else if(g_ascii_strcasecmp(value, "identity") != 0) {
+            response_data->bad_encoding = TRUE;
+        }
     }
 }
 
-/**
- * callback from the http parser which handles a header name
- */
-static int _handle_header_field(http_parser *http_parser, const char *at,
-        size_t length)
+
+static void _handle_headers_complete(MatrixHttpRequest *http_request,
+        gpointer user_data, int status_code, gint64 content_length)
 {
-    MatrixApiResponseParserData *response_data = http_parser->data;
+    MatrixApiRequestData *data = user_data;
+    MatrixApiResponseParserData *response_data = data->response_data;
 
-    if (response_data->header_parsing_state ==
-            HEADER_PARSING_STATE_LAST_WAS_VALUE) {
-        /* starting a new header */
-        _handle_header_completed(response_data);
+    response_data->status_code = status_code;
+    response_data->got_headers = TRUE;
 
-        g_string_truncate(response_data -> current_header_name, 0);
-        g_string_truncate(response_data -> current_header_value, 0);
+    /* if we know how big the body will be, allocate it all now, so that we
+     * don't need to copy it as it grows. We don't trust the server with more
+     * than the response limit, though. (For a compressed response, the
+     * length is the compressed size, so is no use to us.) */
+    if(content_length > 0 && content_length <= response_data->max_len &&
+            response_data->body == NULL &&
+            response_data->decompressor == NULL &&
+            data->data_callback == NULL) {
+        response_data->body_size = content_length + 1;
+        response_data->body = g_malloc(response_data->body_size);
+        response_data->body[0] = '\0';
     }
-
-    g_string_append_len(response_data -> current_header_name, at, length);
-    response_data->header_parsing_state = HEADER_PARSING_STATE_LAST_WAS_FIELD;
-    return 0;
 }
 
+
 /**
- * callback from the http parser which handles a header value
+ * Decompress a piece of a compressed body onto the end of the body buffer
+ *
+ * @returns FALSE if the body is corrupt or too big
  */
-static int _handle_header_value(http_parser *http_parser, const char *at,
-        size_t length)
+static gboolean _decompress_body(MatrixApiResponseParserData *response_data,
+        const gchar *at, gsize length)
 {
-    MatrixApiResponseParserData *response_data = http_parser->data;
-    g_string_append_len(response_data -> current_header_value, at, length);
-    response_data->header_parsing_state = HEADER_PARSING_STATE_LAST_WAS_VALUE;
-    return 0;
-}
+    /* the decompressor may have output left to give us after it has read
+     * all of its input, so keep going until it stops producing any */
+    while(!response_data->decompressor_finished) {
+        GConverterResult res;
+        gsize bytes_read = 0, bytes_written = 0;
+        GError *err = NULL;
+
+        _response_body_reserve(response_data, MAX(length * 4, 16384));
+        res = g_converter_convert(response_data->decompressor, at, length,
+                response_data->body + response_data->body_len,
+                response_data->body_size - response_data->body_len - 1,
+                G_CONVERTER_NO_FLAGS, &bytes_read, &bytes_written, &err);
+
+        if(res == G_CONVERTER_ERROR) {
+            if(g_error_matches(err, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+                /* make more room and try again */
+                g_error_free(err);
+                _response_body_reserve(response_data,
+                        response_data->body_size);
+                continue;
+            }
+            if(g_error_matches(err, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT)) {
+                /* wait for the next piece */
+                g_error_free(err);
+                break;
+            }
+            purple_debug_info("matrixprpl",
+                    "unable to decompress response: %s\n", err->message);
+            g_error_free(err);
+            return FALSE;
+        }
 
+        at += bytes_read;
+        length -= bytes_read;
+        response_data->body_len += bytes_written;
+        response_data->body[response_data->body_len] = '\0';
 
-static int _handle_headers_complete(http_parser *http_parser)
-{
-    MatrixApiResponseParserData *response_data = http_parser->data;
-    _handle_header_completed(response_data);
-    response_data->got_headers = TRUE;
-    return 0;
+        if(response_data->body_len > response_data->max_len) {
+            purple_debug_info("matrixprpl",
+                    "decompressed response is too large\n");
+            return FALSE;
+        }
+
+        if(res == G_CONVERTER_FINISHED)
+            response_data->decompressor_finished = TRUE;
+        else if(length == 0 && bytes_written == 0)
+            break;
+    }
+    return TRUE;
 }
 
 
 /**
- * callback from the http parser which handles the message body
+ * callback from the transport which handles the message body
  * Can be called multiple times as we accumulate chunks.
  */
-static int _handle_body(http_parser *http_parser, const char *at,
-        size_t length)
+static gboolean _handle_body(MatrixHttpRequest *http_request,
+        gpointer user_data, const gchar *at, gsize length)
 {
-    MatrixApiResponseParserData *response_data = http_parser->data;
+    MatrixApiRequestData *data = user_data;
+    MatrixApiResponseParserData *response_data = data->response_data;
+    gsize old_len = response_data->body_len;
+
+    if(response_data->bad_encoding) {
+        purple_debug_info("matrixprpl",
+                "Unsupported Content-Encoding in response\n");
+        return FALSE;
+    }
+
+    if(response_data->decompressor != NULL) {
+        if(!_decompress_body(response_data, at, length))
+            return FALSE;
+    } else {
+        _response_body_reserve(response_data, length);
+        memcpy(response_data->body + response_data->body_len, at, length);
+        response_data->body_len += length;
+        response_data->body[response_data->body_len] = '\0';
+    }
+
+    /* a streamed download is handed over as it arrives, rather than
+     * accumulated. Error responses are kept, so that we can parse them. */
+    if(data->data_callback != NULL && response_data->status_code < 300) {
+        gboolean ok = TRUE;
+        if(response_data->body_len > 0)
+            ok = data->data_callback(data->conn, data->user_data,
+                    response_data->body, response_data->body_len);
+        response_data->body_len = 0;
+        response_data->body[0] = '\0';
+        return ok;
+    }
+
     if(purple_debug_is_verbose())
         purple_debug_info("matrixprpl", "Handling API response body %.*s\n",
-                (int)length, at);
-
-    response_data->body = g_realloc(response_data->body,
-                                    response_data->body_len + length);
-    memcpy(response_data->body + response_data->body_len, at, length);
-    response_data->body_len += length;
+                (int)(response_data->body_len - old_len),
+                response_data->body + old_len);
 
-    return 0;
+    return TRUE;
 }
 
 /**
- * callback from the http parser after all chunks have arrived.
+ * Called once all of the body has arrived.
+ *
+ * @returns FALSE if the body couldn't be handled
  */
-static int _handle_message_complete(http_parser *http_parser)
+static gboolean _handle_message_complete(
+        MatrixApiResponseParserData *response_data)
 {
-    MatrixApiResponseParserData *response_data = http_parser->data;
     GError *err = NULL;
 
     if (!response_data->content_type) {
             purple_debug_info("matrixprpl", "Missing content type\n");
-            return 1;
+            return FALSE;
     }
         
-    if(strcmp(response_data->content_type, "application/json") == 0) {
+    /* error responses are always parsed, so that the bad_response callback
+     * can see the errcode */
+    if((response_data->parse_json || response_data->status_code >= 300) &&
+            strcmp(response_data->content_type, "application/json") == 0) {
         if(!json_parser_load_from_data(response_data -> json_parser,
                                        response_data->body,
                                        response_data->body_len,
@@ -251,101 +425,121 @@ static int _handle_message_complete(http_parser *http_parser)
             purple_debug_info("matrixprpl", "unable to parse JSON: %s\n",
                     err->message);
             g_error_free(err);
-            return 1;
+            return FALSE;
         }
     }
-    return 0;
+    return TRUE;
 }
 
 
 /**
- * The callback we give to purple_util_fetch_url_request - does some
- * initial processing of the response
+ * Pass the outcome of a request on to one of the callers which wanted it
  */
-static void matrix_api_complete(PurpleUtilFetchUrlData *url_data,
+static void _deliver_response(MatrixApiRequestData *data,
+        MatrixApiResponseParserData *response_data,
+        const gchar *error_message, int response_code, JsonNode *root,
+        gboolean shared)
+{
+    if (error_message) {
+        purple_debug_info("matrixprpl", "Handling error: %s\n", error_message);
+        (data->error_callback)(data->conn, data->user_data, error_message);
+    } else if(response_code >= 300) {
+        purple_debug_info("matrixprpl", "API gave response %i\n",
+                response_code);
+        (data->bad_response_callback)(data->conn, data->user_data,
+                response_code, root);
+    } else if (data->callback) {
+        _completing_response = response_data;
+        _completing_shared = shared;
+        (data->callback)(data->conn, data->user_data, root,
+                         response_data->body, response_data->body_len,
+                         response_data->content_type );
+        _completing_response = NULL;
+    }
+}
+
+
+/**
+ * The callback from the transport at the end of the response - does some
+ * initial processing of the response, and passes it on
+ */
+static void matrix_api_complete(MatrixHttpRequest *http_request,
                                 gpointer user_data,
-                                const gchar *ret_data,
-                                gsize ret_len,
                                 const gchar *error_message)
 {
     MatrixApiRequestData *data = (MatrixApiRequestData *)user_data;
-    MatrixApiResponseParserData *response_data = NULL;
+    MatrixApiResponseParserData *response_data = data->response_data;
     int response_code = -1;
     JsonNode *root = NULL;
     
     if(error_message) {
         purple_debug_warning("matrixprpl", "Error from http request: %s\n",
                 error_message);
-    } else if (purple_debug_is_verbose()) {
-        purple_debug_info("matrixprpl", "Got response: %s\n", ret_data);
+    } else if(!response_data->got_headers) {
+        /* this will happen if we hit EOF before the end of the headers */
+        purple_debug_info("matrixprpl",
+                          "EOF before end of HTTP headers in response\n");
+        error_message = _("Invalid response from homeserver");
+    } else if(response_data->decompressor != NULL &&
+            response_data->body_len > 0 &&
+            !response_data->decompressor_finished) {
+        purple_debug_info("matrixprpl", "Compressed response was truncated\n");
+        error_message = _("Invalid response from homeserver");
+    } else if(!_handle_message_complete(response_data)) {
+        error_message = _("Invalid response from homeserver");
+    } else {
+        response_code = response_data->status_code;
+        root = json_parser_get_root(response_data -> json_parser);
     }
 
-    if(!error_message) {
-        http_parser http_parser;
-        http_parser_settings http_parser_settings;
-        enum http_errno http_error;
-
-        memset(&http_parser, 0, sizeof(http_parser));
-        memset(&http_parser_settings, 0, sizeof(http_parser_settings));
-
-        response_data = _response_parser_data_new();
-
-        http_parser_settings.on_header_field = _handle_header_field;
-        http_parser_settings.on_header_value = _handle_header_value;
-        http_parser_settings.on_headers_complete = _handle_headers_complete;
-        http_parser_settings.on_body = _handle_body;
-        http_parser_settings.on_message_complete = _handle_message_complete;
+    /* stop anyone else joining this request now that it's done: if one of
+     * the callbacks asks for the same thing again, it gets a new request */
+    if(data->coalesce_key != NULL) {
+        g_hash_table_remove(data->conn->inflight_requests,
+                data->coalesce_key);
+        g_free(data->coalesce_key);
+        data->coalesce_key = NULL;
+    }
 
-        http_parser_init(&http_parser, HTTP_RESPONSE);
-        http_parser.data = response_data;
-        http_parser_execute(&http_parser, &http_parser_settings,
-                ret_data, ret_len);
+    if(!data->cancelled)
+        _deliver_response(data, response_data, error_message, response_code,
+                root, data->followers != NULL);
+
+    /* take the followers off the list one at a time, so that a callback can
+     * still cancel one which hasn't been told yet */
+    while(data->followers != NULL) {
+        MatrixApiRequestData *follower = data->followers->data;
+        data->followers = g_slist_delete_link(data->followers,
+                data->followers);
+        _deliver_response(follower, response_data, error_message,
+                response_code, root, data->followers != NULL);
+        g_free(follower);
+    }
 
-        /* we have to do a separate call to tell the parser that we've got to
-         * EOF.
-         */
-        http_parser_execute(&http_parser, &http_parser_settings, ret_data, 0);
+    _request_data_free(data);
+}
 
-        http_error = HTTP_PARSER_ERRNO(&http_parser);
-        if(http_error != HPE_OK) {
-            /* invalid response line */
-            purple_debug_info("matrixprpl",
-                              "Error (%s) parsing HTTP response %s\n",
-                              http_errno_description(http_error), ret_data);
-            error_message = _("Invalid response from homeserver");
-        } else if (!response_data->got_headers) {
-            /* this will happen if we hit EOF before the end of the headers */
-            purple_debug_info("matrixprpl",
-                              "EOF before end of HTTP headers in response %s\n",
-                              ret_data);
-            error_message = _("Invalid response from homeserver");
 
-        } else {
-            response_code = http_parser.status_code;
-        }
-    }
+/**
+ * callback from the transport as the body of the request is sent
+ */
+static void _handle_sent(MatrixHttpRequest *http_request, gpointer user_data,
+        gsize sent, gsize total)
+{
+    MatrixApiRequestData *data = user_data;
 
-    if(!error_message) {
-        root = json_parser_get_root(response_data -> json_parser);
-    }
+    if(data->progress_callback != NULL)
+        data->progress_callback(data->conn, data->user_data, sent, total);
+}
 
-    if (error_message) {
-        purple_debug_info("matrixprpl", "Handling error: %s\n", error_message);
-        (data->error_callback)(data->conn, data->user_data, error_message);
-    } else if(response_code >= 300) {
-        purple_debug_info("matrixprpl", "API gave response %i\n",
-                response_code);
-        (data->bad_response_callback)(data->conn, data->user_data,
-                response_code, root);
-    } else if (data->callback) {
-        (data->callback)(data->conn, data->user_data, root,
-                         response_data->body, response_data->body_len,
-                         response_data->content_type );
-    }
 
-    _response_parser_data_free(response_data);
-    g_free(data);
-}
+static const MatrixHttpResponseHandler _response_handler = {
+    _handle_header,
+    _handle_headers_complete,
+    _handle_body,
+    _handle_sent,
+    matrix_api_complete
+};
 
 /******************************************************************************
  *
@@ -420,20 +614,14 @@ static void _parse_url(const gchar *url, const gchar **host, const gchar **path)
 
 
 /**
- * We have to build our own HTTP requests because:
- *   - libpurple only supports GET
- *   - libpurple's purple_url_parse assumes that the path + querystring is
- *     shorter than 256 bytes.
- *
- *  @returns a GString* which should be freed
+ * Work out the parts of our requests which are the same every time, and
+ * cache them in the connection data: what goes before the path in the
+ * request line, and the headers that every request carries.
  */
-static GString *_build_request(PurpleAccount *acct, const gchar *url,
-        const gchar *method, const gchar *extra_headers,
-        const gchar *body,
-        const gchar *extra_data, gsize extra_len)
+static void _build_request_template(MatrixConnectionData *conn)
 {
-    PurpleProxyInfo *gpi = purple_proxy_get_setup(acct);
-    GString *request_str = g_string_new(NULL);
+    PurpleProxyInfo *gpi = purple_proxy_get_setup(conn->pc->account);
+    GString *headers = g_string_new(NULL);
     const gchar *url_host, *url_path;
     gboolean using_http_proxy = FALSE;
 
@@ -443,96 +631,203 @@ static GString *_build_request(PurpleAccount *acct, const gchar *url,
                 || type == PURPLE_PROXY_HTTP);
     }
 
-    _parse_url(url, &url_host, &url_path);
+    _parse_url(conn->homeserver, &url_host, &url_path);
 
     /* we only support absolute URLs (with schemes) */
     g_assert(url_host != NULL);
 
     /* If we are connecting via a proxy, we should put the whole url
      * in the request line. (But synapse chokes if we do that on a direct
-     * connection.)
+     * connection.) The homeserver url always ends in '/', so url_path is
+     * never empty.
      */
-    g_string_append_printf(request_str, "%s %s HTTP/1.1\r\n",
-            method, using_http_proxy ? url : url_path);
-    g_string_append_printf(request_str, "Host: %.*s\r\n",
+    g_free(conn->request_base);
+    conn->request_base = g_strdup(using_http_proxy ? conn->homeserver :
+            url_path);
+
+    g_string_append_printf(headers, "Host: %.*s\r\n",
             (int)(url_path-url_host), url_host);
 
+    /* a header rather than a query parameter, so that it doesn't end up in
+     * the logs of any proxies on the way */
+    if(conn->access_token != NULL)
+        g_string_append_printf(headers, "Authorization: Bearer %s\r\n",
+                conn->access_token);
+
+    /* /sync responses in particular compress very well */
+    g_string_append(headers, "Accept-Encoding: gzip, deflate\r\n");
+
+    if(using_http_proxy)
+        _add_proxy_auth_headers(headers, gpi);
+
+    g_free(conn->request_headers);
+    conn->request_headers = g_string_free(headers, FALSE);
+}
+
+
+/**
+ * We have to build our own HTTP requests because:
+ *   - libpurple only supports GET
+ *   - libpurple's purple_url_parse assumes that the path + querystring is
+ *     shorter than 256 bytes.
+ *
+ * @param path   the path of the endpoint, relative to the homeserver url
+ * @param body   the body of the request, or NULL
+ * @param body_writer  if non-NULL, called to write the body instead
+ * @param extra_len  the length of any raw data which will be sent after the
+ *                   body. It isn't included in the result.
+ *
+ *  @returns a GString* which should be freed
+ */
+static GString *_build_request(MatrixConnectionData *conn,
+        const gchar *method, const gchar *path, const gchar *extra_headers,
+        const gchar *body, MatrixApiBodyWriter body_writer,
+        gpointer writer_data, gsize extra_len)
+{
+    GString *request_str;
+    gsize body_len = body == NULL ? 0 : strlen(body);
+    gsize body_start;
+    MatrixJsonWriter writer;
+    gchar content_length[64];
+
+    if(conn->request_headers == NULL)
+        _build_request_template(conn);
+
+    /* we can't know how long a written body will be, but event bodies are
+     * mostly short */
+    if(body_writer != NULL)
+        body_len = 256;
+
+    request_str = g_string_sized_new(strlen(conn->request_base) +
+            strlen(path) + strlen(conn->request_headers) +
+            (extra_headers == NULL ? 0 : strlen(extra_headers)) +
+            body_len + 64);
+
+    g_string_append_printf(request_str, "%s %s%s HTTP/1.1\r\n",
+            method, conn->request_base, path);
+    g_string_append(request_str, conn->request_headers);
+
     if (extra_headers != NULL)
         g_string_append(request_str, extra_headers);
-    g_string_append(request_str, "Connection: close\r\n");
-    g_string_append_printf(request_str, "Content-Length: %" G_GSIZE_FORMAT "\r\n",
-            extra_len + (body == NULL ? 0 : strlen(body)));
 
-    if(using_http_proxy)
-        _add_proxy_auth_headers(request_str, gpi);
+    if(body_writer == NULL) {
+        g_string_append_printf(request_str,
+                "Content-Length: %" G_GSIZE_FORMAT "\r\n",
+                extra_len + body_len);
+        g_string_append(request_str, "\r\n");
+        if(body != NULL)
+            g_string_append_len(request_str, body, body_len);
+        return request_str;
+    }
 
+    /* write the body straight into the request, then slot the
+     * Content-Length header in before the blank line once we know it */
     g_string_append(request_str, "\r\n");
-    if(body != NULL)
-        g_string_append(request_str, body);
-
-    if(extra_data != NULL)
-        g_string_append_len(request_str, extra_data, extra_len);
+    body_start = request_str->len;
+    matrix_json_writer_init(&writer, request_str);
+    body_writer(&writer, writer_data);
+    g_snprintf(content_length, sizeof(content_length),
+            "Content-Length: %" G_GSIZE_FORMAT "\r\n",
+            extra_len + request_str->len - body_start);
+    g_string_insert(request_str, body_start - 2, content_length);
 
     return request_str;
 }
 
 
 /**
- * Start an HTTP call to the API
+ * Build the path for an API endpoint, relative to the homeserver url.
  *
- * @param method      HTTP method (eg "GET")
- * @param extra_headers  Extra HTTP headers to add
- * @param body        body of request, or NULL if none
- * @param extra_data  raw binary data to be sent after the body
- * @param extra_len   The length of the raw binary data
- * @param max_len     maximum number of bytes to return from the request. -1 for
- *                    default (512K).
+ * The arguments alternate between literal parts of the path and parameters
+ * (room ids and the like) which need escaping, starting with a literal part.
+ * The list ends with NULL.
  *
- * @returns handle for the request, or NULL if the request couldn't be started
- *   (eg, invalid hostname). In this case, the error_callback will have
- *   been called already.
- * Note: extra_data/extra_len is only available on libpurple >=2.11.0
+ * @returns a GString* which should be freed
  */
-static MatrixApiRequestData *matrix_api_start_full(const gchar *url,
+static GString *_build_path(const gchar *literal, ...)
+{
+    GString *path = g_string_sized_new(128);
+    const gchar *part;
+    gboolean escape = FALSE;
+    va_list args;
+
+    va_start(args, literal);
+    for(part = literal; part != NULL; part = va_arg(args, const gchar *)) {
+        if(escape)
+            g_string_append_uri_escaped(path, part, NULL, FALSE);
+        else
+            g_string_append(path, part);
+        escape = !escape;
+    }
+    va_end(args);
+    return path;
+}
+
+
+/**
+ * The guts of matrix_api_start_full and matrix_api_start_json. At most one
+ * of body and body_writer should be set.
+ */
+static MatrixApiRequestData *_start_request(const gchar *path,
         const gchar *method, const gchar *extra_headers,
-        const gchar *body,
+        const gchar *body, MatrixApiBodyWriter body_writer,
+        gpointer writer_data,
         const gchar *extra_data, gsize extra_len,
         MatrixConnectionData *conn,
         MatrixApiCallback callback, MatrixApiErrorCallback error_callback,
         MatrixApiBadResponseCallback bad_response_callback,
-        gpointer user_data, gssize max_len)
+        gpointer user_data, gssize max_len, guint flags,
+        MatrixHttpClass request_class)
 {
     MatrixApiRequestData *data;
     GString *request;
-    PurpleUtilFetchUrlData *purple_data;
+    gchar *coalesce_key = NULL;
 
     if (error_callback == NULL)
         error_callback = matrix_api_error;
     if (bad_response_callback == NULL)
         bad_response_callback = matrix_api_bad_response;
 
-    /* _build_request assumes the url is absolute, so enforce that here */
-    if(!g_str_has_prefix(url, "http://") &&
-            !g_str_has_prefix(url, "https://")) {
-        gchar *error_msg;
-        error_msg = g_strdup_printf(_("Invalid homeserver URL %s"), url);
-        error_callback(conn, user_data, error_msg);
-        g_free(error_msg);
-        return NULL;
+    /* the same media often turns up in several rooms at once during a
+     * sync; if we're already fetching it, wait for that response */
+    if(flags & MATRIX_API_FLAG_COALESCE) {
+        MatrixApiRequestData *leader = NULL;
+
+        coalesce_key = g_strdup_printf("%s %" G_GSSIZE_FORMAT " %s", method,
+                max_len, path);
+        if(conn->inflight_requests != NULL)
+            leader = g_hash_table_lookup(conn->inflight_requests,
+                    coalesce_key);
+        if(leader != NULL) {
+            purple_debug_info("matrixprpl", "joining in-flight request %s\n",
+                    path);
+            g_free(coalesce_key);
+            data = g_new0(MatrixApiRequestData, 1);
+            data->conn = conn;
+            data->flags = flags;
+            data->callback = callback;
+            data->error_callback = error_callback;
+            data->bad_response_callback = bad_response_callback;
+            data->user_data = user_data;
+            data->leader = leader;
+            leader->followers = g_slist_append(leader->followers, data);
+            return data;
+        }
     }
 
-#if !PURPLE_VERSION_CHECK(2,11,0)
-    if (extra_len) {
+    /* _build_request assumes the url is absolute, so enforce that here */
+    if(!g_str_has_prefix(conn->homeserver, "http://") &&
+            !g_str_has_prefix(conn->homeserver, "https://")) {
         gchar *error_msg;
-        error_msg = g_strdup_printf(_("Feature not available on old purple version"));
+        error_msg = g_strdup_printf(_("Invalid homeserver URL %s"),
+                conn->homeserver);
         error_callback(conn, user_data, error_msg);
         g_free(error_msg);
         return NULL;
     }
-#endif
 
-    request = _build_request(conn->pc->account, url, method, extra_headers,
-                             body, extra_data, extra_len);
+    request = _build_request(conn, method, path, extra_headers,
+                             body, body_writer, writer_data, extra_len);
 
     if(purple_debug_is_unsafe())
         purple_debug_info("matrixprpl", "request %s\n", request->str);
@@ -540,73 +835,178 @@ static MatrixApiRequestData *matrix_api_start_full(const gchar *url,
 
     data = g_new0(MatrixApiRequestData, 1);
     data->conn = conn;
+    data->flags = flags;
     data->callback = callback;
     data->error_callback = error_callback;
     data->bad_response_callback = bad_response_callback;
     data->user_data = user_data;
+    data->response_data = _response_parser_data_new(
+            !(flags & MATRIX_API_FLAG_RAW_RESPONSE), max_len);
 
-#if PURPLE_VERSION_CHECK(2,11,0)
-    purple_data = purple_util_fetch_url_request_data_len_with_account(
-            conn -> pc -> account,
-            url, FALSE, NULL, TRUE, request->str, request->len,
-            TRUE, max_len, matrix_api_complete,
-            data);
-#else
-    purple_data = purple_util_fetch_url_request_len_with_account(
-            conn -> pc -> account,
-            url, FALSE, NULL, TRUE, request->str, TRUE,
-            max_len, matrix_api_complete,
-            data);
-#endif
+    /* the request goes out on one of the connections in the pool, which
+     * takes ownership of it */
+    data->http_request = matrix_http_request_start(conn->http_pool,
+            conn->homeserver, request, extra_data, extra_len, max_len,
+            request_class, &_response_handler, data);
 
-    if(purple_data == NULL) {
-        /* we couldn't start the request. In this case, our callback will
-         * already have been called, which will have freed data.
-         */
-        data = NULL;
-    } else {
-        data->purple_data = purple_data;
+    if(data->http_request == NULL) {
+        gchar *error_msg;
+        error_msg = g_strdup_printf(_("Invalid homeserver URL %s"),
+                conn->homeserver);
+        error_callback(conn, user_data, error_msg);
+        g_free(error_msg);
+        g_free(coalesce_key);
+        _response_parser_data_free(data->response_data);
+        g_free(data);
+        return NULL;
+    }
+
+    if(coalesce_key != NULL) {
+        if(conn->inflight_requests == NULL)
+            conn->inflight_requests = g_hash_table_new(g_str_hash,
+                    g_str_equal);
+        data->coalesce_key = coalesce_key;
+        g_hash_table_insert(conn->inflight_requests, coalesce_key, data);
     }
 
-    g_string_free(request, TRUE);
     return data;
 }
 
 
+/**
+ * Start an HTTP call to the API
+ *
+ * @param path        path of the endpoint, relative to the homeserver url
+ * @param method      HTTP method (eg "GET")
+ * @param extra_headers  Extra HTTP headers to add
+ * @param body        body of request, or NULL if none
+ * @param extra_data  raw binary data to be sent after the body. This is not
+ *                    copied, so must stay valid until one of the callbacks
+ *                    is called.
+ * @param extra_len   The length of the raw binary data
+ * @param max_len     maximum number of bytes to return from the request. -1 for
+ *                    default (512K).
+ * @param flags       MATRIX_API_FLAG_*
+ * @param request_class  the class of request, which sets its priority in
+ *                    the queue for a connection
+ *
+ * @returns handle for the request, or NULL if the request couldn't be started
+ *   (eg, invalid hostname). In this case, the error_callback will have
+ *   been called already.
+ */
+static MatrixApiRequestData *matrix_api_start_full(const gchar *path,
+        const gchar *method, const gchar *extra_headers,
+        const gchar *body,
+        const gchar *extra_data, gsize extra_len,
+        MatrixConnectionData *conn,
+        MatrixApiCallback callback, MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data, gssize max_len, guint flags,
+        MatrixHttpClass request_class)
+{
+    return _start_request(path, method, extra_headers, body, NULL, NULL,
+            extra_data, extra_len, conn, callback, error_callback,
+            bad_response_callback, user_data, max_len, flags, request_class);
+}
+
+
+/**
+ * Start an HTTP call to the API, with a JSON body written by body_writer.
+ * body_writer is called (once) before this returns, so writer_data need not
+ * outlive the call.
+ *
+ * Other parameters are as for matrix_api_start_full.
+ */
+static MatrixApiRequestData *matrix_api_start_json(const gchar *path,
+        const gchar *method, const gchar *extra_headers,
+        MatrixApiBodyWriter body_writer, gpointer writer_data,
+        MatrixConnectionData *conn,
+        MatrixApiCallback callback, MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data, gssize max_len,
+        MatrixHttpClass request_class)
+{
+    return _start_request(path, method, extra_headers, NULL, body_writer,
+            writer_data, NULL, 0, conn, callback, error_callback,
+            bad_response_callback, user_data, max_len, 0, request_class);
+}
+
+
 /**
  * Start an HTTP call to the API; lighter version of matrix_api_start_full
  * since most callers don't need the extras.
  *
+ * @param path        path of the endpoint, relative to the homeserver url
  * @param method      HTTP method (eg "GET")
  * @param body        body of request, or NULL if none
  * @param max_len     maximum number of bytes to return from the request. -1 for
  *                    default (512K).
+ * @param request_class  the class of request
  *
  * @returns handle for the request, or NULL if the request couldn't be started
  *   (eg, invalid hostname). In this case, the error_callback will have
  *   been called already.
  */
-static MatrixApiRequestData *matrix_api_start(const gchar *url,
+static MatrixApiRequestData *matrix_api_start(const gchar *path,
         const gchar *method, const gchar *body,
         MatrixConnectionData *conn,
         MatrixApiCallback callback, MatrixApiErrorCallback error_callback,
         MatrixApiBadResponseCallback bad_response_callback,
-        gpointer user_data, gssize max_len)
+        gpointer user_data, gssize max_len,
+        MatrixHttpClass request_class)
 {
-    return matrix_api_start_full(url, method, NULL, body, NULL, 0, conn,
+    return matrix_api_start_full(path, method, NULL, body, NULL, 0, conn,
             callback, error_callback, bad_response_callback,
-            user_data, max_len);
+            user_data, max_len, 0, request_class);
 }
 
 
 void matrix_api_cancel(MatrixApiRequestData *data)
 {
-    if(data -> purple_data != NULL)
-        purple_util_fetch_url_cancel(data -> purple_data);
-    data -> purple_data = NULL;
-    (data->error_callback)(data->conn, data->user_data, "cancelled");
+    MatrixApiRequestData *leader = data->leader;
+
+    if(leader != NULL) {
+        /* we were waiting on someone else's request: just stop waiting, and
+         * drop the request if nobody else wants it */
+        leader->followers = g_slist_remove(leader->followers, data);
+        (data->error_callback)(data->conn, data->user_data, "cancelled");
+        g_free(data);
+        if(leader->cancelled && leader->followers == NULL)
+            matrix_api_cancel(leader);
+        return;
+    }
 
-    g_free(data);
+    if(!data->cancelled) {
+        data->cancelled = TRUE;
+        (data->error_callback)(data->conn, data->user_data, "cancelled");
+        /* others are waiting for the response, so let it carry on */
+        if(data->followers != NULL)
+            return;
+    }
+
+    if(data -> http_request != NULL)
+        matrix_http_request_cancel(data -> http_request);
+    data -> http_request = NULL;
+    _request_data_free(data);
+}
+
+
+gchar *matrix_api_steal_body(const char *body)
+{
+    MatrixApiResponseParserData *response_data = _completing_response;
+    gchar *res;
+
+    g_return_val_if_fail(response_data != NULL, NULL);
+    g_return_val_if_fail(body != NULL && body == response_data->body, NULL);
+
+    /* the callers still to come need it too */
+    if(_completing_shared)
+        return g_memdup(response_data->body, response_data->body_len + 1);
+
+    res = response_data->body;
+    response_data->body = NULL;
+    response_data->body_len = response_data->body_size = 0;
+    return res;
 }
 
 
@@ -650,88 +1050,88 @@ MatrixApiRequestData *matrix_api_password_login(MatrixConnectionData *conn,
         MatrixApiCallback callback,
         gpointer user_data)
 {
-    gchar *url, *json;
+    gchar *json;
     MatrixApiRequestData *fetch_data;
 
     purple_debug_info("matrixprpl", "logging in %s\n", username);
 
-    url = g_strconcat(conn->homeserver, "_matrix/client/r0/login",
-            NULL);
-
     json = _build_login_body(username, password, device_id);
 
-    fetch_data = matrix_api_start(url, "POST", json, conn, callback,
-            NULL, NULL, user_data, 0);
+    fetch_data = matrix_api_start("_matrix/client/r0/login", "POST", json,
+            conn, callback, NULL, NULL, user_data, 0, MATRIX_HTTP_CLASS_SEND);
     g_free(json);
-    g_free(url);
 
     return fetch_data;
 }
 
 
 MatrixApiRequestData *matrix_api_sync(MatrixConnectionData *conn,
-        const gchar *since, int timeout, gboolean full_state,
+        const gchar *since, const gchar *filter, int timeout,
+        gboolean full_state,
         MatrixApiCallback callback,
         MatrixApiErrorCallback error_callback,
         MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data)
 {
-    GString *url;
+    GString *path;
     MatrixApiRequestData *fetch_data;
 
-    url = g_string_new(conn->homeserver);
-    g_string_append_printf(url,
-            "_matrix/client/r0/sync?access_token=%s&timeout=%i",
-            purple_url_encode(conn->access_token), timeout);
+    path = g_string_new("_matrix/client/r0/sync");
+    g_string_append_printf(path, "?timeout=%i", timeout);
 
-    if(since != NULL)
-        g_string_append_printf(url, "&since=%s", purple_url_encode(since));
+    if(since != NULL) {
+        g_string_append(path, "&since=");
+        g_string_append_uri_escaped(path, since, NULL, FALSE);
+    }
+
+    if(filter != NULL) {
+        g_string_append(path, "&filter=");
+        g_string_append_uri_escaped(path, filter, NULL, FALSE);
+    }
 
     if(full_state)
-        g_string_append(url, "&full_state=true");
+        g_string_append(path, "&full_state=true");
 
     purple_debug_info("matrixprpl", "syncing %s since %s (full_state=%i)\n",
                 conn->pc->account->username, since, full_state);
 
-    /* XXX: stream the response, so that we don't need to allocate so much
-     * memory? But it's JSON
+    /* The response can be huge, so we don't parse it here: matrix-sync.c
+     * picks it apart one room at a time, which saves us building a tree for
+     * the whole thing.
      */
-    fetch_data = matrix_api_start(url->str, "GET", NULL, conn, callback,
-            error_callback, bad_response_callback, user_data, 40*1024*1024);
-    g_string_free(url, TRUE);
+    fetch_data = matrix_api_start_full(path->str, "GET", NULL, NULL, NULL, 0,
+            conn, callback, error_callback, bad_response_callback,
+            user_data, 40*1024*1024, MATRIX_API_FLAG_RAW_RESPONSE,
+            MATRIX_HTTP_CLASS_SYNC);
+    g_string_free(path, TRUE);
     
     return fetch_data;
 }
 
 
-MatrixApiRequestData *matrix_api_send(MatrixConnectionData *conn,
-        const gchar *room_id, const gchar *event_type, const gchar *txn_id,
-        JsonObject *content, MatrixApiCallback callback,
+MatrixApiRequestData *matrix_api_sliding_sync(MatrixConnectionData *conn,
+        const gchar *pos, JsonObject *request, int timeout,
+        MatrixApiCallback callback,
         MatrixApiErrorCallback error_callback,
         MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data)
 {
-    GString *url;
+    GString *path;
     MatrixApiRequestData *fetch_data;
     JsonNode *body_node;
     JsonGenerator *generator;
     gchar *json;
 
-    /* purple_url_encode uses a single static buffer, so we have to build up
-     * the url gradually
-     */
-    url = g_string_new(conn->homeserver);
-    g_string_append(url, "_matrix/client/r0/rooms/");
-    g_string_append(url, purple_url_encode(room_id));
-    g_string_append(url, "/send/");
-    g_string_append(url, purple_url_encode(event_type));
-    g_string_append(url, "/");
-    g_string_append(url, purple_url_encode(txn_id));
-    g_string_append(url, "?access_token=");
-    g_string_append(url, purple_url_encode(conn->access_token));
+    path = g_string_new("_matrix/client/unstable/org.matrix.simplified_msc3575/sync");
+    g_string_append_printf(path, "?timeout=%i", timeout);
+
+    if(pos != NULL) {
+        g_string_append(path, "&pos=");
+        g_string_append_uri_escaped(path, pos, NULL, FALSE);
+    }
 
     body_node = json_node_new(JSON_NODE_OBJECT);
-    json_node_set_object(body_node, content);
+    json_node_set_object(body_node, request);
 
     generator = json_generator_new();
     json_generator_set_root(generator, body_node);
@@ -739,42 +1139,38 @@ MatrixApiRequestData *matrix_api_send(MatrixConnectionData *conn,
     g_object_unref(G_OBJECT(generator));
     json_node_free(body_node);
 
-    purple_debug_info("matrixprpl", "sending %s on %s\n", event_type, room_id);
+    purple_debug_info("matrixprpl", "sliding sync for %s from %s\n",
+                conn->pc->account->username, pos);
 
-    fetch_data = matrix_api_start(url->str, "PUT", json, conn, callback,
-            error_callback, bad_response_callback,
-            user_data, 0);
+    fetch_data = matrix_api_start_full(path->str, "POST", NULL, json, NULL, 0,
+            conn, callback, error_callback, bad_response_callback,
+            user_data, 40*1024*1024, MATRIX_API_FLAG_RAW_RESPONSE,
+            MATRIX_HTTP_CLASS_SYNC);
     g_free(json);
-    g_string_free(url, TRUE);
+    g_string_free(path, TRUE);
 
     return fetch_data;
 }
 
-void matrix_api_invite_user(MatrixConnectionData *conn,
-        const gchar *room_id,
-        const gchar *who,
+
+MatrixApiRequestData *matrix_api_upload_filter(MatrixConnectionData *conn,
+        JsonObject *filter,
         MatrixApiCallback callback,
         MatrixApiErrorCallback error_callback,
         MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data)
 {
-    GString *url;
+    GString *path;
+    MatrixApiRequestData *fetch_data;
     JsonNode *body_node;
     JsonGenerator *generator;
     gchar *json;
 
-    JsonObject *invitee;
-    invitee = json_object_new();
-    json_object_set_string_member(invitee, "user_id", who);
-
-    url = g_string_new(conn->homeserver);
-    g_string_append(url, "_matrix/client/r0/rooms/");
-    g_string_append(url, purple_url_encode(room_id));
-    g_string_append(url, "/invite?access_token=");
-    g_string_append(url, purple_url_encode(conn->access_token));
+    path = _build_path("_matrix/client/r0/user/", conn->user_id, "/filter",
+            NULL);
 
     body_node = json_node_new(JSON_NODE_OBJECT);
-    json_node_set_object(body_node, invitee);
+    json_node_set_object(body_node, filter);
 
     generator = json_generator_new();
     json_generator_set_root(generator, body_node);
@@ -782,14 +1178,102 @@ void matrix_api_invite_user(MatrixConnectionData *conn,
     g_object_unref(G_OBJECT(generator));
     json_node_free(body_node);
 
-    purple_debug_info("matrixprpl", "sending an invite on %s\n", room_id);
+    purple_debug_info("matrixprpl", "uploading sync filter\n");
 
-    matrix_api_start(url->str, "POST", json, conn, callback,
+    fetch_data = matrix_api_start(path->str, "POST", json, conn, callback,
             error_callback, bad_response_callback,
-            user_data, 0);
+            user_data, 10*1024, MATRIX_HTTP_CLASS_SYNC);
     g_free(json);
-    g_string_free(url, TRUE);
-    json_object_unref(invitee);
+    g_string_free(path, TRUE);
+
+    return fetch_data;
+}
+
+
+static void _write_object_body(MatrixJsonWriter *writer, gpointer object)
+{
+    matrix_json_writer_object(writer, object);
+}
+
+MatrixApiRequestData *matrix_api_send(MatrixConnectionData *conn,
+        const gchar *room_id, const gchar *event_type, const gchar *txn_id,
+        JsonObject *content, MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data)
+{
+    GString *path;
+    MatrixApiRequestData *fetch_data;
+
+    path = _build_path("_matrix/client/r0/rooms/", room_id, "/send/",
+            event_type, "/", txn_id, NULL);
+
+    purple_debug_info("matrixprpl", "sending %s on %s\n", event_type, room_id);
+
+    fetch_data = matrix_api_start_json(path->str, "PUT", NULL,
+            _write_object_body, content, conn, callback,
+            error_callback, bad_response_callback,
+            user_data, 0, MATRIX_HTTP_CLASS_SEND);
+    g_string_free(path, TRUE);
+
+    return fetch_data;
+}
+
+MatrixApiRequestData *matrix_api_get_room_members(MatrixConnectionData *conn,
+        const gchar *room_id, const gchar *at,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data)
+{
+    GString *path;
+    MatrixApiRequestData *fetch_data;
+
+    path = _build_path("_matrix/client/r0/rooms/", room_id,
+            "/members?not_membership=leave", NULL);
+    if(at != NULL) {
+        g_string_append(path, "&at=");
+        g_string_append_uri_escaped(path, at, NULL, FALSE);
+    }
+
+    purple_debug_info("matrixprpl", "getting members for %s\n", room_id);
+
+    fetch_data = matrix_api_start(path->str, "GET", NULL, conn, callback,
+            error_callback, bad_response_callback,
+            user_data, 20*1024*1024, MATRIX_HTTP_CLASS_STATE);
+    g_string_free(path, TRUE);
+
+    return fetch_data;
+}
+
+
+static void _write_invite_body(MatrixJsonWriter *writer, gpointer who)
+{
+    matrix_json_writer_begin_object(writer);
+    matrix_json_writer_member(writer, "user_id");
+    matrix_json_writer_string(writer, who);
+    matrix_json_writer_end_object(writer);
+}
+
+void matrix_api_invite_user(MatrixConnectionData *conn,
+        const gchar *room_id,
+        const gchar *who,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data)
+{
+    GString *path;
+
+    path = _build_path("_matrix/client/r0/rooms/", room_id, "/invite", NULL);
+
+    purple_debug_info("matrixprpl", "sending an invite on %s\n", room_id);
+
+    matrix_api_start_json(path->str, "POST", NULL, _write_invite_body,
+            (gpointer)who, conn, callback,
+            error_callback, bad_response_callback,
+            user_data, 0, MATRIX_HTTP_CLASS_SEND);
+    g_string_free(path, TRUE);
 }
 
 MatrixApiRequestData *matrix_api_join_room(MatrixConnectionData *conn,
@@ -799,25 +1283,40 @@ MatrixApiRequestData *matrix_api_join_room(MatrixConnectionData *conn,
         MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data)
 {
-    GString *url;
+    GString *path;
     MatrixApiRequestData *fetch_data;
 
-    url = g_string_new(conn->homeserver);
-    g_string_append(url, "_matrix/client/r0/join/");
-    g_string_append(url, purple_url_encode(room));
-    g_string_append(url, "?access_token=");
-    g_string_append(url, purple_url_encode(conn->access_token));
+    path = _build_path("_matrix/client/r0/join/", room, NULL);
 
     purple_debug_info("matrixprpl", "joining %s\n", room);
 
-    fetch_data = matrix_api_start(url->str, "POST", "{}", conn, callback,
+    fetch_data = matrix_api_start(path->str, "POST", "{}", conn, callback,
             error_callback, bad_response_callback,
-            user_data, 0);
-    g_string_free(url, TRUE);
+            user_data, 0, MATRIX_HTTP_CLASS_SEND);
+    g_string_free(path, TRUE);
 
     return fetch_data;
 }
 
+typedef struct _TypingBody {
+    gboolean typing;
+    gint timeout;
+} TypingBody;
+
+static void _write_typing_body(MatrixJsonWriter *writer, gpointer data)
+{
+    TypingBody *body = data;
+
+    matrix_json_writer_begin_object(writer);
+    matrix_json_writer_member(writer, "typing");
+    matrix_json_writer_boolean(writer, body->typing);
+    if (body->typing == TRUE) {
+        matrix_json_writer_member(writer, "timeout");
+        matrix_json_writer_int(writer, body->timeout);
+    }
+    matrix_json_writer_end_object(writer);
+}
+
 MatrixApiRequestData *matrix_api_typing(MatrixConnectionData *conn,
         const gchar *room_id, gboolean typing,
         gint typing_timeout, MatrixApiCallback callback,
@@ -825,46 +1324,20 @@ MatrixApiRequestData *matrix_api_typing(MatrixConnectionData *conn,
         MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data)
 {
-    GString *url;
+    GString *path;
     MatrixApiRequestData *fetch_data;
-    JsonNode *body_node;
-    JsonGenerator *generator;
-    gchar *json;
-    JsonObject *content;
-
-    /* purple_url_encode uses a single static buffer, so we have to build up
-     * the url gradually
-     */
-    url = g_string_new(conn->homeserver);
-    g_string_append(url, "_matrix/client/r0/rooms/");
-    g_string_append(url, purple_url_encode(room_id));
-    g_string_append(url, "/typing/");
-    g_string_append(url, purple_url_encode(conn->user_id));
-    g_string_append(url, "?access_token=");
-    g_string_append(url, purple_url_encode(conn->access_token));
-
-    body_node = json_node_new(JSON_NODE_OBJECT);
-    content = json_object_new();
-    json_object_set_boolean_member(content, "typing", typing);
-    if (typing == TRUE) {
-        json_object_set_int_member(content, "timeout", typing_timeout);
-    }
-    json_node_set_object(body_node, content);
+    TypingBody body = { typing, typing_timeout };
 
-    generator = json_generator_new();
-    json_generator_set_root(generator, body_node);
-    json = json_generator_to_data(generator, NULL);
-    g_object_unref(G_OBJECT(generator));
-    json_node_free(body_node);
+    path = _build_path("_matrix/client/r0/rooms/", room_id, "/typing/",
+            conn->user_id, NULL);
 
     purple_debug_info("matrixprpl", "typing in %s\n", room_id);
 
-    fetch_data = matrix_api_start(url->str, "PUT", json, conn, callback,
+    fetch_data = matrix_api_start_json(path->str, "PUT", NULL,
+            _write_typing_body, &body, conn, callback,
             error_callback, bad_response_callback,
-            user_data, 0);
-    g_free(json);
-    g_string_free(url, TRUE);
-    json_object_unref(content);
+            user_data, 0, MATRIX_HTTP_CLASS_TYPING);
+    g_string_free(path, TRUE);
 
     return fetch_data;
 }
@@ -877,21 +1350,17 @@ MatrixApiRequestData *matrix_api_leave_room(MatrixConnectionData *conn,
         MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data)
 {
-    GString *url;
+    GString *path;
     MatrixApiRequestData *fetch_data;
 
-    url = g_string_new(conn->homeserver);
-    g_string_append(url, "_matrix/client/r0/rooms/");
-    g_string_append(url, purple_url_encode(room_id));
-    g_string_append(url, "/leave?access_token=");
-    g_string_append(url, purple_url_encode(conn->access_token));
+    path = _build_path("_matrix/client/r0/rooms/", room_id, "/leave", NULL);
 
     purple_debug_info("matrixprpl", "leaving %s\n", room_id);
 
-    fetch_data = matrix_api_start(url->str, "POST", "{}", conn, callback,
+    fetch_data = matrix_api_start(path->str, "POST", "{}", conn, callback,
             error_callback, bad_response_callback,
-            user_data, 0);
-    g_string_free(url, TRUE);
+            user_data, 0, MATRIX_HTTP_CLASS_SEND);
+    g_string_free(path, TRUE);
 
     return fetch_data;
 }
@@ -901,9 +1370,13 @@ MatrixApiRequestData *matrix_api_leave_room(MatrixConnectionData *conn,
  *
  * @param conn             The connection with which to make the request
  * @param ctype            Content type of file
- * @param data             Raw data content of file
+ * @param data             Raw data content of file. This is sent straight
+ *                            from this buffer, so must stay valid until one
+ *                            of the callbacks is called.
  * @param data_len         Length of the data
  * @param callback         Function to be called when the request completes
+ * @param progress_callback  Function to be called as the data is sent; may
+ *                            be NULL
  * @param user_data        Opaque data to be passed to the callback
  */
 MatrixApiRequestData *matrix_api_upload_file(MatrixConnectionData *conn,
@@ -911,26 +1384,27 @@ MatrixApiRequestData *matrix_api_upload_file(MatrixConnectionData *conn,
         MatrixApiCallback callback,
         MatrixApiErrorCallback error_callback,
         MatrixApiBadResponseCallback bad_response_callback,
+        MatrixApiProgressCallback progress_callback,
         gpointer user_data)
 {
-    GString *url, *extra_header;
+    GString *extra_header;
     MatrixApiRequestData *fetch_data;
 
-    url = g_string_new(conn->homeserver);
-    g_string_append(url, "_matrix/media/r0/upload");
-    g_string_append(url, "?access_token=");
-    g_string_append(url, purple_url_encode(conn->access_token));
-
     extra_header = g_string_new("Content-Type: ");
     g_string_append(extra_header, ctype);
     g_string_append(extra_header, "\r\n");
 
-    fetch_data = matrix_api_start_full(url->str, "POST", extra_header->str, "",
-            data, data_len, conn,
-            callback, error_callback, bad_response_callback, user_data, 0);
-    g_string_free(url, TRUE);
+    fetch_data = matrix_api_start_full("_matrix/media/r0/upload", "POST",
+            extra_header->str, "", data, data_len, conn,
+            callback, error_callback, bad_response_callback, user_data, 0, 0,
+            MATRIX_HTTP_CLASS_MEDIA);
     g_string_free(extra_header, TRUE);
 
+    /* nothing is sent until we return to the main loop, so this is soon
+     * enough */
+    if(fetch_data != NULL)
+        fetch_data->progress_callback = progress_callback;
+
     return fetch_data;
 }
 
@@ -960,22 +1434,63 @@ MatrixApiRequestData *matrix_api_download_file(MatrixConnectionData *conn,
         MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data)
 {
-    GString *url;
+    GString *path;
     MatrixApiRequestData *fetch_data;
 
-    url = get_download_url(conn->homeserver, uri);
-    if (!url) {
+    /* Sanity check the uri - TODO: Add more sanity */
+    if (strncmp(uri, "mxc://", 6)) {
         error_callback(conn, user_data, "bad media uri");
         return NULL;
     }
+    path = g_string_new("_matrix/media/r0/download/");
+    g_string_append(path, uri + 6); /* i.e. after the mxc:// */
 
     /* I'd like to validate the headers etc a bit before downloading the
      * data (maybe using _handle_header_completed), also I'm not convinced
      * purple always does sane things on over-size.
      */
-    fetch_data = matrix_api_start(url->str, "GET", NULL, conn, callback,
-            error_callback, bad_response_callback, user_data, max_size);
-    g_string_free(url, TRUE);
+    fetch_data = matrix_api_start_full(path->str, "GET", NULL, NULL, NULL, 0,
+            conn, callback, error_callback, bad_response_callback, user_data,
+            max_size, MATRIX_API_FLAG_COALESCE, MATRIX_HTTP_CLASS_MEDIA);
+    g_string_free(path, TRUE);
+
+    return fetch_data;
+}
+
+/**
+ * Download a file, passing it on a piece at a time
+ * @param uri       URI string in the form mxc://example.com/unique
+ */
+MatrixApiRequestData *matrix_api_download_file_stream(
+        MatrixConnectionData *conn,
+        const gchar *uri,
+        MatrixApiDataCallback data_callback,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data)
+{
+    GString *path;
+    MatrixApiRequestData *fetch_data;
+
+    if (strncmp(uri, "mxc://", 6)) {
+        error_callback(conn, user_data, "bad media uri");
+        return NULL;
+    }
+    path = g_string_new("_matrix/media/r0/download/");
+    g_string_append(path, uri + 6); /* i.e. after the mxc:// */
+
+    /* we don't keep the body, so there's no need to limit its size */
+    fetch_data = matrix_api_start_full(path->str, "GET", NULL, NULL, NULL, 0,
+            conn, callback, error_callback, bad_response_callback, user_data,
+            G_MAXSSIZE, MATRIX_API_FLAG_RAW_RESPONSE,
+            MATRIX_HTTP_CLASS_MEDIA);
+    g_string_free(path, TRUE);
+
+    /* nothing arrives until we return to the main loop, so this is soon
+     * enough */
+    if(fetch_data != NULL)
+        fetch_data->data_callback = data_callback;
 
     return fetch_data;
 }
@@ -993,31 +1508,27 @@ MatrixApiRequestData *matrix_api_download_thumb(MatrixConnectionData *conn,
         MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data)
 {
-    GString *url;
+    GString *path;
     MatrixApiRequestData *fetch_data;
-    char tmp[64];
 
     /* Sanity check the uri - TODO: Add more sanity */
     if (strncmp(uri, "mxc://", 6)) {
         error_callback(conn, user_data, "bad media uri");
         return NULL;
     }
-    url = g_string_new(conn->homeserver);
-    g_string_append(url, "_matrix/media/r0/thumbnail/");
-    g_string_append(url, uri + 6); /* i.e. after the mxc:// */
-    sprintf(tmp, "?width=%u", width);
-    g_string_append(url, tmp);
-    sprintf(tmp, "&height=%u", height);
-    g_string_append(url, tmp);
-    g_string_append(url, scale ? "&method=scale": "&method=crop");
+    path = g_string_new("_matrix/media/r0/thumbnail/");
+    g_string_append(path, uri + 6); /* i.e. after the mxc:// */
+    g_string_append_printf(path, "?width=%u&height=%u", width, height);
+    g_string_append(path, scale ? "&method=scale": "&method=crop");
 
     /* I'd like to validate the headers etc a bit before downloading the
      * data (maybe using _handle_header_completed), also I'm not convinced
      * purple always does sane things on over-size.
      */
-    fetch_data = matrix_api_start(url->str, "GET", NULL, conn, callback,
-            error_callback, bad_response_callback, user_data, max_size);
-    g_string_free(url, TRUE);
+    fetch_data = matrix_api_start_full(path->str, "GET", NULL, NULL, NULL, 0,
+            conn, callback, error_callback, bad_response_callback, user_data,
+            max_size, MATRIX_API_FLAG_COALESCE, MATRIX_HTTP_CLASS_MEDIA);
+    g_string_free(path, TRUE);
 
     return fetch_data;
 }
@@ -1032,21 +1543,36 @@ MatrixApiRequestData *matrix_api_whoami(MatrixConnectionData *conn,
         MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data)
 {
-    GString *url;
     MatrixApiRequestData *fetch_data;
 
-    url = g_string_new(conn->homeserver);
-    g_string_append_printf(url,
-            "_matrix/client/r0/account/whoami?access_token=%s",
-            purple_url_encode(conn->access_token));
-
-    fetch_data = matrix_api_start(url->str, "GET", NULL, conn, callback,
-            error_callback, bad_response_callback, user_data, 10*1024);
-    g_string_free(url, TRUE);
+    fetch_data = matrix_api_start("_matrix/client/r0/account/whoami", "GET",
+            NULL, conn, callback, error_callback, bad_response_callback,
+            user_data, 10*1024, MATRIX_HTTP_CLASS_SEND);
 
     return fetch_data;
 }
 
+typedef struct _UploadKeysBody {
+    JsonObject *device_keys;
+    JsonObject *one_time_keys;
+} UploadKeysBody;
+
+static void _write_upload_keys_body(MatrixJsonWriter *writer, gpointer data)
+{
+    UploadKeysBody *body = data;
+
+    matrix_json_writer_begin_object(writer);
+    if (body->device_keys) {
+        matrix_json_writer_member(writer, "device_keys");
+        matrix_json_writer_object(writer, body->device_keys);
+    }
+    if (body->one_time_keys) {
+        matrix_json_writer_member(writer, "one_time_keys");
+        matrix_json_writer_object(writer, body->one_time_keys);
+    }
+    matrix_json_writer_end_object(writer);
+}
+
 MatrixApiRequestData *matrix_api_upload_keys(MatrixConnectionData *conn,
         JsonObject *device_keys, JsonObject *one_time_keys,
         MatrixApiCallback callback,
@@ -1054,40 +1580,14 @@ MatrixApiRequestData *matrix_api_upload_keys(MatrixConnectionData *conn,
         MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data)
 {
-    GString *url;
     MatrixApiRequestData *fetch_data;
-    JsonNode *body_node;
-    JsonObject *top_obj;
-    JsonGenerator *generator;
-    gchar *json;
-
-    url = g_string_new(conn->homeserver);
-    g_string_append(url, "_matrix/client/r0/keys/upload?access_token=");
-    g_string_append(url, purple_url_encode(conn->access_token));
+    UploadKeysBody body = { device_keys, one_time_keys };
 
-    top_obj = json_object_new();
-    if (device_keys) {
-        json_object_set_object_member(top_obj, "device_keys", device_keys);
-    }
-    if (one_time_keys) {
-        json_object_set_object_member(top_obj, "one_time_keys", one_time_keys);
-    }
-    body_node = json_node_new(JSON_NODE_OBJECT);
-    json_node_set_object(body_node, top_obj);
-    json_object_unref(top_obj);
-
-    generator = json_generator_new();
-    json_generator_set_root(generator, body_node);
-    json = json_generator_to_data(generator, NULL);
-    g_object_unref(G_OBJECT(generator));
-    json_node_free(body_node);
-
-    fetch_data = matrix_api_start_full(url->str, "POST",
-            "Content-Type: application/json", json, NULL, 0,
+    fetch_data = matrix_api_start_json("_matrix/client/r0/keys/upload",
+            "POST", "Content-Type: application/json\r\n",
+            _write_upload_keys_body, &body,
             conn, callback, error_callback, bad_response_callback,
-            user_data, 10*1024);
-    g_free(json);
-    g_string_free(url, TRUE);
+            user_data, 10*1024, MATRIX_HTTP_CLASS_KEYS);
 
     return fetch_data;
 }
@@ -1099,20 +1599,16 @@ MatrixApiRequestData *matrix_api_get_room_state(MatrixConnectionData *conn,
         MatrixApiCallback callback,
         gpointer user_data)
 {
-    GString *url;
+    GString *path;
     MatrixApiRequestData *fetch_data;
 
-    url = g_string_new(conn->homeserver);
-    g_string_append(url, "/_matrix/client/r0/rooms/");
-    g_string_append(url, purple_url_encode(room_id));
-    g_string_append(url, "/state?access_token=");
-    g_string_append(url, purple_url_encode(conn->access_token));
+    path = _build_path("_matrix/client/r0/rooms/", room_id, "/state", NULL);
 
     purple_debug_info("matrixprpl", "getting state for %s\n", room_id);
 
-    fetch_data = matrix_api_start(url->str, NULL, conn, callback,
-            NULL, NULL, user_data, 10*1024*1024);
-    g_string_free(url, TRUE);
+    fetch_data = matrix_api_start(path->str, NULL, conn, callback,
+            NULL, NULL, user_data, 10*1024*1024, MATRIX_HTTP_CLASS_STATE);
+    g_string_free(path, TRUE);
 
     return fetch_data;
 }
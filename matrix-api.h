@@ -102,6 +102,33 @@ typedef void (*MatrixApiBadResponseCallback)(MatrixConnectionData *conn,
         gpointer user_data, int http_response_code,
         struct _JsonNode *json_root);
 
+/**
+ * Signature for functions which are told how an upload is going
+ *
+ * @param conn             The MatrixConnectionData passed into the api method
+ * @param user_data        The user data that your code passed into the api
+ *                         method.
+ * @param sent             The number of bytes of the upload sent so far
+ * @param total            The size of the upload
+ */
+typedef void (*MatrixApiProgressCallback)(MatrixConnectionData *conn,
+        gpointer user_data, gsize sent, gsize total);
+
+/**
+ * Signature for functions which are passed a download as it arrives
+ *
+ * @param conn             The MatrixConnectionData passed into the api method
+ * @param user_data        The user data that your code passed into the api
+ *                         method.
+ * @param data             The next piece of the response body
+ * @param len              The length of data
+ *
+ * @returns FALSE to abandon the download, in which case the error callback
+ *          is called.
+ */
+typedef gboolean (*MatrixApiDataCallback)(MatrixConnectionData *conn,
+        gpointer user_data, const gchar *data, gsize len);
+
 /**
  * Default bad-response callback. We just put the connection into the "error"
  * state.
@@ -122,6 +149,20 @@ void matrix_api_bad_response(MatrixConnectionData *ma, gpointer user_data,
 void matrix_api_cancel(MatrixApiRequestData *request);
 
 
+/**
+ * Take ownership of the raw body passed to a MatrixApiCallback, so that it
+ * can be kept after the callback returns without being copied. This may only
+ * be called from within the callback. If the response is shared with other
+ * callers which asked for the same thing, and they have yet to see it, this
+ * returns a copy instead.
+ *
+ * @param body   the body which was passed to the callback
+ *
+ * @returns the body, which is nul-terminated and should be freed with g_free
+ */
+gchar *matrix_api_steal_body(const char *body);
+
+
 /**
  * call the /login API
  *
@@ -144,11 +185,15 @@ MatrixApiRequestData *matrix_api_password_login(MatrixConnectionData *conn,
  *
  * @param conn       The connection with which to make the request
  * @param since      If non-null, the batch token to start sync from
+ * @param filter     If non-null, the id of a filter previously created with
+ *                      matrix_api_upload_filter
  * @param timeout    Number of milliseconds after which the API will time out if
  *                      no events
  * @param full_state       If true, will do a full state sync instead of an
  *                             incremental sync
- * @param callback         Function to be called when the request completes
+ * @param callback         Function to be called when the request completes.
+ *                             The response is not parsed, so json_root will
+ *                             be NULL; use body/body_len instead.
  * @param error_callback   Function to be called if there is an error making
  *                             the request. If NULL, matrix_api_error will be
  *                             used.
@@ -158,7 +203,63 @@ MatrixApiRequestData *matrix_api_password_login(MatrixConnectionData *conn,
  * @param user_data  Opaque data to be passed to the callback
  */
 MatrixApiRequestData *matrix_api_sync(MatrixConnectionData *conn,
-        const gchar *since, int timeout, gboolean full_state,
+        const gchar *since, const gchar *filter, int timeout,
+        gboolean full_state,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data);
+
+
+/**
+ * Make a request to the sliding sync API (the simplified form of MSC3575,
+ * as described in MSC4186). This is an alternative to /sync which only
+ * returns the rooms in a window of the room list, plus any rooms we have
+ * explicitly subscribed to.
+ *
+ * @param conn       The connection with which to make the request
+ * @param pos        The 'pos' token from the previous response, or NULL to
+ *                      start a new session
+ * @param request    The request body: the lists, room subscriptions and
+ *                      extensions we want
+ * @param timeout    Number of milliseconds after which the API will time out if
+ *                      no events
+ * @param callback         Function to be called when the request completes.
+ *                             As with matrix_api_sync, the response is not
+ *                             parsed.
+ * @param error_callback   Function to be called if there is an error making
+ *                             the request. If NULL, matrix_api_error will be
+ *                             used.
+ * @param bad_response_callback Function to be called if the API gives a non-200
+ *                            response. If NULL, matrix_api_bad_response will be
+ *                            used.
+ * @param user_data  Opaque data to be passed to the callback
+ */
+MatrixApiRequestData *matrix_api_sliding_sync(MatrixConnectionData *conn,
+        const gchar *pos, struct _JsonObject *request, int timeout,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data);
+
+
+/**
+ * Create a filter on the server, for use with matrix_api_sync
+ *
+ * @param conn             The connection with which to make the request
+ * @param filter           The filter definition
+ * @param callback         Function to be called when the request completes.
+ *                             The response contains the filter_id.
+ * @param error_callback   Function to be called if there is an error making
+ *                             the request. If NULL, matrix_api_error will be
+ *                             used.
+ * @param bad_response_callback Function to be called if the API gives a non-200
+ *                            response. If NULL, matrix_api_bad_response will be
+ *                            used.
+ * @param user_data        Opaque data to be passed to the callbacks
+ */
+MatrixApiRequestData *matrix_api_upload_filter(MatrixConnectionData *conn,
+        struct _JsonObject *filter,
         MatrixApiCallback callback,
         MatrixApiErrorCallback error_callback,
         MatrixApiBadResponseCallback bad_response_callback,
@@ -190,6 +291,30 @@ MatrixApiRequestData *matrix_api_send(MatrixConnectionData *conn,
         MatrixApiBadResponseCallback bad_response_callback,
         gpointer user_data);
 
+/**
+ * Get the membership events for a room
+ *
+ * @param conn             The connection with which to make the request
+ * @param room_id          The room to get the members of
+ * @param at               If non-null, a /sync next_batch token (not a
+ *                             sliding sync pos): we get the members as of
+ *                             that point
+ * @param callback         Function to be called when the request completes
+ * @param error_callback   Function to be called if there is an error making
+ *                             the request. If NULL, matrix_api_error will be
+ *                             used.
+ * @param bad_response_callback Function to be called if the API gives a non-200
+ *                            response. If NULL, matrix_api_bad_response will be
+ *                            used.
+ * @param user_data        Opaque data to be passed to the callbacks
+ */
+MatrixApiRequestData *matrix_api_get_room_members(MatrixConnectionData *conn,
+        const gchar *room_id, const gchar *at,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data);
+
 /**
  * Invite a user to a room
  *
@@ -287,9 +412,13 @@ MatrixApiRequestData *matrix_api_leave_room(MatrixConnectionData *conn,
  *
  * @param conn             The connection with which to make the request
  * @param ctype            Content type of file
- * @param data             Raw data content of file
+ * @param data             Raw data content of file. This is sent straight
+ *                            from this buffer, so must stay valid until one
+ *                            of the callbacks is called.
  * @param data_len         Length of the data
  * @param callback         Function to be called when the request completes
+ * @param progress_callback  Function to be called as the data is sent; may
+ *                            be NULL
  * @param user_data        Opaque data to be passed to the callback
  */
 MatrixApiRequestData *matrix_api_upload_file(MatrixConnectionData *conn,
@@ -299,6 +428,7 @@ MatrixApiRequestData *matrix_api_upload_file(MatrixConnectionData *conn,
         MatrixApiCallback callback,
         MatrixApiErrorCallback error_callback,
         MatrixApiBadResponseCallback bad_response_callback,
+        MatrixApiProgressCallback progress_callback,
         gpointer user_data);
 
 
@@ -311,7 +441,9 @@ GString *get_download_url(const gchar *homeserver, const gchar *uri);
 
 
 /**
- * Download a file
+ * Download a file. If the same file is already being downloaded, we wait for
+ * that download rather than starting another; the callbacks then share the
+ * response, so must not modify it.
  *
  * @param conn             The connection with which to make the request
  * @param uri              The Matrix uri to fetch starting mxc://
@@ -335,7 +467,32 @@ MatrixApiRequestData *matrix_api_download_file(MatrixConnectionData *conn,
         gpointer user_data);
 
 /**
- * Download a thumbnail for a file
+ * Download a file of any size, passing it to data_callback as it arrives
+ * rather than keeping it in memory.
+ *
+ * @param conn             The connection with which to make the request
+ * @param uri              The Matrix uri to fetch starting mxc://
+ * @param data_callback    Function to be called with each piece of the file
+ * @param callback         Function to be called when the download completes;
+ *                             it is not given the body.
+ * @param error_callback   Function to be called if there is an error making
+ *                             the request, or data_callback returns FALSE.
+ * @param bad_response_callback Function to be called if the API gives a non-200
+ *                            response.
+ * @param user_data        Opaque data to be passed to the callbacks
+ */
+MatrixApiRequestData *matrix_api_download_file_stream(
+        MatrixConnectionData *conn,
+        const gchar *uri,
+        MatrixApiDataCallback data_callback,
+        MatrixApiCallback callback,
+        MatrixApiErrorCallback error_callback,
+        MatrixApiBadResponseCallback bad_response_callback,
+        gpointer user_data);
+
+/**
+ * Download a thumbnail for a file. As with matrix_api_download_file,
+ * identical downloads share a request.
  *
  * @param conn             The connection with which to make the request
  * @param uri              The Matrix uri to fetch starting mxc://
@@ -32,11 +32,18 @@
 /* libmatrix */
 #include "libmatrix.h"
 #include "matrix-api.h"
+#include "matrix-http.h"
 #include "matrix-json.h"
+#include "matrix-room.h"
+#include "matrix-statestore.h"
 #include "matrix-sync.h"
 
 static void _start_next_sync(MatrixConnectionData *ma,
         const gchar *next_batch, gboolean full_state);
+static JsonObject *_build_sliding_sync_request(MatrixConnectionData *ma);
+
+/* the name of the room list in our sliding sync requests */
+#define SLIDING_SYNC_LIST "rooms"
 
 
 void matrix_connection_new(PurpleConnection *pc)
@@ -46,6 +53,8 @@ void matrix_connection_new(PurpleConnection *pc)
      g_assert(purple_connection_get_protocol_data(pc) == NULL);
      conn = g_new0(MatrixConnectionData, 1);
      conn->pc = pc;
+     conn->http_pool = matrix_http_pool_new(pc->account);
+     g_queue_init(&conn->sync_jobs);
      purple_connection_set_protocol_data(pc, conn);
 }
 
@@ -56,7 +65,16 @@ void matrix_connection_free(PurpleConnection *pc)
 
     g_assert(conn != NULL);
 
+    /* anything still in flight is cancelled */
+    matrix_http_pool_free(conn->http_pool);
+    conn->http_pool = NULL;
+    if(conn->inflight_requests != NULL)
+        g_hash_table_destroy(conn->inflight_requests);
+    conn->inflight_requests = NULL;
+
     matrix_e2e_cleanup_connection(conn);
+    matrix_statestore_close(conn->state_store);
+    conn->state_store = NULL;
     purple_connection_set_protocol_data(pc, NULL);
 
     g_free(conn->homeserver);
@@ -65,9 +83,23 @@ void matrix_connection_free(PurpleConnection *pc)
     g_free(conn->access_token);
     conn->access_token = NULL;
 
+    g_free(conn->request_base);
+    conn->request_base = NULL;
+    g_free(conn->request_headers);
+    conn->request_headers = NULL;
+
     g_free(conn->user_id);
     conn->user_id = NULL;
 
+    g_free(conn->sync_filter_id);
+    conn->sync_filter_id = NULL;
+
+    g_free(conn->sync_since);
+    conn->sync_since = NULL;
+
+    g_free(conn->sync_to_device_since);
+    conn->sync_to_device_since = NULL;
+
     conn->pc = NULL;
 
     g_free(conn);
@@ -82,9 +114,76 @@ void matrix_connection_cancel_sync(PurpleConnection *pc)
                 pc->account->username);
         matrix_api_cancel(conn->active_sync);
     }
+    if(conn->sync_retry_timer != 0) {
+        purple_timeout_remove(conn->sync_retry_timer);
+        conn->sync_retry_timer = 0;
+    }
+    while(!g_queue_is_empty(&conn->sync_jobs))
+        matrix_sync_cancel(g_queue_pop_head(&conn->sync_jobs));
     return;
 }
 
+
+/* delay before the first retry of a failed /sync, and the most we will
+ * back off to (ms) */
+#define SYNC_RETRY_MIN_DELAY 1000
+#define SYNC_RETRY_MAX_DELAY 60000
+
+static gboolean _retry_sync(gpointer user_data)
+{
+    MatrixConnectionData *ma = user_data;
+    gchar *since = g_strdup(ma->sync_since);
+
+    ma->sync_retry_timer = 0;
+    purple_debug_info("matrixprpl", "retrying sync (attempt %u)\n",
+            ma->sync_failures + 1);
+    _start_next_sync(ma, since, ma->sync_full_state);
+    g_free(since);
+    return FALSE;
+}
+
+
+/**
+ * Arrange to retry a /sync which failed for a reason which might go away on
+ * its own (a network problem, or the server being overloaded), rather than
+ * dropping the connection.
+ *
+ * @param retry_after_ms  how long the server asked us to wait, or 0
+ *
+ * @returns FALSE if we have been failing for too long, and should give up
+ */
+static gboolean _schedule_sync_retry(MatrixConnectionData *ma,
+        gint64 retry_after_ms)
+{
+    gint64 now = g_get_monotonic_time(), delay, budget_ms;
+
+    if(ma->sync_failures++ == 0)
+        ma->sync_failing_since = now;
+
+    /* exponential backoff, with jitter so that lots of clients which lost
+     * the server at the same moment don't all come back at once */
+    delay = SYNC_RETRY_MIN_DELAY << MIN(ma->sync_failures - 1, 6);
+    if(delay > SYNC_RETRY_MAX_DELAY)
+        delay = SYNC_RETRY_MAX_DELAY;
+    delay = delay / 2 + g_random_int_range(0, delay / 2 + 1);
+
+    if(retry_after_ms > delay)
+        delay = retry_after_ms;
+
+    budget_ms = 1000 * (gint64)purple_account_get_int(ma->pc->account,
+            PRPL_ACCOUNT_OPT_SYNC_RETRY_SECONDS, DEFAULT_SYNC_RETRY_SECONDS);
+    if((now - ma->sync_failing_since) / 1000 + delay > budget_ms) {
+        purple_debug_warning("matrixprpl", "sync has failed %u times; "
+                "giving up\n", ma->sync_failures);
+        return FALSE;
+    }
+
+    purple_debug_info("matrixprpl", "sync failed (%u in a row); retrying in %"
+            G_GINT64_FORMAT " ms\n", ma->sync_failures, delay);
+    ma->sync_retry_timer = purple_timeout_add(delay, _retry_sync, ma);
+    return TRUE;
+}
+
 /**
  * /sync failed
  */
@@ -92,6 +191,15 @@ void _sync_error(MatrixConnectionData *ma, gpointer user_data,
         const gchar *error_message)
 {
     ma->active_sync = NULL;
+
+    /* we're shutting down */
+    if(strcmp(error_message, "cancelled") == 0)
+        return;
+
+    purple_debug_warning("matrixprpl", "sync failed: %s\n", error_message);
+    if(_schedule_sync_retry(ma, 0))
+        return;
+
     matrix_api_error(ma, user_data, error_message);
 }
 
@@ -102,21 +210,120 @@ void _sync_bad_response(MatrixConnectionData *ma, gpointer user_data,
         int http_response_code, JsonNode *json_root)
 {
     ma->active_sync = NULL;
+
+    /* If the server has forgotten our filter (or never knew about it, because
+     * the account has moved), throw it away; we will make a new one when we
+     * reconnect.
+     */
+    if(ma->sync_filter_id != NULL &&
+            (http_response_code == 400 || http_response_code == 404)) {
+        purple_debug_info("matrixprpl", "discarding sync filter %s\n",
+                ma->sync_filter_id);
+        purple_account_set_string(ma->pc->account,
+                PRPL_ACCOUNT_OPT_SYNC_FILTER_ID, NULL);
+        purple_account_set_string(ma->pc->account,
+                PRPL_ACCOUNT_OPT_SYNC_FILTER, NULL);
+        g_free(ma->sync_filter_id);
+        ma->sync_filter_id = NULL;
+    }
+
+    /* the server has forgotten our sliding sync session (they expire after
+     * a while); start a new one */
+    if(ma->sliding_sync && http_response_code == 400 && g_strcmp0(
+            matrix_json_object_get_string_member(
+                    matrix_json_node_get_object(json_root), "errcode"),
+            "M_UNKNOWN_POS") == 0) {
+        purple_debug_info("matrixprpl", "sliding sync session has expired; "
+                "starting a new one\n");
+        _start_next_sync(ma, NULL, TRUE);
+        return;
+    }
+
+    /* rate-limiting and server errors are usually temporary */
+    if(http_response_code == 429 || http_response_code >= 500) {
+        gint64 retry_after_ms = matrix_json_object_get_int_member(
+                matrix_json_node_get_object(json_root), "retry_after_ms");
+        if(_schedule_sync_retry(ma, retry_after_ms))
+            return;
+    }
+
     matrix_api_bad_response(ma, user_data, http_response_code, json_root);
 }
 
 
+/* the number of sync responses we will hold (including the one being
+ * applied) before we stop asking the server for more */
+#define MAX_QUEUED_SYNCS 2
+
+/**
+ * Start the next /sync, unless there is one running already or we have too
+ * many responses waiting to be applied.
+ *
+ * We don't wait for a response to be applied before asking for the next
+ * one, so that the server can hold the long-poll open while we work.
+ */
+static void _start_next_sync_if_ready(MatrixConnectionData *ma)
+{
+    MatrixSyncJob *latest;
+
+    if(ma->active_sync != NULL || ma->sync_retry_timer != 0 ||
+            g_queue_get_length(&ma->sync_jobs) >= MAX_QUEUED_SYNCS)
+        return;
+
+    latest = g_queue_peek_tail(&ma->sync_jobs);
+    if(latest == NULL)
+        return;
+
+    _start_next_sync(ma, matrix_sync_get_next_batch(latest), FALSE);
+}
+
+
+/* callback which is called when we have finished applying a /sync response */
+static void _sync_applied(PurpleConnection *pc, const gchar *next_batch,
+        gpointer user_data)
+{
+    MatrixConnectionData *ma = purple_connection_get_protocol_data(pc);
+    MatrixSyncJob *job, *next_job;
+    const gchar *to_device_batch;
+
+    job = g_queue_pop_head(&ma->sync_jobs);
+
+    /* only now is it safe to skip this batch next time we start */
+    purple_account_set_string(pc->account, PRPL_ACCOUNT_OPT_NEXT_BATCH,
+            next_batch);
+    purple_account_set_bool(pc->account, PRPL_ACCOUNT_OPT_NEXT_BATCH_IS_POS,
+            ma->sliding_sync);
+    to_device_batch = matrix_sync_get_to_device_batch(job);
+    if(to_device_batch != NULL)
+        purple_account_set_string(pc->account,
+                PRPL_ACCOUNT_OPT_TO_DEVICE_SINCE, to_device_batch);
+
+    /* responses are applied strictly in order */
+    next_job = g_queue_peek_head(&ma->sync_jobs);
+    if(next_job != NULL)
+        matrix_sync_run(next_job);
+
+    _start_next_sync_if_ready(ma);
+}
+
+
 /* callback which is called when a /sync request completes */
 static void _sync_complete(MatrixConnectionData *ma, gpointer user_data,
     JsonNode *body,
     const char *raw_body, size_t raw_body_len, const char *content_type)
 {
     PurpleConnection *pc = ma->pc;
-    const gchar *next_batch;
+    MatrixSyncJob *job;
+    gchar *sync_body;
 
     ma->active_sync = NULL;
+    ma->sync_failures = 0;
+
+    /* once per sync is a convenient interval to report on the request
+     * queues */
+    matrix_http_pool_log_stats(ma->http_pool);
 
-    if(body == NULL) {
+    if(raw_body == NULL) {
         purple_connection_error_reason(pc, PURPLE_CONNECTION_ERROR_OTHER_ERROR,
                 "Couldn't parse sync response");
         return;
@@ -128,29 +335,415 @@ static void _sync_complete(MatrixConnectionData *ma, gpointer user_data,
         purple_connection_set_state(pc, PURPLE_CONNECTED);
     }
 
-    matrix_sync_parse(pc, body, &next_batch);
+    /* the job keeps the body while it works through it; take it rather than
+     * copying what may be many megabytes */
+    sync_body = matrix_api_steal_body(raw_body);
+    if(ma->sliding_sync)
+        job = matrix_sync_new_sliding(pc, sync_body, raw_body_len,
+                SLIDING_SYNC_LIST, _sync_applied, NULL);
+    else
+        job = matrix_sync_new(pc, sync_body, raw_body_len, _sync_applied,
+                NULL);
+    if(job == NULL) {
+        purple_connection_error_reason(pc, PURPLE_CONNECTION_ERROR_OTHER_ERROR,
+                "Couldn't parse sync response");
+        return;
+    }
 
-    /* Start the next sync */
-    if(next_batch == NULL) {
+    if(matrix_sync_get_next_batch(job) == NULL) {
+        matrix_sync_cancel(job);
         purple_connection_error_reason(pc, PURPLE_CONNECTION_ERROR_OTHER_ERROR,
                 "No next_batch field");
         return;
     }
-    purple_account_set_string(pc->account, PRPL_ACCOUNT_OPT_NEXT_BATCH,
-            next_batch);
 
-    _start_next_sync(ma, next_batch, FALSE);
+    /* the next request acknowledges the to-device messages in this one */
+    if(matrix_sync_get_to_device_batch(job) != NULL) {
+        g_free(ma->sync_to_device_since);
+        ma->sync_to_device_since = g_strdup(
+                matrix_sync_get_to_device_batch(job));
+    }
+
+    g_queue_push_tail(&ma->sync_jobs, job);
+    if(g_queue_get_length(&ma->sync_jobs) == 1)
+        matrix_sync_run(job);
+
+    _start_next_sync_if_ready(ma);
 }
 
 
 static void _start_next_sync(MatrixConnectionData *ma,
         const gchar *next_batch, gboolean full_state)
 {
-    ma->active_sync = matrix_api_sync(ma, next_batch, 30000, full_state,
+    /* remember what we asked for, in case we need to ask again */
+    g_free(ma->sync_since);
+    ma->sync_since = g_strdup(next_batch);
+    ma->sync_full_state = full_state;
+
+    if(ma->sliding_sync) {
+        /* a new sliding sync session always starts with the full state of
+         * the rooms in it, so full_state doesn't apply */
+        JsonObject *request = _build_sliding_sync_request(ma);
+        ma->active_sync = matrix_api_sliding_sync(ma, next_batch, request,
+                30000, _sync_complete, _sync_error, _sync_bad_response, NULL);
+        json_object_unref(request);
+        return;
+    }
+
+    ma->active_sync = matrix_api_sync(ma, next_batch, ma->sync_filter_id,
+            30000, full_state,
             _sync_complete, _sync_error, _sync_bad_response, NULL);
 }
 
 
+/* the number of timeline events we ask for per room in each /sync */
+#define SYNC_TIMELINE_LIMIT 10
+
+/* the state events we do something with (see matrix-room.c) */
+static const gchar *_sync_state_types[] = {
+    "m.room.member",
+    "m.room.name",
+    "m.room.aliases",
+    "m.room.canonical_alias",
+    "m.room.topic",
+    "m.room.encryption",
+    NULL
+};
+
+/* the non-state events we display (see matrix_room_handle_timeline_event) */
+static const gchar *_sync_timeline_types[] = {
+    "m.room.message",
+    "m.room.encrypted",
+    NULL
+};
+
+
+static JsonArray *_string_array_new(const gchar **strings,
+        const gchar **more_strings)
+{
+    JsonArray *array = json_array_new();
+    while(strings != NULL && *strings != NULL)
+        json_array_add_string_element(array, *strings++);
+    while(more_strings != NULL && *more_strings != NULL)
+        json_array_add_string_element(array, *more_strings++);
+    return array;
+}
+
+
+/**
+ * An event filter which matches nothing
+ */
+static JsonObject *_empty_event_filter_new()
+{
+    const gchar *all_types[] = {"*", NULL};
+    JsonObject *filter = json_object_new();
+    json_object_set_array_member(filter, "not_types",
+            _string_array_new(all_types, NULL));
+    return filter;
+}
+
+
+/**
+ * Build the filter we use for /sync. This strips out everything we would
+ * otherwise ignore, which makes a big difference to the size of the
+ * response.
+ *
+ * If lazy_load_members is set, the server only sends the membership events
+ * for the senders of the events in the timeline; matrix-room.c fetches the
+ * rest when it needs them.
+ */
+static JsonObject *_build_sync_filter(gboolean lazy_load_members)
+{
+    const gchar *ephemeral_types[] = {"m.typing", NULL};
+    JsonObject *filter, *room_filter, *event_filter;
+
+    room_filter = json_object_new();
+
+    event_filter = json_object_new();
+    json_object_set_array_member(event_filter, "types",
+            _string_array_new(_sync_state_types, NULL));
+    if(lazy_load_members)
+        json_object_set_boolean_member(event_filter, "lazy_load_members",
+                TRUE);
+    json_object_set_object_member(room_filter, "state", event_filter);
+
+    event_filter = json_object_new();
+    json_object_set_int_member(event_filter, "limit", SYNC_TIMELINE_LIMIT);
+    json_object_set_array_member(event_filter, "types",
+            _string_array_new(_sync_state_types, _sync_timeline_types));
+    if(lazy_load_members)
+        json_object_set_boolean_member(event_filter, "lazy_load_members",
+                TRUE);
+    json_object_set_object_member(room_filter, "timeline", event_filter);
+
+    event_filter = json_object_new();
+    json_object_set_array_member(event_filter, "types",
+            _string_array_new(ephemeral_types, NULL));
+    json_object_set_object_member(room_filter, "ephemeral", event_filter);
+
+    json_object_set_object_member(room_filter, "account_data",
+            _empty_event_filter_new());
+
+    filter = json_object_new();
+    json_object_set_object_member(filter, "room", room_filter);
+    json_object_set_object_member(filter, "presence",
+            _empty_event_filter_new());
+    json_object_set_object_member(filter, "account_data",
+            _empty_event_filter_new());
+    return filter;
+}
+
+
+/*
+ * Sliding sync.
+ *
+ * Rather than every room we are in, we ask for a window onto the room list,
+ * which the server keeps sorted with the most recently active rooms first,
+ * plus a subscription to each room we have a conversation for (so that we
+ * keep getting updates for rooms which drop out of the window). The rooms in
+ * the response are applied in the same way as those from /sync.
+ */
+
+/* how many rooms from the top of the room list we ask for */
+#define SLIDING_SYNC_WINDOW 50
+
+static void _add_required_state(JsonArray *required_state,
+        const gchar *event_type, const gchar *state_key)
+{
+    JsonArray *entry = json_array_new();
+    json_array_add_string_element(entry, event_type);
+    json_array_add_string_element(entry, state_key);
+    json_array_add_array_element(required_state, entry);
+}
+
+
+/**
+ * The state we want for each room: the same as for /sync (see
+ * _build_sync_filter)
+ */
+static JsonArray *_sliding_sync_required_state_new(gboolean lazy_load_members)
+{
+    JsonArray *required_state = json_array_new();
+    const gchar **event_type;
+
+    for(event_type = _sync_state_types; *event_type != NULL; event_type++) {
+        if(strcmp(*event_type, "m.room.member") == 0) {
+            if(lazy_load_members) {
+                _add_required_state(required_state, *event_type, "$LAZY");
+                _add_required_state(required_state, *event_type, "$ME");
+            } else {
+                _add_required_state(required_state, *event_type, "*");
+            }
+        } else if(strcmp(*event_type, "m.room.aliases") == 0) {
+            /* keyed on server name */
+            _add_required_state(required_state, *event_type, "*");
+        } else {
+            _add_required_state(required_state, *event_type, "");
+        }
+    }
+    return required_state;
+}
+
+
+static JsonObject *_sliding_sync_room_config_new(gboolean lazy_load_members)
+{
+    JsonObject *config = json_object_new();
+    json_object_set_array_member(config, "required_state",
+            _sliding_sync_required_state_new(lazy_load_members));
+    json_object_set_int_member(config, "timeline_limit", SYNC_TIMELINE_LIMIT);
+    return config;
+}
+
+
+static JsonObject *_build_sliding_sync_request(MatrixConnectionData *ma)
+{
+    PurpleAccount *account = ma->pc->account;
+    gboolean lazy_load_members = purple_account_get_bool(account,
+            PRPL_ACCOUNT_OPT_LAZY_LOAD_MEMBERS, DEFAULT_LAZY_LOAD_MEMBERS);
+    JsonObject *request, *lists, *list, *subscriptions, *extensions,
+            *extension;
+    JsonArray *ranges, *range;
+    GList *ptr;
+
+    range = json_array_new();
+    json_array_add_int_element(range, 0);
+    json_array_add_int_element(range, SLIDING_SYNC_WINDOW - 1);
+    ranges = json_array_new();
+    json_array_add_array_element(ranges, range);
+
+    list = _sliding_sync_room_config_new(lazy_load_members);
+    json_object_set_array_member(list, "ranges", ranges);
+    lists = json_object_new();
+    json_object_set_object_member(lists, SLIDING_SYNC_LIST, list);
+
+    /* only the rooms the user is actually looking at; the window takes
+     * care of the rest */
+    subscriptions = json_object_new();
+    for(ptr = purple_get_conversations(); ptr != NULL; ptr = g_list_next(ptr))
+    {
+        PurpleConversation *conv = ptr->data;
+        if(conv->account == account &&
+                purple_conversation_get_type(conv) == PURPLE_CONV_TYPE_CHAT &&
+                matrix_room_is_in_use(conv))
+            json_object_set_object_member(subscriptions, conv->name,
+                    _sliding_sync_room_config_new(lazy_load_members));
+    }
+
+    extensions = json_object_new();
+    extension = json_object_new();
+    json_object_set_boolean_member(extension, "enabled", TRUE);
+    if(ma->sync_to_device_since != NULL)
+        json_object_set_string_member(extension, "since",
+                ma->sync_to_device_since);
+    json_object_set_object_member(extensions, "to_device", extension);
+    extension = json_object_new();
+    json_object_set_boolean_member(extension, "enabled", TRUE);
+    json_object_set_object_member(extensions, "e2ee", extension);
+
+    request = json_object_new();
+    json_object_set_object_member(request, "lists", lists);
+    json_object_set_object_member(request, "room_subscriptions",
+            subscriptions);
+    json_object_set_object_member(request, "extensions", extensions);
+    return request;
+}
+
+
+static gchar *_sync_filter_to_string(JsonObject *filter)
+{
+    JsonNode *node;
+    JsonGenerator *generator;
+    gchar *json;
+
+    node = json_node_new(JSON_NODE_OBJECT);
+    json_node_set_object(node, filter);
+    generator = json_generator_new();
+    json_generator_set_root(generator, node);
+    json = json_generator_to_data(generator, NULL);
+    g_object_unref(G_OBJECT(generator));
+    json_node_free(node);
+    return json;
+}
+
+
+/* state which we keep while uploading the sync filter */
+typedef struct _SyncFilterUploadData {
+    gchar *filter_json;
+    gchar *next_batch;
+    gboolean full_state;
+} SyncFilterUploadData;
+
+static void _sync_filter_upload_data_free(SyncFilterUploadData *data)
+{
+    g_free(data->filter_json);
+    g_free(data->next_batch);
+    g_free(data);
+}
+
+
+static void _sync_filter_upload_complete(MatrixConnectionData *ma,
+        gpointer user_data, JsonNode *json_root,
+        const char *raw_body, size_t raw_body_len, const char *content_type)
+{
+    SyncFilterUploadData *data = user_data;
+    PurpleAccount *account = ma->pc->account;
+    const gchar *filter_id;
+
+    ma->active_sync = NULL;
+
+    filter_id = matrix_json_object_get_string_member(
+            matrix_json_node_get_object(json_root), "filter_id");
+    if(filter_id == NULL) {
+        purple_debug_warning("matrixprpl", "No filter_id in /filter response; "
+                "syncing without a filter\n");
+    } else {
+        purple_debug_info("matrixprpl", "created sync filter %s\n",
+                filter_id);
+        g_free(ma->sync_filter_id);
+        ma->sync_filter_id = g_strdup(filter_id);
+        purple_account_set_string(account, PRPL_ACCOUNT_OPT_SYNC_FILTER_ID,
+                filter_id);
+        purple_account_set_string(account, PRPL_ACCOUNT_OPT_SYNC_FILTER,
+                data->filter_json);
+    }
+
+    _start_next_sync(ma, data->next_batch, data->full_state);
+    _sync_filter_upload_data_free(data);
+}
+
+
+static void _sync_filter_upload_error(MatrixConnectionData *ma,
+        gpointer user_data, const gchar *error_message)
+{
+    _sync_filter_upload_data_free(user_data);
+    ma->active_sync = NULL;
+    matrix_api_error(ma, NULL, error_message);
+}
+
+
+static void _sync_filter_upload_bad_response(MatrixConnectionData *ma,
+        gpointer user_data, int http_response_code, JsonNode *json_root)
+{
+    SyncFilterUploadData *data = user_data;
+
+    /* not worth failing the connection over; just sync without it */
+    purple_debug_warning("matrixprpl", "Unable to create sync filter (%i); "
+            "syncing without a filter\n", http_response_code);
+    ma->active_sync = NULL;
+    _start_next_sync(ma, data->next_batch, data->full_state);
+    _sync_filter_upload_data_free(data);
+}
+
+
+/**
+ * Start the first sync on this connection, once we have made sure that the
+ * server has our sync filter.
+ */
+static void _start_first_sync(MatrixConnectionData *ma,
+        const gchar *next_batch, gboolean full_state)
+{
+    PurpleAccount *account = ma->pc->account;
+    JsonObject *filter;
+    SyncFilterUploadData *data;
+    gchar *filter_json;
+    const gchar *filter_id;
+
+    /* sliding sync doesn't use a filter */
+    if(ma->sliding_sync) {
+        _start_next_sync(ma, next_batch, full_state);
+        return;
+    }
+
+    filter = _build_sync_filter(purple_account_get_bool(account,
+            PRPL_ACCOUNT_OPT_LAZY_LOAD_MEMBERS, DEFAULT_LAZY_LOAD_MEMBERS));
+    filter_json = _sync_filter_to_string(filter);
+
+    /* reuse the filter from last time, if it's still what we want */
+    filter_id = purple_account_get_string(account,
+            PRPL_ACCOUNT_OPT_SYNC_FILTER_ID, NULL);
+    if(filter_id != NULL && g_strcmp0(filter_json, purple_account_get_string(
+            account, PRPL_ACCOUNT_OPT_SYNC_FILTER, NULL)) == 0) {
+        g_free(ma->sync_filter_id);
+        ma->sync_filter_id = g_strdup(filter_id);
+        json_object_unref(filter);
+        g_free(filter_json);
+        _start_next_sync(ma, next_batch, full_state);
+        return;
+    }
+
+    data = g_new0(SyncFilterUploadData, 1);
+    data->filter_json = filter_json;
+    data->next_batch = g_strdup(next_batch);
+    data->full_state = full_state;
+
+    /* use active_sync so that the upload gets cancelled if we disconnect */
+    ma->active_sync = matrix_api_upload_filter(ma, filter,
+            _sync_filter_upload_complete, _sync_filter_upload_error,
+            _sync_filter_upload_bad_response, data);
+    json_object_unref(filter);
+}
+
+
 static gboolean _account_has_active_conversations(PurpleAccount *account)
 {
     GList *ptr;
@@ -169,6 +762,7 @@ static void _start_sync(MatrixConnectionData *conn)
     PurpleConnection *pc = conn->pc;
     gboolean needs_full_state_sync = TRUE;
     const gchar *next_batch;
+    gchar *restored_batch = NULL;
     const gchar *device_id = purple_account_get_string(pc->account,
             "device_id", NULL);
 
@@ -176,10 +770,28 @@ static void _start_sync(MatrixConnectionData *conn)
         matrix_e2e_get_device_keys(conn, device_id);
     }
 
+    if(conn->state_store == NULL)
+        conn->state_store = matrix_statestore_open(pc->account,
+                conn->user_id);
+
+    conn->sliding_sync = purple_account_get_bool(pc->account,
+            PRPL_ACCOUNT_OPT_SLIDING_SYNC, DEFAULT_SLIDING_SYNC);
+    if(conn->sliding_sync) {
+        g_free(conn->sync_to_device_since);
+        conn->sync_to_device_since = g_strdup(purple_account_get_string(
+                pc->account, PRPL_ACCOUNT_OPT_TO_DEVICE_SINCE, NULL));
+    }
+
     /* start the sync loop */
     next_batch = purple_account_get_string(pc->account,
             PRPL_ACCOUNT_OPT_NEXT_BATCH, NULL);
 
+    /* a token from the other kind of sync is no use to us (and neither is
+     * the copy of the state on disk which goes with it) */
+    if(next_batch != NULL && !purple_account_get_bool(pc->account,
+            PRPL_ACCOUNT_OPT_NEXT_BATCH_IS_POS, FALSE) != !conn->sliding_sync)
+        next_batch = NULL;
+
     if(next_batch != NULL) {
         /* if we have previously done a full_state sync on this account, there's
          * no need to do another. If there are already conversations associated
@@ -188,6 +800,12 @@ static void _start_sync(MatrixConnectionData *conn)
          */
         if(_account_has_active_conversations(pc->account)) {
             needs_full_state_sync = FALSE;
+        } else if((restored_batch = matrix_sync_restore(pc)) != NULL) {
+            /* we have rebuilt our rooms from the copy on disk; carry on
+             * from where that left off.
+             */
+            next_batch = restored_batch;
+            needs_full_state_sync = FALSE;
         } else {
             /* this appears to be the first time we have connected to this account
              * on this invocation of pidgin.
@@ -206,9 +824,25 @@ static void _start_sync(MatrixConnectionData *conn)
         purple_connection_set_state(pc, PURPLE_CONNECTED);
     }
 
-    _start_next_sync(conn, next_batch, needs_full_state_sync);
+    _start_first_sync(conn, next_batch, needs_full_state_sync);
+    g_free(restored_batch);
 }
 
+/**
+ * Set the access token to use for our API calls. The headers we put on every
+ * request include it, so they have to be rebuilt.
+ */
+static void _set_access_token(MatrixConnectionData *conn,
+        const gchar *access_token)
+{
+    g_free(conn->access_token);
+    conn->access_token = g_strdup(access_token);
+
+    g_free(conn->request_headers);
+    conn->request_headers = NULL;
+}
+
+
 static void _login_completed(MatrixConnectionData *conn,
         gpointer user_data,
         JsonNode *json_root,
@@ -228,7 +862,7 @@ static void _login_completed(MatrixConnectionData *conn,
                 "No access_token in /login response");
         return;
     }
-    conn->access_token = g_strdup(access_token);
+    _set_access_token(conn, access_token);
     conn->user_id = g_strdup(matrix_json_object_get_string_member(root_obj,
             "user_id"));
     device_id = matrix_json_object_get_string_member(root_obj, "device_id");
@@ -375,7 +1009,7 @@ void matrix_connection_start_login(PurpleConnection *pc)
     purple_connection_update_progress(pc, _("Logging in"), 0, 3);
 
     if (access_token) {
-        conn->access_token = g_strdup(access_token);
+        _set_access_token(conn, access_token);
         matrix_api_whoami(conn, _whoami_completed, _whoami_error,
                 _whoami_badresp, conn);
     } else {
@@ -30,17 +30,54 @@
 
 struct _PurpleConnection;
 struct _MatrixE2EData;
+struct _MatrixHttpPool;
+struct _MatrixStateStore;
 
 typedef struct _MatrixConnectionData {
     struct _PurpleConnection *pc;
     gchar *homeserver;      /* URL of the homeserver. Always ends in '/' */
     gchar *user_id;         /* our full user id ("@user:server") */
     gchar *access_token;    /* access token corresponding to our user */
+    gchar *sync_filter_id;  /* filter to use for /sync; NULL if none */
 
     /* the active sync request */
     struct _MatrixApiRequestData *active_sync;
+    /* sync responses waiting to be applied (MatrixSyncJob *), oldest first.
+     * The head is the one being applied. */
+    GQueue sync_jobs;
+
+    /* the parameters of the latest /sync, so that we can retry it */
+    gchar *sync_since;
+    gboolean sync_full_state;
+    /* timer for retrying a failed /sync; 0 if none */
+    guint sync_retry_timer;
+    /* number of /syncs which have failed in a row, and when the first of
+     * them failed (monotonic time, us) */
+    guint sync_failures;
+    gint64 sync_failing_since;
+
+    /* TRUE if we are using sliding sync rather than /sync */
+    gboolean sliding_sync;
+    /* sliding sync: the token for the to-device messages */
+    gchar *sync_to_device_since;
+
+    /* connections to the homeserver, for all our API calls */
+    struct _MatrixHttpPool *http_pool;
+
+    /* the parts of every API request which don't change: what goes before
+     * the path in the request line, and the headers. Built by matrix-api.c
+     * when first needed, and reset if the access token changes. */
+    gchar *request_base;
+    gchar *request_headers;
+    /* the coalescable requests which are in flight, so that identical
+     * requests can share them (gchar * => MatrixApiRequestData *). NULL
+     * until first needed. */
+    GHashTable *inflight_requests;
+
     /* All the end-2-end encryption magic */
     struct _MatrixE2EData *e2e;
+    /* on-disk copy of our rooms' state; NULL if unavailable */
+    struct _MatrixStateStore *state_store;
 } MatrixConnectionData;
 
 
@@ -24,6 +24,7 @@
 #include "libmatrix.h"
 #include "matrix-api.h"
 #include "matrix-e2e.h"
+#include "matrix-intern.h"
 #include "matrix-json.h"
 #include "debug.h"
 
@@ -45,6 +46,9 @@ struct _MatrixE2EData {
     sqlite3 *db;
     /* Mapping from MatrixHashKeyOlm to MatrixOlmSession */
     GHashTable *olm_session_hash;
+    /* Buffer for the canonical JSON of whatever we are signing; kept, since
+     * we sign a lot of one-time keys in a row */
+    GString *sign_buf;
 };
 
 #define PURPLE_CONV_E2E_STATE "e2e"
@@ -55,24 +59,26 @@ typedef struct _MatrixE2ERoomData {
     GHashTable *megolm_sessions_inbound;
 } MatrixE2ERoomData;
 
+/* sender_id is interned (see matrix-intern.h) */
 typedef struct _MatrixHashKeyOlm {
     gchar *sender_key;
-    gchar *sender_id;
+    const gchar *sender_id;
 } MatrixHashKeyOlm;
 
 typedef struct _MatrixOlmSession {
     gchar *sender_key;
-    gchar *sender_id;
+    const gchar *sender_id;     /* interned */
     OlmSession *session;
     sqlite3_int64 unique;
     struct _MatrixOlmSession *next;
 } MatrixOlmSession;
 
+/* sender_id and device_id are interned (see matrix-intern.h) */
 typedef struct _MatrixHashKeyInBoundMegOlm {
     gchar *sender_key;
-    gchar *sender_id;
+    const gchar *sender_id;
     gchar *session_id;
-    gchar *device_id;
+    const gchar *device_id;
 } MatrixHashKeyInBoundMegOlm;
 
 struct _MatrixMediaCryptInfo {
@@ -148,14 +154,14 @@ static void olm_hash_key_destroy(gpointer k)
 
     clear_mem(ok->sender_key, strlen(ok->sender_key));
     g_free(ok->sender_key);
-    g_free(ok->sender_id);
+    matrix_unintern(ok->sender_id);
     g_free(ok);
 }
 
 static void free_matrix_olm_session(MatrixOlmSession *msession,
                                     gboolean free_session)
 {
-    g_free(msession->sender_id);
+    matrix_unintern(msession->sender_id);
     g_free(msession->sender_key);
     if (free_session) {
         olm_clear_session(msession->session);
@@ -205,8 +211,8 @@ static void megolm_inbound_key_destroy(gpointer v)
     MatrixHashKeyInBoundMegOlm *key = v;
     g_free(key->sender_key);
     g_free(key->session_id);
-    g_free(key->sender_id);
-    g_free(key->device_id);
+    matrix_unintern(key->sender_id);
+    matrix_unintern(key->device_id);
 }
 
 static void megolm_inbound_value_destroy(gpointer v)
@@ -270,9 +276,9 @@ static void store_inbound_megolm_session(PurpleConversation *conv,
         OlmInboundGroupSession *igs) {
     MatrixHashKeyInBoundMegOlm *key = g_new0(MatrixHashKeyInBoundMegOlm, 1);
     key->sender_key = g_strdup(sender_key);
-    key->sender_id = g_strdup(sender_id);
+    key->sender_id = matrix_intern(sender_id);
     key->session_id = g_strdup(session_id);
-    key->device_id = g_strdup(device_id);
+    key->device_id = matrix_intern(device_id);
     purple_debug_info("matrixprpl", "%s: %s/%s/%s/%s\n",
                __func__, device_id, sender_id, sender_key, session_id);
     g_hash_table_insert(get_e2e_inbound_megolm_hash(conv), key, igs);
@@ -381,7 +387,7 @@ static MatrixOlmSession *find_olm_session(MatrixConnectionData *conn,
             }
             g_free(dupe_pickle);
             cur_entry = g_new0(MatrixOlmSession, 1);
-            cur_entry->sender_id = g_strdup(sender_id);
+            cur_entry->sender_id = matrix_intern(sender_id);
             cur_entry->sender_key = g_strdup(sender_key);
             cur_entry->session = session;
             cur_entry->unique = sqlite3_column_int64(dbstmt, 1);
@@ -427,7 +433,7 @@ bad_sql:
     if (list_head && !hash_result) {
         MatrixHashKeyOlm *key = g_new0(MatrixHashKeyOlm, 1);
         key->sender_key = g_strdup(sender_key);
-        key->sender_id = g_strdup(sender_id);
+        key->sender_id = matrix_intern(sender_id);
         /* We loaded entries where there were none before, set the hash */
         g_hash_table_insert(conn->e2e->olm_session_hash, key, list_head);
     }
@@ -455,7 +461,7 @@ static MatrixOlmSession *store_olm_session(MatrixConnectionData *conn,
     }
     pickle[pickle_len] = '\0';
 
-    cur_entry->sender_id = g_strdup(sender_id);
+    cur_entry->sender_id = matrix_intern(sender_id);
     cur_entry->sender_key = g_strdup(sender_key);
     cur_entry->session = session;
 
@@ -506,7 +512,7 @@ static MatrixOlmSession *store_olm_session(MatrixConnectionData *conn,
         /* No entry, we need to stuff it into the hash table */
         MatrixHashKeyOlm *key = g_new0(MatrixHashKeyOlm, 1);
         key->sender_key = g_strdup(sender_key);
-        key->sender_id = g_strdup(sender_id);
+        key->sender_id = matrix_intern(sender_id);
         /* We loaded entries where there were none before, set the hash */
         g_hash_table_insert(conn->e2e->olm_session_hash, key, cur_entry);
     }
@@ -595,11 +601,15 @@ int matrix_sign_json(MatrixConnectionData *conn, JsonObject *tosign)
     OlmAccount *account = conn->e2e->oa;
     const gchar *device_id = conn->e2e->device_id;
     PurpleConnection *pc = conn->pc;
-    GString *can_json = matrix_canonical_json(tosign);
-    gchar *can_json_c = g_string_free(can_json, FALSE);
+    GString *can_json = conn->e2e->sign_buf;
     size_t sig_length = olm_account_signature_length(account);
     gchar *sig = g_malloc0(sig_length+1);
-    if (olm_account_sign(account, can_json_c, strlen(can_json_c),
+
+    if (can_json == NULL)
+        can_json = conn->e2e->sign_buf = g_string_sized_new(512);
+    g_string_truncate(can_json, 0);
+    matrix_canonical_json_append(can_json, tosign);
+    if (olm_account_sign(account, can_json->str, can_json->len,
             sig, sig_length)==olm_error()) {
         purple_connection_error_reason(pc,
                 PURPLE_CONNECTION_ERROR_OTHER_ERROR,
@@ -623,7 +633,6 @@ int matrix_sign_json(MatrixConnectionData *conn, JsonObject *tosign)
     g_free(alg_dev_c);
     ret = 0;
 out:
-    g_free(can_json_c);
     g_free(sig);
 
     return ret;
@@ -1233,6 +1242,8 @@ void matrix_e2e_cleanup_connection(MatrixConnectionData *conn)
     if (conn->e2e) {
         close_e2e_db(conn);
         g_hash_table_destroy(conn->e2e->olm_session_hash);
+        if (conn->e2e->sign_buf)
+            g_string_free(conn->e2e->sign_buf, TRUE);
         g_free(conn->e2e->curve25519_pubkey);
         g_free(conn->e2e->ed25519_pubkey);
         g_free(conn->e2e->oa);
@@ -1663,6 +1674,8 @@ JsonParser *matrix_e2e_decrypt_room(PurpleConversation *conv,
                 cevent_session_id);
         goto out;
     }
+    /* olm_group_decrypt_max_plaintext_length destroyed the copy */
+    g_free(dupe_ciphertext);
     dupe_ciphertext = g_strdup(cevent_ciphertext);
     plaintext = g_malloc0(maxlen+1);
     uint32_t index;
@@ -1687,6 +1700,18 @@ JsonParser *matrix_e2e_decrypt_room(PurpleConversation *conv,
     }
     // TODO: Stash index somewhere - supposed to check it for validity
     plaintext[decrypt_len] = '\0';
+
+    /* The sender chose the plaintext: a NUL would cut it short when it is
+     * logged or parsed, and json-glib before 1.6 doesn't check that its
+     * input is UTF-8.
+     */
+    if (!matrix_json_validate_text(plaintext, decrypt_len)) {
+        purple_debug_info("matrixprpl",
+                "%s: decrypted megolm event is not valid UTF-8 text for "
+                "%s/%s/%s/%s\n", __func__, cevent_device_id, cevent_sender,
+                cevent_sender_key, cevent_session_id);
+        goto out;
+    }
     purple_debug_info("matrixprpl",
                       "%s: Decrypted megolm event as '%s' index=%zd\n",
                       __func__, plaintext, (size_t)index);
@@ -1694,11 +1719,13 @@ JsonParser *matrix_e2e_decrypt_room(PurpleConversation *conv,
     plaintext_parser = json_parser_new();
     GError *err = NULL;
     if (!json_parser_load_from_data(plaintext_parser,
-                                    plaintext, strlen(plaintext), &err)) {
+                                    plaintext, decrypt_len, &err)) {
         purple_debug_info("matrixprpl",
                           "%s: Failed to json parse decrypted plain text: %s\n",
                           __func__, plaintext);
+        g_error_free(err);
         g_object_unref(plaintext_parser);
+        plaintext_parser = NULL;
         goto out;
     }
 
@@ -1840,6 +1867,82 @@ err:
     return fail_str;
 }
 
+struct _MatrixMediaDecryptor {
+    gcry_cipher_hd_t cipher_hd;
+    gcry_md_hd_t md_hd;
+    guchar sha256[32];  /* the hash the ciphertext should have */
+};
+
+MatrixMediaDecryptor *matrix_e2e_media_decryptor_new(
+        MatrixMediaCryptInfo *crypt, const char **fail_str)
+{
+    MatrixMediaDecryptor *dec = g_new0(MatrixMediaDecryptor, 1);
+    gcry_error_t gcry_err;
+
+    memcpy(dec->sha256, crypt->sha256, 32);
+
+    gcry_err = gcry_cipher_open(&dec->cipher_hd, GCRY_CIPHER_AES256,
+            GCRY_CIPHER_MODE_CTR, 0);
+    if (gcry_err) {
+        dec->cipher_hd = NULL;
+        *fail_str = "failed to open cipher";
+        goto err;
+    }
+    gcry_err = gcry_cipher_setkey(dec->cipher_hd, crypt->aes_k, 32);
+    if (gcry_err) {
+        *fail_str = "failed to set key";
+        goto err;
+    }
+    /* Note: this is only working if we use setctr not setiv */
+    gcry_err = gcry_cipher_setctr(dec->cipher_hd, crypt->aes_iv, 16);
+    if (gcry_err) {
+        *fail_str = "failed to set iv";
+        goto err;
+    }
+    gcry_err = gcry_md_open(&dec->md_hd, GCRY_MD_SHA256, 0);
+    if (gcry_err) {
+        dec->md_hd = NULL;
+        *fail_str = "failed to open hash";
+        goto err;
+    }
+
+    return dec;
+
+err:
+    matrix_e2e_media_decryptor_free(dec);
+    return NULL;
+}
+
+const char *matrix_e2e_media_decryptor_update(MatrixMediaDecryptor *dec,
+        const void *in, void *out, size_t len)
+{
+    /* CTR mode doesn't care how the data is split up, so we can decrypt
+     * each piece as it comes */
+    gcry_md_write(dec->md_hd, in, len);
+    if (gcry_cipher_decrypt(dec->cipher_hd, out, len, in, len)) {
+        return "failed to decrypt";
+    }
+    return NULL;
+}
+
+const char *matrix_e2e_media_decryptor_finish(MatrixMediaDecryptor *dec)
+{
+    unsigned char *digest = gcry_md_read(dec->md_hd, GCRY_MD_SHA256);
+
+    if (digest == NULL || memcmp(digest, dec->sha256, 32) != 0) {
+        return "hash mismatch";
+    }
+    return NULL;
+}
+
+void matrix_e2e_media_decryptor_free(MatrixMediaDecryptor *dec)
+{
+    if (!dec) return;
+    if (dec->cipher_hd) gcry_cipher_close(dec->cipher_hd);
+    if (dec->md_hd) gcry_md_close(dec->md_hd);
+    g_free(dec);
+}
+
 static void action_device_info(PurplePluginAction *action)
 {
     PurpleConnection *pc = (PurpleConnection *) action->context;
@@ -1915,6 +2018,28 @@ const char *matrix_e2e_decrypt_media(MatrixMediaCryptInfo *crypt,
     return "Crypto not available";
 }
 
+MatrixMediaDecryptor *matrix_e2e_media_decryptor_new(
+        MatrixMediaCryptInfo *crypt, const char **fail_str)
+{
+    *fail_str = "Crypto not available";
+    return NULL;
+}
+
+const char *matrix_e2e_media_decryptor_update(MatrixMediaDecryptor *dec,
+        const void *in, void *out, size_t len)
+{
+    return "Crypto not available";
+}
+
+const char *matrix_e2e_media_decryptor_finish(MatrixMediaDecryptor *dec)
+{
+    return "Crypto not available";
+}
+
+void matrix_e2e_media_decryptor_free(MatrixMediaDecryptor *dec)
+{
+}
+
 
 GList *matrix_e2e_actions(GList *list)
 {
@@ -25,6 +25,7 @@
 typedef struct _MatrixE2EData MatrixE2EData;
 typedef struct _PurpleConversation PurpleConversation;
 typedef struct _MatrixMediaCryptInfo MatrixMediaCryptInfo;
+typedef struct _MatrixMediaDecryptor MatrixMediaDecryptor;
 
 GList *matrix_e2e_actions(GList *list);
 int matrix_e2e_get_device_keys(MatrixConnectionData *conn, const gchar *device_id);
@@ -36,6 +37,18 @@ gboolean matrix_e2e_parse_media_decrypt_info(MatrixMediaCryptInfo **crypt,
                                              JsonObject *file_obj);
 const char *matrix_e2e_decrypt_media(MatrixMediaCryptInfo *crypt,
                                      size_t inlen, const void *in, void **out);
+
+/* Decrypt media a piece at a time, as it arrives. _new returns NULL (and sets
+ * *fail_str) on failure; _update decrypts len bytes from in to out; _finish
+ * checks the hash of everything we were given. The others return NULL or an
+ * error string.
+ */
+MatrixMediaDecryptor *matrix_e2e_media_decryptor_new(
+        MatrixMediaCryptInfo *crypt, const char **fail_str);
+const char *matrix_e2e_media_decryptor_update(MatrixMediaDecryptor *dec,
+        const void *in, void *out, size_t len);
+const char *matrix_e2e_media_decryptor_finish(MatrixMediaDecryptor *dec);
+void matrix_e2e_media_decryptor_free(MatrixMediaDecryptor *dec);
 void matrix_e2e_handle_sync_key_counts(struct _PurpleConnection *pc, struct _JsonObject *count_object, gboolean force_send);
 
 #endif
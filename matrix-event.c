@@ -26,10 +26,12 @@
 
 #include <json-glib/json-glib.h>
 
+#include "matrix-intern.h"
+
 /**
  * Allocate a new MatrixRoomEvent.
  *
- * @param event_type   the type of the event. this is copied into the event
+ * @param event_type   the type of the event. this is interned into the event
  * @param content      the content of the event. This is used direct, but the
  *                     reference count is incremented.
  */
@@ -38,7 +40,7 @@ MatrixRoomEvent *matrix_event_new(const gchar *event_type, JsonObject *content)
     MatrixRoomEvent *event;
     event = g_new0(MatrixRoomEvent, 1);
     event->content = json_object_ref(content);
-    event->event_type = g_strdup(event_type);
+    event->event_type = matrix_intern(event_type);
     return event;
 }
 
@@ -48,8 +50,8 @@ void matrix_event_free(MatrixRoomEvent *event)
     if(event->content)
         json_object_unref(event->content);
     g_free(event->txn_id);
-    g_free(event->sender);
-    g_free(event->event_type);
+    matrix_unintern(event->sender);
+    matrix_unintern(event->event_type);
     if (event->hook) {
         event->hook(event, TRUE);
     }
@@ -39,10 +39,12 @@ typedef struct _MatrixRoomEvent {
      */
     gchar *txn_id;
 
-    /* the sender, for incoming events. NULL for outgoing ones. */
-    gchar *sender;
+    /* the sender, for incoming events. NULL for outgoing ones. Interned
+     * (see matrix-intern.h). */
+    const gchar *sender;
 
-    gchar *event_type;
+    /* interned (see matrix-intern.h) */
+    const gchar *event_type;
     struct _JsonObject *content;
 
     /* Hook (& data) called when the event is unqueued; the hook should
@@ -58,7 +60,7 @@ typedef struct _MatrixRoomEvent {
 /**
  * Allocate a new MatrixRoomEvent.
  *
- * @param event_type   the type of the event. this is copied into the event
+ * @param event_type   the type of the event. this is interned into the event
  * @param content      the content of the event. This is used direct, but the
  *                     reference count is incremented.
  */
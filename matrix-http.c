@@ -0,0 +1,1922 @@
+/**
+ * matrix-http.c: HTTP transport, with a pool of keep-alive connections
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-http.h"
+
+/* std lib */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include "win32/win32dep.h"
+#else
+#include <unistd.h>
+#endif
+
+#include <http_parser.h>
+#ifndef MATRIX_NO_HTTP2
+#include <nghttp2/nghttp2.h>
+#endif
+
+/* libpurple */
+#include "account.h"
+#include "debug.h"
+#include "eventloop.h"
+#include "proxy.h"
+#include "sslconn.h"
+
+#include "libmatrix.h"
+
+/* the most connections we will open to any one server */
+#define MAX_CONNECTIONS_PER_SERVER 7
+
+/* how long we keep an unused connection open (seconds) */
+#define IDLE_TIMEOUT 30
+
+/* the most requests we will have in progress at once on an HTTP/2
+ * connection, if the server will take that many */
+#define MAX_STREAMS_PER_CONNECTION 100
+
+/* how many connections in a row may fail before the server says anything,
+ * without any sign that it doesn't speak HTTP/2, before we try HTTP/1.1 */
+#define MAX_HTTP2_ATTEMPTS 3
+
+/* how much of a response an HTTP/2 server may send before we ask for more:
+ * for each request, and for the connection as a whole. They are big enough
+ * that a large /sync doesn't have to wait on us. */
+#define HTTP2_STREAM_WINDOW (1024 * 1024)
+#define HTTP2_CONNECTION_WINDOW (16 * 1024 * 1024)
+
+typedef struct _MatrixHttpConnection MatrixHttpConnection;
+
+/* The most requests of each class which can be in progress at once. Between
+ * them, everything but sends is limited to one fewer than
+ * MAX_CONNECTIONS_PER_SERVER, so there is always a connection for sending
+ * messages.
+ */
+static const struct {
+    const gchar *name;
+    guint max_active;
+} _class_info[MATRIX_HTTP_CLASS_COUNT] = {
+    {"sync", 1},
+    {"send", MAX_CONNECTIONS_PER_SERVER},
+    {"typing", 1},
+    {"keys", 1},
+    {"state", 1},
+    {"media", 2},
+};
+
+typedef struct _MatrixHttpClassStats {
+    guint active;           /* requests in progress */
+    guint started;          /* requests started since the stats were logged */
+    gint64 total_wait_us;   /* time those requests spent in the queue */
+    gint64 max_wait_us;
+} MatrixHttpClassStats;
+
+struct _MatrixHttpPool {
+    PurpleAccount *account;
+    GList *connections;     /* MatrixHttpConnection */
+
+    /* MatrixHttpRequest: waiting for a connection, for each class */
+    GQueue pending[MATRIX_HTTP_CLASS_COUNT];
+    MatrixHttpClassStats stats[MATRIX_HTTP_CLASS_COUNT];
+
+    guint dispatch_id;      /* timeout which starts pending requests */
+
+    /* whether to try HTTP/2 on plain http connections, and the servers
+     * which have turned out not to speak it */
+    gboolean http2;
+    GHashTable *http1_servers;
+
+    /* for each server, how many HTTP/2 connections in a row have failed
+     * before we heard from it (GUINT_TO_POINTER) */
+    GHashTable *h2_failures;
+
+    /* MatrixHttpRequest: finished by an HTTP/2 connection, but not yet
+     * passed back to the caller */
+    GQueue finished;
+};
+
+struct _MatrixHttpRequest {
+    MatrixHttpPool *pool;
+
+    /* where to connect to. server is "host:port", with a scheme, and
+     * identifies the connections this request can use. */
+    gchar *server;
+    gchar *host;
+    int port;
+    gboolean ssl;
+
+    MatrixHttpClass request_class;
+    gint64 queued_time;     /* when it joined the queue */
+
+    GString *request;
+    const gchar *body;      /* sent after request; not ours */
+    gsize body_len;
+    gsize written;          /* how much of request + body we have sent */
+    gsize max_len;
+    gsize received;         /* how much of the response we have had */
+
+    /* whether the request can safely be sent twice (RFC 7231 4.2.2) */
+    gboolean idempotent;
+
+    /* set once we have retried on a new connection */
+    gboolean retried;
+
+    /* the connection carrying the request; NULL while it is pending */
+    MatrixHttpConnection *connection;
+
+    /* for HTTP/2: the stream carrying the request, where the body starts in
+     * the request string, and the response so far */
+    gint32 stream_id;
+    gsize body_start;
+    int status_code;
+    gint64 content_length;
+    gboolean headers_complete;
+    const gchar *error_message;     /* once it is finished */
+
+    const MatrixHttpResponseHandler *handler;
+    gpointer user_data;
+};
+
+struct _MatrixHttpConnection {
+    MatrixHttpPool *pool;
+    gchar *server;
+
+    /* for http: the connection attempt, and then the socket */
+    PurpleProxyConnectData *connect_data;
+    int fd;
+    guint read_handle;
+
+    /* for https. The read handler is part of the ssl connection. */
+    PurpleSslConnection *gsc;
+
+    gboolean connected;
+    guint write_handle;
+    guint idle_timer;
+
+    /* the number of responses we have had on this connection */
+    guint requests_served;
+
+    /* the request in progress; NULL if the connection is idle */
+    MatrixHttpRequest *request;
+    http_parser parser;
+    gboolean message_complete;
+    gboolean abandoned;
+
+    /* the header we are part-way through parsing */
+    GString *header_name, *header_value;
+    gboolean header_in_value;
+
+#ifndef MATRIX_NO_HTTP2
+    /* for HTTP/2, in place of all of the above: the session, which carries
+     * any number of requests at once, and what it has for us to send */
+    nghttp2_session *h2;
+    GList *streams;         /* MatrixHttpRequest */
+    GString *h2_out;
+    gsize h2_out_written;
+    gboolean h2_heard;      /* we have had a frame from the server */
+    gboolean h2_refused;    /* it answered in something other than HTTP/2 */
+    gboolean h2_goaway;     /* the server wants no more requests */
+    gboolean h2_receiving;  /* we are in nghttp2_session_mem_recv */
+#endif
+};
+
+
+static void _pool_schedule_dispatch(MatrixHttpPool *pool);
+
+/* HTTP/2: see below */
+static gboolean _connection_is_http2(MatrixHttpConnection *conn);
+static void _h2_connection_init(MatrixHttpConnection *conn);
+static void _h2_connection_free(MatrixHttpConnection *conn);
+static gboolean _h2_connection_has_room(MatrixHttpConnection *conn);
+static void _h2_connection_error(MatrixHttpConnection *conn,
+        const gchar *error_message);
+static GList *_h2_detach_requests(MatrixHttpConnection *conn);
+static void _h2_start_request(MatrixHttpConnection *conn,
+        MatrixHttpRequest *request);
+static void _h2_cancel_request(MatrixHttpConnection *conn,
+        MatrixHttpRequest *request);
+static gboolean _h2_send(MatrixHttpConnection *conn);
+static gboolean _h2_got_data(MatrixHttpConnection *conn, const gchar *buf,
+        gsize len);
+static void _h2_eof(MatrixHttpConnection *conn);
+
+
+/**
+ * Split the scheme, host and port out of a url
+ *
+ * @returns FALSE if the url can't be parsed
+ */
+static gboolean _parse_url(const gchar *url, gboolean *ssl, gchar **host,
+        int *port)
+{
+    const gchar *start, *end, *host_end = NULL;
+
+    if(g_str_has_prefix(url, "https://")) {
+        *ssl = TRUE;
+        *port = 443;
+        start = url + strlen("https://");
+    } else if(g_str_has_prefix(url, "http://")) {
+        *ssl = FALSE;
+        *port = 80;
+        start = url + strlen("http://");
+    } else {
+        return FALSE;
+    }
+
+    for(end = start; *end != '\0' && *end != '/' && *end != '?'; end++) {
+        if(*end == ':')
+            host_end = end;
+        else if(*end == ']')
+            host_end = NULL;  /* the colons were in an IPv6 address */
+    }
+
+    if(host_end != NULL)
+        *port = atoi(host_end + 1);
+    else
+        host_end = end;
+
+    /* strip the brackets from an IPv6 address */
+    if(*start == '[' && host_end > start + 1 && host_end[-1] == ']') {
+        start++;
+        host_end--;
+    }
+
+    if(host_end == start || *port <= 0)
+        return FALSE;
+
+    *host = g_strndup(start, host_end - start);
+    return TRUE;
+}
+
+
+/******************************************************************************
+ *
+ * Requests
+ */
+
+static void _request_free(MatrixHttpRequest *request)
+{
+    g_string_free(request->request, TRUE);
+    g_free(request->server);
+    g_free(request->host);
+    g_free(request);
+}
+
+
+/**
+ * Check the method in a request line for one which may be repeated
+ */
+static gboolean _method_is_idempotent(const gchar *request_line)
+{
+    static const gchar *methods[] = {"GET ", "HEAD ", "PUT ", "DELETE ",
+            NULL};
+    const gchar **method;
+
+    for(method = methods; *method != NULL; method++) {
+        if(g_str_has_prefix(request_line, *method))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+/**
+ * Check whether a request can go over HTTP/2
+ */
+static gboolean _request_can_use_http2(MatrixHttpRequest *request)
+{
+    MatrixHttpPool *pool = request->pool;
+    const gchar *target = strchr(request->request->str, ' ');
+
+    /* requests via a proxy have the whole url in the request line, and stay
+     * on HTTP/1.1 */
+    return pool->http2 && !request->ssl && target != NULL &&
+            target[1] == '/' &&
+            !g_hash_table_contains(pool->http1_servers, request->server);
+}
+
+
+/**
+ * Tell the handler that a request, which has been detached from its
+ * connection, is complete; and free it
+ */
+static void _request_complete(MatrixHttpRequest *request,
+        const gchar *error_message)
+{
+    request->handler->complete(request, request->user_data, error_message);
+    _request_free(request);
+}
+
+
+/**
+ * Put a request, which has been detached from its connection, back at the
+ * front of the queue to be sent again
+ */
+static void _request_requeue(MatrixHttpRequest *request)
+{
+    MatrixHttpPool *pool = request->pool;
+
+    request->written = 0;
+    request->queued_time = g_get_monotonic_time();
+    request->status_code = 0;
+    request->content_length = -1;
+    request->headers_complete = FALSE;
+    g_queue_push_head(&pool->pending[request->request_class], request);
+    _pool_schedule_dispatch(pool);
+}
+
+
+/**
+ * A request has been detached from a connection which failed: either fail
+ * it, or try it again
+ *
+ * @param reused   whether the connection had carried a request before
+ */
+static void _request_retry_or_fail(MatrixHttpRequest *request,
+        gboolean reused, const gchar *error_message)
+{
+    /* If we had used the connection before, the server may just have closed
+     * it as we sent the request. That isn't really an error; send the
+     * request again on a new connection.
+     *
+     * Hearing nothing back doesn't prove that the server didn't act on the
+     * request, though, so we only do that if none of it went out, or if it
+     * is safe to send twice.
+     */
+    if(reused && request->received == 0 && !request->retried &&
+            (request->written == 0 || request->idempotent)) {
+        request->retried = TRUE;
+        _request_requeue(request);
+        return;
+    }
+
+    _request_complete(request, error_message);
+}
+
+
+/******************************************************************************
+ *
+ * Connections
+ */
+
+/**
+ * Close a connection and forget about it. Any request must already have been
+ * detached.
+ */
+static void _connection_close(MatrixHttpConnection *conn)
+{
+    MatrixHttpPool *pool = conn->pool;
+
+    g_assert(conn->request == NULL);
+
+    pool->connections = g_list_remove(pool->connections, conn);
+
+    if(conn->connect_data != NULL)
+        purple_proxy_connect_cancel(conn->connect_data);
+    if(conn->read_handle != 0)
+        purple_input_remove(conn->read_handle);
+    if(conn->write_handle != 0)
+        purple_input_remove(conn->write_handle);
+    if(conn->idle_timer != 0)
+        purple_timeout_remove(conn->idle_timer);
+    if(conn->gsc != NULL)
+        purple_ssl_close(conn->gsc);
+    if(conn->fd >= 0)
+        close(conn->fd);
+    if(_connection_is_http2(conn))
+        _h2_connection_free(conn);
+
+    g_string_free(conn->header_name, TRUE);
+    g_string_free(conn->header_value, TRUE);
+    g_free(conn->server);
+    g_free(conn);
+}
+
+
+static MatrixHttpRequest *_connection_detach_request(
+        MatrixHttpConnection *conn)
+{
+    MatrixHttpRequest *request = conn->request;
+
+    if(request != NULL) {
+        request->connection = NULL;
+        conn->request = NULL;
+        conn->pool->stats[request->request_class].active--;
+    }
+    return request;
+}
+
+
+/**
+ * Something has gone wrong with a connection: close it, and either fail the
+ * request it was carrying, or try it again.
+ */
+static void _connection_error(MatrixHttpConnection *conn,
+        const gchar *error_message)
+{
+    gboolean reused = conn->requests_served > 0;
+    MatrixHttpRequest *request;
+
+    purple_debug_info("matrixprpl", "connection to %s failed: %s\n",
+            conn->server, error_message);
+
+    if(_connection_is_http2(conn)) {
+        _h2_connection_error(conn, error_message);
+        return;
+    }
+
+    request = _connection_detach_request(conn);
+    _connection_close(conn);
+
+    if(request != NULL)
+        _request_retry_or_fail(request, reused, error_message);
+}
+
+
+static gboolean _connection_idle_timeout(gpointer user_data)
+{
+    MatrixHttpConnection *conn = user_data;
+
+    conn->idle_timer = 0;
+    _connection_close(conn);
+    return FALSE;
+}
+
+
+/**
+ * We have the whole response for a connection's request
+ *
+ * @param keep_alive   whether the connection can be used again
+ */
+static void _connection_finish(MatrixHttpConnection *conn,
+        gboolean keep_alive)
+{
+    MatrixHttpPool *pool = conn->pool;
+    MatrixHttpRequest *request = _connection_detach_request(conn);
+
+    conn->requests_served++;
+    if(keep_alive) {
+        conn->idle_timer = purple_timeout_add_seconds(IDLE_TIMEOUT,
+                _connection_idle_timeout, conn);
+    } else {
+        _connection_close(conn);
+    }
+
+    /* there may be requests waiting for this connection */
+    _pool_schedule_dispatch(pool);
+
+    _request_complete(request, NULL);
+}
+
+
+static void _connection_write(MatrixHttpConnection *conn);
+
+static void _connection_writable_cb(gpointer user_data, gint source,
+        PurpleInputCondition cond)
+{
+    _connection_write(user_data);
+}
+
+
+/**
+ * Send as much of the request as the socket will take
+ */
+static void _connection_write(MatrixHttpConnection *conn)
+{
+    MatrixHttpRequest *request = conn->request;
+    gsize head_len, total, start;
+
+    if(_connection_is_http2(conn)) {
+        _h2_send(conn);
+        return;
+    }
+
+    head_len = request->request->len;
+    total = head_len + request->body_len;
+    start = request->written;
+
+    while(request->written < total) {
+        const gchar *buf;
+        gsize len;
+        gssize ret;
+
+        /* the body is sent straight from the caller's buffer, so that we
+         * don't need another copy of a big upload */
+        if(request->written < head_len) {
+            buf = request->request->str + request->written;
+            len = head_len - request->written;
+        } else {
+            buf = request->body + (request->written - head_len);
+            len = total - request->written;
+        }
+
+        if(conn->gsc != NULL)
+            ret = purple_ssl_write(conn->gsc, buf, len);
+        else
+            ret = write(conn->fd, buf, len);
+
+        if(ret < 0 && errno == EAGAIN) {
+            if(conn->write_handle == 0)
+                conn->write_handle = purple_input_add(
+                        conn->gsc != NULL ? conn->gsc->fd : conn->fd,
+                        PURPLE_INPUT_WRITE, _connection_writable_cb, conn);
+            break;
+        }
+
+        if(ret <= 0) {
+            _connection_error(conn, _("Unable to send request"));
+            return;
+        }
+
+        request->written += ret;
+    }
+
+    if(request->handler->sent != NULL && request->body_len > 0 &&
+            request->written > MAX(start, head_len))
+        request->handler->sent(request, request->user_data,
+                request->written - head_len, request->body_len);
+
+    if(request->written == total && conn->write_handle != 0) {
+        purple_input_remove(conn->write_handle);
+        conn->write_handle = 0;
+    }
+}
+
+
+/**
+ * Give a connection a request to carry
+ */
+static void _connection_start_request(MatrixHttpConnection *conn,
+        MatrixHttpRequest *request)
+{
+    MatrixHttpClassStats *stats = &conn->pool->stats[request->request_class];
+    gint64 wait_us = g_get_monotonic_time() - request->queued_time;
+
+    request->connection = conn;
+
+    stats->active++;
+    stats->started++;
+    stats->total_wait_us += wait_us;
+    stats->max_wait_us = MAX(stats->max_wait_us, wait_us);
+
+    if(conn->idle_timer != 0) {
+        purple_timeout_remove(conn->idle_timer);
+        conn->idle_timer = 0;
+    }
+
+    if(_connection_is_http2(conn)) {
+        _h2_start_request(conn, request);
+        return;
+    }
+
+    conn->request = request;
+    http_parser_init(&conn->parser, HTTP_RESPONSE);
+    conn->parser.data = conn;
+    conn->message_complete = FALSE;
+    g_string_truncate(conn->header_name, 0);
+    g_string_truncate(conn->header_value, 0);
+    conn->header_in_value = FALSE;
+
+    if(conn->connected)
+        _connection_write(conn);
+}
+
+
+/******************************************************************************
+ *
+ * Response parsing. We pass everything on to the request's handler as soon
+ * as we have it.
+ */
+
+/* pass on a header, once we have all of it */
+static void _handle_header_completed(MatrixHttpConnection *conn)
+{
+    MatrixHttpRequest *request = conn->request;
+
+    if(conn->header_name->len > 0)
+        request->handler->header(request, request->user_data,
+                conn->header_name->str, conn->header_value->str);
+    g_string_truncate(conn->header_name, 0);
+    g_string_truncate(conn->header_value, 0);
+}
+
+/**
+ * callback from the http parser which handles a header name. It may come in
+ * several pieces.
+ */
+static int _handle_header_field(http_parser *http_parser, const char *at,
+        size_t length)
+{
+    MatrixHttpConnection *conn = http_parser->data;
+
+    if(conn->header_in_value) {
+        /* starting a new header */
+        _handle_header_completed(conn);
+        conn->header_in_value = FALSE;
+    }
+    g_string_append_len(conn->header_name, at, length);
+    return 0;
+}
+
+/**
+ * callback from the http parser which handles a header value
+ */
+static int _handle_header_value(http_parser *http_parser, const char *at,
+        size_t length)
+{
+    MatrixHttpConnection *conn = http_parser->data;
+
+    g_string_append_len(conn->header_value, at, length);
+    conn->header_in_value = TRUE;
+    return 0;
+}
+
+static int _handle_headers_complete(http_parser *http_parser)
+{
+    MatrixHttpConnection *conn = http_parser->data;
+    MatrixHttpRequest *request = conn->request;
+
+    _handle_header_completed(conn);
+    request->handler->headers_complete(request, request->user_data,
+            http_parser->status_code,
+            http_parser->content_length == G_MAXUINT64 ? -1 :
+                    (gint64)http_parser->content_length);
+    return 0;
+}
+
+/**
+ * callback from the http parser which handles a piece of the body
+ */
+static int _handle_body(http_parser *http_parser, const char *at,
+        size_t length)
+{
+    MatrixHttpConnection *conn = http_parser->data;
+    MatrixHttpRequest *request = conn->request;
+
+    if(!request->handler->body(request, request->user_data, at, length)) {
+        conn->abandoned = TRUE;
+        http_parser_pause(http_parser, 1);
+    }
+    return 0;
+}
+
+/**
+ * callback from the http parser at the end of the response
+ */
+static int _handle_message_complete(http_parser *http_parser)
+{
+    MatrixHttpConnection *conn = http_parser->data;
+    conn->message_complete = TRUE;
+
+    /* anything after this is not part of our response */
+    http_parser_pause(http_parser, 1);
+    return 0;
+}
+
+
+static void _parse_response(MatrixHttpConnection *conn, const gchar *buf,
+        gsize len)
+{
+    http_parser_settings http_parser_settings;
+
+    memset(&http_parser_settings, 0, sizeof(http_parser_settings));
+    http_parser_settings.on_header_field = _handle_header_field;
+    http_parser_settings.on_header_value = _handle_header_value;
+    http_parser_settings.on_headers_complete = _handle_headers_complete;
+    http_parser_settings.on_body = _handle_body;
+    http_parser_settings.on_message_complete = _handle_message_complete;
+    http_parser_execute(&conn->parser, &http_parser_settings, buf, len);
+}
+
+
+/**
+ * Handle some data from the server
+ *
+ * @returns FALSE if we have finished with the connection's request (or the
+ *    connection itself), so should stop reading
+ */
+static gboolean _connection_got_data(MatrixHttpConnection *conn,
+        const gchar *buf, gsize len)
+{
+    MatrixHttpRequest *request = conn->request;
+
+    if(_connection_is_http2(conn))
+        return _h2_got_data(conn, buf, len);
+
+    if(request == NULL) {
+        /* the server shouldn't send anything on an idle connection */
+        _connection_close(conn);
+        return FALSE;
+    }
+
+    request->received += len;
+    if(request->received > request->max_len) {
+        _connection_error(conn, _("Response from homeserver is too large"));
+        return FALSE;
+    }
+
+    _parse_response(conn, buf, len);
+
+    if(conn->abandoned) {
+        _connection_error(conn, _("Response abandoned"));
+        return FALSE;
+    }
+
+    if(conn->message_complete) {
+        _connection_finish(conn, http_should_keep_alive(&conn->parser));
+        return FALSE;
+    }
+
+    if(HTTP_PARSER_ERRNO(&conn->parser) != HPE_OK) {
+        _connection_error(conn, _("Invalid response from homeserver"));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+/**
+ * The server has closed the connection
+ */
+static void _connection_eof(MatrixHttpConnection *conn)
+{
+    if(_connection_is_http2(conn)) {
+        _h2_eof(conn);
+        return;
+    }
+
+    if(conn->request == NULL) {
+        /* the server has closed an idle connection */
+        if(purple_debug_is_verbose())
+            purple_debug_info("matrixprpl", "%s closed idle connection\n",
+                    conn->server);
+        _connection_close(conn);
+        return;
+    }
+
+    /* the response may be one which runs until EOF */
+    _parse_response(conn, NULL, 0);
+
+    if(conn->message_complete)
+        _connection_finish(conn, FALSE);
+    else
+        _connection_error(conn, _("Server closed the connection"));
+}
+
+
+/**
+ * The socket is readable: read all we can from it
+ */
+static void _connection_read(MatrixHttpConnection *conn)
+{
+    gchar buf[16384];
+
+    while(TRUE) {
+        gssize len;
+
+        if(conn->gsc != NULL)
+            len = purple_ssl_read(conn->gsc, buf, sizeof(buf));
+        else
+            len = read(conn->fd, buf, sizeof(buf));
+
+        if(len < 0 && errno == EAGAIN)
+            return;
+
+        if(len == 0) {
+            _connection_eof(conn);
+            return;
+        }
+
+        if(len < 0) {
+            _connection_error(conn, g_strerror(errno));
+            return;
+        }
+
+        if(!_connection_got_data(conn, buf, len))
+            return;
+    }
+}
+
+
+static void _connection_readable_cb(gpointer user_data, gint source,
+        PurpleInputCondition cond)
+{
+    _connection_read(user_data);
+}
+
+
+static void _connection_ssl_readable_cb(gpointer user_data,
+        PurpleSslConnection *gsc, PurpleInputCondition cond)
+{
+    _connection_read(user_data);
+}
+
+
+/**
+ * The connection is established; send the request which has been waiting
+ * for it
+ */
+static void _connection_connected(MatrixHttpConnection *conn)
+{
+    conn->connected = TRUE;
+    if(conn->request != NULL || _connection_is_http2(conn))
+        _connection_write(conn);
+}
+
+
+static void _connection_connect_cb(gpointer user_data, gint source,
+        const gchar *error_message)
+{
+    MatrixHttpConnection *conn = user_data;
+
+    conn->connect_data = NULL;
+    if(source < 0) {
+        _connection_error(conn, error_message);
+        return;
+    }
+
+    conn->fd = source;
+    conn->read_handle = purple_input_add(source, PURPLE_INPUT_READ,
+            _connection_readable_cb, conn);
+    _connection_connected(conn);
+}
+
+
+static void _connection_ssl_connect_cb(gpointer user_data,
+        PurpleSslConnection *gsc, PurpleInputCondition cond)
+{
+    MatrixHttpConnection *conn = user_data;
+
+    /* we keep reading even when the connection is idle, so that we notice
+     * when the server closes it */
+    purple_ssl_input_add(gsc, _connection_ssl_readable_cb, conn);
+    _connection_connected(conn);
+}
+
+
+static void _connection_ssl_error_cb(PurpleSslConnection *gsc,
+        PurpleSslErrorType error, gpointer user_data)
+{
+    MatrixHttpConnection *conn = user_data;
+
+    /* libpurple closes the ssl connection after calling this */
+    conn->gsc = NULL;
+    _connection_error(conn, purple_ssl_strerror(error));
+}
+
+
+/**
+ * Open a new connection for a request
+ */
+static void _connection_open(MatrixHttpPool *pool,
+        MatrixHttpRequest *request)
+{
+    MatrixHttpConnection *conn;
+    gboolean http2 = _request_can_use_http2(request);
+    gboolean started;
+
+    purple_debug_info("matrixprpl", "opening %sconnection to %s\n",
+            http2 ? "HTTP/2 " : "", request->server);
+
+    conn = g_new0(MatrixHttpConnection, 1);
+    conn->pool = pool;
+    conn->server = g_strdup(request->server);
+    conn->fd = -1;
+    conn->header_name = g_string_new(NULL);
+    conn->header_value = g_string_new(NULL);
+    if(http2)
+        _h2_connection_init(conn);
+    pool->connections = g_list_prepend(pool->connections, conn);
+    _connection_start_request(conn, request);
+
+    if(request->ssl) {
+        started = purple_ssl_is_supported();
+        if(started)
+            conn->gsc = purple_ssl_connect(pool->account, request->host,
+                    request->port, _connection_ssl_connect_cb,
+                    _connection_ssl_error_cb, conn);
+        started = started && conn->gsc != NULL;
+    } else {
+        conn->connect_data = purple_proxy_connect(conn, pool->account,
+                request->host, request->port, _connection_connect_cb, conn);
+        started = conn->connect_data != NULL;
+    }
+
+    if(!started)
+        _connection_error(conn, _("Unable to connect to homeserver"));
+}
+
+
+/******************************************************************************
+ *
+ * HTTP/2. A server we talk to over plain http may also speak HTTP/2 ("h2c"),
+ * if we start with the HTTP/2 connection preface ("prior knowledge") instead
+ * of agreeing it over HTTP/1.1 first. Then one connection carries all of our
+ * requests to the server at once, and HPACK saves us sending the same
+ * headers in full every time.
+ *
+ * We can't offer it over https: servers only agree to that through ALPN in
+ * the TLS handshake, which libpurple's SSL API gives us no way to do.
+ *
+ * A server which doesn't speak HTTP/2 answers the preface with an HTTP/1.1
+ * error, or just closes the connection. It can't have acted on any of our
+ * requests, so we remember that it only speaks HTTP/1.1, and send them again
+ * that way.
+ */
+
+#ifndef MATRIX_NO_HTTP2
+
+static gboolean _connection_is_http2(MatrixHttpConnection *conn)
+{
+    return conn->h2 != NULL;
+}
+
+
+static MatrixHttpRequest *_h2_find_request(MatrixHttpConnection *conn,
+        gint32 stream_id)
+{
+    GList *ptr;
+
+    for(ptr = conn->streams; ptr != NULL; ptr = ptr->next) {
+        MatrixHttpRequest *request = ptr->data;
+        if(request->stream_id == stream_id)
+            return request;
+    }
+    return NULL;
+}
+
+
+static void _h2_detach_request(MatrixHttpConnection *conn,
+        MatrixHttpRequest *request)
+{
+    conn->streams = g_list_remove(conn->streams, request);
+    request->connection = NULL;
+    conn->pool->stats[request->request_class].active--;
+
+    /* there may be requests waiting for room on the connection */
+    _pool_schedule_dispatch(conn->pool);
+}
+
+
+static GList *_h2_detach_requests(MatrixHttpConnection *conn)
+{
+    GList *requests = g_list_copy(conn->streams);
+    GList *ptr;
+
+    for(ptr = requests; ptr != NULL; ptr = ptr->next)
+        _h2_detach_request(conn, ptr->data);
+    return requests;
+}
+
+
+/**
+ * The session has finished with a request. We tell the caller once the
+ * session is done with the data it was given, in _h2_complete_finished.
+ */
+static void _h2_request_finished(MatrixHttpConnection *conn,
+        MatrixHttpRequest *request, const gchar *error_message)
+{
+    _h2_detach_request(conn, request);
+    request->error_message = error_message;
+    g_queue_push_tail(&conn->pool->finished, request);
+}
+
+
+static void _h2_complete_finished(MatrixHttpPool *pool)
+{
+    MatrixHttpRequest *request;
+
+    /* the callers may cancel the others as we go */
+    while((request = g_queue_pop_head(&pool->finished)) != NULL)
+        _request_complete(request, request->error_message);
+}
+
+
+static gboolean _h2_connection_has_room(MatrixHttpConnection *conn)
+{
+    guint32 max_streams = nghttp2_session_get_remote_settings(conn->h2,
+            NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
+
+    return !conn->h2_goaway && g_list_length(conn->streams) <
+            MIN(max_streams, MAX_STREAMS_PER_CONNECTION);
+}
+
+
+static void _h2_connection_error(MatrixHttpConnection *conn,
+        const gchar *error_message)
+{
+    MatrixHttpPool *pool = conn->pool;
+    gboolean heard = conn->h2_heard;
+    gboolean fall_back, retry = FALSE;
+    GList *requests = _h2_detach_requests(conn), *ptr;
+    guint failures;
+
+    /* nghttp2 ends the session, rather than fail, if the server sends
+     * something other than SETTINGS to start with */
+    fall_back = conn->h2_refused ||
+            (conn->connected && !heard &&
+                    !nghttp2_session_want_read(conn->h2));
+
+    if(!fall_back && conn->connected && !heard) {
+        /* the connection was reset, say, before the server said anything.
+         * That proves nothing about HTTP/2, unless it keeps happening. */
+        failures = GPOINTER_TO_UINT(g_hash_table_lookup(pool->h2_failures,
+                conn->server)) + 1;
+        g_hash_table_replace(pool->h2_failures, g_strdup(conn->server),
+                GUINT_TO_POINTER(failures));
+        fall_back = failures >= MAX_HTTP2_ATTEMPTS;
+        retry = !fall_back;
+    }
+
+    if(fall_back) {
+        purple_debug_info("matrixprpl", "%s doesn't speak HTTP/2; "
+                "using HTTP/1.1\n", conn->server);
+        g_hash_table_add(pool->http1_servers, g_strdup(conn->server));
+        g_hash_table_remove(pool->h2_failures, conn->server);
+    }
+    _connection_close(conn);
+
+    if(fall_back || retry) {
+        /* back to the front of the queue, in the order they were sent */
+        for(ptr = g_list_last(requests); ptr != NULL; ptr = ptr->prev)
+            _request_requeue(ptr->data);
+        g_list_free(requests);
+        return;
+    }
+
+    while(requests != NULL) {
+        _request_retry_or_fail(requests->data, heard, error_message);
+        requests = g_list_delete_link(requests, requests);
+    }
+}
+
+
+/**
+ * Send whatever the session has for the server, as far as the socket will
+ * take it
+ *
+ * @returns FALSE if the connection failed (and is gone)
+ */
+static gboolean _h2_send(MatrixHttpConnection *conn)
+{
+    /* we take this much from the session at a time, so that a big upload
+     * isn't all copied at once */
+    static const gsize max_pending = 65536;
+
+    while(TRUE) {
+        while(conn->h2_out->len - conn->h2_out_written < max_pending) {
+            const uint8_t *data;
+            ssize_t len = nghttp2_session_mem_send(conn->h2, &data);
+
+            if(len < 0) {
+                _connection_error(conn, nghttp2_strerror(len));
+                return FALSE;
+            }
+            if(len == 0)
+                break;
+            g_string_append_len(conn->h2_out, (const gchar *)data, len);
+        }
+
+        if(conn->h2_out_written == conn->h2_out->len || !conn->connected)
+            break;
+
+        while(conn->h2_out_written < conn->h2_out->len) {
+            gssize ret = write(conn->fd,
+                    conn->h2_out->str + conn->h2_out_written,
+                    conn->h2_out->len - conn->h2_out_written);
+
+            if(ret < 0 && errno == EAGAIN) {
+                if(conn->write_handle == 0)
+                    conn->write_handle = purple_input_add(conn->fd,
+                            PURPLE_INPUT_WRITE, _connection_writable_cb,
+                            conn);
+                return TRUE;
+            }
+
+            if(ret <= 0) {
+                _connection_error(conn, _("Unable to send request"));
+                return FALSE;
+            }
+            conn->h2_out_written += ret;
+        }
+        g_string_truncate(conn->h2_out, 0);
+        conn->h2_out_written = 0;
+    }
+
+    if(conn->write_handle != 0 && conn->h2_out->len == 0) {
+        purple_input_remove(conn->write_handle);
+        conn->write_handle = 0;
+    }
+    return TRUE;
+}
+
+
+/**
+ * Supply the body of a request, from the request string after the headers
+ * and then from the caller's buffer, as the session asks for it
+ */
+static ssize_t _h2_read_body(nghttp2_session *session, int32_t stream_id,
+        uint8_t *buf, size_t length, uint32_t *data_flags,
+        nghttp2_data_source *source, void *user_data)
+{
+    MatrixHttpRequest *request = _h2_find_request(user_data, stream_id);
+    gsize head_len, total, start, len;
+
+    if(request == NULL)
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+
+    head_len = request->request->len;
+    total = head_len + request->body_len;
+    start = MAX(request->written, request->body_start);
+
+    if(start < head_len) {
+        len = MIN(length, head_len - start);
+        memcpy(buf, request->request->str + start, len);
+    } else {
+        len = MIN(length, total - start);
+        memcpy(buf, request->body + (start - head_len), len);
+    }
+    request->written = start + len;
+
+    if(request->written == total)
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+
+    if(request->handler->sent != NULL && request->body_len > 0 &&
+            request->written > MAX(start, head_len))
+        request->handler->sent(request, request->user_data,
+                request->written - head_len, request->body_len);
+    return len;
+}
+
+
+/* headers which only mean something to HTTP/1.1 (RFC 9113 8.2.2); and
+ * Host, which becomes :authority */
+static gboolean _h2_header_is_http1_only(const gchar *name)
+{
+    static const gchar *names[] = {"host", "connection", "keep-alive",
+            "proxy-connection", "transfer-encoding", "upgrade", "te", NULL};
+    const gchar **ptr;
+
+    for(ptr = names; *ptr != NULL; ptr++) {
+        if(strcmp(name, *ptr) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+static void _h2_add_header(GArray *headers, guint index, const gchar *name,
+        const gchar *value)
+{
+    nghttp2_nv nv = {(uint8_t *)name, (uint8_t *)value, strlen(name),
+            strlen(value), NGHTTP2_NV_FLAG_NONE};
+
+    /* keep the access token out of the compression tables, as RFC 7541
+     * 7.1.3 suggests, so that it can't be guessed from the size of later
+     * requests */
+    if(strcmp(name, "authorization") == 0)
+        nv.flags = NGHTTP2_NV_FLAG_NO_INDEX;
+
+    if(index < headers->len)
+        g_array_index(headers, nghttp2_nv, index) = nv;
+    else
+        g_array_append_val(headers, nv);
+}
+
+
+/* split a line off the front of a string, returning the rest, or NULL if
+ * this was the last line */
+static gchar *_h2_split_line(gchar *str)
+{
+    gchar *end = strstr(str, "\r\n");
+
+    if(end == NULL)
+        return NULL;
+    *end = '\0';
+    return end + 2;
+}
+
+
+/**
+ * Turn the HTTP/1.1 request we were given into HTTP/2 headers
+ *
+ * @param head     returns a copy of the request line and headers, which the
+ *                 names and values point into; to be freed with g_free
+ *
+ * @returns the headers, or NULL if the request can't be parsed
+ */
+static GArray *_h2_request_headers(MatrixHttpRequest *request, gchar **head)
+{
+    const gchar *str = request->request->str;
+    const gchar *end = strstr(str, "\r\n\r\n");
+    gchar *method, *target, *version, *line;
+    GArray *headers;
+
+    if(end == NULL)
+        return NULL;
+    request->body_start = end + 4 - str;
+
+    /* "METHOD target HTTP/1.1" */
+    *head = method = g_strndup(str, end - str);
+    line = _h2_split_line(method);
+    target = strchr(method, ' ');
+    version = target == NULL ? NULL : strchr(target + 1, ' ');
+    if(version == NULL) {
+        g_free(*head);
+        return NULL;
+    }
+    *target++ = '\0';
+    *version = '\0';
+
+    /* the pseudo-headers have to come first. :authority comes from Host. */
+    headers = g_array_sized_new(FALSE, FALSE, sizeof(nghttp2_nv), 16);
+    _h2_add_header(headers, 0, ":method", method);
+    _h2_add_header(headers, 1, ":scheme", "http");
+    _h2_add_header(headers, 2, ":authority", request->host);
+    _h2_add_header(headers, 3, ":path", target);
+
+    while(line != NULL) {
+        gchar *name = line, *value = strchr(name, ':'), *ptr;
+
+        line = _h2_split_line(line);
+        if(value == NULL)
+            continue;
+        *value++ = '\0';
+        while(*value == ' ' || *value == '\t')
+            value++;
+
+        /* header names are lower case in HTTP/2 */
+        for(ptr = name; *ptr != '\0'; ptr++)
+            *ptr = g_ascii_tolower(*ptr);
+
+        if(strcmp(name, "host") == 0)
+            _h2_add_header(headers, 2, ":authority", value);
+        else if(!_h2_header_is_http1_only(name))
+            _h2_add_header(headers, headers->len, name, value);
+    }
+    return headers;
+}
+
+
+static void _h2_start_request(MatrixHttpConnection *conn,
+        MatrixHttpRequest *request)
+{
+    nghttp2_data_provider body;
+    GArray *headers;
+    gchar *head;
+    gint32 stream_id = -1;
+
+    body.source.ptr = NULL;
+    body.read_callback = _h2_read_body;
+    conn->streams = g_list_append(conn->streams, request);
+
+    headers = _h2_request_headers(request, &head);
+    if(headers != NULL) {
+        gboolean has_body = request->body_start < request->request->len ||
+                request->body_len > 0;
+
+        stream_id = nghttp2_submit_request(conn->h2, NULL,
+                (const nghttp2_nv *)headers->data, headers->len,
+                has_body ? &body : NULL, NULL);
+        g_array_free(headers, TRUE);
+        g_free(head);
+    }
+
+    if(headers == NULL) {
+        _h2_detach_request(conn, request);
+        _request_complete(request, _("Invalid request"));
+        return;
+    }
+
+    if(stream_id < 0) {
+        /* most likely, we have used up the stream ids; try it on another
+         * connection */
+        purple_debug_info("matrixprpl", "unable to start HTTP/2 request: "
+                "%s\n", nghttp2_strerror(stream_id));
+        conn->h2_goaway = TRUE;
+        _h2_detach_request(conn, request);
+        _request_requeue(request);
+        return;
+    }
+
+    request->stream_id = stream_id;
+    if(!conn->h2_receiving)
+        _h2_send(conn);
+}
+
+
+static void _h2_cancel_request(MatrixHttpConnection *conn,
+        MatrixHttpRequest *request)
+{
+    nghttp2_submit_rst_stream(conn->h2, NGHTTP2_FLAG_NONE, request->stream_id,
+            NGHTTP2_CANCEL);
+    _h2_detach_request(conn, request);
+    if(!conn->h2_receiving)
+        _h2_send(conn);
+}
+
+
+/******************************************************************************
+ *
+ * HTTP/2 callbacks, from nghttp2_session_mem_recv and _mem_send
+ */
+
+static int _h2_on_frame_send(nghttp2_session *session,
+        const nghttp2_frame *frame, void *user_data)
+{
+    MatrixHttpRequest *request;
+
+    if(frame->hd.type != NGHTTP2_HEADERS)
+        return 0;
+
+    /* the body follows the headers in the request string */
+    request = _h2_find_request(user_data, frame->hd.stream_id);
+    if(request != NULL)
+        request->written = request->body_start;
+    return 0;
+}
+
+
+static int _h2_on_header(nghttp2_session *session, const nghttp2_frame *frame,
+        const uint8_t *name, size_t namelen, const uint8_t *value,
+        size_t valuelen, uint8_t flags, void *user_data)
+{
+    MatrixHttpRequest *request;
+
+    if(frame->hd.type != NGHTTP2_HEADERS)
+        return 0;
+
+    /* we ignore trailers, and the headers of 1xx responses */
+    request = _h2_find_request(user_data, frame->hd.stream_id);
+    if(request == NULL || request->headers_complete)
+        return 0;
+
+    /* nghttp2 nul-terminates the names and values */
+    if(strcmp((const gchar *)name, ":status") == 0) {
+        request->status_code = atoi((const gchar *)value);
+        return 0;
+    }
+    if(name[0] == ':' || request->status_code < 200)
+        return 0;
+
+    if(strcmp((const gchar *)name, "content-length") == 0)
+        request->content_length = g_ascii_strtoll((const gchar *)value,
+                NULL, 10);
+    request->handler->header(request, request->user_data,
+            (const gchar *)name, (const gchar *)value);
+    return 0;
+}
+
+
+static int _h2_on_frame_recv(nghttp2_session *session,
+        const nghttp2_frame *frame, void *user_data)
+{
+    MatrixHttpConnection *conn = user_data;
+    MatrixHttpRequest *request;
+
+    /* the server speaks HTTP/2, or nghttp2 wouldn't have got this far */
+    if(!conn->h2_heard) {
+        conn->h2_heard = TRUE;
+        g_hash_table_remove(conn->pool->h2_failures, conn->server);
+    }
+
+    if(frame->hd.type == NGHTTP2_GOAWAY) {
+        /* nghttp2 closes any of our streams which the server won't be
+         * dealing with, with NGHTTP2_REFUSED_STREAM */
+        purple_debug_info("matrixprpl", "%s is closing the connection\n",
+                conn->server);
+        conn->h2_goaway = TRUE;
+        return 0;
+    }
+
+    if(frame->hd.type != NGHTTP2_HEADERS ||
+            !(frame->hd.flags & NGHTTP2_FLAG_END_HEADERS))
+        return 0;
+
+    request = _h2_find_request(conn, frame->hd.stream_id);
+    if(request == NULL || request->headers_complete)
+        return 0;
+
+    if(request->status_code < 200) {
+        /* a 1xx response; the real one is still to come */
+        request->status_code = 0;
+        return 0;
+    }
+
+    request->headers_complete = TRUE;
+    request->handler->headers_complete(request, request->user_data,
+            request->status_code, request->content_length);
+    return 0;
+}
+
+
+static int _h2_on_data_chunk_recv(nghttp2_session *session, uint8_t flags,
+        int32_t stream_id, const uint8_t *data, size_t len, void *user_data)
+{
+    MatrixHttpConnection *conn = user_data;
+    MatrixHttpRequest *request = _h2_find_request(conn, stream_id);
+    const gchar *error_message = NULL;
+
+    if(request == NULL)
+        return 0;
+
+    request->received += len;
+    if(request->received > request->max_len)
+        error_message = _("Response from homeserver is too large");
+    else if(!request->handler->body(request, request->user_data,
+            (const gchar *)data, len))
+        error_message = _("Response abandoned");
+
+    if(error_message != NULL) {
+        nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_id,
+                NGHTTP2_CANCEL);
+        _h2_request_finished(conn, request, error_message);
+    }
+    return 0;
+}
+
+
+static int _h2_on_stream_close(nghttp2_session *session, int32_t stream_id,
+        uint32_t error_code, void *user_data)
+{
+    MatrixHttpConnection *conn = user_data;
+    MatrixHttpRequest *request = _h2_find_request(conn, stream_id);
+
+    /* if the server hasn't said anything yet, it probably doesn't speak
+     * HTTP/2; the request stays put until we fall back */
+    if(request == NULL || !conn->h2_heard)
+        return 0;
+
+    if(error_code == NGHTTP2_REFUSED_STREAM) {
+        /* the server didn't start on it, so it is safe to send again */
+        _h2_detach_request(conn, request);
+        _request_requeue(request);
+    } else if(error_code != NGHTTP2_NO_ERROR || !request->headers_complete) {
+        purple_debug_info("matrixprpl", "%s reset request %d: %s\n",
+                conn->server, stream_id, nghttp2_http2_strerror(error_code));
+        _h2_request_finished(conn, request,
+                _("Server abandoned the request"));
+    } else {
+        conn->requests_served++;
+        _h2_request_finished(conn, request, NULL);
+    }
+    return 0;
+}
+
+
+static void _h2_connection_init(MatrixHttpConnection *conn)
+{
+    nghttp2_session_callbacks *callbacks;
+    nghttp2_settings_entry settings[] = {
+        {NGHTTP2_SETTINGS_ENABLE_PUSH, 0},
+        {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, HTTP2_STREAM_WINDOW},
+    };
+
+    nghttp2_session_callbacks_new(&callbacks);
+    nghttp2_session_callbacks_set_on_frame_send_callback(callbacks,
+            _h2_on_frame_send);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks,
+            _h2_on_header);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks,
+            _h2_on_frame_recv);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks,
+            _h2_on_data_chunk_recv);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
+            _h2_on_stream_close);
+    nghttp2_session_client_new(&conn->h2, callbacks, conn);
+    nghttp2_session_callbacks_del(callbacks);
+
+    /* the preface, which nghttp2 sends first, has to include our settings */
+    nghttp2_submit_settings(conn->h2, NGHTTP2_FLAG_NONE, settings,
+            G_N_ELEMENTS(settings));
+    nghttp2_session_set_local_window_size(conn->h2, NGHTTP2_FLAG_NONE, 0,
+            HTTP2_CONNECTION_WINDOW);
+    conn->h2_out = g_string_new(NULL);
+}
+
+
+static void _h2_connection_free(MatrixHttpConnection *conn)
+{
+    g_assert(conn->streams == NULL);
+    nghttp2_session_del(conn->h2);
+    g_string_free(conn->h2_out, TRUE);
+}
+
+
+/**
+ * Once the session has dealt with what it was given, send what it has to
+ * send, and close the connection if we have finished with it
+ *
+ * @returns FALSE if the connection is gone
+ */
+static gboolean _h2_connection_update(MatrixHttpConnection *conn)
+{
+    if(!_h2_send(conn))
+        return FALSE;
+
+    /* the session is over, one way or the other */
+    if(!nghttp2_session_want_read(conn->h2) &&
+            !nghttp2_session_want_write(conn->h2)) {
+        if(conn->streams != NULL)
+            _connection_error(conn, _("Invalid response from homeserver"));
+        else
+            _connection_close(conn);
+        return FALSE;
+    }
+
+    if(conn->streams != NULL)
+        return TRUE;
+
+    if(conn->h2_goaway) {
+        _connection_close(conn);
+        return FALSE;
+    }
+
+    if(conn->idle_timer == 0)
+        conn->idle_timer = purple_timeout_add_seconds(IDLE_TIMEOUT,
+                _connection_idle_timeout, conn);
+    return TRUE;
+}
+
+
+static gboolean _h2_got_data(MatrixHttpConnection *conn, const gchar *buf,
+        gsize len)
+{
+    MatrixHttpPool *pool = conn->pool;
+    ssize_t ret;
+    gboolean alive;
+
+    conn->h2_receiving = TRUE;
+    ret = nghttp2_session_mem_recv(conn->h2, (const uint8_t *)buf, len);
+    conn->h2_receiving = FALSE;
+
+    /* an HTTP/1.x status line, or anything else nghttp2 can't make sense
+     * of, in place of the server's SETTINGS means that the server doesn't
+     * speak HTTP/2; when the connection fails, _h2_connection_error falls
+     * back */
+    if(!conn->h2_heard && (ret < 0 ||
+            (len >= 7 && memcmp(buf, "HTTP/1.", 7) == 0)))
+        conn->h2_refused = TRUE;
+
+    if(ret < 0) {
+        _connection_error(conn, _("Invalid response from homeserver"));
+        alive = FALSE;
+    } else {
+        alive = _h2_connection_update(conn);
+    }
+
+    /* we stop reading if we tell anyone anything, in case they cancel
+     * something; the rest will still be there next time */
+    if(g_queue_is_empty(&pool->finished))
+        return alive;
+    _h2_complete_finished(pool);
+    return FALSE;
+}
+
+
+static void _h2_eof(MatrixHttpConnection *conn)
+{
+    if(conn->streams == NULL && conn->h2_heard) {
+        if(purple_debug_is_verbose())
+            purple_debug_info("matrixprpl", "%s closed idle connection\n",
+                    conn->server);
+        _connection_close(conn);
+        return;
+    }
+    _connection_error(conn, _("Server closed the connection"));
+}
+
+#else /* MATRIX_NO_HTTP2 */
+/* ==== Stubs for when HTTP/2 is configured out of the build ==== */
+
+static gboolean _connection_is_http2(MatrixHttpConnection *conn)
+{
+    return FALSE;
+}
+
+static void _h2_connection_init(MatrixHttpConnection *conn)
+{
+}
+
+static void _h2_connection_free(MatrixHttpConnection *conn)
+{
+}
+
+static gboolean _h2_connection_has_room(MatrixHttpConnection *conn)
+{
+    return FALSE;
+}
+
+static void _h2_connection_error(MatrixHttpConnection *conn,
+        const gchar *error_message)
+{
+}
+
+static GList *_h2_detach_requests(MatrixHttpConnection *conn)
+{
+    return NULL;
+}
+
+static void _h2_start_request(MatrixHttpConnection *conn,
+        MatrixHttpRequest *request)
+{
+}
+
+static void _h2_cancel_request(MatrixHttpConnection *conn,
+        MatrixHttpRequest *request)
+{
+}
+
+static gboolean _h2_send(MatrixHttpConnection *conn)
+{
+    return FALSE;
+}
+
+static gboolean _h2_got_data(MatrixHttpConnection *conn, const gchar *buf,
+        gsize len)
+{
+    return FALSE;
+}
+
+static void _h2_eof(MatrixHttpConnection *conn)
+{
+}
+
+#endif /* MATRIX_NO_HTTP2 */
+
+
+/******************************************************************************
+ *
+ * The pool
+ */
+
+/**
+ * Look for a connection which can carry a request now: an idle one, or an
+ * HTTP/2 one with room for another request
+ *
+ * @param can_open   returns whether we may open another connection to the
+ *                   request's server
+ */
+static MatrixHttpConnection *_pool_find_connection(MatrixHttpPool *pool,
+        MatrixHttpRequest *request, gboolean *can_open)
+{
+    MatrixHttpConnection *found = NULL;
+    gboolean http2 = _request_can_use_http2(request);
+    gboolean have_http2 = FALSE;
+    guint count = 0;
+    GList *ptr;
+
+    for(ptr = pool->connections; ptr != NULL; ptr = ptr->next) {
+        MatrixHttpConnection *conn = ptr->data;
+        if(strcmp(conn->server, request->server) != 0)
+            continue;
+        count++;
+        if(_connection_is_http2(conn) != http2)
+            continue;
+        if(http2) {
+            /* one HTTP/2 connection is all we need, unless it is going
+             * away */
+            if(_h2_connection_has_room(conn)) {
+                have_http2 = TRUE;
+                found = conn;
+            }
+        } else if(found == NULL && conn->connected && conn->request == NULL) {
+            found = conn;
+        }
+    }
+
+    *can_open = count < MAX_CONNECTIONS_PER_SERVER && !have_http2;
+    return found;
+}
+
+
+/**
+ * Start the highest-priority pending request which can have a connection
+ * now
+ *
+ * @returns FALSE if there was nothing we could start
+ */
+static gboolean _pool_start_next(MatrixHttpPool *pool)
+{
+    int cls;
+
+    for(cls = 0; cls < MATRIX_HTTP_CLASS_COUNT; cls++) {
+        GList *link;
+
+        if(pool->stats[cls].active >= _class_info[cls].max_active)
+            continue;
+
+        for(link = pool->pending[cls].head; link != NULL; link = link->next) {
+            MatrixHttpRequest *request = link->data;
+            MatrixHttpConnection *conn;
+            gboolean can_open;
+
+            conn = _pool_find_connection(pool, request, &can_open);
+            if(conn == NULL && !can_open) {
+                /* it will have to wait */
+                continue;
+            }
+
+            g_queue_delete_link(&pool->pending[cls], link);
+            if(conn != NULL) {
+                if(purple_debug_is_verbose())
+                    purple_debug_info("matrixprpl",
+                            "reusing connection to %s\n", request->server);
+                _connection_start_request(conn, request);
+            } else {
+                _connection_open(pool, request);
+            }
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+
+/**
+ * Give each pending request a connection, where we can
+ */
+static gboolean _pool_dispatch(gpointer user_data)
+{
+    MatrixHttpPool *pool = user_data;
+
+    pool->dispatch_id = 0;
+
+    /* starting a request may fail, and the callback may change the queues,
+     * so we look at the queues afresh each time */
+    while(_pool_start_next(pool))
+        ;
+    return FALSE;
+}
+
+
+static void _pool_schedule_dispatch(MatrixHttpPool *pool)
+{
+    if(pool->dispatch_id == 0)
+        pool->dispatch_id = purple_timeout_add(0, _pool_dispatch, pool);
+}
+
+
+MatrixHttpPool *matrix_http_pool_new(PurpleAccount *account)
+{
+    MatrixHttpPool *pool = g_new0(MatrixHttpPool, 1);
+    int cls;
+
+    pool->account = account;
+    for(cls = 0; cls < MATRIX_HTTP_CLASS_COUNT; cls++)
+        g_queue_init(&pool->pending[cls]);
+    g_queue_init(&pool->finished);
+    pool->http1_servers = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, NULL);
+    pool->h2_failures = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, NULL);
+#ifndef MATRIX_NO_HTTP2
+    pool->http2 = purple_account_get_bool(account, PRPL_ACCOUNT_OPT_HTTP2,
+            DEFAULT_HTTP2);
+#endif
+    return pool;
+}
+
+
+void matrix_http_pool_free(MatrixHttpPool *pool)
+{
+    MatrixHttpRequest *request;
+    int cls;
+
+    if(pool == NULL)
+        return;
+
+    while(pool->connections != NULL) {
+        MatrixHttpConnection *conn = pool->connections->data;
+        GList *requests;
+
+        if(_connection_is_http2(conn)) {
+            requests = _h2_detach_requests(conn);
+        } else {
+            request = _connection_detach_request(conn);
+            requests = request == NULL ? NULL : g_list_append(NULL, request);
+        }
+        _connection_close(conn);
+
+        while(requests != NULL) {
+            _request_complete(requests->data, "cancelled");
+            requests = g_list_delete_link(requests, requests);
+        }
+    }
+
+    for(cls = 0; cls < MATRIX_HTTP_CLASS_COUNT; cls++) {
+        while((request = g_queue_pop_head(&pool->pending[cls])) != NULL)
+            _request_complete(request, "cancelled");
+    }
+    while((request = g_queue_pop_head(&pool->finished)) != NULL)
+        _request_complete(request, "cancelled");
+
+    if(pool->dispatch_id != 0)
+        purple_timeout_remove(pool->dispatch_id);
+    g_hash_table_destroy(pool->http1_servers);
+    g_hash_table_destroy(pool->h2_failures);
+    g_free(pool);
+}
+
+
+MatrixHttpRequest *matrix_http_request_start(MatrixHttpPool *pool,
+        const gchar *url, GString *request_str, const gchar *body,
+        gsize body_len, gssize max_len, MatrixHttpClass request_class,
+        const MatrixHttpResponseHandler *handler, gpointer user_data)
+{
+    MatrixHttpRequest *request;
+    gboolean ssl;
+    gchar *host;
+    int port;
+
+    if(!_parse_url(url, &ssl, &host, &port)) {
+        g_string_free(request_str, TRUE);
+        return NULL;
+    }
+
+    request = g_new0(MatrixHttpRequest, 1);
+    request->pool = pool;
+    request->server = g_strdup_printf("%s://%s:%i", ssl ? "https" : "http",
+            host, port);
+    request->host = host;
+    request->port = port;
+    request->ssl = ssl;
+    request->request_class = request_class;
+    request->queued_time = g_get_monotonic_time();
+    request->request = request_str;
+    request->idempotent = _method_is_idempotent(request_str->str);
+    request->content_length = -1;
+    request->body = body;
+    request->body_len = body_len;
+    request->max_len = max_len > 0 ? max_len : MATRIX_HTTP_DEFAULT_MAX_LEN;
+    request->handler = handler;
+    request->user_data = user_data;
+
+    g_queue_push_tail(&pool->pending[request_class], request);
+    _pool_schedule_dispatch(pool);
+    return request;
+}
+
+
+void matrix_http_request_cancel(MatrixHttpRequest *request)
+{
+    MatrixHttpPool *pool = request->pool;
+    MatrixHttpConnection *conn = request->connection;
+
+    if(conn != NULL && _connection_is_http2(conn)) {
+        /* the other requests on the connection carry on */
+        _h2_cancel_request(conn, request);
+    } else if(conn != NULL) {
+        /* we can't reuse a connection with half a response on it */
+        _connection_detach_request(conn);
+        _connection_close(conn);
+        _pool_schedule_dispatch(pool);
+    } else if(!g_queue_remove(&pool->pending[request->request_class],
+            request)) {
+        /* it has finished, but we haven't said so yet */
+        g_queue_remove(&pool->finished, request);
+    }
+    _request_free(request);
+}
+
+
+void matrix_http_pool_log_stats(MatrixHttpPool *pool)
+{
+    int cls;
+
+    for(cls = 0; cls < MATRIX_HTTP_CLASS_COUNT; cls++) {
+        MatrixHttpClassStats *stats = &pool->stats[cls];
+        guint queued = g_queue_get_length(&pool->pending[cls]);
+
+        if(stats->started == 0 && queued == 0)
+            continue;
+
+        purple_debug_info("matrixprpl", "http %s requests: %u queued, "
+                "%u active, %u started, wait avg %" G_GINT64_FORMAT
+                "ms max %" G_GINT64_FORMAT "ms\n", _class_info[cls].name,
+                queued, stats->active, stats->started,
+                stats->started == 0 ? 0 :
+                        stats->total_wait_us / stats->started / 1000,
+                stats->max_wait_us / 1000);
+
+        stats->started = 0;
+        stats->total_wait_us = stats->max_wait_us = 0;
+    }
+}
@@ -0,0 +1,165 @@
+/**
+ * matrix-http.h: HTTP transport, with a pool of keep-alive connections
+ *
+ * libpurple's purple_util_fetch_url opens a new connection for every request
+ * (and, for https, does a new TLS handshake), which costs several round-trips
+ * before the request is even sent. Instead, we keep a few connections to each
+ * server open, and reuse them for each request.
+ *
+ * Each HTTP/1.1 connection carries one request at a time; requests wait in a
+ * queue when all of the connections to their server are busy.
+ *
+ * Each request has a class, which sets its priority in the queue. Classes
+ * also have a limit on how many of their requests can be in progress at
+ * once, so that bulk requests (such as media downloads) can't tie up all of
+ * the connections while a message is waiting to be sent.
+ *
+ * Servers will only agree to HTTP/2 over TLS via ALPN, which libpurple's SSL
+ * API gives us no way to offer, so https is always HTTP/1.1. For a plain http
+ * homeserver (typically a reverse proxy on the same host or network), the
+ * "http2" account option has us speak HTTP/2 without asking (h2c with prior
+ * knowledge, RFC 7540 3.4): then everything to that server is multiplexed
+ * over one connection, and the class limits are the only thing holding
+ * requests back. A server which doesn't understand it is remembered, and
+ * spoken to in HTTP/1.1 from then on.
+ *
+ * Responses are parsed as they arrive, and passed on a piece at a time, so
+ * that the caller can start work on the body (or write it to disk) before we
+ * have all of it.
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_HTTP_H_
+#define MATRIX_HTTP_H_
+
+#include <glib.h>
+
+struct _PurpleAccount;
+
+typedef struct _MatrixHttpPool MatrixHttpPool;
+typedef struct _MatrixHttpRequest MatrixHttpRequest;
+
+/* the default limit on the size of a response, as for
+ * purple_util_fetch_url */
+#define MATRIX_HTTP_DEFAULT_MAX_LEN (512 * 1024)
+
+/**
+ * The classes of request, highest priority first
+ */
+typedef enum {
+    MATRIX_HTTP_CLASS_SYNC,     /* /sync, and the setup for it */
+    MATRIX_HTTP_CLASS_SEND,     /* things the user is waiting for */
+    MATRIX_HTTP_CLASS_TYPING,   /* typing notifications */
+    MATRIX_HTTP_CLASS_KEYS,     /* e2e key management */
+    MATRIX_HTTP_CLASS_STATE,    /* room member lists and state, in bulk */
+    MATRIX_HTTP_CLASS_MEDIA,    /* uploads and downloads */
+    MATRIX_HTTP_CLASS_COUNT
+} MatrixHttpClass;
+
+
+/**
+ * The functions which are called as a response arrives. Each is passed the
+ * user_data given to matrix_http_request_start.
+ *
+ * None of them may cancel the request.
+ */
+typedef struct _MatrixHttpResponseHandler {
+    /* called for each header in the response */
+    void (*header)(MatrixHttpRequest *request, gpointer user_data,
+            const gchar *name, const gchar *value);
+
+    /* called once we have the status line and all the headers.
+     * content_length is -1 if the response didn't say. */
+    void (*headers_complete)(MatrixHttpRequest *request, gpointer user_data,
+            int status_code, gint64 content_length);
+
+    /* called for each piece of the body as it arrives. Return FALSE to
+     * abandon the request, in which case complete is called with an error.
+     */
+    gboolean (*body)(MatrixHttpRequest *request, gpointer user_data,
+            const gchar *data, gsize len);
+
+    /* called, if not NULL, as the body of the request is sent; total is the
+     * size of the body */
+    void (*sent)(MatrixHttpRequest *request, gpointer user_data, gsize sent,
+            gsize total);
+
+    /* called when the response is complete (error_message is NULL) or the
+     * request has failed. error_message is "cancelled" if the pool was freed
+     * before the request completed. The request is freed when this
+     * returns. */
+    void (*complete)(MatrixHttpRequest *request, gpointer user_data,
+            const gchar *error_message);
+} MatrixHttpResponseHandler;
+
+
+/**
+ * Create a connection pool
+ *
+ * @param account   the account whose proxy settings should be used
+ */
+MatrixHttpPool *matrix_http_pool_new(struct _PurpleAccount *account);
+
+
+/**
+ * Close all the connections in a pool, and free it. Any requests which are
+ * still in progress are completed with the error "cancelled".
+ */
+void matrix_http_pool_free(MatrixHttpPool *pool);
+
+
+/**
+ * Start an HTTP request
+ *
+ * @param pool        the pool to take a connection from
+ * @param url         the url of the request; only the scheme, host and port
+ *                       are used, to decide where to connect to
+ * @param request     the request line and headers to send, and optionally
+ *                       the body. We take ownership of this.
+ * @param body        data to send after the request, or NULL. This is not
+ *                       copied: it must stay valid until the request
+ *                       completes or is cancelled.
+ * @param body_len    length of body
+ * @param max_len     the largest response we will accept; 0 or -1 for the
+ *                       default (512K)
+ * @param request_class  the class of the request, which decides its
+ *                       priority
+ * @param handler     functions to call as the response arrives. None of
+ *                       them are called before this function returns.
+ * @param user_data   opaque data to pass to the handler functions
+ *
+ * @returns a handle for the request, or NULL if the url could not be parsed
+ */
+MatrixHttpRequest *matrix_http_request_start(MatrixHttpPool *pool,
+        const gchar *url, GString *request, const gchar *body,
+        gsize body_len, gssize max_len, MatrixHttpClass request_class,
+        const MatrixHttpResponseHandler *handler, gpointer user_data);
+
+
+/**
+ * Abandon a request. None of the handler functions will be called again.
+ */
+void matrix_http_request_cancel(MatrixHttpRequest *request);
+
+
+/**
+ * Log the length of the queue for each class of request, and how long
+ * requests have waited in it since the last call.
+ */
+void matrix_http_pool_log_stats(MatrixHttpPool *pool);
+
+#endif /* MATRIX_HTTP_H_ */
@@ -0,0 +1,114 @@
+/*
+ * matrix-intern.c: shared copies of frequently-repeated strings
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-intern.h"
+
+#include <string.h>
+
+/* each string is stored in one allocation with its refcount, so that
+ * we can get from the string back to its count without a lookup */
+typedef struct _MatrixInternEntry {
+    guint refcount;
+    guint size;         /* of str, with its NUL */
+    gchar str[];
+} MatrixInternEntry;
+
+#define _ENTRY(s) \
+    ((MatrixInternEntry *)((s) - G_STRUCT_OFFSET(MatrixInternEntry, str)))
+
+/* map from string to the MatrixInternEntry holding it. The keys point into
+ * the entries. The table is created when the first string is interned, and
+ * destroyed again when the last is released, so that nothing is left
+ * behind when the plugin is unloaded. */
+static GHashTable *_intern_table = NULL;
+
+static MatrixInternStats _stats;
+
+
+const gchar *matrix_intern(const gchar *str)
+{
+    MatrixInternEntry *entry;
+    gsize len;
+
+    if(str == NULL)
+        return NULL;
+
+    if(_intern_table == NULL) {
+        _intern_table = g_hash_table_new(g_str_hash, g_str_equal);
+    } else {
+        entry = g_hash_table_lookup(_intern_table, str);
+        if(entry != NULL)
+            return matrix_intern_ref(entry->str);
+    }
+
+    len = strlen(str);
+    entry = g_malloc(sizeof(MatrixInternEntry) + len + 1);
+    entry->refcount = 1;
+    entry->size = len + 1;
+    memcpy(entry->str, str, len + 1);
+    g_hash_table_insert(_intern_table, entry->str, entry);
+
+    _stats.strings++;
+    _stats.string_bytes += len + 1;
+    _stats.references++;
+    _stats.reference_bytes += len + 1;
+    return entry->str;
+}
+
+
+const gchar *matrix_intern_ref(const gchar *str)
+{
+    if(str == NULL)
+        return NULL;
+    _ENTRY(str)->refcount++;
+    _stats.references++;
+    _stats.reference_bytes += _ENTRY(str)->size;
+    return str;
+}
+
+
+void matrix_unintern(const gchar *str)
+{
+    MatrixInternEntry *entry;
+
+    if(str == NULL)
+        return;
+
+    entry = _ENTRY(str);
+    g_assert(entry->refcount > 0);
+    _stats.references--;
+    _stats.reference_bytes -= entry->size;
+    if(--entry->refcount > 0)
+        return;
+
+    _stats.strings--;
+    _stats.string_bytes -= entry->size;
+    g_hash_table_remove(_intern_table, entry->str);
+    g_free(entry);
+
+    if(g_hash_table_size(_intern_table) == 0) {
+        g_hash_table_destroy(_intern_table);
+        _intern_table = NULL;
+    }
+}
+
+
+void matrix_intern_get_stats(MatrixInternStats *stats)
+{
+    *stats = _stats;
+}
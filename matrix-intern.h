@@ -0,0 +1,73 @@
+/**
+ * matrix-intern.h: shared copies of frequently-repeated strings
+ *
+ * The same user ids and event types turn up in the state table and member
+ * list of every room we are in, and in the e2e session tables. Rather than
+ * keep a separate copy for each use, we keep a single, refcounted copy of
+ * each, and hand out pointers to it.
+ *
+ * Interned strings must be released with matrix_unintern, never g_free.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_INTERN_H_
+#define MATRIX_INTERN_H_
+
+#include <glib.h>
+
+/**
+ * Get the shared copy of a string, creating it if necessary, and take a
+ * reference to it.
+ *
+ * Two interned strings are equal exactly when their pointers are.
+ *
+ * @param str   the string to look up. May be NULL, in which case NULL is
+ *              returned.
+ *
+ * @returns the shared copy, which should be released with matrix_unintern
+ */
+const gchar *matrix_intern(const gchar *str);
+
+
+/**
+ * Take another reference to a string returned by matrix_intern
+ *
+ * @returns str
+ */
+const gchar *matrix_intern_ref(const gchar *str);
+
+
+/**
+ * Release a reference to a string returned by matrix_intern. Does nothing if
+ * str is NULL.
+ */
+void matrix_unintern(const gchar *str);
+
+
+/**
+ * How much the pool is saving: the strings in it, and the references to
+ * them, each with the bytes they would take as separate copies.
+ */
+typedef struct _MatrixInternStats {
+    guint strings;
+    gsize string_bytes;
+    guint64 references;
+    guint64 reference_bytes;
+} MatrixInternStats;
+
+void matrix_intern_get_stats(MatrixInternStats *stats);
+
+#endif /* MATRIX_INTERN_H_ */
@@ -18,12 +18,25 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
  */
 
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+/* AVX2 code is compiled for the CPUs which have it, whatever the target */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MATRIX_JSON_AVX2
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
 #include "matrix-json.h"
 
-static GString *canonical_json_node(JsonNode *node, GString *result);
-static GString *canonical_json_object(JsonObject *object, GString *result);
+/* libpurple */
+#include "debug.h"
+
+static void canonical_json_node(JsonNode *node, GString *result);
+static void canonical_json_object(JsonObject *object, GString *result);
 
 /* node */
 
@@ -134,93 +147,977 @@ const gchar *matrix_json_array_get_string_element(JsonArray *array,
     return matrix_json_node_get_string(element);
 }
 
-static gint canonical_json_sort(gconstpointer a, gconstpointer b)
+/* raw text scanning */
+
+static const gchar *_skip_whitespace(const gchar *ptr, const gchar *end)
+{
+    while(ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\n' ||
+            *ptr == '\r'))
+        ptr++;
+    return ptr;
+}
+
+/*
+ * Most of the time spent indexing a big document goes on stepping over the
+ * values we don't index (each event, in a /sync response), and checking
+ * text for UTF-8 is mostly stepping over ASCII. Where we can, we look at 16
+ * (SSE2) or 32 (AVX2) bytes at a time. SSE2 is always there on x86-64; AVX2
+ * is only used if the CPU has it, so it is compiled separately and chosen
+ * when we start.
+ *
+ * To step over an object or array, we take 64 bytes at a time, and make a
+ * bitmap of where the quotes, backslashes and brackets are in them. Working
+ * out which characters are escaped only takes a look at each backslash, and
+ * there are few of those; which are in strings is then a prefix XOR of the
+ * quotes which are left; and the brackets outside strings are usually few
+ * enough to count one by one. (This is the first stage of simdjson, by
+ * Langdale and Lemire, without the validation.) Looking for each quote and
+ * bracket in turn would need a vector search for each, and most of the
+ * strings in a /sync response are too short for that to beat a loop.
+ *
+ * A backslash escapes the next character wherever it is, not just in
+ * strings; that is only different for text which isn't JSON anyway.
+ */
+
+static MatrixJsonScan _scan = MATRIX_JSON_SCAN_SCALAR;
+static gboolean _scan_chosen = FALSE;
+
+static const gchar *_scan_names[] = {"scalar", "SSE2", "AVX2"};
+
+static gboolean _scan_supported(MatrixJsonScan scan)
+{
+    switch(scan) {
+        case MATRIX_JSON_SCAN_SCALAR:
+            return TRUE;
+#ifdef __SSE2__
+        case MATRIX_JSON_SCAN_SSE2:
+            return TRUE;
+#endif
+#ifdef MATRIX_JSON_AVX2
+        case MATRIX_JSON_SCAN_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return FALSE;
+    }
+}
+
+static void _choose_scan(void)
+{
+    MatrixJsonScan scan = MATRIX_JSON_SCAN_COUNT - 1;
+
+    if(_scan_chosen)
+        return;
+    while(!_scan_supported(scan))
+        scan--;
+    _scan = scan;
+    _scan_chosen = TRUE;
+}
+
+gboolean matrix_json_set_scan(MatrixJsonScan scan)
+{
+    if(!_scan_supported(scan))
+        return FALSE;
+    _scan = scan;
+    _scan_chosen = TRUE;
+    return TRUE;
+}
+
+MatrixJsonScan matrix_json_get_scan(void)
+{
+    _choose_scan();
+    return _scan;
+}
+
+const gchar *matrix_json_scan_name(MatrixJsonScan scan)
+{
+    return scan < G_N_ELEMENTS(_scan_names) ? _scan_names[scan] : NULL;
+}
+
+/* Where things are in 64 bytes of text: a bit for each byte, the first
+ * byte in the lowest bit. open is '{' and '['; close is '}' and ']'. */
+typedef struct {
+    guint64 quote, backslash, open, close;
+} ScanBlock;
+
+/* How far we have got through an object or array */
+typedef struct {
+    gboolean escaped;       /* the next byte is escaped */
+    gboolean in_string;     /* the next byte is in a string */
+    gint depth;             /* of brackets, including the outermost */
+} SkipState;
+
+/* each bit becomes the XOR of itself and all the bits below it */
+static inline guint64 _prefix_xor(guint64 bits)
+{
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+/* Which bytes of the block are escaped. The backslashes are taken in turn,
+ * since an escaped one escapes nothing. */
+static inline guint64 _block_escaped(guint64 backslash, SkipState *state)
+{
+    guint64 escaped = state->escaped ? 1 : 0;
+
+    state->escaped = FALSE;
+    backslash &= ~escaped;
+    while(backslash != 0) {
+        int i = __builtin_ctzll(backslash);
+
+        if(i == 63) {
+            state->escaped = TRUE;
+            break;
+        }
+        escaped |= (guint64)1 << (i + 1);
+        backslash &= ~((guint64)3 << i);
+    }
+    return escaped;
+}
+
+/* Returns the offset of the bracket which ends the value, or -1 if it
+ * doesn't end in this block */
+static inline int _block_skip(const ScanBlock *block, SkipState *state)
+{
+    guint64 escaped = _block_escaped(block->backslash, state);
+    guint64 in_string = _prefix_xor(block->quote & ~escaped);
+    guint64 open, brackets;
+
+    if(state->in_string)
+        in_string = ~in_string;
+    state->in_string = (in_string >> 63) != 0;
+
+    open = block->open & ~escaped & ~in_string;
+    brackets = open | (block->close & ~escaped & ~in_string);
+    while(brackets != 0) {
+        int i = __builtin_ctzll(brackets);
+
+        if(open & ((guint64)1 << i))
+            state->depth++;
+        else if(--state->depth == 0)
+            return i;
+        brackets &= brackets - 1;
+    }
+    return -1;
+}
+
+#ifdef __SSE2__
+/* Step over whole blocks while there are any. Returns a pointer just past
+ * the end of the value if we found it; otherwise NULL, with *ptr where the
+ * blocks ran out. */
+static const gchar *_skip_blocks_sse2(const gchar **ptr, const gchar *end,
+        SkipState *state)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    /* '[' and ']' are '{' and '}' without 0x20 */
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    const gchar *block_start;
+
+    for(block_start = *ptr; end - block_start >= 64; block_start += 64) {
+        ScanBlock block = {0, 0, 0, 0};
+        int i, offset;
+
+        for(i = 0; i < 4; i++) {
+            __m128i chunk = _mm_loadu_si128(
+                    (const __m128i *)(block_start + 16 * i));
+            __m128i folded = _mm_or_si128(chunk, case_bit);
+            int shift = 16 * i;
+
+            block.quote |= (guint64)(guint16)_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(chunk, quote)) << shift;
+            block.backslash |= (guint64)(guint16)_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(chunk, backslash)) << shift;
+            block.open |= (guint64)(guint16)_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(folded, open)) << shift;
+            block.close |= (guint64)(guint16)_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(folded, close)) << shift;
+        }
+        offset = _block_skip(&block, state);
+        if(offset >= 0)
+            return block_start + offset + 1;
+    }
+    *ptr = block_start;
+    return NULL;
+}
+
+/* Find the first '"' or '\\' in ptr..end, or where there are fewer than 16
+ * bytes left */
+static const gchar *_find_string_special_sse2(const gchar *ptr,
+        const gchar *end)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+
+    while(end - ptr >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)ptr);
+        int mask = _mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi8(chunk, quote),
+                _mm_cmpeq_epi8(chunk, backslash)));
+        if(mask != 0)
+            return ptr + __builtin_ctz(mask);
+        ptr += 16;
+    }
+    return ptr;
+}
+
+/* Find the first NUL or non-ASCII byte in ptr..end, or where there are
+ * fewer than 16 bytes left */
+static const gchar *_find_not_ascii_sse2(const gchar *ptr, const gchar *end)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    while(end - ptr >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)ptr);
+        int mask = _mm_movemask_epi8(chunk) |
+                _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+        if(mask != 0)
+            return ptr + __builtin_ctz(mask);
+        ptr += 16;
+    }
+    return ptr;
+}
+#endif /* __SSE2__ */
+
+#ifdef MATRIX_JSON_AVX2
+/* as _skip_blocks_sse2 */
+static TARGET_AVX2 const gchar *_skip_blocks_avx2(const gchar **ptr,
+        const gchar *end, SkipState *state)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i open = _mm256_set1_epi8('{');
+    const __m256i close = _mm256_set1_epi8('}');
+    const gchar *block_start;
+
+    for(block_start = *ptr; end - block_start >= 64; block_start += 64) {
+        ScanBlock block = {0, 0, 0, 0};
+        int i, offset;
+
+        for(i = 0; i < 2; i++) {
+            __m256i chunk = _mm256_loadu_si256(
+                    (const __m256i *)(block_start + 32 * i));
+            __m256i folded = _mm256_or_si256(chunk, case_bit);
+            int shift = 32 * i;
+
+            block.quote |= (guint64)(guint32)_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(chunk, quote)) << shift;
+            block.backslash |= (guint64)(guint32)_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(chunk, backslash)) << shift;
+            block.open |= (guint64)(guint32)_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(folded, open)) << shift;
+            block.close |= (guint64)(guint32)_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(folded, close)) << shift;
+        }
+        offset = _block_skip(&block, state);
+        if(offset >= 0)
+            return block_start + offset + 1;
+    }
+    *ptr = block_start;
+    return NULL;
+}
+
+/* as _find_not_ascii_sse2, but 32 bytes at a time */
+static TARGET_AVX2 const gchar *_find_not_ascii_avx2(const gchar *ptr,
+        const gchar *end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+
+    while(end - ptr >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)ptr);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(chunk) |
+                (unsigned int)_mm256_movemask_epi8(
+                        _mm256_cmpeq_epi8(chunk, zero));
+        if(mask != 0)
+            return ptr + __builtin_ctz(mask);
+        ptr += 32;
+    }
+    return ptr;
+}
+#endif /* MATRIX_JSON_AVX2 */
+
+/* Find the first '"' or '\\' in ptr..end; returns end if there is none.
+ * Strings are short, and come one at a time, so AVX2 wouldn't help. */
+static const gchar *_find_string_special(const gchar *ptr, const gchar *end)
+{
+#ifdef __SSE2__
+    if(_scan != MATRIX_JSON_SCAN_SCALAR)
+        ptr = _find_string_special_sse2(ptr, end);
+#endif
+    while(ptr < end && *ptr != '"' && *ptr != '\\')
+        ptr++;
+    return ptr;
+}
+
+/* a byte at a time: for the end of the text, or when there is no SSE2 */
+static const gchar *_skip_bytes(const gchar *ptr, const gchar *end,
+        SkipState *state)
+{
+    for(; ptr < end; ptr++) {
+        if(state->escaped) {
+            state->escaped = FALSE;
+            continue;
+        }
+        /* in a string, only a quote or a backslash matters */
+        if(state->in_string) {
+            ptr = _find_string_special(ptr, end);
+            if(ptr >= end)
+                break;
+        }
+        switch(*ptr) {
+            case '\\':
+                state->escaped = TRUE;
+                break;
+            case '"':
+                state->in_string = !state->in_string;
+                break;
+            case '{':
+            case '[':
+                if(!state->in_string)
+                    state->depth++;
+                break;
+            case '}':
+            case ']':
+                if(!state->in_string && --state->depth == 0)
+                    return ptr + 1;
+                break;
+        }
+    }
+    return NULL;
+}
+
+/* Find the first NUL or non-ASCII byte in ptr..end; returns end if there is
+ * none */
+static const gchar *_find_not_ascii(const gchar *ptr, const gchar *end)
+{
+    switch(_scan) {
+#ifdef MATRIX_JSON_AVX2
+        case MATRIX_JSON_SCAN_AVX2:
+            ptr = _find_not_ascii_avx2(ptr, end);
+            break;
+#endif
+#ifdef __SSE2__
+        case MATRIX_JSON_SCAN_SSE2:
+            ptr = _find_not_ascii_sse2(ptr, end);
+            break;
+#endif
+        default:
+            break;
+    }
+    while(ptr < end && *ptr != '\0' && (guchar)*ptr < 0x80)
+        ptr++;
+    return ptr;
+}
+
+
+gboolean matrix_json_validate_text(const gchar *text, gsize text_len)
+{
+    const gchar *ptr = text, *end = text + text_len;
+
+    _choose_scan();
+    for(;;) {
+        gunichar c;
+
+        /* step over the ASCII, then check each other character by itself
+         * (most text is mostly ASCII) */
+        ptr = _find_not_ascii(ptr, end);
+        if(ptr >= end)
+            return TRUE;
+        if(*ptr == '\0')
+            return FALSE;
+        c = g_utf8_get_char_validated(ptr, end - ptr);
+        if(c == (gunichar)-1 || c == (gunichar)-2)
+            return FALSE;
+        ptr = g_utf8_next_char(ptr);
+    }
+}
+
+/* ptr points at the opening quote. Returns a pointer just past the closing
+ * quote, or NULL if the string is unterminated.
+ */
+static const gchar *_skip_string(const gchar *ptr, const gchar *end)
+{
+    g_assert(*ptr == '"');
+
+    for(ptr++; ptr < end; ptr++) {
+        ptr = _find_string_special(ptr, end);
+        if(ptr >= end)
+            break;
+        if(*ptr == '\\') {
+            ptr++;
+        } else {
+            return ptr + 1;
+        }
+    }
+    return NULL;
+}
+
+/* ptr points at the first character of a value. Returns a pointer just past
+ * the end of the value, or NULL if it is malformed.
+ */
+static const gchar *_skip_value(const gchar *ptr, const gchar *end)
+{
+    SkipState state = {FALSE, FALSE, 0};
+    const gchar *value_end = NULL;
+
+    if(ptr >= end)
+        return NULL;
+
+    if(*ptr == '"')
+        return _skip_string(ptr, end);
+
+    if(*ptr != '{' && *ptr != '[') {
+        /* number, true, false or null */
+        const gchar *start = ptr;
+        while(ptr < end && *ptr != ',' && *ptr != '}' && *ptr != ']' &&
+                *ptr != ' ' && *ptr != '\t' && *ptr != '\n' && *ptr != '\r')
+            ptr++;
+        return ptr == start ? NULL : ptr;
+    }
+
+    switch(_scan) {
+#ifdef MATRIX_JSON_AVX2
+        case MATRIX_JSON_SCAN_AVX2:
+            value_end = _skip_blocks_avx2(&ptr, end, &state);
+            break;
+#endif
+#ifdef __SSE2__
+        case MATRIX_JSON_SCAN_SSE2:
+            value_end = _skip_blocks_sse2(&ptr, end, &state);
+            break;
+#endif
+        default:
+            break;
+    }
+    if(value_end != NULL)
+        return value_end;
+    return _skip_bytes(ptr, end, &state);
+}
+
+static gboolean _read_hex4(const gchar *ptr, const gchar *end, gunichar *result)
 {
-    return strcmp((const gchar *)a, (const gchar *)b);
+    int i;
+
+    if(end - ptr < 4)
+        return FALSE;
+
+    *result = 0;
+    for(i = 0; i < 4; i++) {
+        int digit = g_ascii_xdigit_value(ptr[i]);
+        if(digit < 0)
+            return FALSE;
+        *result = (*result << 4) | digit;
+    }
+    return TRUE;
 }
 
-static GString *canonical_json_value(JsonNode *node, GString *result)
+/* decode the string between ptr and end, which excludes the quotes */
+static gchar *_decode_string(const gchar *ptr, const gchar *end)
+{
+    GString *result;
+
+    if(memchr(ptr, '\\', end - ptr) == NULL) {
+        /* the common case: nothing to unescape */
+        return g_strndup(ptr, end - ptr);
+    }
+
+    result = g_string_sized_new(end - ptr);
+    while(ptr < end) {
+        gunichar c;
+
+        if(*ptr != '\\') {
+            g_string_append_c(result, *ptr++);
+            continue;
+        }
+
+        if(++ptr >= end)
+            goto bad;
+
+        switch(*ptr++) {
+            case 'b': g_string_append_c(result, '\b'); break;
+            case 'f': g_string_append_c(result, '\f'); break;
+            case 'n': g_string_append_c(result, '\n'); break;
+            case 'r': g_string_append_c(result, '\r'); break;
+            case 't': g_string_append_c(result, '\t'); break;
+            case '"': case '\\': case '/':
+                g_string_append_c(result, ptr[-1]);
+                break;
+            case 'u':
+                if(!_read_hex4(ptr, end, &c))
+                    goto bad;
+                ptr += 4;
+                /* a NUL would truncate the string we return, and a lone
+                 * low surrogate isn't a character at all */
+                if(c == 0 || (c >= 0xdc00 && c < 0xe000))
+                    goto bad;
+                if(c >= 0xd800 && c < 0xdc00) {
+                    /* high surrogate; should be followed by a low one */
+                    gunichar low;
+                    if(end - ptr < 6 || ptr[0] != '\\' || ptr[1] != 'u' ||
+                            !_read_hex4(ptr+2, end, &low) ||
+                            low < 0xdc00 || low >= 0xe000)
+                        goto bad;
+                    ptr += 6;
+                    c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                }
+                g_string_append_unichar(result, c);
+                break;
+            default:
+                goto bad;
+        }
+    }
+    return g_string_free(result, FALSE);
+
+bad:
+    g_string_free(result, TRUE);
+    return NULL;
+}
+
+
+gchar *matrix_json_span_get_string(const gchar *value, gsize value_len)
+{
+    if(value == NULL || value_len < 2 || value[0] != '"' ||
+            value[value_len-1] != '"')
+        return NULL;
+    return _decode_string(value + 1, value + value_len - 1);
+}
+
+
+JsonParser *matrix_json_parse_span(const gchar *value, gsize value_len)
+{
+    JsonParser *parser = json_parser_new();
+    GError *err = NULL;
+
+    if(!json_parser_load_from_data(parser, value, value_len, &err)) {
+        purple_debug_info("matrixprpl", "unable to parse JSON: %s\n",
+                err->message);
+        g_error_free(err);
+        g_object_unref(parser);
+        return NULL;
+    }
+    return parser;
+}
+
+
+JsonNode *matrix_json_parser_load_span(JsonParser *parser, const gchar *value,
+        gsize value_len)
+{
+    GError *err = NULL;
+
+    if(!json_parser_load_from_data(parser, value, value_len, &err)) {
+        purple_debug_info("matrixprpl", "unable to parse JSON: %s\n",
+                err->message);
+        g_error_free(err);
+        return NULL;
+    }
+    return json_parser_get_root(parser);
+}
+
+
+/* structural index */
+
+/* There is one of these for every event in a /sync response, so they are
+ * kept small: offsets are 32 bits, and matrix_json_tape_new won't index
+ * more text than that. */
+typedef struct {
+    guint32 start, len;             /* the text of the value */
+    guint32 name_start, name_len;   /* the member name, without its quotes */
+    guint32 next;                   /* the next sibling */
+    gchar type;                     /* first character of the value */
+    guint8 has_name;
+    guint8 indexed;                 /* whether the children follow */
+} MatrixJsonTapeEntry;
+
+struct _MatrixJsonTape {
+    const gchar *json;
+    GArray *entries;    /* MatrixJsonTapeEntry */
+    guint max_depth;
+};
+
+#define _TAPE_ENTRY(tape, index) \
+    g_array_index((tape)->entries, MatrixJsonTapeEntry, (index))
+
+/* Add the value at ptr (and, within max_depth, its children) to the tape.
+ * Returns a pointer just past the value, or NULL if it is malformed.
+ */
+static const gchar *_tape_add_value(MatrixJsonTape *tape, const gchar *ptr,
+        const gchar *end, guint depth, const gchar *name, gsize name_len)
+{
+    MatrixJsonTapeEntry entry = {0};
+    guint index = tape->entries->len, prev = MATRIX_JSON_TAPE_NONE;
+    gchar close;
+
+    if(ptr >= end)
+        return NULL;
+
+    entry.start = ptr - tape->json;
+    entry.next = MATRIX_JSON_TAPE_NONE;
+    entry.type = *ptr;
+    if(name != NULL) {
+        entry.has_name = TRUE;
+        entry.name_start = name - tape->json;
+        entry.name_len = name_len;
+    }
+    entry.indexed = (*ptr == '{' || *ptr == '[') && depth < tape->max_depth;
+    g_array_append_val(tape->entries, entry);
+
+    if(!entry.indexed) {
+        const gchar *value_end = _skip_value(ptr, end);
+        if(value_end == NULL)
+            return NULL;
+        _TAPE_ENTRY(tape, index).len = value_end - ptr;
+        return value_end;
+    }
+
+    close = (*ptr == '{') ? '}' : ']';
+    ptr = _skip_whitespace(ptr + 1, end);
+    if(ptr < end && *ptr == close)
+        goto done;
+
+    while(ptr < end) {
+        const gchar *child_name = NULL;
+        gsize child_name_len = 0;
+        guint child = tape->entries->len;
+
+        if(close == '}') {
+            if(*ptr != '"')
+                return NULL;
+            child_name = ptr + 1;
+            ptr = _skip_string(ptr, end);
+            if(ptr == NULL)
+                return NULL;
+            child_name_len = ptr - 1 - child_name;
+            ptr = _skip_whitespace(ptr, end);
+            if(ptr >= end || *ptr != ':')
+                return NULL;
+            ptr = _skip_whitespace(ptr + 1, end);
+        }
+
+        ptr = _tape_add_value(tape, ptr, end, depth + 1, child_name,
+                child_name_len);
+        if(ptr == NULL)
+            return NULL;
+        if(prev != MATRIX_JSON_TAPE_NONE)
+            _TAPE_ENTRY(tape, prev).next = child;
+        prev = child;
+
+        ptr = _skip_whitespace(ptr, end);
+        if(ptr >= end)
+            return NULL;
+        if(*ptr == close)
+            goto done;
+        if(*ptr != ',')
+            return NULL;
+        ptr = _skip_whitespace(ptr + 1, end);
+    }
+    return NULL;
+
+done:
+    ptr++;
+    _TAPE_ENTRY(tape, index).len = (ptr - tape->json) -
+            _TAPE_ENTRY(tape, index).start;
+    return ptr;
+}
+
+
+MatrixJsonTape *matrix_json_tape_new(const gchar *json, gsize json_len,
+        guint max_depth)
+{
+    MatrixJsonTape *tape;
+    const gchar *end = json + json_len, *ptr;
+
+    if(json_len > G_MAXUINT32) {
+        purple_debug_warning("matrixprpl", "%" G_GSIZE_FORMAT
+                " bytes of JSON is too much to index\n", json_len);
+        return NULL;
+    }
+
+    _choose_scan();
+    tape = g_new0(MatrixJsonTape, 1);
+    tape->json = json;
+    tape->max_depth = max_depth;
+    tape->entries = g_array_new(FALSE, FALSE, sizeof(MatrixJsonTapeEntry));
+
+    ptr = _tape_add_value(tape, _skip_whitespace(json, end), end, 0, NULL, 0);
+    if(ptr == NULL || _skip_whitespace(ptr, end) != end) {
+        matrix_json_tape_free(tape);
+        return NULL;
+    }
+    return tape;
+}
+
+
+void matrix_json_tape_free(MatrixJsonTape *tape)
+{
+    if(tape == NULL)
+        return;
+    g_array_free(tape->entries, TRUE);
+    g_free(tape);
+}
+
+
+static const MatrixJsonTapeEntry *_tape_entry(const MatrixJsonTape *tape,
+        guint index)
+{
+    if(tape == NULL || index >= tape->entries->len)
+        return NULL;
+    return &_TAPE_ENTRY(tape, index);
+}
+
+
+guint matrix_json_tape_first_child(const MatrixJsonTape *tape, guint index)
+{
+    const MatrixJsonTapeEntry *entry = _tape_entry(tape, index);
+    const MatrixJsonTapeEntry *child;
+
+    if(entry == NULL || !entry->indexed)
+        return MATRIX_JSON_TAPE_NONE;
+
+    /* the first child comes straight after its parent, if there is one */
+    child = _tape_entry(tape, index + 1);
+    if(child == NULL || child->start >= entry->start + entry->len)
+        return MATRIX_JSON_TAPE_NONE;
+    return index + 1;
+}
+
+
+guint matrix_json_tape_next_sibling(const MatrixJsonTape *tape, guint index)
+{
+    const MatrixJsonTapeEntry *entry = _tape_entry(tape, index);
+    return entry == NULL ? MATRIX_JSON_TAPE_NONE : entry->next;
+}
+
+
+guint matrix_json_tape_find_member(const MatrixJsonTape *tape, guint index,
+        const gchar *member_name)
+{
+    const MatrixJsonTapeEntry *entry = _tape_entry(tape, index);
+    gsize name_len = strlen(member_name);
+    guint child;
+
+    if(entry == NULL || entry->type != '{')
+        return MATRIX_JSON_TAPE_NONE;
+
+    for(child = matrix_json_tape_first_child(tape, index);
+            child != MATRIX_JSON_TAPE_NONE;
+            child = _TAPE_ENTRY(tape, child).next) {
+        const MatrixJsonTapeEntry *c = &_TAPE_ENTRY(tape, child);
+        const gchar *name = tape->json + c->name_start;
+        gchar *decoded;
+        gboolean match;
+
+        /* names are compared in place, unless they have escapes in them */
+        if(memchr(name, '\\', c->name_len) == NULL) {
+            if(c->name_len == name_len &&
+                    memcmp(name, member_name, name_len) == 0)
+                return child;
+            continue;
+        }
+        decoded = _decode_string(name, name + c->name_len);
+        match = (decoded != NULL && strcmp(decoded, member_name) == 0);
+        g_free(decoded);
+        if(match)
+            return child;
+    }
+    return MATRIX_JSON_TAPE_NONE;
+}
+
+
+const gchar *matrix_json_tape_get_span(const MatrixJsonTape *tape,
+        guint index, gsize *value_len)
+{
+    const MatrixJsonTapeEntry *entry = _tape_entry(tape, index);
+
+    if(entry == NULL) {
+        *value_len = 0;
+        return NULL;
+    }
+    *value_len = entry->len;
+    return tape->json + entry->start;
+}
+
+
+gchar *matrix_json_tape_get_name(const MatrixJsonTape *tape, guint index)
+{
+    const MatrixJsonTapeEntry *entry = _tape_entry(tape, index);
+    const gchar *name;
+
+    if(entry == NULL || !entry->has_name)
+        return NULL;
+    name = tape->json + entry->name_start;
+    return _decode_string(name, name + entry->name_len);
+}
+
+
+gboolean matrix_json_tape_is_array(const MatrixJsonTape *tape, guint index)
+{
+    const MatrixJsonTapeEntry *entry = _tape_entry(tape, index);
+    return entry != NULL && entry->type == '[';
+}
+
+
+/* canonical json */
+
+/*
+ * How each byte is written inside a string: 0 if as itself, 'u' for a \u00XX
+ * escape, otherwise the character to put after a backslash.
+ */
+static const gchar _canonical_escapes[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    ['"'] = '"',
+    ['\\'] = '\\',
+};
+
+static void canonical_json_string(const gchar *str, GString *result)
+{
+    static const gchar hex[] = "0123456789abcdef";
+    const guchar *start = (const guchar *)str, *ptr;
+
+    g_string_append_c(result, '"');
+    for(ptr = start; *ptr; ptr++) {
+        gchar escape = _canonical_escapes[*ptr];
+        if(escape == 0)
+            continue;
+
+        /* write out the run of characters which didn't need escaping */
+        g_string_append_len(result, (const gchar *)start, ptr - start);
+        start = ptr + 1;
+
+        g_string_append_c(result, '\\');
+        g_string_append_c(result, escape);
+        if(escape == 'u') {
+            g_string_append(result, "00");
+            g_string_append_c(result, hex[*ptr >> 4]);
+            g_string_append_c(result, hex[*ptr & 0xf]);
+        }
+    }
+    g_string_append_len(result, (const gchar *)start, ptr - start);
+    g_string_append_c(result, '"');
+}
+
+static void canonical_json_value(JsonNode *node, GString *result)
 {
     GType vt = json_node_get_value_type(node);
     switch (vt) {
         case G_TYPE_STRING:
-            /* TODO: I'm assuming our strings are nice UTF-8 strings already */
-            result = g_string_append_c(result, '"');
-            result = g_string_append(result, json_node_get_string(node));
-            result = g_string_append_c(result, '"');
+            canonical_json_string(json_node_get_string(node), result);
+            break;
+
+        case G_TYPE_INT64:
+            g_string_append_printf(result, "%" G_GINT64_FORMAT,
+                    json_node_get_int(node));
+            break;
+
+        case G_TYPE_BOOLEAN:
+            g_string_append(result, json_node_get_boolean(node) ?
+                    "true" : "false");
             break;
 
         default:
+            /* canonical JSON has no floating-point numbers */
             fprintf(stderr, "%s: Unknown value type %zd\n", __func__,
                     (size_t)vt);
-            /* TODO: Other value types */
             g_assert_not_reached();
     }
-
-    return result;
 }
 
-static GString *canonical_json_array(JsonArray *arr, GString *result)
+static void canonical_json_array(JsonArray *arr, GString *result)
 {
     guint nelems, i;
-    result = g_string_append_c(result, '[');
+    g_string_append_c(result, '[');
     nelems = json_array_get_length(arr);
     for(i = 0; i < nelems; i++) {
-        if (i) result=g_string_append_c(result, ',');
-        result = canonical_json_node(json_array_get_element(arr, i), result);
+        if (i) g_string_append_c(result, ',');
+        canonical_json_node(json_array_get_element(arr, i), result);
     }
-    result = g_string_append_c(result, ']');
-
-    return result;
+    g_string_append_c(result, ']');
 }
 
-static GString *canonical_json_node(JsonNode *node, GString *result)
+static void canonical_json_node(JsonNode *node, GString *result)
 {
     switch (json_node_get_node_type(node)) {
         case JSON_NODE_OBJECT:
-            result = canonical_json_object(json_node_get_object(node), result);
+            canonical_json_object(json_node_get_object(node), result);
             break;
 
         case JSON_NODE_ARRAY:
-            result = canonical_json_array(json_node_get_array(node), result);
+            canonical_json_array(json_node_get_array(node), result);
             break;
 
         case JSON_NODE_VALUE:
-            result = canonical_json_value(node, result);
+            canonical_json_value(node, result);
             break;
 
         case JSON_NODE_NULL:
-            result = g_string_append(result, "null");
+            g_string_append(result, "null");
             break;
     }
-    return result;
 }
 
-static GString *canonical_json_object(JsonObject *object, GString *result)
+typedef struct {
+    const gchar *name;
+    JsonNode *node;
+} CanonicalJsonMember;
+
+static int canonical_json_sort(const void *a, const void *b)
 {
-    gboolean first = TRUE;
-    result = result ? g_string_append_c(result, '{') : g_string_new("{");
+    return strcmp(((const CanonicalJsonMember *)a)->name,
+            ((const CanonicalJsonMember *)b)->name);
+}
 
-    /* This gets an unsorted list of member names */
-    GList *members = json_object_get_members(object);
-    GList *cur;
+/*
+ * The members are sorted on the stack, unless there are a lot of them: most
+ * of what we sign (each one-time key, for instance) is small, and this runs
+ * for every one.
+ */
+static void canonical_json_object(JsonObject *object, GString *result)
+{
+    CanonicalJsonMember small[16], *members = small;
+    guint count = json_object_get_size(object), i = 0;
+    JsonObjectIter iter;
+    const gchar *name;
+    JsonNode *node;
 
-    members = g_list_sort(members, canonical_json_sort);
-    for(cur=g_list_first(members); cur; cur=g_list_next(cur)) {
-        const gchar *cur_name = cur->data;
-        JsonNode *cur_node  = json_object_get_member(object, cur_name);
-        if (!first) result=g_string_append_c(result, ',');
-        first = FALSE;
-        result = g_string_append_c(result, '"');
-        result = g_string_append(result, cur_name);
-        result = g_string_append_c(result, '"');
-        result = g_string_append_c(result, ':');
-        result = canonical_json_node(cur_node, result);
+    if(count > G_N_ELEMENTS(small))
+        members = g_new(CanonicalJsonMember, count);
+    json_object_iter_init(&iter, object);
+    while(json_object_iter_next(&iter, &name, &node)) {
+        members[i].name = name;
+        members[i].node = node;
+        i++;
+    }
+    if(count > 1)
+        qsort(members, count, sizeof(CanonicalJsonMember),
+                canonical_json_sort);
+
+    g_string_append_c(result, '{');
+    for(i = 0; i < count; i++) {
+        if (i) g_string_append_c(result, ',');
+        canonical_json_string(members[i].name, result);
+        g_string_append_c(result, ':');
+        canonical_json_node(members[i].node, result);
     }
+    g_string_append_c(result, '}');
 
-    g_list_free(members);
+    if(members != small)
+        g_free(members);
+}
 
-    result = g_string_append_c(result, '}');
+GString *matrix_canonical_json_append(GString *result, JsonObject *object)
+{
+    canonical_json_object(object, result);
     return result;
 }
 
@@ -229,7 +1126,151 @@ static GString *canonical_json_object(JsonObject *object, GString *result)
  */
 GString *matrix_canonical_json(JsonObject *object)
 {
-    return canonical_json_object(object, NULL);
+    return matrix_canonical_json_append(g_string_sized_new(256), object);
+}
+
+
+/* streaming writer */
+
+static void _writer_separate(MatrixJsonWriter *writer)
+{
+    if(writer->need_comma)
+        g_string_append_c(writer->out, ',');
+}
+
+static void _writer_open(MatrixJsonWriter *writer, gchar c)
+{
+    _writer_separate(writer);
+    g_string_append_c(writer->out, c);
+    writer->need_comma = FALSE;
+}
+
+static void _writer_close(MatrixJsonWriter *writer, gchar c)
+{
+    g_string_append_c(writer->out, c);
+    writer->need_comma = TRUE;
+}
+
+void matrix_json_writer_init(MatrixJsonWriter *writer, GString *out)
+{
+    writer->out = out;
+    writer->need_comma = FALSE;
+}
+
+void matrix_json_writer_begin_object(MatrixJsonWriter *writer)
+{
+    _writer_open(writer, '{');
+}
+
+void matrix_json_writer_end_object(MatrixJsonWriter *writer)
+{
+    _writer_close(writer, '}');
+}
+
+void matrix_json_writer_member(MatrixJsonWriter *writer, const gchar *name)
+{
+    _writer_separate(writer);
+    canonical_json_string(name, writer->out);
+    g_string_append_c(writer->out, ':');
+    writer->need_comma = FALSE;
+}
+
+void matrix_json_writer_string(MatrixJsonWriter *writer, const gchar *value)
+{
+    _writer_separate(writer);
+    /* the canonical escaping is as good as any for ordinary output */
+    canonical_json_string(value, writer->out);
+    writer->need_comma = TRUE;
+}
+
+void matrix_json_writer_int(MatrixJsonWriter *writer, gint64 value)
+{
+    _writer_separate(writer);
+    g_string_append_printf(writer->out, "%" G_GINT64_FORMAT, value);
+    writer->need_comma = TRUE;
+}
+
+void matrix_json_writer_boolean(MatrixJsonWriter *writer, gboolean value)
+{
+    _writer_separate(writer);
+    g_string_append(writer->out, value ? "true" : "false");
+    writer->need_comma = TRUE;
+}
+
+static void _writer_node(MatrixJsonWriter *writer, JsonNode *node)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+    JsonArray *array;
+    guint nelems, i;
+
+    switch (json_node_get_node_type(node)) {
+        case JSON_NODE_OBJECT:
+            matrix_json_writer_object(writer, json_node_get_object(node));
+            return;
+
+        case JSON_NODE_ARRAY:
+            array = json_node_get_array(node);
+            _writer_open(writer, '[');
+            nelems = json_array_get_length(array);
+            for(i = 0; i < nelems; i++)
+                _writer_node(writer, json_array_get_element(array, i));
+            _writer_close(writer, ']');
+            return;
+
+        case JSON_NODE_NULL:
+            break;
+
+        case JSON_NODE_VALUE:
+            switch (json_node_get_value_type(node)) {
+                case G_TYPE_STRING:
+                    matrix_json_writer_string(writer,
+                            json_node_get_string(node));
+                    return;
+
+                case G_TYPE_INT64:
+                    matrix_json_writer_int(writer, json_node_get_int(node));
+                    return;
+
+                case G_TYPE_BOOLEAN:
+                    matrix_json_writer_boolean(writer,
+                            json_node_get_boolean(node));
+                    return;
+
+                case G_TYPE_DOUBLE:
+                    /* JSON has no NaN or infinity: they are written as null,
+                     * as JSON.stringify does */
+                    if(!isfinite(json_node_get_double(node)))
+                        break;
+                    _writer_separate(writer);
+                    g_string_append(writer->out, g_ascii_dtostr(buf,
+                            sizeof(buf), json_node_get_double(node)));
+                    writer->need_comma = TRUE;
+                    return;
+
+                default:
+                    break;
+            }
+            break;
+    }
+
+    _writer_separate(writer);
+    g_string_append(writer->out, "null");
+    writer->need_comma = TRUE;
+}
+
+void matrix_json_writer_object(MatrixJsonWriter *writer, JsonObject *object)
+{
+    JsonObjectIter iter;
+    const gchar *name;
+    JsonNode *node;
+
+    matrix_json_writer_begin_object(writer);
+    json_object_iter_init(&iter, object);
+    while(json_object_iter_next(&iter, &name, &node)) {
+        matrix_json_writer_member(writer, name);
+        _writer_node(writer, node);
+    }
+    matrix_json_writer_end_object(writer);
 }
 
 /* Decode a json web signature (JWS) which is almost base64,
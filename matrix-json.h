@@ -60,11 +60,144 @@ const gchar *matrix_json_array_get_string_element(JsonArray *array,
         guint index);
 
 
+/* Handling of raw JSON text
+ *
+ * These let us handle a very large document (such as a /sync response) one
+ * piece at a time, without building a json-glib tree for all of it. A
+ * "span" is a pointer to a single value within the original text, and its
+ * length; matrix_json_parse_span gets a tree for just that value.
+ */
+
+/* Decode a JSON string value. Returns NULL if the value is not a string;
+ * otherwise a string which should be freed.
+ */
+gchar *matrix_json_span_get_string(const gchar *value, gsize value_len);
+
+/* Parse a single JSON value. Returns NULL (after logging the problem) if it
+ * could not be parsed; otherwise a JsonParser which should be unreffed.
+ */
+JsonParser *matrix_json_parse_span(const gchar *value, gsize value_len);
+
+
+/* Parse a single JSON value into an existing parser, which can then be reused
+ * for the next one. Returns the root of the tree, or NULL (after logging the
+ * problem) if it could not be parsed.
+ */
+JsonNode *matrix_json_parser_load_span(JsonParser *parser, const gchar *value,
+        gsize value_len);
+
+/* Check that some text is valid UTF-8 and has no NULs in it, as it must be
+ * before it can be used as a C string. Returns FALSE if not.
+ */
+gboolean matrix_json_validate_text(const gchar *text, gsize text_len);
+
+
+/* Structural index ("tape") of a JSON document
+ *
+ * This records, in a single pass over the text, where each value starts and
+ * ends, so that the document can then be navigated without scanning the text
+ * again. Each value has an index; the root is index 0, and the members of an
+ * object (or elements of an array) follow it in order.
+ *
+ * Objects and arrays nested deeper than max_depth get one entry covering all
+ * of their text, rather than one for each member; the root is at depth 0.
+ * That keeps the index small when we only want to find our way to (say) the
+ * events in a /sync response, which can then be parsed one at a time.
+ *
+ * Nothing is copied: values are pointers into the original text, which must
+ * outlive the tape.
+ */
+typedef struct _MatrixJsonTape MatrixJsonTape;
+
+/* returned by the functions below where there is no such value */
+#define MATRIX_JSON_TAPE_NONE G_MAXUINT
+
+/* Build the index for json[0..json_len]. Returns NULL if the text is not
+ * well-formed, or is 4GB or more; otherwise a tape which should be freed
+ * with matrix_json_tape_free.
+ */
+MatrixJsonTape *matrix_json_tape_new(const gchar *json, gsize json_len,
+        guint max_depth);
+void matrix_json_tape_free(MatrixJsonTape *tape);
+
+/* The first member or element of an object or array, or the one after
+ * another. These return MATRIX_JSON_TAPE_NONE at the end, and for values
+ * which are not indexed objects or arrays.
+ */
+guint matrix_json_tape_first_child(const MatrixJsonTape *tape, guint index);
+guint matrix_json_tape_next_sibling(const MatrixJsonTape *tape, guint index);
+
+/* Find a member of an indexed object by name */
+guint matrix_json_tape_find_member(const MatrixJsonTape *tape, guint index,
+        const gchar *member_name);
+
+/* The text of a value; returns NULL for MATRIX_JSON_TAPE_NONE */
+const gchar *matrix_json_tape_get_span(const MatrixJsonTape *tape,
+        guint index, gsize *value_len);
+
+/* The name of an object member, which should be freed; NULL if the value is
+ * not an object member */
+gchar *matrix_json_tape_get_name(const MatrixJsonTape *tape, guint index);
+
+/* TRUE if the value is an array */
+gboolean matrix_json_tape_is_array(const MatrixJsonTape *tape, guint index);
+
+/* How raw text is scanned, by matrix_json_tape_new and
+ * matrix_json_validate_text: a byte at a time, or many at once with vector
+ * instructions. By default, the fastest the CPU supports is used; the tests
+ * and benchmarks choose each in turn, to compare them.
+ */
+typedef enum {
+    MATRIX_JSON_SCAN_SCALAR,
+    MATRIX_JSON_SCAN_SSE2,
+    MATRIX_JSON_SCAN_AVX2,
+    MATRIX_JSON_SCAN_COUNT
+} MatrixJsonScan;
+
+/* Returns FALSE, and changes nothing, if this build or CPU can't do it */
+gboolean matrix_json_set_scan(MatrixJsonScan scan);
+MatrixJsonScan matrix_json_get_scan(void);
+const gchar *matrix_json_scan_name(MatrixJsonScan scan);
+
+
 /* Produce a canonicalised string as defined in
  * https://matrix.org/speculator/spec/drafts%2Fe2e/appendices.html#canonical-json
  */
 GString *matrix_canonical_json(JsonObject *object);
 
+/* As matrix_canonical_json, but append to an existing string, so that the
+ * same buffer can be reused */
+GString *matrix_canonical_json_append(GString *result, JsonObject *object);
+
+
+/**
+ * A writer which serialises JSON straight onto the end of a GString, without
+ * building a tree of JsonNodes or a separate string first. The output is
+ * compact, with members in the order they are written.
+ *
+ * A writer owns nothing, so it needs no cleanup and can live on the stack.
+ * Objects are written with matrix_json_writer_begin_object, then a
+ * matrix_json_writer_member followed by a value for each member, then
+ * matrix_json_writer_end_object.
+ */
+typedef struct _MatrixJsonWriter {
+    GString *out;
+
+    /* private: set when the next value must be preceded by a comma */
+    gboolean need_comma;
+} MatrixJsonWriter;
+
+void matrix_json_writer_init(MatrixJsonWriter *writer, GString *out);
+void matrix_json_writer_begin_object(MatrixJsonWriter *writer);
+void matrix_json_writer_end_object(MatrixJsonWriter *writer);
+void matrix_json_writer_member(MatrixJsonWriter *writer, const gchar *name);
+void matrix_json_writer_string(MatrixJsonWriter *writer, const gchar *value);
+void matrix_json_writer_int(MatrixJsonWriter *writer, gint64 value);
+void matrix_json_writer_boolean(MatrixJsonWriter *writer, gboolean value);
+
+/* Write out an existing object, and everything in it */
+void matrix_json_writer_object(MatrixJsonWriter *writer, JsonObject *object);
+
 /* Decode a json web signature (JWS) which is almost base64,
  * its needs _ -> / and - -> + and some = padding.
  * as https://tools.ietf.org/html/draft-ietf-jose-json-web-signature-41#appendix-C
@@ -28,6 +28,7 @@
 /* libpurple */
 #include <libpurple/connection.h>
 #include <libpurple/debug.h>
+#include <libpurple/ft.h>
 
 #include "libmatrix.h"
 #include "matrix-api.h"
@@ -35,6 +36,7 @@
 #include "matrix-event.h"
 #include "matrix-json.h"
 #include "matrix-roommembers.h"
+#include "matrix-statestore.h"
 #include "matrix-statetable.h"
 
 
@@ -63,15 +65,22 @@ static MatrixConnectionData *_get_connection_data_from_conversation(
 /* a GList of MatrixRoomEvent * */
 #define PURPLE_CONV_DATA_EVENT_QUEUE "queue"
 
-/* PurpleUtilFetchUrlData * */
+/* MatrixApiRequestData * */
 #define PURPLE_CONV_DATA_ACTIVE_SEND "active_send"
 
 /* MatrixRoomMemberTable * - see below */
 #define PURPLE_CONV_MEMBER_TABLE "member_table"
 
+/* MatrixApiRequestData * for a /members request in progress */
+#define PURPLE_CONV_DATA_MEMBERS_FETCH "members_fetch"
+
 /* PURPLE_CONV_FLAG_* */
 #define PURPLE_CONV_FLAGS "flags"
 #define PURPLE_CONV_FLAG_NEEDS_NAME_UPDATE 0x1
+/* we have the full member list (rather than just the lazy-loaded members) */
+#define PURPLE_CONV_FLAG_MEMBERS_LOADED 0x2
+/* the user has looked at (or sent to) the room since it was opened */
+#define PURPLE_CONV_FLAG_IN_USE 0x4
 
 /* Arbitrary limit on the size of an image to receive; should make
  * configurable. This is based on the worst-case assumption of a
@@ -114,6 +123,23 @@ static void _set_flags(PurpleConversation *conv, guint flags)
 }
 
 
+gboolean matrix_room_is_in_use(PurpleConversation *conv)
+{
+    guint flags = _get_flags(conv);
+
+    /* no UI has a window for it */
+    if(conv->ui_data == NULL)
+        return FALSE;
+
+    if(!(flags & PURPLE_CONV_FLAG_IN_USE) &&
+            purple_conversation_has_focus(conv)) {
+        flags |= PURPLE_CONV_FLAG_IN_USE;
+        _set_flags(conv, flags);
+    }
+    return (flags & PURPLE_CONV_FLAG_IN_USE) != 0;
+}
+
+
 /******************************************************************************
  *
  * room state handling
@@ -467,6 +493,7 @@ struct SendImageEventData {
     PurpleConversation *conv;
     MatrixRoomEvent *event;
     int imgstore_id;
+    guint progress;     /* the last progress we logged, in tenths */
 };
 
 /**
@@ -533,6 +560,23 @@ void _image_upload_error(MatrixConnectionData *ma, gpointer user_data,
     /* More clear up with the message? */
 }
 
+/**
+ * Called back by matrix_api_upload_file as the image is sent
+ */
+static void _image_upload_progress(MatrixConnectionData *ma,
+        gpointer user_data, gsize sent, gsize total)
+{
+    struct SendImageEventData *sied = user_data;
+    guint progress = sent * 10 / total;
+
+    if(progress > sied->progress) {
+        sied->progress = progress;
+        purple_debug_info("matrixprpl", "image id %d: sent %" G_GSIZE_FORMAT
+                " of %" G_GSIZE_FORMAT " bytes\n", sied->imgstore_id, sent,
+                total);
+    }
+}
+
 /**
  * Return a mimetype based on some info; this should get replaced
  * with a glib/gio/gcontent_type_guess call if we can include it,
@@ -619,7 +663,8 @@ static void _send_image_hook(MatrixRoomEvent *event, gboolean just_free)
     fetch_data = matrix_api_upload_file(acct, ctype, imgdata, imgsize,
                            _image_upload_complete,
                            _image_upload_error,
-                           _image_upload_bad_response, sied);
+                           _image_upload_bad_response,
+                           _image_upload_progress, sied);
     if (fetch_data) {
         purple_conversation_set_data(sied->conv, PURPLE_CONV_DATA_ACTIVE_SEND,
                 fetch_data);
@@ -672,9 +717,9 @@ static void _image_download_complete(MatrixConnectionData *ma,
         return _image_download_complete_crypt(rid, raw_body, raw_body_len);
     }
     if (is_known_image_type(content_type)) {
-        /* Excellent - something to work with */
-        int img_id = purple_imgstore_add_with_id(g_memdup(raw_body, raw_body_len),
-                                                 raw_body_len, NULL);
+        /* Excellent - something to work with. The image store frees it. */
+        int img_id = purple_imgstore_add_with_id(
+                matrix_api_steal_body(raw_body), raw_body_len, NULL);
         msg = g_strdup_printf("<IMG ID=\"%d\">", img_id);
         serv_got_chat_in(rid->conv->account->gc, g_str_hash(rid->room_id), rid->sender_display_name,
                 PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_IMAGES,
@@ -729,6 +774,200 @@ static void _image_download_error(MatrixConnectionData *ma, gpointer user_data,
     g_free(rid);
 }
 
+/*
+ * Receiving files: if the user accepts the transfer, we stream the file
+ * straight to disk (decrypting it as it arrives, if need be), so we aren't
+ * limited by how much we're willing to hold in memory.
+ */
+struct ReceiveFileData {
+    PurpleAccount *account;
+    gchar *url;
+    MatrixMediaCryptInfo *crypt;
+    MatrixMediaDecryptor *decryptor;
+    FILE *fp;
+    gboolean file_created;
+    MatrixApiRequestData *fetch;
+    gsize received;
+};
+
+static void _file_receive_data_free(PurpleXfer *xfer)
+{
+    struct ReceiveFileData *rfd = xfer->data;
+
+    if (!rfd)
+        return;
+    xfer->data = NULL;
+    if (rfd->fetch)
+        matrix_api_cancel(rfd->fetch);
+    if (rfd->fp)
+        fclose(rfd->fp);
+    /* however the transfer ended, if it didn't succeed, don't leave part
+     * of the file behind: for an encrypted file, that would be plaintext
+     * whose hash we never checked */
+    if (rfd->file_created && !purple_xfer_is_completed(xfer))
+        g_unlink(purple_xfer_get_local_filename(xfer));
+    matrix_e2e_media_decryptor_free(rfd->decryptor);
+    g_free(rfd->crypt);
+    g_free(rfd->url);
+    g_free(rfd);
+}
+
+static void _file_receive_failed(PurpleXfer *xfer, const gchar *error)
+{
+    purple_debug_info("matrixprpl", "file download failed: %s\n", error);
+    purple_xfer_error(PURPLE_XFER_RECEIVE, purple_xfer_get_account(xfer),
+            purple_xfer_get_remote_user(xfer), error);
+    purple_xfer_cancel_remote(xfer);
+}
+
+static gboolean _file_receive_data(MatrixConnectionData *ma,
+        gpointer user_data, const gchar *data, gsize len)
+{
+    PurpleXfer *xfer = user_data;
+    struct ReceiveFileData *rfd = xfer->data;
+    gchar *decrypted = NULL;
+    size_t written;
+
+    if (rfd->decryptor) {
+        decrypted = g_malloc(len);
+        if (matrix_e2e_media_decryptor_update(rfd->decryptor, data,
+                    decrypted, len) != NULL) {
+            g_free(decrypted);
+            return FALSE;
+        }
+        data = decrypted;
+    }
+    written = fwrite(data, 1, len, rfd->fp);
+    g_free(decrypted);
+    if (written != len)
+        return FALSE;
+
+    rfd->received += len;
+    purple_xfer_set_bytes_sent(xfer, rfd->received);
+    purple_xfer_update_progress(xfer);
+    return TRUE;
+}
+
+static void _file_receive_complete(MatrixConnectionData *ma,
+        gpointer user_data, JsonNode *json_root,
+        const char *raw_body, size_t raw_body_len, const char *content_type)
+{
+    PurpleXfer *xfer = user_data;
+    struct ReceiveFileData *rfd = xfer->data;
+    const char *fail_str = NULL;
+
+    rfd->fetch = NULL;
+    if (fclose(rfd->fp) != 0)
+        fail_str = g_strerror(errno);
+    rfd->fp = NULL;
+    if (!fail_str && rfd->decryptor)
+        fail_str = matrix_e2e_media_decryptor_finish(rfd->decryptor);
+
+    if (fail_str) {
+        _file_receive_failed(xfer, fail_str);
+        return;
+    }
+    purple_xfer_set_completed(xfer, TRUE);
+    purple_xfer_end(xfer);
+}
+
+static void _file_receive_error(MatrixConnectionData *ma, gpointer user_data,
+        const gchar *error_message)
+{
+    PurpleXfer *xfer = user_data;
+    struct ReceiveFileData *rfd = xfer->data;
+
+    /* if we cancelled the download ourselves, the transfer is going away */
+    if (rfd == NULL)
+        return;
+    rfd->fetch = NULL;
+    _file_receive_failed(xfer, error_message);
+}
+
+static void _file_receive_bad_response(MatrixConnectionData *ma,
+        gpointer user_data, int http_response_code, JsonNode *json_root)
+{
+    PurpleXfer *xfer = user_data;
+    struct ReceiveFileData *rfd = xfer->data;
+    gchar *error;
+
+    rfd->fetch = NULL;
+    error = g_strdup_printf("bad response to download file %d",
+            http_response_code);
+    _file_receive_failed(xfer, error);
+    g_free(error);
+}
+
+/* the user has accepted the transfer, and picked a file to save it in */
+static void _file_receive_init(PurpleXfer *xfer)
+{
+    struct ReceiveFileData *rfd = xfer->data;
+    PurpleConnection *pc = purple_account_get_connection(rfd->account);
+    const char *fail_str = NULL;
+
+    if (pc == NULL) {
+        _file_receive_failed(xfer, "not connected");
+        return;
+    }
+
+    rfd->fp = g_fopen(purple_xfer_get_local_filename(xfer), "wb");
+    if (rfd->fp == NULL) {
+        _file_receive_failed(xfer, g_strerror(errno));
+        return;
+    }
+    rfd->file_created = TRUE;
+
+    if (rfd->crypt) {
+        rfd->decryptor = matrix_e2e_media_decryptor_new(rfd->crypt,
+                &fail_str);
+        if (rfd->decryptor == NULL) {
+            _file_receive_failed(xfer, fail_str);
+            return;
+        }
+    }
+
+    /* the fetch is only set once it returns, so if it fails straight away,
+     * _file_receive_error will see a NULL fetch, which is what we want */
+    rfd->fetch = matrix_api_download_file_stream(pc->proto_data, rfd->url,
+            _file_receive_data, _file_receive_complete, _file_receive_error,
+            _file_receive_bad_response, xfer);
+}
+
+/*
+ * Offer a file which has been sent to us as a file transfer
+ *
+ * @param json_file_obj  the 'file' member of the content, for encrypted
+ *                       files; otherwise NULL
+ */
+static void _offer_incoming_file(PurpleConversation *conv,
+        const gchar *sender_display_name, const gchar *msg_body,
+        const gchar *url, guint64 size, JsonObject *json_file_obj)
+{
+    struct ReceiveFileData *rfd;
+    PurpleXfer *xfer;
+
+    rfd = g_new0(struct ReceiveFileData, 1);
+    if (json_file_obj &&
+            !matrix_e2e_parse_media_decrypt_info(&rfd->crypt, json_file_obj)) {
+        g_free(rfd);
+        return;
+    }
+    rfd->account = conv->account;
+    rfd->url = g_strdup(url);
+
+    xfer = purple_xfer_new(conv->account, PURPLE_XFER_RECEIVE,
+            sender_display_name);
+    xfer->data = rfd;
+    purple_xfer_set_filename(xfer, msg_body);
+    if (size > 0)
+        purple_xfer_set_size(xfer, size);
+    purple_xfer_set_init_fnc(xfer, _file_receive_init);
+    purple_xfer_set_cancel_recv_fnc(xfer, _file_receive_data_free);
+    purple_xfer_set_request_denied_fnc(xfer, _file_receive_data_free);
+    purple_xfer_set_end_fnc(xfer, _file_receive_data_free);
+    purple_xfer_request(xfer);
+}
+
 /*
  * Called from matrix_room_handle_timeline_event when it finds an m.video
  * or m.audio or m.file or m.image; msg_body has the fallback text,
@@ -788,6 +1027,12 @@ static gboolean _handle_incoming_media(PurpleConversation *conv,
     g_free(msg);
     g_string_free(download_url, TRUE);
 
+    if (purple_account_get_bool(conv->account, PRPL_ACCOUNT_OPT_OFFER_FILES,
+                DEFAULT_OFFER_FILES)) {
+        _offer_incoming_file(conv, sender_display_name, msg_body, url, size,
+                json_file_obj);
+    }
+
     /* m.audio is not supposed to have a thumbnail, handling completed
      */
     if (!strcmp("m.audio", msg_type)) {
@@ -1128,6 +1373,143 @@ void matrix_room_handle_timeline_event(PurpleConversation *conv,
 }
 
 
+/* *****************************************************************************
+ *
+ * Fetching of the member list.
+ *
+ * If lazy-loading of members is enabled, /sync only gives us the members who
+ * have sent something recently. We fetch the rest in the background when it
+ * looks like the user cares: when they start typing in the room, or when we
+ * are asked about a member we don't know.
+ */
+
+static void _members_fetch_complete(MatrixConnectionData *ma,
+        gpointer user_data, JsonNode *json_root,
+        const char *raw_body, size_t raw_body_len, const char *content_type)
+{
+    PurpleConversation *conv = user_data;
+    MatrixRoomStateEventTable *state_table = matrix_room_get_state_table(conv);
+    JsonArray *chunk;
+    JsonNode *event;
+    guint i = 0;
+
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_MEMBERS_FETCH, NULL);
+
+    chunk = matrix_json_object_get_array_member(
+            matrix_json_node_get_object(json_root), "chunk");
+    purple_debug_info("matrixprpl", "got %u members for %s\n",
+            chunk == NULL ? 0 : json_array_get_length(chunk), conv->name);
+
+    matrix_statestore_begin(ma->state_store);
+    while((event = matrix_json_array_get_element(chunk, i++)) != NULL) {
+        JsonObject *event_obj = matrix_json_node_get_object(event);
+        const gchar *state_key = matrix_json_object_get_string_member(
+                event_obj, "state_key");
+
+        if(state_key == NULL)
+            continue;
+
+        /* anything we already know about came from /sync, and is at least as
+         * recent as this */
+        if(matrix_statetable_get_event(state_table, "m.room.member",
+                state_key) != NULL)
+            continue;
+
+        matrix_statestore_store_event(ma->state_store, conv->name,
+                event_obj);
+        matrix_room_handle_state_event(conv, event_obj);
+    }
+    matrix_statestore_commit(ma->state_store, NULL);
+
+    _set_flags(conv, _get_flags(conv) | PURPLE_CONV_FLAG_MEMBERS_LOADED);
+    matrix_room_complete_state_update(conv, FALSE);
+}
+
+
+static void _members_fetch_error(MatrixConnectionData *ma,
+        gpointer user_data, const gchar *error_message)
+{
+    PurpleConversation *conv = user_data;
+
+    /* not fatal: we'll try again next time we need the members */
+    purple_debug_warning("matrixprpl", "Unable to get members for %s: %s\n",
+            conv->name, error_message);
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_MEMBERS_FETCH, NULL);
+}
+
+
+static void _members_fetch_bad_response(MatrixConnectionData *ma,
+        gpointer user_data, int http_response_code, JsonNode *json_root)
+{
+    PurpleConversation *conv = user_data;
+
+    purple_debug_warning("matrixprpl", "Unable to get members for %s: %i\n",
+            conv->name, http_response_code);
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_MEMBERS_FETCH, NULL);
+}
+
+
+/**
+ * Start fetching the full member list for a room, unless we already have it
+ */
+static void _fetch_members(PurpleConversation *conv)
+{
+    MatrixConnectionData *conn;
+    MatrixApiRequestData *fetch;
+    const gchar *at;
+
+    if(_get_flags(conv) & PURPLE_CONV_FLAG_MEMBERS_LOADED)
+        return;
+
+    if(purple_conversation_get_data(conv, PURPLE_CONV_DATA_MEMBERS_FETCH)
+            != NULL)
+        return;
+
+    /* we've left the room */
+    if(matrix_room_get_state_table(conv) == NULL)
+        return;
+
+    /* without lazy-loading, /sync gave us everyone */
+    if(!purple_account_get_bool(conv->account,
+            PRPL_ACCOUNT_OPT_LAZY_LOAD_MEMBERS, DEFAULT_LAZY_LOAD_MEMBERS))
+        return;
+
+    conn = _get_connection_data_from_conversation(conv);
+
+    /* a sliding sync pos isn't a stream token, so the server can't give us
+     * the members as of then: we take them as they are now instead */
+    if(purple_account_get_bool(conv->account,
+            PRPL_ACCOUNT_OPT_NEXT_BATCH_IS_POS, FALSE))
+        at = NULL;
+    else
+        at = purple_account_get_string(conv->account,
+                PRPL_ACCOUNT_OPT_NEXT_BATCH, NULL);
+
+    fetch = matrix_api_get_room_members(conn, conv->name, at,
+            _members_fetch_complete, _members_fetch_error,
+            _members_fetch_bad_response, conv);
+    purple_conversation_set_data(conv, PURPLE_CONV_DATA_MEMBERS_FETCH, fetch);
+}
+
+
+/**
+ * If there is a /members request in progress, cancel it
+ */
+static void _cancel_members_fetch(PurpleConversation *conv)
+{
+    MatrixApiRequestData *fetch = purple_conversation_get_data(conv,
+            PURPLE_CONV_DATA_MEMBERS_FETCH);
+
+    if(fetch == NULL)
+        return;
+
+    matrix_api_cancel(fetch);
+
+    g_assert(purple_conversation_get_data(conv,
+            PURPLE_CONV_DATA_MEMBERS_FETCH) == NULL);
+}
+
+
 PurpleConversation *matrix_room_create_conversation(
         PurpleConnection *pc, const gchar *room_id)
 {
@@ -1154,10 +1536,9 @@ PurpleConversation *matrix_room_create_conversation(
 
 
 /**
- * Leave a chat: notify the server that we are leaving, and (ultimately)
- * free the memory structures
+ * Free everything we keep for a room, and forget its state on disk
  */
-void matrix_room_leave_chat(PurpleConversation *conv)
+static void _forget_room(PurpleConversation *conv)
 {
     MatrixConnectionData *conn;
     MatrixRoomStateEventTable *state_table;
@@ -1167,18 +1548,8 @@ void matrix_room_leave_chat(PurpleConversation *conv)
     conn = _get_connection_data_from_conversation(conv);
 
     _cancel_event_send(conv);
-    matrix_api_leave_room(conn, conv->name, NULL, NULL, NULL, NULL);
-
-    /* At this point, we have no confirmation that the 'leave' request will
-     * be successful (nor that it has even started), so it's questionable
-     * whether we can/should actually free all of the room state.
-     *
-     * On the other hand, we don't have any mechanism for telling purple that
-     * we haven't really left the room, and if the leave request does fail,
-     * we'll set the error flag on the connection, which will eventually
-     * result in pidgin flagging the connection as failed; things will
-     * hopefully then get resynced when the user reconnects.
-     */
+    _cancel_members_fetch(conv);
+    matrix_statestore_forget_room(conn->state_store, conv->name);
 
     state_table = matrix_room_get_state_table(conv);
     matrix_statetable_destroy(state_table);
@@ -1197,6 +1568,45 @@ void matrix_room_leave_chat(PurpleConversation *conv)
 }
 
 
+/**
+ * Leave a chat: notify the server that we are leaving, and (ultimately)
+ * free the memory structures
+ */
+void matrix_room_leave_chat(PurpleConversation *conv)
+{
+    MatrixConnectionData *conn;
+
+    conn = _get_connection_data_from_conversation(conv);
+
+    matrix_api_leave_room(conn, conv->name, NULL, NULL, NULL, NULL);
+
+    /* At this point, we have no confirmation that the 'leave' request will
+     * be successful (nor that it has even started), so it's questionable
+     * whether we can/should actually free all of the room state.
+     *
+     * On the other hand, we don't have any mechanism for telling purple that
+     * we haven't really left the room, and if the leave request does fail,
+     * we'll set the error flag on the connection, which will eventually
+     * result in pidgin flagging the connection as failed; things will
+     * hopefully then get resynced when the user reconnects.
+     */
+    _forget_room(conv);
+}
+
+
+void matrix_room_handle_leave(PurpleConversation *conv)
+{
+    PurpleConvChat *chat = PURPLE_CONV_CHAT(conv);
+
+    purple_debug_info("matrixprpl", "We are no longer in %s\n", conv->name);
+    _forget_room(conv);
+
+    /* the window stays open, marked as left; closing it won't call
+     * chat_leave */
+    serv_got_chat_left(conv->account->gc, purple_conv_chat_get_id(chat));
+}
+
+
 /* *****************************************************************************
  *
  * Tracking of member additions/removals.
@@ -1362,6 +1772,11 @@ gchar *matrix_room_displayname_to_userid(struct _PurpleConversation *conv,
     }
 
     g_list_free(members);
+
+    /* perhaps we haven't heard of them yet. Next time, we might have. */
+    if(result == NULL)
+        _fetch_members(conv);
+
     return result;
 }
 
@@ -1434,6 +1849,11 @@ void matrix_room_send_typing(PurpleConversation *conv, gboolean typing)
     PurpleConnection *pc = conv->account->gc;
 
     acct = purple_connection_get_protocol_data(pc);
+
+    /* the user is paying attention to this room, so make sure they can see
+     * (and tab-complete) everyone in it */
+    if(typing)
+        _fetch_members(conv);
     
     // Don't check callbacks as it's inconsequential whether typing notifications go through
     matrix_api_typing(acct, conv->name, typing, 25000,
@@ -1453,6 +1873,8 @@ void matrix_room_send_message(PurpleConversation *conv, const gchar *message)
     gchar *message_to_send, *message_dup;
     GData *image_attribs;
 
+    _set_flags(conv, _get_flags(conv) | PURPLE_CONV_FLAG_IN_USE);
+
     /* Matrix doesn't have messages that have both images and text in, so
      * we have to split this message if it has an image.
      */
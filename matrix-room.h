@@ -54,6 +54,25 @@ struct _PurpleConversation *matrix_room_create_conversation(
  */
 void matrix_room_leave_chat(struct _PurpleConversation *conv);
 
+/**
+ * We are no longer in a room, because we left it from another client or were
+ * kicked or banned: forget its state, and tell libpurple we have left the
+ * chat. Joining the room again gets a new conversation from
+ * matrix_room_create_conversation.
+ */
+void matrix_room_handle_leave(struct _PurpleConversation *conv);
+
+
+/**
+ * Check whether the user is using a room: that is, whether the UI has a
+ * window for it which has had the focus (or which the user has sent a
+ * message from) since the conversation was opened.
+ *
+ * We create a conversation for every room we hear about, so having a
+ * conversation isn't enough.
+ */
+gboolean matrix_room_is_in_use(struct _PurpleConversation *conv);
+
 
 /**
  * Update the state table on a room, based on a received state event
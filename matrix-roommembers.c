@@ -27,6 +27,7 @@
 
 #include "debug.h"
 
+#include "matrix-intern.h"
 #include "matrix-json.h"
 
 /******************************************************************************
@@ -35,7 +36,9 @@
  */
 
 typedef struct _MatrixRoomMember {
-    gchar *user_id;
+    /* interned (see matrix-intern.h); also used as the key in the member
+     * table */
+    const gchar *user_id;
 
     /* the current room membership */
     int membership;
@@ -72,7 +75,7 @@ static int _parse_membership(const gchar *membership)
 static MatrixRoomMember *_new_member(const gchar *userid)
 {
     MatrixRoomMember *mem = g_new0(MatrixRoomMember, 1);
-    mem->user_id = g_strdup(userid);
+    mem->user_id = matrix_intern(userid);
     return mem;
 }
 
@@ -81,7 +84,7 @@ static void _free_member(MatrixRoomMember *member)
     g_assert(member != NULL);
     if(member->on_delete)
         member->on_delete(member);
-    g_free(member->user_id);
+    matrix_unintern(member->user_id);
     member->user_id = NULL;
     g_free(member);
 }
@@ -151,7 +154,7 @@ MatrixRoomMemberTable *matrix_roommembers_new_table()
 {
     MatrixRoomMemberTable *table;
     table = g_new0(MatrixRoomMemberTable, 1);
-    table -> hash_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+    table -> hash_table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
                            (GDestroyNotify) _free_member);
     return table;
 }
@@ -197,7 +200,7 @@ void matrix_roommembers_update_member(MatrixRoomMemberTable *table,
 
     if(!member) {
         member = _new_member(member_user_id);
-        g_hash_table_insert(table->hash_table, g_strdup(member_user_id),
+        g_hash_table_insert(table->hash_table, (gpointer)member->user_id,
                 member);
     }
     member->membership = new_membership_val;
@@ -0,0 +1,315 @@
+/*
+ * matrix-statestore.c: On-disk snapshot of room state
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "matrix-statestore.h"
+
+#include <string.h>
+#include <sqlite3.h>
+
+/* json-glib */
+#include <json-glib/json-glib.h>
+
+/* libpurple */
+#include "account.h"
+#include "debug.h"
+#include "util.h"
+
+/* libmatrix */
+#include "matrix-json.h"
+
+struct _MatrixStateStore {
+    sqlite3 *db;
+
+    /* statement for matrix_statestore_store_event; we use it a lot, so we
+     * keep it prepared */
+    sqlite3_stmt *store_stmt;
+
+    /* number of nested batches we are in */
+    guint batch_depth;
+
+    /* set if a nested batch was rolled back */
+    gboolean batch_failed;
+};
+
+
+static const char *_schema =
+        "CREATE TABLE IF NOT EXISTS room_state ("
+        "    room_id TEXT NOT NULL, event_type TEXT NOT NULL,"
+        "    state_key TEXT NOT NULL, event TEXT NOT NULL,"
+        "    PRIMARY KEY (room_id, event_type, state_key));"
+        "CREATE TABLE IF NOT EXISTS sync_token ("
+        "    id INTEGER PRIMARY KEY CHECK (id = 0), next_batch TEXT);";
+
+
+/**
+ * Run a statement which returns no results
+ */
+static gboolean _exec(MatrixStateStore *store, const char *sql)
+{
+    char *errmsg = NULL;
+
+    if(sqlite3_exec(store->db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+        purple_debug_warning("matrixprpl", "state store: '%s' failed: %s\n",
+                sql, errmsg);
+        sqlite3_free(errmsg);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+MatrixStateStore *matrix_statestore_open(PurpleAccount *account,
+        const gchar *user_id)
+{
+    MatrixStateStore *store;
+    gchar *filename, *full_path;
+    int ret;
+
+    filename = g_strdup_printf("matrix-state-%s-%s.db", user_id,
+            purple_account_get_username(account));
+    full_path = g_strdup_printf("%s/%s", purple_user_dir(),
+            purple_escape_filename(filename));
+    g_free(filename);
+
+    store = g_new0(MatrixStateStore, 1);
+    ret = sqlite3_open(full_path, &store->db);
+    purple_debug_info("matrixprpl", "Opened state store at %s %d\n",
+            full_path, ret);
+    g_free(full_path);
+
+    /* we don't need durability: if we lose the last few commits, we just
+     * sync from an earlier point */
+    if(ret != SQLITE_OK || !_exec(store, _schema) ||
+            !_exec(store, "PRAGMA synchronous = NORMAL")) {
+        purple_debug_warning("matrixprpl", "Unable to open state store\n");
+        matrix_statestore_close(store);
+        return NULL;
+    }
+
+    ret = sqlite3_prepare_v2(store->db,
+            "INSERT OR REPLACE INTO room_state "
+            "(room_id, event_type, state_key, event) VALUES (?, ?, ?, ?)",
+            -1, &store->store_stmt, NULL);
+    if(ret != SQLITE_OK) {
+        purple_debug_warning("matrixprpl", "Unable to prepare state store: "
+                "%s\n", sqlite3_errmsg(store->db));
+        matrix_statestore_close(store);
+        return NULL;
+    }
+
+    return store;
+}
+
+
+void matrix_statestore_close(MatrixStateStore *store)
+{
+    if(store == NULL)
+        return;
+
+    if(store->store_stmt != NULL)
+        sqlite3_finalize(store->store_stmt);
+
+    /* closing the database throws away any open transaction */
+    sqlite3_close(store->db);
+    g_free(store);
+}
+
+
+void matrix_statestore_begin(MatrixStateStore *store)
+{
+    if(store == NULL)
+        return;
+
+    if(store->batch_depth++ == 0) {
+        store->batch_failed = FALSE;
+        if(!_exec(store, "BEGIN"))
+            store->batch_failed = TRUE;
+    }
+}
+
+
+void matrix_statestore_commit(MatrixStateStore *store,
+        const gchar *next_batch)
+{
+    sqlite3_stmt *stmt;
+
+    if(store == NULL)
+        return;
+
+    g_assert(store->batch_depth > 0);
+
+    if(next_batch != NULL && !store->batch_failed) {
+        if(sqlite3_prepare_v2(store->db,
+                "INSERT OR REPLACE INTO sync_token (id, next_batch) "
+                "VALUES (0, ?)", -1, &stmt, NULL) != SQLITE_OK) {
+            store->batch_failed = TRUE;
+        } else {
+            sqlite3_bind_text(stmt, 1, next_batch, -1, SQLITE_STATIC);
+            if(sqlite3_step(stmt) != SQLITE_DONE)
+                store->batch_failed = TRUE;
+            sqlite3_finalize(stmt);
+        }
+    }
+
+    if(--store->batch_depth > 0)
+        return;
+
+    if(store->batch_failed) {
+        purple_debug_warning("matrixprpl",
+                "state store: abandoning changes after an error\n");
+        _exec(store, "ROLLBACK");
+    } else {
+        _exec(store, "COMMIT");
+    }
+}
+
+
+void matrix_statestore_rollback(MatrixStateStore *store)
+{
+    if(store == NULL)
+        return;
+
+    g_assert(store->batch_depth > 0);
+
+    store->batch_failed = TRUE;
+    if(--store->batch_depth == 0)
+        _exec(store, "ROLLBACK");
+}
+
+
+void matrix_statestore_store_event(MatrixStateStore *store,
+        const gchar *room_id, JsonObject *event)
+{
+    const gchar *event_type, *state_key;
+    JsonNode *node;
+    JsonGenerator *generator;
+    gchar *json;
+
+    if(store == NULL || (store->batch_depth > 0 && store->batch_failed))
+        return;
+
+    event_type = matrix_json_object_get_string_member(event, "type");
+    state_key = matrix_json_object_get_string_member(event, "state_key");
+    if(event_type == NULL || state_key == NULL)
+        return;
+
+    node = json_node_new(JSON_NODE_OBJECT);
+    json_node_set_object(node, event);
+    generator = json_generator_new();
+    json_generator_set_root(generator, node);
+    json = json_generator_to_data(generator, NULL);
+    g_object_unref(G_OBJECT(generator));
+    json_node_free(node);
+
+    sqlite3_bind_text(store->store_stmt, 1, room_id, -1, SQLITE_STATIC);
+    sqlite3_bind_text(store->store_stmt, 2, event_type, -1, SQLITE_STATIC);
+    sqlite3_bind_text(store->store_stmt, 3, state_key, -1, SQLITE_STATIC);
+    sqlite3_bind_text(store->store_stmt, 4, json, -1, SQLITE_STATIC);
+    if(sqlite3_step(store->store_stmt) != SQLITE_DONE) {
+        purple_debug_warning("matrixprpl", "state store: unable to store "
+                "%s event in %s: %s\n", event_type, room_id,
+                sqlite3_errmsg(store->db));
+        if(store->batch_depth > 0)
+            store->batch_failed = TRUE;
+    }
+    sqlite3_reset(store->store_stmt);
+    sqlite3_clear_bindings(store->store_stmt);
+    g_free(json);
+}
+
+
+void matrix_statestore_forget_room(MatrixStateStore *store,
+        const gchar *room_id)
+{
+    sqlite3_stmt *stmt;
+
+    if(store == NULL)
+        return;
+
+    if(sqlite3_prepare_v2(store->db, "DELETE FROM room_state WHERE room_id=?",
+            -1, &stmt, NULL) != SQLITE_OK) {
+        purple_debug_warning("matrixprpl", "state store: unable to forget "
+                "%s: %s\n", room_id, sqlite3_errmsg(store->db));
+        return;
+    }
+    sqlite3_bind_text(stmt, 1, room_id, -1, SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+}
+
+
+gchar *matrix_statestore_get_next_batch(MatrixStateStore *store)
+{
+    sqlite3_stmt *stmt;
+    gchar *next_batch = NULL;
+
+    if(store == NULL)
+        return NULL;
+
+    if(sqlite3_prepare_v2(store->db,
+            "SELECT next_batch FROM sync_token WHERE id=0", -1, &stmt,
+            NULL) != SQLITE_OK)
+        return NULL;
+
+    if(sqlite3_step(stmt) == SQLITE_ROW)
+        next_batch = g_strdup((const gchar *)sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+    return next_batch;
+}
+
+
+gboolean matrix_statestore_foreach_event(MatrixStateStore *store,
+        MatrixStateStoreEventCallback callback, gpointer user_data)
+{
+    sqlite3_stmt *stmt;
+    int ret;
+
+    if(store == NULL)
+        return FALSE;
+
+    if(sqlite3_prepare_v2(store->db,
+            "SELECT room_id, event FROM room_state ORDER BY room_id", -1,
+            &stmt, NULL) != SQLITE_OK) {
+        purple_debug_warning("matrixprpl", "state store: unable to read: "
+                "%s\n", sqlite3_errmsg(store->db));
+        return FALSE;
+    }
+
+    while((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const gchar *room_id = (const gchar *)sqlite3_column_text(stmt, 0);
+        const gchar *event = (const gchar *)sqlite3_column_text(stmt, 1);
+        JsonParser *parser;
+        JsonObject *event_obj;
+
+        parser = matrix_json_parse_span(event, sqlite3_column_bytes(stmt, 1));
+        if(parser == NULL)
+            continue;
+        event_obj = matrix_json_node_get_object(json_parser_get_root(parser));
+        if(event_obj != NULL)
+            callback(room_id, event_obj, user_data);
+        g_object_unref(parser);
+    }
+    sqlite3_finalize(stmt);
+
+    if(ret != SQLITE_DONE) {
+        purple_debug_warning("matrixprpl", "state store: unable to read: "
+                "%s\n", sqlite3_errmsg(store->db));
+        return FALSE;
+    }
+    return TRUE;
+}
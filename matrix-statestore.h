@@ -0,0 +1,125 @@
+/*
+ * matrix-statestore.h: On-disk snapshot of room state
+ *
+ * We keep a copy of the state events for each of our rooms in an sqlite
+ * database, along with the sync token they correspond to. That means that
+ * when pidgin starts, we can rebuild our rooms from disk and carry on with an
+ * incremental sync, rather than asking the server for the full state of every
+ * room.
+ *
+ * The member table for each room is not stored separately: it is rebuilt
+ * from the m.room.member events when the state is replayed.
+ *
+ * All of these functions accept a NULL store, and do nothing in that case;
+ * if the database can't be opened we simply do without it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef MATRIX_STATESTORE_H_
+#define MATRIX_STATESTORE_H_
+
+#include <glib.h>
+
+struct _PurpleAccount;
+struct _JsonObject;
+
+typedef struct _MatrixStateStore MatrixStateStore;
+
+
+/**
+ * Open (creating if necessary) the state store for an account
+ *
+ * @param account   the account
+ * @param user_id   our matrix user id on that account
+ *
+ * @returns the store, or NULL if it could not be opened
+ */
+MatrixStateStore *matrix_statestore_open(struct _PurpleAccount *account,
+        const gchar *user_id);
+
+
+/**
+ * Close the state store, discarding any uncommitted changes
+ */
+void matrix_statestore_close(MatrixStateStore *store);
+
+
+/**
+ * Start a batch of changes. Batches may be nested; nothing is written until
+ * the outermost batch is committed.
+ */
+void matrix_statestore_begin(MatrixStateStore *store);
+
+
+/**
+ * Finish a batch of changes.
+ *
+ * @param next_batch   if non-NULL, the sync token which the stored state now
+ *                     corresponds to
+ */
+void matrix_statestore_commit(MatrixStateStore *store,
+        const gchar *next_batch);
+
+
+/**
+ * Abandon a batch of changes. If this is a nested batch, the outermost batch
+ * will be abandoned too.
+ */
+void matrix_statestore_rollback(MatrixStateStore *store);
+
+
+/**
+ * Record a state event for a room, replacing any previous event with the
+ * same type and state key
+ */
+void matrix_statestore_store_event(MatrixStateStore *store,
+        const gchar *room_id, struct _JsonObject *event);
+
+
+/**
+ * Forget everything we know about a room (for instance, because we have left
+ * it)
+ */
+void matrix_statestore_forget_room(MatrixStateStore *store,
+        const gchar *room_id);
+
+
+/**
+ * Get the sync token which the stored state corresponds to
+ *
+ * @returns a string which should be freed, or NULL if there is no snapshot
+ */
+gchar *matrix_statestore_get_next_batch(MatrixStateStore *store);
+
+
+/**
+ * The type of a function which can be passed into
+ * matrix_statestore_foreach_event
+ */
+typedef void (*MatrixStateStoreEventCallback)(const gchar *room_id,
+        struct _JsonObject *event, gpointer user_data);
+
+
+/**
+ * Call a function for each stored state event. All of the events for a room
+ * are delivered together.
+ *
+ * @returns FALSE if the store could not be read
+ */
+gboolean matrix_statestore_foreach_event(MatrixStateStore *store,
+        MatrixStateStoreEventCallback callback, gpointer user_data);
+
+#endif /* MATRIX_STATESTORE_H_ */
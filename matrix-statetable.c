@@ -25,6 +25,7 @@
 #include "debug.h"
 
 #include "matrix-event.h"
+#include "matrix-intern.h"
 #include "matrix-json.h"
 
 
@@ -33,7 +34,8 @@
  */
 MatrixRoomStateEventTable *matrix_statetable_new()
 {
-    return g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+    return g_hash_table_new_full(g_str_hash, g_str_equal,
+            (GDestroyNotify) matrix_unintern,
             (GDestroyNotify) g_hash_table_destroy);
 }
 
@@ -97,13 +99,16 @@ void matrix_statetable_update(MatrixRoomStateEventTable *state_table,
     }
 
     event = matrix_event_new(event_type, json_content_obj);
-    event -> sender = g_strdup(sender);
+    event -> sender = matrix_intern(sender);
 
     state_table_entry = g_hash_table_lookup(state_table, event_type);
     if(state_table_entry == NULL) {
+        /* most state keys are user ids (or empty), so we intern them too */
         state_table_entry = g_hash_table_new_full(g_str_hash, g_str_equal,
-                g_free, (GDestroyNotify)matrix_event_free);
-        g_hash_table_insert(state_table, g_strdup(event_type),
+                (GDestroyNotify)matrix_unintern,
+                (GDestroyNotify)matrix_event_free);
+        g_hash_table_insert(state_table,
+                (gpointer)matrix_intern_ref(event->event_type),
                 state_table_entry);
         old_event = NULL;
     } else {
@@ -115,7 +120,8 @@ void matrix_statetable_update(MatrixRoomStateEventTable *state_table,
         callback(event_type, state_key, old_event, event, user_data);
     }
 
-    g_hash_table_insert(state_table_entry, g_strdup(state_key), event);
+    g_hash_table_insert(state_table_entry, (gpointer)matrix_intern(state_key),
+            event);
 }
 
 
@@ -16,7 +16,11 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
  */
 
+#include <stdio.h>
 #include <string.h>
+#ifdef __linux__
+#include <unistd.h>
+#endif
 #include "matrix-sync.h"
 
 /* json-glib */
@@ -33,27 +37,27 @@
 #include "matrix-event.h"
 #include "matrix-json.h"
 #include "matrix-room.h"
+#include "matrix-statestore.h"
 #include "matrix-statetable.h"
 
 
 typedef struct _RoomEventParserData {
     PurpleConversation *conv;
     gboolean state_events;
+
+    /* if non-NULL, we add the delivery latency (ms) of each timeline event */
+    GArray *latencies;
 } RoomEventParserData;
 
 
 /**
  * handle an event for a room
  *
- * @param state        the complete state array (unused)
- * @param state_id     position within the array (unused)
- * @param state_entry  the event id to be handled
- * @param user_data    a RoomEventParserData
+ * @param event        the event to be handled
+ * @param data         what to do with it
  */
-static void _parse_room_event(JsonArray *event_array, guint event_idx,
-        JsonNode *event, gpointer user_data)
+static void _parse_room_event(JsonNode *event, RoomEventParserData *data)
 {
-    RoomEventParserData *data = user_data;
     PurpleConversation *conv = data->conv;
     JsonObject *json_event_obj;
 
@@ -63,6 +67,15 @@ static void _parse_room_event(JsonArray *event_array, guint event_idx,
         return;
     }
 
+    /* keep a copy of the room state, so we don't need to ask for it next
+     * time (ephemeral events don't have a state_key, so don't get stored) */
+    if(json_object_has_member(json_event_obj, "state_key")) {
+        MatrixConnectionData *conn = purple_connection_get_protocol_data(
+                conv->account->gc);
+        matrix_statestore_store_event(conn->state_store, conv->name,
+                json_event_obj);
+    }
+
     if(data->state_events) {
         matrix_room_handle_state_event(conv, json_event_obj);
     } else {
@@ -71,21 +84,17 @@ static void _parse_room_event(JsonArray *event_array, guint event_idx,
             matrix_room_complete_state_update(conv, TRUE);
         } else {
             matrix_room_handle_timeline_event(conv, json_event_obj);
+            if(data->latencies != NULL) {
+                gint64 ts = matrix_json_object_get_int_member(json_event_obj,
+                        "origin_server_ts");
+                gint64 latency = g_get_real_time() / 1000 - ts;
+                if(ts > 0)
+                    g_array_append_val(data->latencies, latency);
+            }
         }
     }
 }
 
-/**
- * parse the list of events in a sync response
- */
-static void _parse_room_event_array(PurpleConversation *conv, JsonArray *events,
-        gboolean state_events)
-{
-    RoomEventParserData data = {conv, state_events};
-    json_array_foreach_element(events, _parse_room_event, &data);
-}
-
-
 static PurpleChat *_ensure_blist_entry(PurpleAccount *acct,
         const gchar *room_id)
 {
@@ -122,53 +131,384 @@ static PurpleChat *_ensure_blist_entry(PurpleAccount *acct,
 }
 
 
+/******************************************************************************
+ *
+ * Applying a sync response.
+ *
+ * A big sync response can take seconds to handle, and we don't want to block
+ * the UI for that long. So we split the work into small units (a room, or an
+ * event within a room), and do them from an idle callback, a slice at a time,
+ * stopping each slice when it has run for longer than the configured budget.
+ */
+
+/*
+ * How deep we index the sync response (see matrix_json_tape_new). This is
+ * just deep enough to reach the arrays of events in each room
+ * (rooms.join.<room>.timeline.events for /sync, rooms.<room>.timeline for
+ * sliding sync); the events themselves are only parsed as we come to them.
+ */
+#define SYNC_TAPE_DEPTH 6
+#define SLIDING_SYNC_TAPE_DEPTH 4
+
 /**
- * handle a joined room within the sync response
+ * A list of events from the sync response, which we are part-way through
+ * handling
  */
-static void matrix_sync_room(const gchar *room_id,
-        JsonObject *room_data, PurpleConnection *pc,
-        gboolean handle_timeline)
+typedef struct _SyncEventCursor {
+    gboolean started;
+    guint next;         /* index of the next event in the tape */
+} SyncEventCursor;
+
+
+/**
+ * Find the events in one of the sections of the sync response (eg, a room's
+ * "state"), ready to handle them. The section is normally an object with an
+ * "events" member, but sliding sync gives us the array directly.
+ */
+static void _event_cursor_init(SyncEventCursor *cursor,
+        const MatrixJsonTape *tape, guint section)
 {
-    JsonObject *state_object, *timeline_object, *ephemeral_object;
-    JsonArray *state_array, *timeline_array, *ephemeral_array;
+    if(!matrix_json_tape_is_array(tape, section))
+        section = matrix_json_tape_find_member(tape, section, "events");
+
+    cursor->started = TRUE;
+    cursor->next = matrix_json_tape_first_child(tape, section);
+}
+
+
+static void _event_cursor_clear(SyncEventCursor *cursor)
+{
+    cursor->started = FALSE;
+    cursor->next = MATRIX_JSON_TAPE_NONE;
+}
+
+
+/* the sections of a joined room in the sync response which we handle */
+typedef struct _SyncRoomSections {
+    guint state, ephemeral, timeline;
+} SyncRoomSections;
+
+
+/* how far we have got with a joined room */
+typedef enum {
+    SYNC_ROOM_NOT_STARTED,
+    SYNC_ROOM_STATE,
+    SYNC_ROOM_EPHEMERAL,
+    SYNC_ROOM_TIMELINE,
+} SyncRoomStage;
+
+/**
+ * A joined room from the sync response. We handle the state and ephemeral
+ * events first, and keep hold of this until it is time to handle the
+ * timeline.
+ */
+typedef struct _MatrixSyncRoom {
+    gchar *room_id;
+    SyncRoomStage stage;
+
+    /* the room's entry in rooms.join, within the tape */
+    guint index;
+    SyncRoomSections sections;
+
+    /* NULL before we start, or if the conversation has gone away */
     PurpleConversation *conv;
-    gboolean initial_sync = FALSE;
+    gboolean initial_sync;
+
+    /* the events we are working through */
+    SyncEventCursor cursor;
+} MatrixSyncRoom;
+
+
+static void _sync_room_free(MatrixSyncRoom *room)
+{
+    g_free(room->room_id);
+    g_free(room);
+}
+
+
+/* the parts of a sync response which we handle once all the rooms are
+ * done, as indexes in the tape */
+typedef struct _SyncResponseSections {
+    guint to_device, key_counts;
+} SyncResponseSections;
+
 
-    /* ensure we have an entry in the buddy list for this room. */
-    _ensure_blist_entry(pc->account, room_id);
+/* how far we have got with the sync response as a whole */
+typedef enum {
+    SYNC_PHASE_ROOM_STATE,
+    SYNC_PHASE_INVITES,
+    SYNC_PHASE_TO_DEVICE,
+    SYNC_PHASE_TIMELINE,
+    SYNC_PHASE_DONE,
+} SyncPhase;
 
-    conv = purple_find_conversation_with_account(
-            PURPLE_CONV_TYPE_CHAT, room_id, pc->account);
+static const gchar *_sync_stat_names[MATRIX_SYNC_STAT_COUNT] = {
+    "index", "parse", "state", "ephemeral", "invites", "to_device",
+    "timeline"
+};
 
-    if(conv == NULL) {
-        conv = matrix_room_create_conversation(pc, room_id);
-        initial_sync = TRUE;
+/* an invite from the sync response */
+typedef struct _SyncInvite {
+    gchar *room_id;
+    const gchar *data;
+    gsize data_len;
+} SyncInvite;
+
+struct _MatrixSyncJob {
+    PurpleConnection *pc;
+
+    /* our copy of the response; everything below points into this */
+    gchar *body;
+    gsize body_len;
+    MatrixJsonTape *tape;
+    SyncResponseSections sections;
+
+    /* used to parse each event in turn */
+    JsonParser *parser;
+    gchar *next_batch;
+    gchar *to_device_batch; /* sliding sync only */
+
+    SyncPhase phase;
+    GQueue rooms;            /* MatrixSyncRoom: waiting for state */
+    GQueue timeline_rooms;   /* MatrixSyncRoom: waiting for timeline */
+    GQueue invites;          /* SyncInvite */
+    GQueue left_rooms;       /* gchar *: ids of rooms we are no longer in */
+    SyncEventCursor to_device;
+
+    /* the idle callback, if we have one */
+    guint idle_id;
+
+    /* time budget for each slice */
+    gint64 slice_budget_us;
+    gint64 slice_deadline;
+    guint slice_units;
+
+    /* statistics */
+    gint64 received_time;   /* when matrix_sync_new was called */
+    gint64 run_time;        /* when matrix_sync_run was called */
+    GArray *latencies;      /* delivery latency of each message, in ms */
+    MatrixSyncStat stat;    /* what we are currently spending time on */
+    gint64 stat_mark;       /* when we started on it */
+    MatrixSyncStats stats;
+
+    MatrixSyncAppliedCallback callback;
+    gpointer user_data;
+};
+
+
+/**
+ * Get the resident set size of the process as it stands now (rather than
+ * the peak, which would hide anything we give back), or 0 if we can't
+ */
+static glong _get_rss_kb()
+{
+    glong rss_kb = 0;
+#ifdef __linux__
+    FILE *statm = fopen("/proc/self/statm", "r");
+    long pages;
+
+    if(statm == NULL)
+        return 0;
+    if(fscanf(statm, "%*s %ld", &pages) == 1)
+        rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+    fclose(statm);
+#endif
+    return rss_kb;
+}
+
+
+/**
+ * Charge the time since the last switch to what we were doing then, and
+ * start charging to something else.
+ */
+static void _sync_stat_switch(MatrixSyncJob *job, MatrixSyncStat stat)
+{
+    gint64 now = g_get_monotonic_time();
+
+    job->stats.us[job->stat] += now - job->stat_mark;
+    job->stat_mark = now;
+    job->stat = stat;
+}
+
+
+/**
+ * Record the RSS at the end of one of the phases
+ */
+static void _sync_stat_phase_done(MatrixSyncJob *job, MatrixSyncStat stat)
+{
+    job->stats.rss_kb[stat] = _get_rss_kb();
+}
+
+
+/**
+ * Parse part of the response: an event, usually. Whichever phase we are in,
+ * the time this takes is charged to parsing.
+ *
+ * @returns the parsed value, which lasts until the next call, or NULL if it
+ *    could not be parsed
+ */
+static JsonNode *_sync_parse_span(MatrixSyncJob *job, const gchar *span,
+        gsize span_len)
+{
+    MatrixSyncStat phase = job->stat;
+    JsonNode *node;
+
+    _sync_stat_switch(job, MATRIX_SYNC_STAT_PARSE);
+    node = matrix_json_parser_load_span(job->parser, span, span_len);
+    _sync_stat_switch(job, phase);
+    return node;
+}
+
+
+/**
+ * Check whether we've used up the time for this slice. We always allow at
+ * least one unit of work per slice, so that we make progress however small
+ * the budget.
+ */
+static gboolean _slice_expired(MatrixSyncJob *job)
+{
+    if(job->slice_units++ == 0)
+        return FALSE;
+    return g_get_monotonic_time() >= job->slice_deadline;
+}
+
+
+/**
+ * Parse the next event from a cursor
+ *
+ * @returns the event, which lasts until the next call, or NULL if it could
+ *    not be parsed
+ */
+static JsonNode *_event_cursor_next(MatrixSyncJob *job,
+        SyncEventCursor *cursor)
+{
+    const gchar *event;
+    gsize event_len;
+
+    event = matrix_json_tape_get_span(job->tape, cursor->next, &event_len);
+    cursor->next = matrix_json_tape_next_sibling(job->tape, cursor->next);
+    return _sync_parse_span(job, event, event_len);
+}
+
+
+/**
+ * Handle the events from a cursor until we run out of them or of time
+ *
+ * @returns TRUE if we handled all the events
+ */
+static gboolean _apply_room_events(MatrixSyncJob *job,
+        PurpleConversation *conv, SyncEventCursor *cursor,
+        gboolean state_events)
+{
+    RoomEventParserData data = {conv, state_events, job->latencies};
+    JsonNode *event;
+
+    while(cursor->next != MATRIX_JSON_TAPE_NONE) {
+        if(_slice_expired(job))
+            return FALSE;
+        event = _event_cursor_next(job, cursor);
+        if(event != NULL)
+            _parse_room_event(event, &data);
     }
+    _event_cursor_clear(cursor);
+    return TRUE;
+}
+
+
+/**
+ * handle the state and ephemeral events for a joined room within the sync
+ * response
+ *
+ * @returns TRUE if we have finished with them, FALSE if we ran out of time
+ */
+static gboolean _sync_room_state(MatrixSyncJob *job, MatrixSyncRoom *room)
+{
+    PurpleConnection *pc = job->pc;
+
+    _sync_stat_switch(job, room->stage == SYNC_ROOM_EPHEMERAL ?
+            MATRIX_SYNC_STAT_EPHEMERAL : MATRIX_SYNC_STAT_STATE);
+
+    if(room->stage == SYNC_ROOM_NOT_STARTED) {
+        if(_slice_expired(job))
+            return FALSE;
+
+        purple_debug_info("matrixprpl", "Syncing room %s\n", room->room_id);
 
-    /* parse the room state */
-    state_object = matrix_json_object_get_object_member(room_data, "state");
-    state_array = matrix_json_object_get_array_member(state_object, "events");
-    if(state_array != NULL)
-        _parse_room_event_array(conv, state_array, TRUE);
+        /* for sliding sync, the state is in "required_state", and there is
+         * no "ephemeral" */
+        room->sections.state = matrix_json_tape_find_member(job->tape,
+                room->index, "state");
+        if(room->sections.state == MATRIX_JSON_TAPE_NONE)
+            room->sections.state = matrix_json_tape_find_member(job->tape,
+                    room->index, "required_state");
+        room->sections.ephemeral = matrix_json_tape_find_member(job->tape,
+                room->index, "ephemeral");
+        room->sections.timeline = matrix_json_tape_find_member(job->tape,
+                room->index, "timeline");
 
-    matrix_room_complete_state_update(conv, !initial_sync);
+        /* ensure we have an entry in the buddy list for this room. */
+        _ensure_blist_entry(pc->account, room->room_id);
+
+        room->conv = purple_find_conversation_with_account(
+                PURPLE_CONV_TYPE_CHAT, room->room_id, pc->account);
+
+        /* a window left open after we left the room is joined again */
+        if(room->conv == NULL ||
+                purple_conv_chat_has_left(PURPLE_CONV_CHAT(room->conv))) {
+            room->conv = matrix_room_create_conversation(pc, room->room_id);
+            room->initial_sync = TRUE;
+        }
+
+        _event_cursor_init(&room->cursor, job->tape, room->sections.state);
+        room->stage = SYNC_ROOM_STATE;
+    }
+
+    if(room->conv == NULL) {
+        /* the conversation has been closed under our feet */
+        return TRUE;
+    }
+
+    if(room->stage == SYNC_ROOM_STATE) {
+        /* parse the room state */
+        if(!_apply_room_events(job, room->conv, &room->cursor, TRUE))
+            return FALSE;
+
+        matrix_room_complete_state_update(room->conv, !room->initial_sync);
+
+        _event_cursor_init(&room->cursor, job->tape,
+                room->sections.ephemeral);
+        room->stage = SYNC_ROOM_EPHEMERAL;
+        _sync_stat_switch(job, MATRIX_SYNC_STAT_EPHEMERAL);
+    }
 
     /* parse the ephemeral events */
     /* (uses the state table to track the state of who is typing and who isn't) */
-    ephemeral_object = matrix_json_object_get_object_member(room_data, "ephemeral");
-    ephemeral_array = matrix_json_object_get_array_member(ephemeral_object, "events");
-    if(ephemeral_array != NULL)
-        _parse_room_event_array(conv, ephemeral_array, TRUE);
+    if(!_apply_room_events(job, room->conv, &room->cursor, TRUE))
+        return FALSE;
 
-    if (handle_timeline) {
-        /* parse the timeline events */
-        timeline_object = matrix_json_object_get_object_member(
-                    room_data, "timeline");
-        timeline_array = matrix_json_object_get_array_member(
-                    timeline_object, "events");
-        if(timeline_array != NULL)
-            _parse_room_event_array(conv, timeline_array, FALSE);
+    room->stage = SYNC_ROOM_TIMELINE;
+    return TRUE;
+}
+
+
+/**
+ * handle the timeline events for a joined room
+ *
+ * @returns TRUE if we have finished with them, FALSE if we ran out of time
+ */
+static gboolean _sync_room_timeline(MatrixSyncJob *job, MatrixSyncRoom *room)
+{
+    if(room->conv == NULL)
+        return TRUE;
+
+    _sync_stat_switch(job, MATRIX_SYNC_STAT_TIMELINE);
+    if(!room->cursor.started) {
+        if(_slice_expired(job))
+            return FALSE;
+        _event_cursor_init(&room->cursor, job->tape, room->sections.timeline);
     }
+
+    return _apply_room_events(job, room->conv, &room->cursor, FALSE);
 }
 
 
@@ -214,7 +554,7 @@ static void _raise_invite_request(PurpleConnection *pc,
 static void _handle_invite(const gchar *room_id,
         JsonObject *invite_data, PurpleConnection *pc)
 {
-    JsonObject *invite_state_object;
+    JsonNode *invite_state;
     JsonArray *events;
     MatrixRoomStateEventTable *state_table;
     MatrixConnectionData *conn;
@@ -224,10 +564,13 @@ static void _handle_invite(const gchar *room_id,
 
     conn = purple_connection_get_protocol_data(pc);
 
-    invite_state_object = matrix_json_object_get_object_member(invite_data,
-            "invite_state");
-    events = matrix_json_object_get_array_member(invite_state_object,
-            "events");
+    /* sliding sync gives us the events directly; /sync wraps them in an
+     * object */
+    invite_state = matrix_json_object_get_member(invite_data, "invite_state");
+    events = matrix_json_node_get_array(invite_state);
+    if(events == NULL)
+        events = matrix_json_object_get_array_member(
+                matrix_json_node_get_object(invite_state), "events");
 
     if(events == NULL) {
         purple_debug_warning("prplmatrix", "no events array in invite event\n");
@@ -262,92 +605,702 @@ static void _handle_invite(const gchar *room_id,
 
 
 /**
- * handle the results of the sync request
+ * get a string from the tape; returns NULL if the value is missing or not a
+ * string, or else a string which should be freed
  */
-void matrix_sync_parse(PurpleConnection *pc, JsonNode *body,
-        const gchar **next_batch)
-{
-    JsonObject *rootObj;
-    JsonObject *rooms;
-    JsonObject *joined_rooms, *invited_rooms;
-    GList *room_ids, *elem;
-
-    rootObj = matrix_json_node_get_object(body);
-    *next_batch = matrix_json_object_get_string_member(rootObj, "next_batch");
-    rooms = matrix_json_object_get_object_member(rootObj, "rooms");
-
-    joined_rooms = matrix_json_object_get_object_member(rooms, "join");
-    if(joined_rooms != NULL) {
-        room_ids = json_object_get_members(joined_rooms);
-        for(elem = room_ids; elem; elem = elem->next) {
-            const gchar *room_id = elem->data;
-            JsonObject *room_data = matrix_json_object_get_object_member(
-                    joined_rooms, room_id);
-            purple_debug_info("matrixprpl", "Syncing room (1)%s\n", room_id);
-            matrix_sync_room(room_id, room_data, pc, FALSE);
+static gchar *_tape_get_string(const MatrixJsonTape *tape, guint index)
+{
+    const gchar *value;
+    gsize value_len;
+
+    value = matrix_json_tape_get_span(tape, index, &value_len);
+    return matrix_json_span_get_string(value, value_len);
+}
+
+
+/**
+ * queue up a joined room from the sync response
+ */
+static void _find_joined_room(MatrixSyncJob *job, guint index)
+{
+    MatrixSyncRoom *room;
+    gchar *room_id = matrix_json_tape_get_name(job->tape, index);
+
+    if(room_id == NULL)
+        return;
+    room = g_new0(MatrixSyncRoom, 1);
+    room->room_id = room_id;
+    room->index = index;
+    g_queue_push_tail(&job->rooms, room);
+}
+
+
+/**
+ * queue up a room invite from the sync response
+ */
+static void _find_invited_room(MatrixSyncJob *job, guint index)
+{
+    SyncInvite *invite;
+    gchar *room_id = matrix_json_tape_get_name(job->tape, index);
+
+    if(room_id == NULL)
+        return;
+    invite = g_new0(SyncInvite, 1);
+    invite->room_id = room_id;
+    invite->data = matrix_json_tape_get_span(job->tape, index,
+            &invite->data_len);
+    g_queue_push_tail(&job->invites, invite);
+}
+
+
+/**
+ * queue up a room from rooms.leave: one we left, or were kicked or banned
+ * from, perhaps from another client, or an invite we rejected
+ */
+static void _find_left_room(MatrixSyncJob *job, guint index)
+{
+    gchar *room_id = matrix_json_tape_get_name(job->tape, index);
+
+    if(room_id != NULL)
+        g_queue_push_tail(&job->left_rooms, room_id);
+}
+
+
+static void _sync_invite_free(SyncInvite *invite)
+{
+    g_free(invite->room_id);
+    g_free(invite);
+}
+
+
+/**
+ * handle a room invite from the sync response
+ */
+static void _sync_invite(MatrixSyncJob *job, SyncInvite *invite)
+{
+    JsonObject *room_data;
+
+    room_data = matrix_json_node_get_object(_sync_parse_span(job,
+            invite->data, invite->data_len));
+    if(room_data != NULL) {
+        purple_debug_info("matrixprpl", "Invite to room %s\n",
+                invite->room_id);
+        _handle_invite(invite->room_id, room_data, job->pc);
+    }
+}
+
+
+static void _forget_conversation(gpointer data, gpointer user_data)
+{
+    MatrixSyncRoom *room = data;
+    if(room->conv == user_data)
+        room->conv = NULL;
+}
+
+
+/**
+ * handle a room we are no longer in: without this, its state would stay on
+ * disk, and the room would come back each time we start
+ */
+static void _sync_left_room(MatrixSyncJob *job, const gchar *room_id)
+{
+    PurpleConnection *pc = job->pc;
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    PurpleConversation *conv;
+
+    purple_debug_info("matrixprpl", "Left room %s\n", room_id);
+    conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_CHAT,
+            room_id, pc->account);
+    if(conv == NULL || purple_conv_chat_has_left(PURPLE_CONV_CHAT(conv))) {
+        matrix_statestore_forget_room(conn->state_store, room_id);
+        return;
+    }
+
+    /* in case the room was in rooms.join too */
+    g_queue_foreach(&job->timeline_rooms, _forget_conversation, conv);
+    matrix_room_handle_leave(conv);
+}
+
+
+/**
+ * handle a to_device event from the sync response
+ */
+static void _handle_to_device_event(PurpleConnection *pc,
+        JsonObject *event_obj)
+{
+    const gchar *event_type;
+    event_type = matrix_json_object_get_string_member(event_obj,
+                                                       "type");
+    purple_debug_info("matrixprpl",  "to_device: Got %s from %s\n",
+            event_type,
+            matrix_json_object_get_string_member(event_obj, "sender"));
+    if (!g_strcmp0(event_type, "m.room.encrypted")) {
+        matrix_e2e_decrypt_d2d(pc, event_obj);
+    }
+}
+
+
+/**
+ * handle the to_device events and one-time key counts from the sync response
+ *
+ * @returns TRUE if we have finished with them, FALSE if we ran out of time
+ */
+static gboolean _sync_to_device(MatrixSyncJob *job)
+{
+    SyncEventCursor *cursor = &job->to_device;
+    JsonObject *event_obj;
+    const gchar *key_counts;
+    gsize key_counts_len;
+
+    _sync_stat_switch(job, MATRIX_SYNC_STAT_TO_DEVICE);
+    if(!cursor->started)
+        _event_cursor_init(cursor, job->tape, job->sections.to_device);
+
+    while (cursor->next != MATRIX_JSON_TAPE_NONE) {
+        if(_slice_expired(job))
+            return FALSE;
+        event_obj = matrix_json_node_get_object(
+                _event_cursor_next(job, cursor));
+        if(event_obj != NULL)
+            _handle_to_device_event(job->pc, event_obj);
+    }
+
+    key_counts = matrix_json_tape_get_span(job->tape,
+            job->sections.key_counts, &key_counts_len);
+    if (key_counts != NULL) {
+        JsonObject *dev_key_counts = matrix_json_node_get_object(
+                _sync_parse_span(job, key_counts, key_counts_len));
+        if (dev_key_counts) {
+            matrix_e2e_handle_sync_key_counts(job->pc, dev_key_counts,
+                    FALSE);
         }
-        g_list_free(room_ids);
     }
+    return TRUE;
+}
+
 
+/**
+ * Do as much of the work for a sync as we can in this slice
+ *
+ * @returns TRUE if we have finished
+ */
+static gboolean _sync_job_run(MatrixSyncJob *job)
+{
+    MatrixSyncRoom *room;
+    SyncInvite *invite;
+    gchar *room_id;
+
+    if(job->phase == SYNC_PHASE_ROOM_STATE) {
+        while((room = g_queue_peek_head(&job->rooms)) != NULL) {
+            if(!_sync_room_state(job, room))
+                return FALSE;
+            g_queue_pop_head(&job->rooms);
+            if(room->conv == NULL)
+                _sync_room_free(room);
+            else
+                g_queue_push_tail(&job->timeline_rooms, room);
+        }
+        _sync_stat_phase_done(job, MATRIX_SYNC_STAT_STATE);
+        _sync_stat_phase_done(job, MATRIX_SYNC_STAT_EPHEMERAL);
+        job->phase = SYNC_PHASE_INVITES;
+    }
 
-    invited_rooms = matrix_json_object_get_object_member(rooms, "invite");
-    if(invited_rooms != NULL) {
-        room_ids = json_object_get_members(invited_rooms);
-        for(elem = room_ids; elem; elem = elem->next) {
-            const gchar *room_id = elem->data;
-            JsonObject *room_data = matrix_json_object_get_object_member(
-                    invited_rooms, room_id);
-            purple_debug_info("matrixprpl", "Invite to room %s\n", room_id);
-            _handle_invite(room_id, room_data, pc);
+    if(job->phase == SYNC_PHASE_INVITES) {
+        _sync_stat_switch(job, MATRIX_SYNC_STAT_INVITES);
+        while((room_id = g_queue_peek_head(&job->left_rooms)) != NULL) {
+            if(_slice_expired(job))
+                return FALSE;
+            g_queue_pop_head(&job->left_rooms);
+            _sync_left_room(job, room_id);
+            g_free(room_id);
+        }
+        while((invite = g_queue_peek_head(&job->invites)) != NULL) {
+            if(_slice_expired(job))
+                return FALSE;
+            g_queue_pop_head(&job->invites);
+            _sync_invite(job, invite);
+            _sync_invite_free(invite);
         }
-        g_list_free(room_ids);
+        _sync_stat_phase_done(job, MATRIX_SYNC_STAT_INVITES);
+        job->phase = SYNC_PHASE_TO_DEVICE;
     }
 
     /* Handle d2d messages so we can create any e2e sessions needed
      * We need to do this after we created rooms/conversations, but before
      * we handle timeline events that we might need to decrypt.
      */
-    JsonObject *to_device = matrix_json_object_get_object_member(rootObj,
-                               "to_device");
-    if (to_device) {
-        JsonArray *events = matrix_json_object_get_array_member(to_device,
-                                                               "events");
-        guint i = 0;
-        JsonNode *device_event;
-        while (device_event = matrix_json_array_get_element(events, i++),
-               device_event) {
-            JsonObject *event_obj = matrix_json_node_get_object(device_event);
-            const gchar *event_type;
-            event_type = matrix_json_object_get_string_member(event_obj,
-                                                               "type");
-            purple_debug_info("matrixprpl",  "to_device: Got %s from %s\n",
-                    event_type,
-                    matrix_json_object_get_string_member(event_obj, "sender"));
-            if (!strcmp(event_type, "m.room.encrypted")) {
-                matrix_e2e_decrypt_d2d(pc, event_obj);
-            } else {
-            }
+    if(job->phase == SYNC_PHASE_TO_DEVICE) {
+        if(!_sync_to_device(job))
+            return FALSE;
+        _sync_stat_phase_done(job, MATRIX_SYNC_STAT_TO_DEVICE);
+        job->phase = SYNC_PHASE_TIMELINE;
+    }
 
+    /* Now handle the timeline events for the rooms we found earlier */
+    if(job->phase == SYNC_PHASE_TIMELINE) {
+        while((room = g_queue_peek_head(&job->timeline_rooms)) != NULL) {
+            if(!_sync_room_timeline(job, room))
+                return FALSE;
+            g_queue_pop_head(&job->timeline_rooms);
+            _sync_room_free(room);
         }
+        _sync_stat_phase_done(job, MATRIX_SYNC_STAT_TIMELINE);
+        job->phase = SYNC_PHASE_DONE;
     }
 
-    JsonObject *dev_key_counts = matrix_json_object_get_object_member(rootObj,
-                                    "device_one_time_keys_count");
-    if (dev_key_counts) {
-	      matrix_e2e_handle_sync_key_counts(pc, dev_key_counts, FALSE);
+    return TRUE;
+}
+
+
+/**
+ * Called by libpurple when a conversation is about to be destroyed; make sure
+ * we don't try to use it
+ */
+static void _on_deleting_conversation(PurpleConversation *conv,
+        MatrixSyncJob *job)
+{
+    g_queue_foreach(&job->rooms, _forget_conversation, conv);
+    g_queue_foreach(&job->timeline_rooms, _forget_conversation, conv);
+}
+
+
+static void _sync_job_free(MatrixSyncJob *job)
+{
+    if(job->idle_id != 0)
+        g_source_remove(job->idle_id);
+    purple_signals_disconnect_by_handle(job);
+
+    g_queue_foreach(&job->rooms, (GFunc)_sync_room_free, NULL);
+    g_queue_clear(&job->rooms);
+    g_queue_foreach(&job->timeline_rooms, (GFunc)_sync_room_free, NULL);
+    g_queue_clear(&job->timeline_rooms);
+    g_queue_foreach(&job->invites, (GFunc)_sync_invite_free, NULL);
+    g_queue_clear(&job->invites);
+    g_queue_foreach(&job->left_rooms, (GFunc)g_free, NULL);
+    g_queue_clear(&job->left_rooms);
+
+    g_object_unref(job->parser);
+    matrix_json_tape_free(job->tape);
+    g_array_free(job->latencies, TRUE);
+    g_free(job->next_batch);
+    g_free(job->to_device_batch);
+    g_free(job->body);
+    g_free(job);
+}
+
+
+static gint _compare_latency(gconstpointer a, gconstpointer b)
+{
+    gint64 la = *(const gint64 *)a, lb = *(const gint64 *)b;
+    return la < lb ? -1 : la > lb;
+}
+
+/**
+ * Log how long a sync took to apply, and how long it took the messages in it
+ * to reach us. The latter is measured against origin_server_ts, so is only
+ * as good as the clocks on the server and here.
+ */
+static void _log_sync_stats(MatrixSyncJob *job)
+{
+    gint64 now = g_get_monotonic_time();
+    GArray *latencies = job->latencies;
+    GString *phases = g_string_new(NULL);
+    MatrixSyncStat stat;
+
+    purple_debug_info("matrixprpl", "sync applied in %u slices: queued %"
+            G_GINT64_FORMAT " ms, applied in %" G_GINT64_FORMAT " ms; "
+            "longest slice %" G_GINT64_FORMAT " us\n",
+            job->stats.slices, (job->run_time - job->received_time) / 1000,
+            (now - job->run_time) / 1000, job->stats.max_slice_us);
+
+    /* where the time went, and the RSS of the whole process at the end of
+     * each phase (parsing is spread through the others, so has none) */
+    for(stat = 0; stat < MATRIX_SYNC_STAT_COUNT; stat++) {
+        g_string_append_printf(phases, " %s %" G_GINT64_FORMAT " us",
+                _sync_stat_names[stat], job->stats.us[stat]);
+        if(job->stats.rss_kb[stat] != 0)
+            g_string_append_printf(phases, " (%ld kB)",
+                    job->stats.rss_kb[stat]);
     }
+    purple_debug_info("matrixprpl", "sync phases:%s\n", phases->str);
+    g_string_free(phases, TRUE);
 
-    /* Now go round the rooms again getting the timeline events */
-    if (joined_rooms != NULL) {
-        room_ids = json_object_get_members(joined_rooms);
-        for(elem = room_ids; elem; elem = elem->next) {
-            const gchar *room_id = elem->data;
-            JsonObject *room_data = matrix_json_object_get_object_member(
-                    joined_rooms, room_id);
-            purple_debug_info("matrixprpl", "Syncing room (2) %s\n", room_id);
-            matrix_sync_room(room_id, room_data, pc, TRUE);
-        }
-        g_list_free(room_ids);
+    if(latencies->len > 0) {
+        g_array_sort(latencies, _compare_latency);
+        purple_debug_info("matrixprpl", "%u messages delivered; latency "
+                "median %" G_GINT64_FORMAT " ms, max %" G_GINT64_FORMAT
+                " ms\n", latencies->len,
+                g_array_index(latencies, gint64, latencies->len / 2),
+                g_array_index(latencies, gint64, latencies->len - 1));
+    }
+}
+
+
+/**
+ * idle callback which does a slice of work on the sync
+ */
+static gboolean _sync_job_slice(gpointer user_data)
+{
+    MatrixSyncJob *job = user_data;
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(job->pc);
+    gint64 slice_start, slice_us;
+    gboolean done;
+
+    slice_start = g_get_monotonic_time();
+    job->slice_deadline = slice_start + job->slice_budget_us;
+    job->slice_units = 0;
+    job->stat_mark = slice_start;
+
+    done = _sync_job_run(job);
+
+    _sync_stat_switch(job, job->stat);
+    slice_us = g_get_monotonic_time() - slice_start;
+    job->stats.slices++;
+    if(slice_us > job->stats.max_slice_us)
+        job->stats.max_slice_us = slice_us;
+
+    if(!done)
+        return TRUE;
+
+    job->idle_id = 0;
+    /* without a sync token, the stored state couldn't be matched up with
+     * the point to resume from, so don't keep it */
+    if(job->next_batch == NULL)
+        matrix_statestore_rollback(conn->state_store);
+    else
+        matrix_statestore_commit(conn->state_store, job->next_batch);
+
+    _log_sync_stats(job);
+
+    job->callback(job->pc, job->next_batch, job->user_data);
+    _sync_job_free(job);
+    return FALSE;
+}
+
+
+static MatrixSyncJob *_sync_job_new(PurpleConnection *pc, gchar *body,
+        gsize body_len, MatrixSyncAppliedCallback callback,
+        gpointer user_data)
+{
+    MatrixSyncJob *job;
+
+    job = g_new0(MatrixSyncJob, 1);
+    job->pc = pc;
+    job->body = body;
+    job->body_len = body_len;
+    job->callback = callback;
+    job->user_data = user_data;
+    job->received_time = g_get_monotonic_time();
+    job->latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+    job->parser = json_parser_new();
+    job->sections.to_device = MATRIX_JSON_TAPE_NONE;
+    job->sections.key_counts = MATRIX_JSON_TAPE_NONE;
+    _event_cursor_clear(&job->to_device);
+    g_queue_init(&job->rooms);
+    g_queue_init(&job->timeline_rooms);
+    g_queue_init(&job->invites);
+    g_queue_init(&job->left_rooms);
+    return job;
+}
+
+
+/* record how long it took to index the response */
+static void _sync_job_indexed(MatrixSyncJob *job)
+{
+    job->stats.us[MATRIX_SYNC_STAT_INDEX] = g_get_monotonic_time() -
+            job->received_time;
+    _sync_stat_phase_done(job, MATRIX_SYNC_STAT_INDEX);
+}
+
+
+/**
+ * handle the results of the sync request
+ *
+ * We never build a tree for the whole response, which can run to hundreds of
+ * megabytes on a big account. Instead we index the raw text in one pass, as
+ * far down as the lists of events, and then parse each event as we come to
+ * it, so that the memory we need is bounded by the size of the biggest
+ * event.
+ */
+MatrixSyncJob *matrix_sync_new(PurpleConnection *pc, gchar *body,
+        gsize body_len, MatrixSyncAppliedCallback callback,
+        gpointer user_data)
+{
+    MatrixSyncJob *job;
+    MatrixJsonTape *tape;
+    guint rooms, index;
+
+    job = _sync_job_new(pc, body, body_len, callback, user_data);
+
+    job->tape = tape = matrix_json_tape_new(job->body, job->body_len,
+            SYNC_TAPE_DEPTH);
+    if(tape == NULL) {
+        purple_debug_warning("matrixprpl", "unable to parse sync response\n");
+        _sync_job_free(job);
+        return NULL;
     }
+
+    job->next_batch = _tape_get_string(tape,
+            matrix_json_tape_find_member(tape, 0, "next_batch"));
+    job->sections.to_device = matrix_json_tape_find_member(tape, 0,
+            "to_device");
+    job->sections.key_counts = matrix_json_tape_find_member(tape, 0,
+            "device_one_time_keys_count");
+
+    rooms = matrix_json_tape_find_member(tape, 0, "rooms");
+    for(index = matrix_json_tape_first_child(tape,
+                matrix_json_tape_find_member(tape, rooms, "join"));
+            index != MATRIX_JSON_TAPE_NONE;
+            index = matrix_json_tape_next_sibling(tape, index))
+        _find_joined_room(job, index);
+
+    for(index = matrix_json_tape_first_child(tape,
+                matrix_json_tape_find_member(tape, rooms, "invite"));
+            index != MATRIX_JSON_TAPE_NONE;
+            index = matrix_json_tape_next_sibling(tape, index))
+        _find_invited_room(job, index);
+
+    for(index = matrix_json_tape_first_child(tape,
+                matrix_json_tape_find_member(tape, rooms, "leave"));
+            index != MATRIX_JSON_TAPE_NONE;
+            index = matrix_json_tape_next_sibling(tape, index))
+        _find_left_room(job, index);
+
+    _sync_job_indexed(job);
+    return job;
 }
 
+
+MatrixSyncJob *matrix_sync_new_sliding(PurpleConnection *pc,
+        gchar *body, gsize body_len, const gchar *list_name,
+        MatrixSyncAppliedCallback callback, gpointer user_data)
+{
+    MatrixSyncJob *job;
+    MatrixJsonTape *tape;
+    guint list, count, extensions, to_device, e2ee, index;
+    const gchar *count_value;
+    gsize count_len;
+
+    job = _sync_job_new(pc, body, body_len, callback, user_data);
+
+    job->tape = tape = matrix_json_tape_new(job->body, job->body_len,
+            SLIDING_SYNC_TAPE_DEPTH);
+    if(tape == NULL) {
+        purple_debug_warning("matrixprpl",
+                "unable to parse sliding sync response\n");
+        _sync_job_free(job);
+        return NULL;
+    }
+
+    job->next_batch = _tape_get_string(tape,
+            matrix_json_tape_find_member(tape, 0, "pos"));
+
+    list = matrix_json_tape_find_member(tape,
+            matrix_json_tape_find_member(tape, 0, "lists"), list_name);
+    count = matrix_json_tape_find_member(tape, list, "count");
+    count_value = matrix_json_tape_get_span(tape, count, &count_len);
+    if(count_value != NULL) {
+        purple_debug_info("matrixprpl", "sliding sync: %.*s rooms in list\n",
+                (int)count_len, count_value);
+    }
+
+    /* rooms we are invited to come in the same map as the others, but with
+     * an invite_state */
+    for(index = matrix_json_tape_first_child(tape,
+                matrix_json_tape_find_member(tape, 0, "rooms"));
+            index != MATRIX_JSON_TAPE_NONE;
+            index = matrix_json_tape_next_sibling(tape, index)) {
+        if(matrix_json_tape_find_member(tape, index, "invite_state") !=
+                MATRIX_JSON_TAPE_NONE)
+            _find_invited_room(job, index);
+        else
+            _find_joined_room(job, index);
+    }
+
+    /* the to-device events and key counts come in extensions, with their own
+     * sync token for the to-device messages */
+    extensions = matrix_json_tape_find_member(tape, 0, "extensions");
+    to_device = matrix_json_tape_find_member(tape, extensions, "to_device");
+    job->sections.to_device = to_device;
+    job->to_device_batch = _tape_get_string(tape,
+            matrix_json_tape_find_member(tape, to_device, "next_batch"));
+
+    e2ee = matrix_json_tape_find_member(tape, extensions, "e2ee");
+    job->sections.key_counts = matrix_json_tape_find_member(tape, e2ee,
+            "device_one_time_keys_count");
+
+    _sync_job_indexed(job);
+    return job;
+}
+
+
+const gchar *matrix_sync_get_next_batch(MatrixSyncJob *job)
+{
+    return job->next_batch;
+}
+
+
+const gchar *matrix_sync_get_to_device_batch(MatrixSyncJob *job)
+{
+    return job->to_device_batch;
+}
+
+
+const MatrixSyncStats *matrix_sync_get_stats(MatrixSyncJob *job)
+{
+    return &job->stats;
+}
+
+
+const gchar *matrix_sync_stat_name(MatrixSyncStat stat)
+{
+    return _sync_stat_names[stat];
+}
+
+
+void matrix_sync_run(MatrixSyncJob *job)
+{
+    PurpleConnection *pc = job->pc;
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+
+    g_assert(job->idle_id == 0 && job->run_time == 0);
+
+    purple_signal_connect(purple_conversations_get_handle(),
+            "deleting-conversation", job,
+            PURPLE_CALLBACK(_on_deleting_conversation), job);
+
+    /* the state changes from this sync get written to disk together, so that
+     * the copy there always matches a sync token */
+    matrix_statestore_begin(conn->state_store);
+
+    job->slice_budget_us = 1000 * purple_account_get_int(pc->account,
+            PRPL_ACCOUNT_OPT_SYNC_SLICE_MS, DEFAULT_SYNC_SLICE_MS);
+    job->run_time = g_get_monotonic_time();
+    job->stat = MATRIX_SYNC_STAT_STATE;
+    job->idle_id = g_idle_add(_sync_job_slice, job);
+}
+
+
+void matrix_sync_cancel(MatrixSyncJob *job)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(job->pc);
+
+    if(job->run_time != 0) {
+        purple_debug_info("matrixprpl", "abandoning sync after %u slices\n",
+                job->stats.slices);
+        matrix_statestore_rollback(conn->state_store);
+    }
+    _sync_job_free(job);
+}
+
+
+typedef struct _SyncRestoreData {
+    PurpleConnection *pc;
+    gchar *room_id;          /* the room whose events are in events */
+    GPtrArray *events;       /* JsonObject *: its state events */
+    gboolean member;         /* whether we were in it, as far as we know */
+    GSList *left_rooms;      /* gchar *: ids of rooms we were not in */
+    guint rooms;
+} SyncRestoreData;
+
+/**
+ * restore the room whose events we have collected, unless we were no longer
+ * in it: we might have missed the sync which said so, and it would otherwise
+ * come back each time we start
+ */
+static void _restore_room(SyncRestoreData *data)
+{
+    PurpleConnection *pc = data->pc;
+    PurpleConversation *conv;
+    guint i;
+
+    if(data->room_id == NULL)
+        return;
+
+    if(!data->member) {
+        purple_debug_info("matrixprpl", "not restoring %s: we have left it\n",
+                data->room_id);
+        data->left_rooms = g_slist_prepend(data->left_rooms, data->room_id);
+    } else {
+        _ensure_blist_entry(pc->account, data->room_id);
+        conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_CHAT,
+                data->room_id, pc->account);
+        if(conv == NULL || purple_conv_chat_has_left(PURPLE_CONV_CHAT(conv)))
+            conv = matrix_room_create_conversation(pc, data->room_id);
+        for(i = 0; i < data->events->len; i++)
+            matrix_room_handle_state_event(conv,
+                    g_ptr_array_index(data->events, i));
+        matrix_room_complete_state_update(conv, FALSE);
+        data->rooms++;
+        g_free(data->room_id);
+    }
+
+    data->room_id = NULL;
+    g_ptr_array_set_size(data->events, 0);
+}
+
+
+static void _restore_room_state_event(const gchar *room_id,
+        JsonObject *event, gpointer user_data)
+{
+    SyncRestoreData *data = user_data;
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(data->pc);
+    const gchar *membership;
+
+    if(data->room_id == NULL || strcmp(data->room_id, room_id) != 0) {
+        _restore_room(data);
+        data->room_id = g_strdup(room_id);
+        data->member = TRUE;
+    }
+
+    if(g_strcmp0(matrix_json_object_get_string_member(event, "type"),
+                "m.room.member") == 0 &&
+            g_strcmp0(matrix_json_object_get_string_member(event,
+                    "state_key"), conn->user_id) == 0) {
+        membership = matrix_json_object_get_string_member(
+                matrix_json_object_get_object_member(event, "content"),
+                "membership");
+        data->member = g_strcmp0(membership, "join") == 0 ||
+                g_strcmp0(membership, "invite") == 0;
+    }
+
+    g_ptr_array_add(data->events, json_object_ref(event));
+}
+
+
+gchar *matrix_sync_restore(PurpleConnection *pc)
+{
+    MatrixConnectionData *conn = purple_connection_get_protocol_data(pc);
+    SyncRestoreData data = {pc, NULL, NULL, FALSE, NULL, 0};
+    gchar *next_batch;
+    GSList *elem;
+
+    next_batch = matrix_statestore_get_next_batch(conn->state_store);
+    if(next_batch == NULL)
+        return NULL;
+
+    data.events = g_ptr_array_new_with_free_func(
+            (GDestroyNotify)json_object_unref);
+    if(!matrix_statestore_foreach_event(conn->state_store,
+            _restore_room_state_event, &data)) {
+        purple_debug_info("matrixprpl",
+                "unable to read the rooms from disk\n");
+        g_free(next_batch);
+        next_batch = NULL;
+    }
+    _restore_room(&data);
+    g_ptr_array_free(data.events, TRUE);
+
+    if(data.left_rooms != NULL) {
+        matrix_statestore_begin(conn->state_store);
+        for(elem = data.left_rooms; elem != NULL; elem = elem->next)
+            matrix_statestore_forget_room(conn->state_store, elem->data);
+        matrix_statestore_commit(conn->state_store, NULL);
+        g_slist_free_full(data.left_rooms, g_free);
+    }
+
+    if(next_batch != NULL)
+        purple_debug_info("matrixprpl", "restored %u rooms from disk at %s\n",
+                data.rooms, next_batch);
+    return next_batch;
+}
@@ -23,18 +23,146 @@
 #include <glib.h>
 
 struct _PurpleConnection;
-struct _JsonNode;
+
+typedef struct _MatrixSyncJob MatrixSyncJob;
+
+/**
+ * The things we spend time on while applying a sync response. The events
+ * are parsed as each phase comes to them, and the time for that is counted
+ * separately.
+ */
+typedef enum {
+    MATRIX_SYNC_STAT_INDEX,     /* indexing the response (matrix_sync_new) */
+    MATRIX_SYNC_STAT_PARSE,     /* parsing the events */
+    MATRIX_SYNC_STAT_STATE,
+    MATRIX_SYNC_STAT_EPHEMERAL,
+    MATRIX_SYNC_STAT_INVITES,
+    MATRIX_SYNC_STAT_TO_DEVICE,
+    MATRIX_SYNC_STAT_TIMELINE,
+    MATRIX_SYNC_STAT_COUNT
+} MatrixSyncStat;
+
+/**
+ * How applying a sync response went
+ */
+typedef struct _MatrixSyncStats {
+    guint slices;
+    gint64 max_slice_us;
+    gint64 us[MATRIX_SYNC_STAT_COUNT];    /* time spent on each */
+
+    /* resident set size of the process at the end of each phase; 0 for
+     * parsing, which isn't a phase of its own, or if we can't find out */
+    glong rss_kb[MATRIX_SYNC_STAT_COUNT];
+} MatrixSyncStats;
 
 /**
- * Parse and dispatch the results of a /sync call.
+ * The type of function called when a sync response has been applied
+ *
+ * @param pc          Connection to which the sync relates
+ * @param next_batch  The next_batch setting, for the next sync (or NULL if
+ *                    none was found)
+ * @param user_data   The user_data passed to matrix_sync_start
+ */
+typedef void (*MatrixSyncAppliedCallback)(struct _PurpleConnection *pc,
+        const gchar *next_batch, gpointer user_data);
+
+
+/**
+ * Prepare to apply the results of a /sync call.
+ *
+ * This just picks out the parts of the response we are interested in; call
+ * matrix_sync_run to actually apply it.
  *
  * @param pc          Connection to which these results relate
- * @param body        Body of /sync response
- * @param next_batch  Returns a pointer to the next_batch setting, for the next
- *                    sync (or NULL if none was found)
+ * @param body        Raw body of /sync response, nul-terminated. We take
+ *                       ownership of this (even on failure), since it can be
+ *                       very large and we don't want to copy it.
+ * @param body_len    Length of body
+ * @param callback    Function to call when the response has been applied
+ * @param user_data   Opaque data to be passed to the callback
+ *
+ * @returns a handle for the job, or NULL if the response could not be parsed
+ */
+MatrixSyncJob *matrix_sync_new(struct _PurpleConnection *pc,
+        gchar *body, gsize body_len,
+        MatrixSyncAppliedCallback callback, gpointer user_data);
+
+
+/**
+ * Prepare to apply the results of a sliding sync request (see
+ * matrix_api_sliding_sync). The rooms in the response are applied in the same
+ * way as those from /sync.
+ *
+ * @param pc          Connection to which these results relate
+ * @param body        Raw body of the response, nul-terminated. We take
+ *                       ownership of this, as for matrix_sync_new.
+ * @param body_len    Length of body
+ * @param list_name   The name of the room list in our request
+ * @param callback    Function to call when the response has been applied
+ * @param user_data   Opaque data to be passed to the callback
+ *
+ * @returns a handle for the job, or NULL if the response could not be parsed.
+ *    Its next_batch is the 'pos' token from the response.
+ */
+MatrixSyncJob *matrix_sync_new_sliding(struct _PurpleConnection *pc,
+        gchar *body, gsize body_len, const gchar *list_name,
+        MatrixSyncAppliedCallback callback, gpointer user_data);
+
+
+/**
+ * Get the next_batch token from a sync response
+ *
+ * @returns the token, or NULL if there wasn't one. Owned by the job.
+ */
+const gchar *matrix_sync_get_next_batch(MatrixSyncJob *job);
+
+
+/**
+ * Get the token for the to_device extension from a sliding sync response
+ *
+ * @returns the token, or NULL if there wasn't one (including for all /sync
+ *    responses). Owned by the job.
+ */
+const gchar *matrix_sync_get_to_device_batch(MatrixSyncJob *job);
+
+
+/**
+ * Get the statistics for a sync response, so far. They are final once the
+ * callback is called (and can be read until it returns).
+ */
+const MatrixSyncStats *matrix_sync_get_stats(MatrixSyncJob *job);
+
+/**
+ * Get the name of one of the things counted in MatrixSyncStats, for logging
+ */
+const gchar *matrix_sync_stat_name(MatrixSyncStat stat);
+
+/**
+ * Start applying a sync response.
+ *
+ * The work is done in slices from the main loop, so that we don't block the
+ * UI; the callback is called when it is complete, after which the job is
+ * freed.
+ */
+void matrix_sync_run(MatrixSyncJob *job);
+
+
+/**
+ * Abandon a sync response, whether or not we have started applying it. The
+ * callback will not be called.
+ */
+void matrix_sync_cancel(MatrixSyncJob *job);
+
+
+/**
+ * Rebuild our rooms from the copy of their state on disk
+ *
+ * @param pc          Connection to restore rooms for
+ *
+ * @returns the sync token to carry on syncing from, which should be freed by
+ *    the caller; or NULL if there was no usable copy
  */
-void matrix_sync_parse(struct _PurpleConnection *pc, struct _JsonNode *body,
-        const gchar **next_batch);
+gchar *matrix_sync_restore(struct _PurpleConnection *pc);
 
 
 #endif /* MATRIX_SYNC_H_ */
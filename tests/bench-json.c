@@ -0,0 +1,194 @@
+/**
+ * bench-json.c: how fast JSON is scanned and written
+ *
+ *   bench-json [-d DEPTH] [-r REPEAT] [-k KEYS] [FILE...]
+ *
+ * Each FILE (a recorded /sync response, say) is indexed with
+ * matrix_json_tape_new to DEPTH (6 by default, as for /sync; use 4 for
+ * sliding sync), and checked with matrix_json_validate_text, REPEAT times
+ * (10 by default) with each way of scanning which this machine supports.
+ * We report the best run of each, in GB/s of input. g_utf8_validate is
+ * there too, for comparison.
+ *
+ * First, though, we time the canonical JSON which matrix_sign_json makes
+ * when we upload KEYS (100 by default) one-time keys: one object for each,
+ * written into the same buffer. The signing itself needs olm, which the
+ * benchmarks are built without.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+/* libmatrix */
+#include "matrix-json.h"
+
+#include "bench.h"
+
+#define MB (1024.0 * 1024.0)
+
+typedef enum {
+    BENCH_INDEX,
+    BENCH_VALIDATE,
+    BENCH_GLIB_VALIDATE
+} BenchJsonTask;
+
+static guint _depth = 6;
+static guint _repeat = 10;
+static guint _keys = 100;
+
+
+static void _usage(void)
+{
+    fprintf(stderr,
+            "usage: bench-json [-d DEPTH] [-r REPEAT] [-k KEYS] [FILE...]\n");
+    exit(2);
+}
+
+
+/* the best time for the task, in seconds */
+static gdouble _time(BenchJsonTask task, const gchar *json, gsize len)
+{
+    gint64 best_us = G_MAXINT64;
+    guint i;
+
+    for(i = 0; i < _repeat; i++) {
+        gint64 start = g_get_monotonic_time(), us;
+        gboolean ok = TRUE;
+
+        switch(task) {
+            case BENCH_INDEX: {
+                MatrixJsonTape *tape = matrix_json_tape_new(json, len,
+                        _depth);
+                ok = tape != NULL;
+                matrix_json_tape_free(tape);
+                break;
+            }
+            case BENCH_VALIDATE:
+                ok = matrix_json_validate_text(json, len);
+                break;
+            case BENCH_GLIB_VALIDATE:
+                ok = g_utf8_validate(json, len, NULL);
+                break;
+        }
+        us = g_get_monotonic_time() - start;
+        if(!ok) {
+            fprintf(stderr, "not valid JSON text\n");
+            exit(1);
+        }
+        best_us = MIN(best_us, us);
+    }
+    return MAX(best_us, 1) / 1e6;
+}
+
+
+static void _report(const gchar *what, gsize len, gdouble seconds)
+{
+    printf("  %-24s %8.2f ms %8.2f GB/s\n", what, seconds * 1000,
+            len / seconds / 1e9);
+}
+
+
+/* As _upload_one_time_keys does: an object for each key, made canonical by
+ * matrix_sign_json in a buffer which is kept between them */
+static void _bench_sign_keys(void)
+{
+    JsonObject **keys = g_new(JsonObject *, _keys);
+    GString *buf = g_string_sized_new(512);
+    gint64 best_us = G_MAXINT64;
+    gsize len = 0;
+    guint i, r;
+
+    for(i = 0; i < _keys; i++) {
+        /* a curve25519 key is 43 characters of unpadded base64 */
+        gchar *key = g_strdup_printf("%043u", g_random_int());
+
+        keys[i] = json_object_new();
+        json_object_set_string_member(keys[i], "key", key);
+        g_free(key);
+    }
+
+    for(r = 0; r < _repeat; r++) {
+        gint64 start = g_get_monotonic_time();
+
+        len = 0;
+        for(i = 0; i < _keys; i++) {
+            g_string_truncate(buf, 0);
+            matrix_canonical_json_append(buf, keys[i]);
+            len += buf->len;
+        }
+        best_us = MIN(best_us, g_get_monotonic_time() - start);
+    }
+
+    printf("canonical JSON of %u one-time keys, best of %u\n", _keys,
+            _repeat);
+    printf("  %-24s %8.3f ms %8.3f us/key\n", "matrix_canonical_json",
+            best_us / 1000.0, (gdouble)best_us / _keys);
+    printf("  %-24s %8" G_GSIZE_FORMAT " bytes\n", "written", len);
+
+    for(i = 0; i < _keys; i++)
+        json_object_unref(keys[i]);
+    g_free(keys);
+    g_string_free(buf, TRUE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt, i;
+
+    while((opt = getopt(argc, argv, "d:r:k:")) != -1) {
+        switch(opt) {
+            case 'd': _depth = atoi(optarg); break;
+            case 'r': _repeat = atoi(optarg); break;
+            case 'k': _keys = atoi(optarg); break;
+            default: _usage();
+        }
+    }
+    if(_repeat == 0 || _keys == 0)
+        _usage();
+
+    _bench_sign_keys();
+
+    for(i = optind; i < argc; i++) {
+        gsize len;
+        gchar *json = bench_read_file(argv[i], &len);
+        MatrixJsonScan scan;
+
+        printf("%s: %.1f MB, best of %u\n", argv[i], len / MB, _repeat);
+        for(scan = MATRIX_JSON_SCAN_SCALAR; scan < MATRIX_JSON_SCAN_COUNT;
+                scan++) {
+            gchar *what;
+
+            if(!matrix_json_set_scan(scan))
+                continue;
+            what = g_strdup_printf("index (%s)", matrix_json_scan_name(scan));
+            _report(what, len, _time(BENCH_INDEX, json, len));
+            g_free(what);
+            what = g_strdup_printf("validate (%s)",
+                    matrix_json_scan_name(scan));
+            _report(what, len, _time(BENCH_VALIDATE, json, len));
+            g_free(what);
+        }
+        _report("g_utf8_validate", len, _time(BENCH_GLIB_VALIDATE, json, len));
+        g_free(json);
+    }
+    return 0;
+}
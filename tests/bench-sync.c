@@ -0,0 +1,352 @@
+/**
+ * bench-sync.c: time applying a sync response, a phase at a time
+ *
+ *   bench-sync [-s LIST] [-b MS] [-u USER_ID] [-n] [-v] FILE
+ *   bench-sync -f [-b MS] [-u USER_ID] [-n] [-v] URL
+ *
+ * The response in FILE (recorded from a real server, or made up by
+ * fake-homeserver.py) is put through the same code as one from the network:
+ * matrix_sync_new to index it, then matrix_sync_run to apply it, a slice at a
+ * time from the main loop. What the plugin does with it goes to the stand-in
+ * libpurple in purple-stubs.c.
+ *
+ * With -f, the response is fetched from the /sync endpoint of the
+ * homeserver at URL (over plain HTTP: there is no SSL here) instead, as the
+ * plugin would, and we report what receiving it took first. For instance:
+ *
+ *   fake-homeserver.py run --rooms 4300 -- bench-sync -n -f {url}
+ *
+ *   -s LIST     FILE is a sliding sync response, and our rooms are in LIST
+ *   -b MS       time budget for each slice (see PRPL_ACCOUNT_OPT_SYNC_SLICE_MS)
+ *   -u USER_ID  who we are (for invites, and the names of rooms)
+ *   -n          don't keep a copy of the state on disk
+ *   -v          write the debug log to stderr
+ *
+ * We report the time spent on each phase, with the RSS of the process at the
+ * end of each, what was allocated from the heap while indexing and while
+ * applying, how much the strings shared by matrix-intern.c save, and how
+ * many times a room was looked up by name. Each run starts from nothing, so
+ * for figures which don't depend on what went before, give each file a run
+ * to itself.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+/* libpurple */
+#include "account.h"
+#include "connection.h"
+
+/* libmatrix */
+#include "libmatrix.h"
+#include "matrix-api.h"
+#include "matrix-connection.h"
+#include "matrix-intern.h"
+#include "matrix-statestore.h"
+#include "matrix-sync.h"
+
+#include "bench.h"
+#include "purple-stubs.h"
+
+#define MB (1024.0 * 1024.0)
+
+typedef struct _BenchRun {
+    MatrixSyncJob *job;
+    gboolean done;
+    gint64 start_time;
+    gint64 end_time;
+    MatrixSyncStats stats;
+    BenchHeap start_heap;
+    BenchHeap indexed_heap;
+    BenchHeap end_heap;
+    glong start_rss_kb;
+} BenchRun;
+
+/* receiving a response over HTTP; see -f */
+typedef struct _BenchFetch {
+    gboolean done;
+    gchar *body;
+    gsize body_len;
+    gint64 start_time;
+    gint64 end_time;
+    BenchHeap start_heap;
+    BenchHeap end_heap;
+} BenchFetch;
+
+
+static void _usage(void)
+{
+    fprintf(stderr, "usage: bench-sync [-s LIST] [-b MS] [-u USER_ID] "
+            "[-n] [-v] FILE\n"
+            "       bench-sync -f [-b MS] [-u USER_ID] [-n] [-v] URL\n");
+    exit(2);
+}
+
+
+static void _sync_applied(PurpleConnection *pc, const gchar *next_batch,
+        gpointer user_data)
+{
+    BenchRun *run = user_data;
+
+    run->end_time = g_get_monotonic_time();
+    bench_heap_get(&run->end_heap);
+    run->stats = *matrix_sync_get_stats(run->job);
+    run->done = TRUE;
+}
+
+
+static void _report(const gchar *filename, gsize len, BenchRun *run)
+{
+    MatrixSyncStat stat;
+    MatrixInternStats interned;
+    gint64 total_us = 0;
+
+    printf("%s: %.1f MB\n", filename, len / MB);
+    printf("  %-10s %10s %12s\n", "phase", "time (ms)", "RSS (MB)");
+    for(stat = 0; stat < MATRIX_SYNC_STAT_COUNT; stat++) {
+        printf("  %-10s %10.1f", matrix_sync_stat_name(stat),
+                run->stats.us[stat] / 1000.0);
+        if(run->stats.rss_kb[stat] != 0)
+            printf(" %12.1f", run->stats.rss_kb[stat] / 1024.0);
+        printf("\n");
+        total_us += run->stats.us[stat];
+    }
+    printf("  %-10s %10.1f %12.1f (%.1f before)\n", "total",
+            total_us / 1000.0, bench_rss_kb() / 1024.0,
+            run->start_rss_kb / 1024.0);
+    printf("  wall time %.1f ms, in %u slices; longest slice %.1f ms\n",
+            (run->end_time - run->start_time) / 1000.0, run->stats.slices,
+            run->stats.max_slice_us / 1000.0);
+
+    if(bench_heap_counted()) {
+        printf("  heap: indexing %" G_GUINT64_FORMAT " allocations, "
+                "%.1f MB; applying %" G_GUINT64_FORMAT " allocations, "
+                "%.1f MB\n",
+                run->indexed_heap.allocations - run->start_heap.allocations,
+                (run->indexed_heap.bytes_allocated -
+                        run->start_heap.bytes_allocated) / MB,
+                run->end_heap.allocations - run->indexed_heap.allocations,
+                (run->end_heap.bytes_allocated -
+                        run->indexed_heap.bytes_allocated) / MB);
+        printf("  heap: peak %.1f MB in use (%.1f MB before), "
+                "%.1f MB at the end\n",
+                run->end_heap.peak_bytes_in_use / MB,
+                run->start_heap.bytes_in_use / MB,
+                run->end_heap.bytes_in_use / MB);
+    }
+
+    /* what the shared strings save over a copy for each use (and each copy
+     * would cost a malloc header on top) */
+    matrix_intern_get_stats(&interned);
+    printf("  interned: %u strings, %.1f KB, for %" G_GUINT64_FORMAT
+            " uses, which would take %.1f KB as copies\n", interned.strings,
+            interned.string_bytes / 1024.0, interned.references,
+            interned.reference_bytes / 1024.0);
+
+    printf("  %u rooms, %u messages, %u chat lines, %u users added, "
+            "%u invites\n", purple_stubs_counts.conversations,
+            purple_stubs_counts.messages, purple_stubs_counts.chat_writes,
+            purple_stubs_counts.users_added, purple_stubs_counts.invites);
+
+    /* each joined room should be looked up a fixed number of times per
+     * sync, however many events it has: a second pass over rooms.join
+     * shows up here */
+    printf("  %u room lookups\n", purple_stubs_counts.room_lookups);
+}
+
+
+static void _fetch_complete(MatrixConnectionData *conn, gpointer user_data,
+        JsonNode *json_root, const char *body, size_t body_len,
+        const char *content_type)
+{
+    BenchFetch *fetch = user_data;
+
+    fetch->end_time = g_get_monotonic_time();
+    bench_heap_get(&fetch->end_heap);
+    if(body != NULL) {
+        /* as _sync_complete does */
+        fetch->body = matrix_api_steal_body(body);
+        fetch->body_len = body_len;
+    }
+    fetch->done = TRUE;
+}
+
+
+static void _fetch_error(MatrixConnectionData *conn, gpointer user_data,
+        const gchar *error_message)
+{
+    fprintf(stderr, "unable to fetch the sync: %s\n", error_message);
+    exit(1);
+}
+
+
+static void _fetch_bad_response(MatrixConnectionData *conn,
+        gpointer user_data, int http_response_code, JsonNode *json_root)
+{
+    fprintf(stderr, "unable to fetch the sync: status %d\n",
+            http_response_code);
+    exit(1);
+}
+
+
+/* Get an initial /sync response from the homeserver, and report what it
+ * took. Returns the body, which the caller should free. */
+static gchar *_fetch(MatrixConnectionData *conn, gsize *body_len)
+{
+    BenchFetch fetch = {FALSE};
+    gdouble body_mb;
+
+    bench_heap_reset_peak();
+    bench_heap_get(&fetch.start_heap);
+    fetch.start_time = g_get_monotonic_time();
+
+    matrix_api_sync(conn, NULL, NULL, 0, FALSE, _fetch_complete,
+            _fetch_error, _fetch_bad_response, &fetch);
+    while(!fetch.done)
+        g_main_context_iteration(NULL, TRUE);
+    if(fetch.body == NULL) {
+        fprintf(stderr, "%s: empty sync response\n", conn->homeserver);
+        exit(1);
+    }
+
+    body_mb = fetch.body_len / MB;
+    printf("%s: fetched %.1f MB in %.1f ms\n", conn->homeserver, body_mb,
+            (fetch.end_time - fetch.start_time) / 1000.0);
+    if(bench_heap_counted()) {
+        gdouble allocated_mb = (fetch.end_heap.bytes_allocated -
+                fetch.start_heap.bytes_allocated) / MB;
+
+        printf("  heap: receiving %" G_GUINT64_FORMAT " allocations, "
+                "%.1f MB (%.2f times the body); peak %.1f MB in use\n",
+                fetch.end_heap.allocations - fetch.start_heap.allocations,
+                allocated_mb, allocated_mb / body_mb,
+                fetch.end_heap.peak_bytes_in_use / MB);
+    }
+
+    *body_len = fetch.body_len;
+    return fetch.body;
+}
+
+
+/* the state store is the only thing we leave in there */
+static void _remove_dir(const gchar *dirname)
+{
+    GDir *dir = g_dir_open(dirname, 0, NULL);
+    const gchar *name;
+
+    if(dir == NULL)
+        return;
+    while((name = g_dir_read_name(dir)) != NULL) {
+        gchar *path = g_build_filename(dirname, name, NULL);
+        g_remove(path);
+        g_free(path);
+    }
+    g_dir_close(dir);
+    g_rmdir(dirname);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const gchar *list_name = NULL, *user_id = "@me:localhost";
+    gboolean keep_state = TRUE, debug = FALSE, fetch = FALSE;
+    gint slice_ms = DEFAULT_SYNC_SLICE_MS;
+    PurpleConnection *pc;
+    MatrixConnectionData *conn;
+    BenchRun run = {NULL};
+    gchar *user_dir, *body;
+    gsize body_len;
+    GError *error = NULL;
+    int opt;
+
+    while((opt = getopt(argc, argv, "fs:b:u:nv")) != -1) {
+        switch(opt) {
+            case 'f': fetch = TRUE; break;
+            case 's': list_name = optarg; break;
+            case 'b': slice_ms = atoi(optarg); break;
+            case 'u': user_id = optarg; break;
+            case 'n': keep_state = FALSE; break;
+            case 'v': debug = TRUE; break;
+            default: _usage();
+        }
+    }
+    if(optind != argc - 1 || (fetch && list_name != NULL))
+        _usage();
+
+    user_dir = g_dir_make_tmp("bench-sync-XXXXXX", &error);
+    if(user_dir == NULL) {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    purple_stubs_init(user_dir, debug);
+
+    pc = purple_stubs_connect(user_id);
+    purple_account_set_int(pc->account, PRPL_ACCOUNT_OPT_SYNC_SLICE_MS,
+            slice_ms);
+    matrix_connection_new(pc);
+    conn = purple_connection_get_protocol_data(pc);
+    conn->user_id = g_strdup(user_id);
+    if(fetch) {
+        /* matrix-api wants it to end in a '/' */
+        conn->homeserver = g_str_has_suffix(argv[optind], "/") ?
+                g_strdup(argv[optind]) : g_strconcat(argv[optind], "/", NULL);
+    } else {
+        /* the stand-in libpurple has no SSL: anything the plugin asks for
+         * fails to connect */
+        conn->homeserver = g_strdup("https://localhost/");
+    }
+    if(keep_state)
+        conn->state_store = matrix_statestore_open(pc->account, user_id);
+
+    if(fetch)
+        body = _fetch(conn, &body_len);
+    else
+        body = bench_read_file(argv[optind], &body_len);
+
+    run.start_rss_kb = bench_rss_kb();
+    bench_heap_reset_peak();
+    bench_heap_get(&run.start_heap);
+    run.start_time = g_get_monotonic_time();
+
+    /* the job takes the body */
+    if(list_name != NULL)
+        run.job = matrix_sync_new_sliding(pc, body, body_len, list_name,
+                _sync_applied, &run);
+    else
+        run.job = matrix_sync_new(pc, body, body_len, _sync_applied, &run);
+    if(run.job == NULL) {
+        fprintf(stderr, "%s: unable to parse\n", argv[optind]);
+        return 1;
+    }
+    bench_heap_get(&run.indexed_heap);
+
+    matrix_sync_run(run.job);
+    while(!run.done)
+        g_main_context_iteration(NULL, TRUE);
+
+    _report(argv[optind], body_len, &run);
+
+    matrix_connection_free(pc);
+    purple_stubs_disconnect(pc);
+    _remove_dir(user_dir);
+    g_free(user_dir);
+    return purple_stubs_counts.errors == 0 ? 0 : 1;
+}
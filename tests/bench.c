@@ -0,0 +1,211 @@
+/**
+ * bench.c: measuring time and memory, for the benchmarks
+ *
+ * The heap is counted by standing in for malloc and friends: since they are
+ * defined here, in the executable, the dynamic linker binds every library's
+ * calls to them here too. We pass each call on to glibc's allocator, and
+ * count what it hands out.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "bench.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+
+/* glibc's own allocator, which we pass everything on to */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+/* sqlite and gio have threads of their own, so the counts are atomic */
+static guint64 _allocations;
+static guint64 _bytes_allocated;
+static gint64 _bytes_in_use;
+static gint64 _peak_bytes_in_use;
+
+static void _count_alloc(void *ptr)
+{
+    gint64 size, in_use, peak;
+
+    if(ptr == NULL)
+        return;
+
+    size = malloc_usable_size(ptr);
+    __atomic_add_fetch(&_allocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_bytes_allocated, size, __ATOMIC_RELAXED);
+    in_use = __atomic_add_fetch(&_bytes_in_use, size, __ATOMIC_RELAXED);
+
+    peak = __atomic_load_n(&_peak_bytes_in_use, __ATOMIC_RELAXED);
+    while(in_use > peak && !__atomic_compare_exchange_n(&_peak_bytes_in_use,
+            &peak, in_use, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void _count_free(void *ptr)
+{
+    if(ptr != NULL)
+        __atomic_sub_fetch(&_bytes_in_use, (gint64)malloc_usable_size(ptr),
+                __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+    void *ptr = __libc_malloc(size);
+    _count_alloc(ptr);
+    return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr = __libc_calloc(nmemb, size);
+    _count_alloc(ptr);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    gint64 old_size = ptr == NULL ? 0 : malloc_usable_size(ptr);
+    void *new_ptr = __libc_realloc(ptr, size);
+
+    /* if it failed, the old block is still there; if size was zero, it was
+     * freed */
+    if(new_ptr == NULL && size != 0)
+        return NULL;
+    __atomic_sub_fetch(&_bytes_in_use, old_size, __ATOMIC_RELAXED);
+    _count_alloc(new_ptr);
+    return new_ptr;
+}
+
+void free(void *ptr)
+{
+    _count_free(ptr);
+    __libc_free(ptr);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    void *ptr = __libc_memalign(alignment, size);
+    _count_alloc(ptr);
+    return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+            alignment % sizeof(void *) != 0)
+        return EINVAL;
+    ptr = memalign(alignment, size);
+    if(ptr == NULL)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+
+gboolean bench_heap_counted(void)
+{
+    return TRUE;
+}
+
+
+void bench_heap_get(BenchHeap *heap)
+{
+    heap->allocations = __atomic_load_n(&_allocations, __ATOMIC_RELAXED);
+    heap->bytes_allocated = __atomic_load_n(&_bytes_allocated,
+            __ATOMIC_RELAXED);
+    heap->bytes_in_use = __atomic_load_n(&_bytes_in_use, __ATOMIC_RELAXED);
+    heap->peak_bytes_in_use = __atomic_load_n(&_peak_bytes_in_use,
+            __ATOMIC_RELAXED);
+}
+
+
+void bench_heap_reset_peak(void)
+{
+    __atomic_store_n(&_peak_bytes_in_use,
+            __atomic_load_n(&_bytes_in_use, __ATOMIC_RELAXED),
+            __ATOMIC_RELAXED);
+}
+
+#else /* !__GLIBC__ */
+
+gboolean bench_heap_counted(void)
+{
+    return FALSE;
+}
+
+
+void bench_heap_get(BenchHeap *heap)
+{
+    heap->allocations = heap->bytes_allocated = 0;
+    heap->bytes_in_use = heap->peak_bytes_in_use = 0;
+}
+
+
+void bench_heap_reset_peak(void)
+{
+}
+
+#endif /* __GLIBC__ */
+
+
+glong bench_rss_kb(void)
+{
+    glong rss_kb = 0;
+#ifdef __linux__
+    FILE *statm = fopen("/proc/self/statm", "r");
+    long pages;
+
+    if(statm == NULL)
+        return 0;
+    if(fscanf(statm, "%*s %ld", &pages) == 1)
+        rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+    fclose(statm);
+#endif
+    return rss_kb;
+}
+
+
+gchar *bench_read_file(const gchar *filename, gsize *len)
+{
+    gchar *contents;
+    GError *error = NULL;
+
+    if(!g_file_get_contents(filename, &contents, len, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        exit(1);
+    }
+    return contents;
+}
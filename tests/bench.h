@@ -0,0 +1,69 @@
+/**
+ * bench.h: measuring time and memory, for the benchmarks
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <glib.h>
+
+/**
+ * What the process has allocated from the heap. Everything linked into the
+ * benchmark counts, including glib, json-glib and sqlite.
+ */
+typedef struct _BenchHeap {
+    guint64 allocations;        /* calls to malloc, calloc, realloc etc */
+    guint64 bytes_allocated;    /* total size of those allocations */
+    gint64 bytes_in_use;        /* allocated and not yet freed */
+    gint64 peak_bytes_in_use;   /* the most there has been in use, since
+                                 * the last bench_heap_reset_peak */
+} BenchHeap;
+
+/**
+ * Find out whether the heap is being counted. We count by standing in for
+ * malloc and friends, which only works with glibc; elsewhere the counts
+ * stay at zero.
+ */
+gboolean bench_heap_counted(void);
+
+/**
+ * Get the heap counts so far
+ */
+void bench_heap_get(BenchHeap *heap);
+
+/**
+ * Start looking for a new peak, from what is in use now
+ */
+void bench_heap_reset_peak(void);
+
+/**
+ * Get the resident set size of the process as it stands now, or 0 if we
+ * can't find out
+ */
+glong bench_rss_kb(void);
+
+/**
+ * Read a file into memory, nul-terminated, or exit if we can't
+ *
+ * @param filename  file to read
+ * @param len       returns the length of the contents
+ *
+ * @returns the contents, which should be freed with g_free
+ */
+gchar *bench_read_file(const gchar *filename, gsize *len);
+
+#endif /* BENCH_H_ */
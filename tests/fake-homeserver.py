@@ -0,0 +1,554 @@
+#!/usr/bin/env python3
+#
+# fake-homeserver.py: a stand-in matrix homeserver, for testing offline
+#
+# This serves just enough of the client-server API for the plugin to log
+# in and sync, with a synthetic account made up of as many rooms as you
+# like. Both /sync and sliding sync (the simplified MSC3575 endpoint) are
+# supported, so either mode can be tried without a real server. Sliding
+# sync leaves out members who haven't said anything if the client asks it to
+# ($LAZY), and /members only takes a /sync token as its "at", as a real
+# server would. Leaving a room, from this client or any other, puts it in
+# rooms.leave of the next /sync; sliding sync just drops it from the list.
+#
+#   fake-homeserver.py serve [--port 8008] [--rooms 500] ...
+#       Run the server. Point an account at http://localhost:8008/ (any
+#       username and password will do). With --activity, a message arrives
+#       in a random room every so often, so that the recency order changes.
+#       With --log, each sync request is recorded as a line of JSON, so
+#       that a test can check what the client asked for.
+#
+#   fake-homeserver.py dump DIR [--rooms 500] ...
+#       Write out the responses to an initial /sync and an initial sliding
+#       sync (sync.json and sliding-sync.json), for tests/bench-sync.
+#
+#   fake-homeserver.py run [--rooms 500] ... -- COMMAND [ARG...]
+#       Serve on a free port while COMMAND runs, with {url} in its
+#       arguments replaced by the server's url, and exit with its status.
+#
+# With --encrypted, the rooms are encrypted: each message is an
+# m.room.encrypted event with made-up ciphertext, which is what most of a
+# real account's timeline looks like. dump then writes sync-encrypted.json
+# and sliding-sync-encrypted.json.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+
+import argparse
+import base64
+import json
+import os
+import random
+import re
+import subprocess
+import sys
+import threading
+import time
+import urllib.parse
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+SERVER_NAME = "localhost"
+USER_ID = "@me:" + SERVER_NAME
+SLIDING_SYNC_PATH = \
+    "/_matrix/client/unstable/org.matrix.simplified_msc3575/sync"
+
+
+class Room:
+    def __init__(self, account, index):
+        self.account = account
+        self.room_id = "!room%d:%s" % (index, SERVER_NAME)
+        self.state = []
+        self.timeline = []
+        self.last_active = 0
+        self.left = False
+
+    def add_state(self, event_type, state_key, sender, content):
+        event = {
+            "type": event_type, "state_key": state_key, "sender": sender,
+            "content": content, "event_id": self.account.event_id(),
+            "origin_server_ts": self.account.ts(),
+        }
+        self.state = [e for e in self.state
+                      if (e["type"], e["state_key"]) != (event_type,
+                                                         state_key)]
+        self.state.append(event)
+        return event
+
+    def add_message(self, sender, body):
+        ts = self.account.ts()
+        content = {"msgtype": "m.text", "body": body}
+        if self.account.encrypted:
+            event_type = "m.room.encrypted"
+            content = self.account.encrypt(sender, content)
+        else:
+            event_type = "m.room.message"
+        self.timeline.append({
+            "type": event_type, "sender": sender, "content": content,
+            "event_id": self.account.event_id(), "origin_server_ts": ts,
+        })
+        self.last_active = ts
+
+
+class Account:
+    """The rooms the user is in, and everything that has happened in them.
+    Everything is generated from a seed, so runs are repeatable."""
+
+    def __init__(self, rooms, members, messages, seed=1, encrypted=False):
+        self.lock = threading.Condition()
+        self.rand = random.Random(seed)
+        self.encrypted = encrypted
+        self.clock = 1500000000000
+        self.next_event = 0
+        self.rooms = []
+        for i in range(rooms):
+            room = Room(self, i)
+            creator = self.user(0)
+            room.add_state("m.room.create", "", creator, {"creator": creator})
+            room.add_state("m.room.name", "", creator,
+                           {"name": "Room number %d" % i})
+            room.add_state("m.room.member", USER_ID, USER_ID,
+                           {"membership": "join", "displayname": "Me"})
+            if encrypted:
+                room.add_state("m.room.encryption", "", creator,
+                               {"algorithm": "m.megolm.v1.aes-sha2"})
+            # each room has a different selection of the users
+            for j in self.rand.sample(range(members * 4), members):
+                user = self.user(j)
+                room.add_state("m.room.member", user, user,
+                               {"membership": "join",
+                                "displayname": "User %d" % j})
+            for j in range(messages):
+                room.add_message(self.user(self.rand.randrange(members * 4)),
+                                 "message %d in room %d" % (j, i))
+            self.rooms.append(room)
+        self.by_id = {room.room_id: room for room in self.rooms}
+
+    @staticmethod
+    def user(index):
+        return "@user%d:%s" % (index, SERVER_NAME)
+
+    def ts(self):
+        # every event gets a distinct timestamp, so the order is well-defined
+        self.clock += self.rand.randrange(1, 60000)
+        return self.clock
+
+    def event_id(self):
+        self.next_event += 1
+        return "$event%d:%s" % (self.next_event, SERVER_NAME)
+
+    def key(self, length):
+        """Made-up unpadded base64, as keys and ciphertext are sent"""
+        data = bytes(self.rand.getrandbits(8) for _ in range(length))
+        return base64.b64encode(data).decode("ascii").rstrip("=")
+
+    def encrypt(self, sender, content):
+        """An m.room.encrypted content the size megolm would make of
+        content; nobody can decrypt it"""
+        plaintext = len(json.dumps({"type": "m.room.message",
+                                    "content": content}))
+        return {"algorithm": "m.megolm.v1.aes-sha2",
+                "sender_key": self.key(32),
+                "device_id": "DEVICE" + sender.split(":")[0][1:].upper(),
+                "session_id": self.key(32),
+                # AES pads to 16 bytes; then the MAC and signature
+                "ciphertext": self.key((plaintext // 16 + 1) * 16 + 80)}
+
+    def joined(self):
+        return [room for room in self.rooms if not room.left]
+
+    def by_recency(self):
+        return sorted(self.joined(), key=lambda r: -r.last_active)
+
+    def post(self, room, sender, body):
+        with self.lock:
+            room.add_message(sender, body)
+            self.lock.notify_all()
+
+    def leave(self, room):
+        with self.lock:
+            if not room.left:
+                event = room.add_state("m.room.member", USER_ID, USER_ID,
+                                       {"membership": "leave"})
+                room.timeline.append(event)
+                room.left = True
+            self.lock.notify_all()
+
+
+class SyncSession:
+    """What we have told a client so far: how far through each room's
+    timeline it has seen"""
+
+    def __init__(self, sliding=False):
+        self.seen = {}
+        self.left = set()
+        # a sliding sync pos isn't a stream token, so /members won't take it
+        self.sliding = sliding
+
+
+def _timeline_since(room, seen, limit):
+    events = room.timeline[seen:] if seen is not None else room.timeline
+    return events[-limit:] if limit else events
+
+
+def sync_response(account, session, since):
+    rooms = {}
+    left = {}
+    for room in account.rooms:
+        if room.left:
+            if room.room_id not in session.left:
+                left[room.room_id] = {
+                    "timeline": {"events": room.timeline[-1:],
+                                 "limited": False},
+                    "state": {"events": []}}
+                session.left.add(room.room_id)
+            continue
+        seen = session.seen.get(room.room_id)
+        if seen is not None and seen == len(room.timeline):
+            continue
+        entry = {"timeline": {"events": _timeline_since(room, seen, 20),
+                              "limited": False},
+                 "ephemeral": {"events": []},
+                 "state": {"events": room.state if seen is None else []}}
+        rooms[room.room_id] = entry
+        session.seen[room.room_id] = len(room.timeline)
+    return {"rooms": {"join": rooms, "invite": {}, "leave": left},
+            "to_device": {"events": []},
+            "device_one_time_keys_count": {"signed_curve25519": 50}}
+
+
+def _lazy_members(config):
+    return ["m.room.member", "$LAZY"] in config.get("required_state", [])
+
+
+def _required_state(room, config, timeline):
+    """All the room's state, unless the client asked for members to be lazily
+    loaded: then only those of the members who sent something in timeline,
+    and ourselves"""
+    if not _lazy_members(config):
+        return room.state
+    senders = {event["sender"] for event in timeline} | {USER_ID}
+    return [event for event in room.state
+            if event["type"] != "m.room.member"
+            or event["state_key"] in senders]
+
+
+def sliding_sync_response(account, session, request):
+    """Build a response to a sliding sync request: the rooms in the window
+    (by recency), and those the client has subscribed to, each either in
+    full, if the client hasn't seen it, or just its new events."""
+    rooms = {}
+    ordered = account.by_recency()
+    wanted = {}
+
+    for name, config in request.get("lists", {}).items():
+        for start, end in config.get("ranges", []):
+            for room in ordered[start:end + 1]:
+                wanted[room.room_id] = config
+    for room_id, config in request.get("room_subscriptions", {}).items():
+        if room_id in account.by_id and not account.by_id[room_id].left:
+            wanted[room_id] = config
+
+    for room_id, config in wanted.items():
+        room = account.by_id[room_id]
+        seen = session.seen.get(room_id)
+        if seen is not None and seen == len(room.timeline):
+            continue
+        limit = config.get("timeline_limit", 20)
+        timeline = _timeline_since(room, seen, limit)
+        entry = {"timeline": timeline, "bump_stamp": room.last_active}
+        if seen is None:
+            entry["initial"] = True
+            entry["required_state"] = _required_state(room, config, timeline)
+        rooms[room_id] = entry
+        session.seen[room_id] = len(room.timeline)
+
+    return {"lists": {name: {"count": len(ordered)}
+                      for name in request.get("lists", {})},
+            "rooms": rooms,
+            "extensions": {
+                "to_device": {"next_batch": "td0", "events": []},
+                "e2ee": {"device_one_time_keys_count":
+                         {"signed_curve25519": 50}}}}
+
+
+class Server(ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, address, account, log):
+        super().__init__(address, Handler)
+        self.account = account
+        self.log = log
+        self.sessions = {}
+        self.next_pos = 0
+        self.sessions_lock = threading.Lock()
+
+    def new_pos(self, session):
+        with self.sessions_lock:
+            self.next_pos += 1
+            pos = str(self.next_pos)
+            self.sessions[pos] = session
+        return pos
+
+    def find_session(self, pos):
+        with self.sessions_lock:
+            return self.sessions.get(pos)
+
+    def handle_error(self, request, client_address):
+        # clients hang up on long polls when they are done with them
+        if not isinstance(sys.exc_info()[1], ConnectionError):
+            super().handle_error(request, client_address)
+
+    def record(self, kind, query, body):
+        if self.log is not None:
+            self.log.write(json.dumps({"kind": kind, "query": query,
+                                       "body": body}) + "\n")
+            self.log.flush()
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, fmt, *args):
+        sys.stderr.write("%s\n" % (fmt % args))
+
+    def reply(self, code, obj):
+        data = json.dumps(obj).encode()
+        self.send_response(code)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def error(self, code, errcode, message):
+        self.reply(code, {"errcode": errcode, "error": message})
+
+    def read_body(self):
+        length = int(self.headers.get("Content-Length", 0))
+        data = self.rfile.read(length) if length else b""
+        return json.loads(data) if data.strip() else {}
+
+    def do_GET(self):
+        self.dispatch("GET")
+
+    def do_POST(self):
+        self.dispatch("POST")
+
+    def do_PUT(self):
+        self.dispatch("PUT")
+
+    def dispatch(self, method):
+        url = urllib.parse.urlsplit(self.path)
+        path = urllib.parse.unquote(url.path)
+        query = dict(urllib.parse.parse_qsl(url.query))
+        body = self.read_body() if method != "GET" else {}
+
+        if path == "/_matrix/client/r0/login":
+            self.reply(200, {"user_id": USER_ID, "access_token": "token",
+                             "device_id": body.get("device_id", "DEVICE")})
+        elif path == "/_matrix/client/r0/account/whoami":
+            self.reply(200, {"user_id": USER_ID})
+        elif re.match(r"^/_matrix/client/r0/user/[^/]+/filter$", path):
+            self.reply(200, {"filter_id": "1"})
+        elif path == "/_matrix/client/r0/keys/upload":
+            self.reply(200, {"one_time_key_counts":
+                             {"signed_curve25519": 50}})
+        elif path == "/_matrix/client/r0/sync":
+            self.sync(query)
+        elif path == SLIDING_SYNC_PATH:
+            self.sliding_sync(query, body)
+        elif path.startswith("/_matrix/client/r0/join/"):
+            self.reply(200, {"room_id": path[len("/_matrix/client/r0/join/"):]})
+        else:
+            self.room_api(method, path, query, body)
+
+    def wait_for_activity(self, query, respond):
+        """Call respond() until it has something to say, or until the
+        client's timeout runs out"""
+        account = self.server.account
+        deadline = time.time() + int(query.get("timeout", 0)) / 1000.0
+        with account.lock:
+            while True:
+                response, empty = respond()
+                remaining = deadline - time.time()
+                if not empty or remaining <= 0:
+                    return response
+                account.lock.wait(remaining)
+
+    def sync(self, query):
+        since = query.get("since")
+        self.server.record("sync", query, None)
+        session = SyncSession() if since is None \
+            else self.server.find_session(since)
+        if session is None:
+            self.error(400, "M_UNKNOWN", "unknown since token")
+            return
+
+        def respond():
+            response = sync_response(self.server.account, session, since)
+            return response, not (response["rooms"]["join"] or
+                                  response["rooms"]["leave"])
+        response = self.wait_for_activity(query, respond)
+        response["next_batch"] = self.server.new_pos(session)
+        self.reply(200, response)
+
+    def sliding_sync(self, query, request):
+        pos = query.get("pos")
+        self.server.record("sliding_sync", query, request)
+        session = SyncSession(sliding=True) if pos is None \
+            else self.server.find_session(pos)
+        if session is None:
+            self.error(400, "M_UNKNOWN_POS", "unknown pos")
+            return
+
+        def respond():
+            response = sliding_sync_response(self.server.account, session,
+                                             request)
+            return response, not response["rooms"]
+        response = self.wait_for_activity(query, respond)
+        response["pos"] = self.server.new_pos(session)
+        self.reply(200, response)
+
+    def room_api(self, method, path, query, body):
+        account = self.server.account
+        match = re.match(r"^/_matrix/client/r0/rooms/([^/]+)/(.*)$", path)
+        room = account.by_id.get(match.group(1)) if match else None
+        action = match.group(2) if match else ""
+
+        if room is None:
+            self.error(404, "M_NOT_FOUND", "no such endpoint or room")
+        elif action.startswith("send/") and method == "PUT":
+            account.post(room, USER_ID, body.get("body", ""))
+            self.reply(200, {"event_id": room.timeline[-1]["event_id"]})
+        elif action.startswith("typing/"):
+            self.reply(200, {})
+        elif action == "leave":
+            account.leave(room)
+            self.reply(200, {})
+        elif action == "invite":
+            self.reply(200, {})
+        elif action == "members":
+            at = query.get("at")
+            session = self.server.find_session(at) if at else None
+            if at is not None and (session is None or session.sliding):
+                self.error(400, "M_INVALID_PARAM", "unknown at token")
+                return
+            self.reply(200, {"chunk": [e for e in room.state
+                                       if e["type"] == "m.room.member"]})
+        else:
+            self.error(404, "M_UNRECOGNIZED", "unrecognised request")
+
+
+def make_account(args):
+    return Account(args.rooms, args.members, args.messages, args.seed,
+                   args.encrypted)
+
+
+def serve(args):
+    account = make_account(args)
+    log = open(args.log, "a") if args.log else None
+    server = Server(("127.0.0.1", args.port), account, log)
+
+    if args.activity > 0:
+        def activity():
+            count = 0
+            while True:
+                time.sleep(args.activity)
+                room = account.rand.choice(account.joined())
+                count += 1
+                account.post(room, account.user(0), "activity %d" % count)
+        threading.Thread(target=activity, daemon=True).start()
+
+    sys.stderr.write("serving %d rooms on http://127.0.0.1:%d/\n"
+                     % (len(account.rooms), args.port))
+    server.serve_forever()
+
+
+def run(args):
+    account = make_account(args)
+    server = Server(("127.0.0.1", 0), account, None)
+    url = "http://127.0.0.1:%d/" % server.server_address[1]
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+
+    command = args.program
+    if command[:1] == ["--"]:
+        command = command[1:]
+    try:
+        return subprocess.call([arg.replace("{url}", url)
+                                for arg in command])
+    finally:
+        server.shutdown()
+
+
+def dump(args):
+    account = make_account(args)
+    os.makedirs(args.dir, exist_ok=True)
+
+    suffix = "-encrypted" if args.encrypted else ""
+
+    response = sync_response(account, SyncSession(), None)
+    response["next_batch"] = "1"
+    with open(os.path.join(args.dir, "sync%s.json" % suffix), "w") as f:
+        json.dump(response, f)
+
+    # the same request as matrix-connection.c makes
+    request = {"lists": {"rooms": {"ranges": [[0, args.window - 1]],
+                                   "timeline_limit": 20}}}
+    response = sliding_sync_response(account, SyncSession(), request)
+    response["pos"] = "1"
+    with open(os.path.join(args.dir, "sliding-sync%s.json" % suffix),
+              "w") as f:
+        json.dump(response, f)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="A stand-in matrix homeserver, for testing offline")
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    for name in ("serve", "dump", "run"):
+        p = sub.add_parser(name)
+        p.add_argument("--rooms", type=int, default=500)
+        p.add_argument("--members", type=int, default=20,
+                       help="members in each room")
+        p.add_argument("--messages", type=int, default=10,
+                       help="messages in each room to start with")
+        p.add_argument("--seed", type=int, default=1)
+        p.add_argument("--encrypted", action="store_true",
+                       help="make the rooms encrypted")
+        if name == "serve":
+            p.add_argument("--port", type=int, default=8008)
+            p.add_argument("--activity", type=float, default=0,
+                           help="seconds between new messages (0 for none)")
+            p.add_argument("--log", help="file to record sync requests in")
+        elif name == "dump":
+            p.add_argument("dir")
+            p.add_argument("--window", type=int, default=50,
+                           help="size of the sliding sync window")
+        else:
+            p.add_argument("program", nargs=argparse.REMAINDER,
+                           help="the command to run, after --")
+
+    args = parser.parse_args()
+    if args.command == "serve":
+        serve(args)
+    elif args.command == "dump":
+        dump(args)
+    else:
+        if not args.program:
+            parser.error("no command to run")
+        sys.exit(run(args))
+
+
+if __name__ == "__main__":
+    main()
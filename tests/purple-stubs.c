@@ -0,0 +1,936 @@
+/**
+ * purple-stubs.c: just enough of libpurple to drive the plugin without a UI
+ *
+ * The benchmarks and tests call into the plugin directly, with no UI and
+ * none of the rest of libpurple. This stands in for the parts of libpurple
+ * which the sync and HTTP code use: accounts and their settings, the
+ * connection, chats and their users, the buddy list, signals, the debug log,
+ * plain TCP connections and the event loop (which is just glib's). Whatever
+ * the plugin hands over is counted, so that a test can check it arrived.
+ *
+ * libpurple does some of its lookups by walking lists; the ones here use
+ * hash tables, so that the figures from the benchmarks are for the plugin's
+ * own work.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include "purple-stubs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* libpurple */
+#include "account.h"
+#include "blist.h"
+#include "connection.h"
+#include "conversation.h"
+#include "debug.h"
+#include "eventloop.h"
+#include "proxy.h"
+#include "server.h"
+#include "signals.h"
+#include "sslconn.h"
+#include "util.h"
+
+/* libmatrix */
+#include "libmatrix.h"
+
+PurpleStubsCounts purple_stubs_counts;
+
+static gchar *_user_dir;
+static gboolean _debug;
+
+static GList *_connections;
+
+/* (type, account, name) => PurpleConversation */
+static GHashTable *_conversations_by_name;
+static GList *_conversations;
+
+/* (account, room id) => PurpleChat */
+static GHashTable *_chats;
+static GList *_groups;
+
+/* a conversation, with the things we keep track of for a chat */
+typedef struct _StubConversation {
+    PurpleConversation conv;
+    PurpleConvChat chat;
+    GHashTable *users;      /* name => PurpleConvChatBuddyFlags */
+} StubConversation;
+
+typedef struct _StubSignalHandler {
+    void *instance;
+    gchar *signal;
+    void *handle;
+    PurpleCallback func;
+    void *data;
+} StubSignalHandler;
+
+static GList *_signal_handlers;
+static gulong _next_signal_id = 1;
+
+static int _conversations_handle;
+
+
+void purple_stubs_init(const gchar *user_dir, gboolean debug)
+{
+    _user_dir = g_strdup(user_dir);
+    _debug = debug;
+    _conversations_by_name = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, NULL);
+    _chats = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+}
+
+
+/******************************************************************************
+ *
+ * debug.h
+ */
+
+static void _debug_vprint(const char *level, const char *category,
+        const char *format, va_list args)
+{
+    if(!_debug)
+        return;
+    fprintf(stderr, "%s %s: ", level, category);
+    vfprintf(stderr, format, args);
+}
+
+void purple_debug_info(const char *category, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    _debug_vprint("info", category, format, args);
+    va_end(args);
+}
+
+void purple_debug_warning(const char *category, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    _debug_vprint("warning", category, format, args);
+    va_end(args);
+}
+
+gboolean purple_debug_is_verbose(void)
+{
+    return FALSE;
+}
+
+gboolean purple_debug_is_unsafe(void)
+{
+    return FALSE;
+}
+
+
+/******************************************************************************
+ *
+ * eventloop.h
+ */
+
+guint purple_timeout_add(guint interval, GSourceFunc function, gpointer data)
+{
+    return g_timeout_add(interval, function, data);
+}
+
+guint purple_timeout_add_seconds(guint interval, GSourceFunc function,
+        gpointer data)
+{
+    return g_timeout_add_seconds(interval, function, data);
+}
+
+gboolean purple_timeout_remove(guint handle)
+{
+    return g_source_remove(handle);
+}
+
+typedef struct _StubInput {
+    int fd;
+    PurpleInputCondition cond;
+    PurpleInputFunction function;
+    gpointer data;
+} StubInput;
+
+static gboolean _input_cb(GIOChannel *source, GIOCondition condition,
+        gpointer user_data)
+{
+    StubInput *input = user_data;
+    PurpleInputCondition cond = 0;
+
+    /* as pidgin's event loop does: errors wake up readers and writers */
+    if(condition & (G_IO_IN | G_IO_HUP | G_IO_ERR))
+        cond |= PURPLE_INPUT_READ;
+    if(condition & (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL))
+        cond |= PURPLE_INPUT_WRITE;
+    input->function(input->data, input->fd, cond & input->cond);
+    return TRUE;
+}
+
+guint purple_input_add(int fd, PurpleInputCondition cond,
+        PurpleInputFunction function, gpointer data)
+{
+    StubInput *input = g_new0(StubInput, 1);
+    GIOCondition condition = 0;
+    GIOChannel *channel;
+    guint handle;
+
+    input->fd = fd;
+    input->cond = cond;
+    input->function = function;
+    input->data = data;
+
+    if(cond & PURPLE_INPUT_READ)
+        condition |= G_IO_IN | G_IO_HUP | G_IO_ERR;
+    if(cond & PURPLE_INPUT_WRITE)
+        condition |= G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+
+    channel = g_io_channel_unix_new(fd);
+    handle = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, condition,
+            _input_cb, input, g_free);
+    g_io_channel_unref(channel);
+    return handle;
+}
+
+gboolean purple_input_remove(guint handle)
+{
+    return g_source_remove(handle);
+}
+
+
+/******************************************************************************
+ *
+ * util.h
+ */
+
+const char *purple_user_dir(void)
+{
+    return _user_dir;
+}
+
+/* like libpurple's, but a byte at a time */
+const char *purple_escape_filename(const char *str)
+{
+    static char buf[4096];
+    gsize i = 0;
+
+    for(; *str != '\0' && i < sizeof(buf) - 4; str++) {
+        if(g_ascii_isalnum(*str) || strchr("@-_.#", *str) != NULL)
+            buf[i++] = *str;
+        else
+            i += sprintf(buf + i, "%%%02x", (guchar)*str);
+    }
+    buf[i] = '\0';
+    return buf;
+}
+
+gchar *purple_markup_escape_text(const gchar *text, gssize length)
+{
+    return g_markup_escape_text(text, length);
+}
+
+
+/******************************************************************************
+ *
+ * proxy.h and sslconn.h
+ *
+ * Plain TCP connections are made directly, ignoring the proxy settings, so
+ * that a test can talk to a server on this machine. There is no SSL, so
+ * anything the plugin asks an https server for fails to connect, as it would
+ * offline.
+ */
+
+struct _PurpleProxyConnectData {
+    int fd;
+    guint watch;
+    PurpleProxyConnectFunction connect_cb;
+    gpointer data;
+};
+
+PurpleProxyInfo *purple_proxy_get_setup(PurpleAccount *account)
+{
+    return NULL;
+}
+
+static void _proxy_connect_done(PurpleProxyConnectData *connect_data,
+        const gchar *error_message)
+{
+    int fd = connect_data->fd;
+
+    if(error_message != NULL) {
+        close(fd);
+        fd = -1;
+    }
+    connect_data->connect_cb(connect_data->data, fd, error_message);
+    g_free(connect_data);
+}
+
+static gboolean _proxy_connected_cb(GIOChannel *source,
+        GIOCondition condition, gpointer user_data)
+{
+    PurpleProxyConnectData *connect_data = user_data;
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if(getsockopt(connect_data->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        error = errno;
+    connect_data->watch = 0;
+    _proxy_connect_done(connect_data, error == 0 ? NULL : g_strerror(error));
+    return FALSE;
+}
+
+PurpleProxyConnectData *purple_proxy_connect(void *handle,
+        PurpleAccount *account, const char *host, int port,
+        PurpleProxyConnectFunction connect_cb, gpointer data)
+{
+    PurpleProxyConnectData *connect_data;
+    struct addrinfo hints, *addrs;
+    gchar service[16];
+    GIOChannel *channel;
+    int fd;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    g_snprintf(service, sizeof(service), "%d", port);
+    if(getaddrinfo(host, service, &hints, &addrs) != 0)
+        return NULL;
+
+    /* just the first address: the tests only connect to this machine */
+    fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+    if(fd < 0) {
+        freeaddrinfo(addrs);
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if(connect(fd, addrs->ai_addr, addrs->ai_addrlen) < 0 &&
+            errno != EINPROGRESS) {
+        freeaddrinfo(addrs);
+        close(fd);
+        return NULL;
+    }
+    freeaddrinfo(addrs);
+
+    connect_data = g_new0(PurpleProxyConnectData, 1);
+    connect_data->fd = fd;
+    connect_data->connect_cb = connect_cb;
+    connect_data->data = data;
+
+    /* libpurple never calls back before returning, even if the connection
+     * is made at once */
+    channel = g_io_channel_unix_new(fd);
+    connect_data->watch = g_io_add_watch(channel,
+            G_IO_OUT | G_IO_HUP | G_IO_ERR, _proxy_connected_cb,
+            connect_data);
+    g_io_channel_unref(channel);
+    purple_stubs_counts.connections++;
+    return connect_data;
+}
+
+void purple_proxy_connect_cancel(PurpleProxyConnectData *connect_data)
+{
+    g_source_remove(connect_data->watch);
+    close(connect_data->fd);
+    g_free(connect_data);
+}
+
+gboolean purple_ssl_is_supported(void)
+{
+    return FALSE;
+}
+
+
+/******************************************************************************
+ *
+ * signals.h
+ *
+ * Nothing here emits signals except "deleting-conversation", when a
+ * connection is torn down.
+ */
+
+gulong purple_signal_connect(void *instance, const char *signal,
+        void *handle, PurpleCallback func, void *data)
+{
+    StubSignalHandler *handler = g_new0(StubSignalHandler, 1);
+
+    handler->instance = instance;
+    handler->signal = g_strdup(signal);
+    handler->handle = handle;
+    handler->func = func;
+    handler->data = data;
+    _signal_handlers = g_list_append(_signal_handlers, handler);
+    return _next_signal_id++;
+}
+
+void purple_signals_disconnect_by_handle(void *handle)
+{
+    GList *link = _signal_handlers, *next;
+
+    for(; link != NULL; link = next) {
+        StubSignalHandler *handler = link->data;
+        next = link->next;
+        if(handler->handle != handle)
+            continue;
+        g_free(handler->signal);
+        g_free(handler);
+        _signal_handlers = g_list_delete_link(_signal_handlers, link);
+    }
+}
+
+static void _emit_deleting_conversation(PurpleConversation *conv)
+{
+    GList *link = _signal_handlers, *next;
+
+    /* handlers may disconnect themselves */
+    for(; link != NULL; link = next) {
+        StubSignalHandler *handler = link->data;
+        next = link->next;
+        if(handler->instance == &_conversations_handle &&
+                strcmp(handler->signal, "deleting-conversation") == 0)
+            ((void (*)(PurpleConversation *, void *))handler->func)(conv,
+                    handler->data);
+    }
+}
+
+
+/******************************************************************************
+ *
+ * account.h
+ *
+ * The settings are kept as strings, in the settings table.
+ */
+
+const char *purple_account_get_username(const PurpleAccount *account)
+{
+    return account->username;
+}
+
+PurpleConnection *purple_account_get_connection(const PurpleAccount *account)
+{
+    return account->gc;
+}
+
+const char *purple_account_get_string(const PurpleAccount *account,
+        const char *name, const char *default_value)
+{
+    const char *value = g_hash_table_lookup(account->settings, name);
+    return value == NULL ? default_value : value;
+}
+
+int purple_account_get_int(const PurpleAccount *account, const char *name,
+        int default_value)
+{
+    const char *value = g_hash_table_lookup(account->settings, name);
+    return value == NULL ? default_value : atoi(value);
+}
+
+gboolean purple_account_get_bool(const PurpleAccount *account,
+        const char *name, gboolean default_value)
+{
+    return purple_account_get_int(account, name, default_value) != 0;
+}
+
+void purple_account_set_string(PurpleAccount *account, const char *name,
+        const char *value)
+{
+    if(value == NULL)
+        g_hash_table_remove(account->settings, name);
+    else
+        g_hash_table_replace(account->settings, g_strdup(name),
+                g_strdup(value));
+}
+
+void purple_account_set_int(PurpleAccount *account, const char *name,
+        int value)
+{
+    g_hash_table_replace(account->settings, g_strdup(name),
+            g_strdup_printf("%d", value));
+}
+
+void purple_account_set_bool(PurpleAccount *account, const char *name,
+        gboolean value)
+{
+    purple_account_set_int(account, name, value ? 1 : 0);
+}
+
+
+/******************************************************************************
+ *
+ * connection.h
+ */
+
+PurpleConnection *purple_stubs_connect(const gchar *username)
+{
+    PurpleAccount *account = g_new0(PurpleAccount, 1);
+    PurpleConnection *pc = g_new0(PurpleConnection, 1);
+
+    account->username = g_strdup(username);
+    account->protocol_id = g_strdup(PRPL_ID);
+    account->settings = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, g_free);
+    account->gc = pc;
+
+    pc->account = account;
+    pc->state = PURPLE_CONNECTED;
+    pc->flags = PURPLE_CONNECTION_HTML;
+    _connections = g_list_append(_connections, pc);
+    return pc;
+}
+
+PurpleAccount *purple_connection_get_account(const PurpleConnection *gc)
+{
+    return gc->account;
+}
+
+void *purple_connection_get_protocol_data(const PurpleConnection *gc)
+{
+    return gc->proto_data;
+}
+
+void purple_connection_set_protocol_data(PurpleConnection *gc,
+        void *proto_data)
+{
+    gc->proto_data = proto_data;
+}
+
+PurpleConnectionState purple_connection_get_state(const PurpleConnection *gc)
+{
+    return gc->state;
+}
+
+void purple_connection_set_state(PurpleConnection *gc,
+        PurpleConnectionState state)
+{
+    gc->state = state;
+}
+
+void purple_connection_update_progress(PurpleConnection *gc,
+        const char *text, size_t step, size_t count)
+{
+}
+
+void purple_connection_error_reason(PurpleConnection *gc,
+        PurpleConnectionError reason, const char *description)
+{
+    /* always worth knowing about, so not just in the debug log */
+    fprintf(stderr, "connection error: %s\n", description);
+    purple_stubs_counts.errors++;
+    gc->wants_to_die = TRUE;
+}
+
+GList *purple_connections_get_all(void)
+{
+    return _connections;
+}
+
+
+/******************************************************************************
+ *
+ * conversation.h and server.h
+ */
+
+static gchar *_conversation_key(PurpleConversationType type,
+        const PurpleAccount *account, const char *name)
+{
+    return g_strdup_printf("%d:%p:%s", type, account, name);
+}
+
+PurpleConversation *serv_got_joined_chat(PurpleConnection *gc, int id,
+        const char *name)
+{
+    StubConversation *stub;
+    PurpleConversation *conv;
+    gchar *key = _conversation_key(PURPLE_CONV_TYPE_CHAT, gc->account, name);
+
+    /* as libpurple does, we reuse the window of a chat we have left */
+    conv = g_hash_table_lookup(_conversations_by_name, key);
+    g_free(key);
+    if(conv != NULL && conv->u.chat->left) {
+        conv->u.chat->left = FALSE;
+        conv->u.chat->id = id;
+        gc->buddy_chats = g_slist_append(gc->buddy_chats, conv);
+        return conv;
+    }
+
+    stub = g_new0(StubConversation, 1);
+    conv = &stub->conv;
+
+    conv->type = PURPLE_CONV_TYPE_CHAT;
+    conv->account = gc->account;
+    conv->name = g_strdup(name);
+    conv->title = g_strdup(name);
+    conv->data = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+            NULL);
+    conv->u.chat = &stub->chat;
+    stub->chat.conv = conv;
+    stub->chat.id = id;
+    stub->users = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+            NULL);
+
+    g_hash_table_insert(_conversations_by_name,
+            _conversation_key(conv->type, conv->account, name), conv);
+    _conversations = g_list_prepend(_conversations, conv);
+    gc->buddy_chats = g_slist_append(gc->buddy_chats, conv);
+    purple_stubs_counts.conversations++;
+    return conv;
+}
+
+static void _conversation_destroy(PurpleConversation *conv)
+{
+    StubConversation *stub = (StubConversation *)conv;
+    gchar *key = _conversation_key(conv->type, conv->account, conv->name);
+
+    _emit_deleting_conversation(conv);
+    g_hash_table_remove(_conversations_by_name, key);
+    g_free(key);
+    _conversations = g_list_remove(_conversations, conv);
+
+    g_hash_table_destroy(stub->users);
+    g_hash_table_destroy(conv->data);
+    g_free(stub->chat.who);
+    g_free(stub->chat.topic);
+    g_free(conv->name);
+    g_free(conv->title);
+    g_free(stub);
+}
+
+GList *purple_get_conversations(void)
+{
+    return _conversations;
+}
+
+void *purple_conversations_get_handle(void)
+{
+    return &_conversations_handle;
+}
+
+PurpleConversation *purple_find_conversation_with_account(
+        PurpleConversationType type, const char *name,
+        const PurpleAccount *account)
+{
+    gchar *key = _conversation_key(type, account, name);
+    PurpleConversation *conv = g_hash_table_lookup(_conversations_by_name,
+            key);
+
+    purple_stubs_counts.room_lookups++;
+    g_free(key);
+    return conv;
+}
+
+PurpleConversation *purple_find_chat(const PurpleConnection *gc, int id)
+{
+    GSList *link;
+
+    for(link = gc->buddy_chats; link != NULL; link = link->next) {
+        PurpleConversation *conv = link->data;
+        if(conv->u.chat->id == id)
+            return conv;
+    }
+    return NULL;
+}
+
+PurpleConversationType purple_conversation_get_type(
+        const PurpleConversation *conv)
+{
+    return conv->type;
+}
+
+PurpleConnection *purple_conversation_get_gc(const PurpleConversation *conv)
+{
+    return conv->account->gc;
+}
+
+PurpleConvChat *purple_conversation_get_chat_data(
+        const PurpleConversation *conv)
+{
+    return conv->type == PURPLE_CONV_TYPE_CHAT ? conv->u.chat : NULL;
+}
+
+const char *purple_conversation_get_title(const PurpleConversation *conv)
+{
+    return conv->title;
+}
+
+void purple_conversation_set_title(PurpleConversation *conv,
+        const char *title)
+{
+    g_free(conv->title);
+    conv->title = g_strdup(title);
+}
+
+gpointer purple_conversation_get_data(PurpleConversation *conv,
+        const char *key)
+{
+    return g_hash_table_lookup(conv->data, key);
+}
+
+void purple_conversation_set_data(PurpleConversation *conv, const char *key,
+        gpointer data)
+{
+    g_hash_table_replace(conv->data, g_strdup(key), data);
+}
+
+gboolean purple_conversation_has_focus(PurpleConversation *conv)
+{
+    return FALSE;
+}
+
+void purple_conversation_update(PurpleConversation *conv,
+        PurpleConvUpdateType type)
+{
+}
+
+void serv_got_chat_in(PurpleConnection *g, int id, const char *who,
+        PurpleMessageFlags flags, const char *message, time_t mtime)
+{
+    if(purple_find_chat(g, id) != NULL)
+        purple_stubs_counts.messages++;
+}
+
+void serv_got_chat_invite(PurpleConnection *gc, const char *name,
+        const char *who, const char *message, GHashTable *data)
+{
+    purple_stubs_counts.invites++;
+    if(data != NULL)
+        g_hash_table_destroy(data);
+}
+
+static GHashTable *_chat_users(PurpleConvChat *chat)
+{
+    return ((StubConversation *)chat->conv)->users;
+}
+
+void serv_got_chat_left(PurpleConnection *g, int id)
+{
+    PurpleConversation *conv = purple_find_chat(g, id);
+
+    if(conv == NULL)
+        return;
+    g->buddy_chats = g_slist_remove(g->buddy_chats, conv);
+    g_hash_table_remove_all(_chat_users(conv->u.chat));
+    conv->u.chat->left = TRUE;
+    purple_stubs_counts.chats_left++;
+}
+
+gboolean purple_conv_chat_has_left(PurpleConvChat *chat)
+{
+    return chat->left;
+}
+
+int purple_conv_chat_get_id(const PurpleConvChat *chat)
+{
+    return chat->id;
+}
+
+void purple_conv_chat_write(PurpleConvChat *chat, const char *who,
+        const char *message, PurpleMessageFlags flags, time_t mtime)
+{
+    purple_stubs_counts.chat_writes++;
+}
+
+void purple_conv_chat_set_topic(PurpleConvChat *chat, const char *who,
+        const char *topic)
+{
+    g_free(chat->who);
+    g_free(chat->topic);
+    chat->who = g_strdup(who);
+    chat->topic = g_strdup(topic);
+    purple_stubs_counts.topics++;
+}
+
+guint purple_stubs_chat_user_count(PurpleConversation *conv)
+{
+    return g_hash_table_size(((StubConversation *)conv)->users);
+}
+
+void purple_conv_chat_add_users(PurpleConvChat *chat, GList *users,
+        GList *extra_msgs, GList *flags, gboolean new_arrivals)
+{
+    for(; users != NULL; users = users->next) {
+        g_hash_table_replace(_chat_users(chat), g_strdup(users->data),
+                flags == NULL ? NULL : flags->data);
+        if(flags != NULL)
+            flags = flags->next;
+        purple_stubs_counts.users_added++;
+    }
+}
+
+void purple_conv_chat_remove_user(PurpleConvChat *chat, const char *user,
+        const char *reason)
+{
+    if(g_hash_table_remove(_chat_users(chat), user))
+        purple_stubs_counts.users_removed++;
+}
+
+void purple_conv_chat_rename_user(PurpleConvChat *chat, const char *old_user,
+        const char *new_user)
+{
+    gpointer flags = g_hash_table_lookup(_chat_users(chat), old_user);
+
+    g_hash_table_remove(_chat_users(chat), old_user);
+    g_hash_table_replace(_chat_users(chat), g_strdup(new_user), flags);
+}
+
+PurpleConvChatBuddyFlags purple_conv_chat_user_get_flags(
+        PurpleConvChat *chat, const char *user)
+{
+    return GPOINTER_TO_INT(g_hash_table_lookup(_chat_users(chat), user));
+}
+
+void purple_conv_chat_user_set_flags(PurpleConvChat *chat, const char *user,
+        PurpleConvChatBuddyFlags flags)
+{
+    if(g_hash_table_contains(_chat_users(chat), user))
+        g_hash_table_replace(_chat_users(chat), g_strdup(user),
+                GINT_TO_POINTER(flags));
+}
+
+
+/******************************************************************************
+ *
+ * blist.h
+ *
+ * Chats are found by the first of their components, which is what
+ * libpurple does too (see matrixprpl_chat_info).
+ */
+
+static gchar *_chat_key(const PurpleAccount *account, const char *name)
+{
+    return g_strdup_printf("%p:%s", account, name);
+}
+
+PurpleGroup *purple_find_group(const char *name)
+{
+    GList *link;
+
+    for(link = _groups; link != NULL; link = link->next) {
+        PurpleGroup *group = link->data;
+        if(strcmp(group->name, name) == 0)
+            return group;
+    }
+    return NULL;
+}
+
+PurpleGroup *purple_group_new(const char *name)
+{
+    PurpleGroup *group = purple_find_group(name);
+
+    if(group != NULL)
+        return group;
+    group = g_new0(PurpleGroup, 1);
+    group->node.type = PURPLE_BLIST_GROUP_NODE;
+    group->name = g_strdup(name);
+    return group;
+}
+
+void purple_blist_add_group(PurpleGroup *group, PurpleBlistNode *node)
+{
+    if(g_list_find(_groups, group) == NULL)
+        _groups = g_list_append(_groups, group);
+}
+
+PurpleChat *purple_chat_new(PurpleAccount *account, const char *alias,
+        GHashTable *components)
+{
+    PurpleChat *chat = g_new0(PurpleChat, 1);
+
+    chat->node.type = PURPLE_BLIST_CHAT_NODE;
+    chat->account = account;
+    chat->alias = g_strdup(alias);
+    chat->components = components;
+    return chat;
+}
+
+void purple_blist_add_chat(PurpleChat *chat, PurpleGroup *group,
+        PurpleBlistNode *node)
+{
+    const char *room_id = g_hash_table_lookup(chat->components,
+            PRPL_CHAT_INFO_ROOM_ID);
+
+    chat->node.parent = &group->node;
+    g_hash_table_replace(_chats, _chat_key(chat->account, room_id), chat);
+}
+
+PurpleChat *purple_blist_find_chat(PurpleAccount *account, const char *name)
+{
+    gchar *key = _chat_key(account, name);
+    PurpleChat *chat = g_hash_table_lookup(_chats, key);
+
+    purple_stubs_counts.room_lookups++;
+    g_free(key);
+    return chat;
+}
+
+void purple_blist_alias_chat(PurpleChat *chat, const char *alias)
+{
+    g_free(chat->alias);
+    chat->alias = g_strdup(alias);
+}
+
+void purple_blist_node_set_bool(PurpleBlistNode *node, const char *key,
+        gboolean value)
+{
+}
+
+
+/******************************************************************************
+ *
+ * tearing down
+ */
+
+static gboolean _remove_chat(gpointer key, gpointer value,
+        gpointer account)
+{
+    PurpleChat *chat = value;
+
+    if(chat->account != account)
+        return FALSE;
+    g_hash_table_destroy(chat->components);
+    g_free(chat->alias);
+    g_free(chat);
+    return TRUE;
+}
+
+void purple_stubs_disconnect(PurpleConnection *pc)
+{
+    PurpleAccount *account = pc->account;
+    GList *link, *next;
+
+    g_assert(pc->proto_data == NULL);
+
+    for(link = _conversations; link != NULL; link = next) {
+        PurpleConversation *conv = link->data;
+        next = link->next;
+        if(conv->account == account)
+            _conversation_destroy(conv);
+    }
+    g_slist_free(pc->buddy_chats);
+    g_hash_table_foreach_remove(_chats, _remove_chat, account);
+
+    _connections = g_list_remove(_connections, pc);
+    g_free(pc);
+
+    g_hash_table_destroy(account->settings);
+    g_free(account->username);
+    g_free(account->protocol_id);
+    g_free(account);
+}
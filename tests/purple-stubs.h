@@ -0,0 +1,73 @@
+/**
+ * purple-stubs.h: just enough of libpurple to drive the plugin without a UI
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#ifndef PURPLE_STUBS_H_
+#define PURPLE_STUBS_H_
+
+#include <glib.h>
+
+struct _PurpleConnection;
+struct _PurpleConversation;
+
+/**
+ * What the plugin has handed over to libpurple so far
+ */
+typedef struct _PurpleStubsCounts {
+    guint conversations;    /* chats joined */
+    guint messages;         /* messages received in chats */
+    guint chat_writes;      /* anything else written to chats */
+    guint users_added;      /* to chat user lists */
+    guint users_removed;
+    guint topics;           /* topics set */
+    guint invites;
+    guint chats_left;       /* chats marked as left */
+    guint room_lookups;     /* of chats and conversations, by name */
+    guint errors;           /* connection errors */
+    guint connections;      /* TCP connections opened */
+} PurpleStubsCounts;
+
+extern PurpleStubsCounts purple_stubs_counts;
+
+/**
+ * Set up the stand-in libpurple
+ *
+ * @param user_dir   where the plugin should keep its files (the state
+ *                      store, for instance); see purple_user_dir
+ * @param debug      TRUE to write the debug log to stderr
+ */
+void purple_stubs_init(const gchar *user_dir, gboolean debug);
+
+/**
+ * Make an account, and a connection for it which is already connected. The
+ * plugin's protocol data is left for the caller to set up.
+ */
+struct _PurpleConnection *purple_stubs_connect(const gchar *username);
+
+/**
+ * How many users are in the user list of a chat
+ */
+guint purple_stubs_chat_user_count(struct _PurpleConversation *conv);
+
+/**
+ * Get rid of a connection from purple_stubs_connect, along with its
+ * account, its conversations and its buddy list entries. The plugin's
+ * protocol data should have been freed already.
+ */
+void purple_stubs_disconnect(struct _PurpleConnection *pc);
+
+#endif /* PURPLE_STUBS_H_ */
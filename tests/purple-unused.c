@@ -0,0 +1,99 @@
+/**
+ * purple-unused.c: the rest of the libpurple API which the plugin calls
+ *
+ * The benchmarks and tests don't log in, send messages or transfer files,
+ * so none of these should be reached; if one is, we stop and say so, rather
+ * than carrying on with a stand-in which doesn't do what the plugin
+ * expects. None of the libpurple headers are included here, so the
+ * signatures don't matter.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static void _unexpected(const char *name)
+{
+    fprintf(stderr, "unexpected call to %s\n", name);
+    abort();
+}
+
+#define UNUSED(name) \
+    void name(void); \
+    void name(void) { _unexpected(#name); }
+
+UNUSED(purple_account_get_password)
+UNUSED(purple_account_request_password)
+UNUSED(purple_account_set_enabled)
+UNUSED(purple_account_set_password)
+UNUSED(purple_account_set_remember_password)
+
+UNUSED(purple_base64_encode)
+
+UNUSED(purple_core_get_ui)
+
+UNUSED(purple_imgstore_add_with_id)
+UNUSED(purple_imgstore_find_by_id)
+UNUSED(purple_imgstore_get_data)
+UNUSED(purple_imgstore_get_extension)
+UNUSED(purple_imgstore_get_filename)
+UNUSED(purple_imgstore_get_size)
+UNUSED(purple_imgstore_ref_by_id)
+UNUSED(purple_imgstore_unref)
+
+UNUSED(purple_markup_find_tag)
+UNUSED(purple_markup_strip_html)
+
+UNUSED(purple_message_meify)
+
+UNUSED(purple_notify_error)
+
+UNUSED(purple_ntlm_gen_type1)
+
+UNUSED(purple_proxy_info_get_password)
+UNUSED(purple_proxy_info_get_type)
+UNUSED(purple_proxy_info_get_username)
+
+UNUSED(purple_request_fields_get_bool)
+UNUSED(purple_request_fields_get_string)
+
+UNUSED(purple_serv_got_join_chat_failed)
+
+UNUSED(purple_ssl_close)
+UNUSED(purple_ssl_connect)
+UNUSED(purple_ssl_input_add)
+UNUSED(purple_ssl_read)
+UNUSED(purple_ssl_strerror)
+UNUSED(purple_ssl_write)
+
+UNUSED(purple_xfer_cancel_remote)
+UNUSED(purple_xfer_end)
+UNUSED(purple_xfer_error)
+UNUSED(purple_xfer_get_account)
+UNUSED(purple_xfer_get_local_filename)
+UNUSED(purple_xfer_get_remote_user)
+UNUSED(purple_xfer_is_completed)
+UNUSED(purple_xfer_new)
+UNUSED(purple_xfer_request)
+UNUSED(purple_xfer_set_bytes_sent)
+UNUSED(purple_xfer_set_cancel_recv_fnc)
+UNUSED(purple_xfer_set_completed)
+UNUSED(purple_xfer_set_end_fnc)
+UNUSED(purple_xfer_set_filename)
+UNUSED(purple_xfer_set_init_fnc)
+UNUSED(purple_xfer_set_request_denied_fnc)
+UNUSED(purple_xfer_set_size)
+UNUSED(purple_xfer_update_progress)
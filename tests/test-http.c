@@ -0,0 +1,267 @@
+/**
+ * test-http.c: drive the HTTP transport against a real server
+ *
+ *   test-http [-2] [-n COUNT] [-e BYTES] [-v] URL
+ *
+ * COUNT requests (10 by default) for URL are started at once, as the plugin
+ * might start a sync, a few sends and some media downloads together, and
+ * each must come back with status 200 and the same body as the others.
+ * With -e, a POST of BYTES made-up bytes is sent to URL too, and must come
+ * back as it went: point it at a server which echoes uploads (nghttpd
+ * --echo-upload, for instance).
+ *
+ *   -2  try HTTP/2 (see PRPL_ACCOUNT_OPT_HTTP2)
+ *   -v  write the debug log to stderr
+ *
+ * We report how many TCP connections were opened, so that a test can check
+ * that the requests shared one over HTTP/2, or fell back to HTTP/1.1.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+/* libpurple */
+#include "account.h"
+#include "connection.h"
+
+/* libmatrix */
+#include "libmatrix.h"
+#include "matrix-http.h"
+
+#include "purple-stubs.h"
+
+/* big enough for anything the tests download */
+#define MAX_LEN (64 * 1024 * 1024)
+
+/* how long to wait for everything to finish (seconds) */
+#define TIMEOUT 30
+
+typedef struct _TestRequest {
+    const gchar *name;
+    GString *body;
+    int status_code;
+    gchar *error_message;
+    gboolean complete;
+} TestRequest;
+
+static guint _outstanding;
+static gboolean _timed_out;
+
+
+static void _usage(void)
+{
+    fprintf(stderr, "usage: test-http [-2] [-n COUNT] [-e BYTES] [-v] URL\n");
+    exit(2);
+}
+
+
+static void _header(MatrixHttpRequest *request, gpointer user_data,
+        const gchar *name, const gchar *value)
+{
+}
+
+
+static void _headers_complete(MatrixHttpRequest *request, gpointer user_data,
+        int status_code, gint64 content_length)
+{
+    TestRequest *test = user_data;
+
+    test->status_code = status_code;
+}
+
+
+static gboolean _body(MatrixHttpRequest *request, gpointer user_data,
+        const gchar *data, gsize len)
+{
+    TestRequest *test = user_data;
+
+    g_string_append_len(test->body, data, len);
+    return TRUE;
+}
+
+
+static void _complete(MatrixHttpRequest *request, gpointer user_data,
+        const gchar *error_message)
+{
+    TestRequest *test = user_data;
+
+    test->error_message = g_strdup(error_message);
+    test->complete = TRUE;
+    _outstanding--;
+}
+
+
+static const MatrixHttpResponseHandler _handler = {
+    _header, _headers_complete, _body, NULL, _complete
+};
+
+
+static gboolean _timeout_cb(gpointer user_data)
+{
+    _timed_out = TRUE;
+    return FALSE;
+}
+
+
+static void _start(MatrixHttpPool *pool, TestRequest *test, const gchar *url,
+        const gchar *method, const gchar *body, gsize body_len,
+        MatrixHttpClass request_class)
+{
+    const gchar *host_start = strstr(url, "://") + 3;
+    const gchar *path = strchr(host_start, '/');
+    int host_len = path == NULL ? strlen(host_start) : path - host_start;
+    GString *request = g_string_new(NULL);
+
+    g_string_append_printf(request, "%s %s HTTP/1.1\r\n", method,
+            path == NULL ? "/" : path);
+    g_string_append_printf(request, "Host: %.*s\r\n", host_len, host_start);
+    g_string_append(request, "Connection: keep-alive\r\n");
+    if(body != NULL)
+        g_string_append_printf(request,
+                "Content-Type: application/octet-stream\r\n"
+                "Content-Length: %" G_GSIZE_FORMAT "\r\n", body_len);
+    g_string_append(request, "\r\n");
+
+    test->body = g_string_new(NULL);
+    _outstanding++;
+    if(matrix_http_request_start(pool, url, request, body, body_len, MAX_LEN,
+            request_class, &_handler, test) == NULL) {
+        fprintf(stderr, "%s: unable to parse url\n", url);
+        exit(2);
+    }
+}
+
+
+/* returns TRUE if the request came back with the expected body */
+static gboolean _check(TestRequest *test, const GString *expected)
+{
+    if(!test->complete) {
+        printf("%s: not complete\n", test->name);
+        return FALSE;
+    }
+    if(test->error_message != NULL) {
+        printf("%s: failed: %s\n", test->name, test->error_message);
+        return FALSE;
+    }
+    if(test->status_code != 200) {
+        printf("%s: status %d\n", test->name, test->status_code);
+        return FALSE;
+    }
+    if(!g_string_equal(test->body, expected)) {
+        printf("%s: got %" G_GSIZE_FORMAT " bytes, not the %" G_GSIZE_FORMAT
+                " expected\n", test->name, test->body->len, expected->len);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+int main(int argc, char *argv[])
+{
+    gboolean http2 = FALSE, debug = FALSE, ok = TRUE;
+    guint count = 10, i;
+    gsize echo_len = 0;
+    const gchar *url;
+    PurpleConnection *pc;
+    MatrixHttpPool *pool;
+    TestRequest *gets, echo = {"POST"};
+    GString *upload = NULL;
+    gchar *user_dir;
+    GError *error = NULL;
+    gint64 start_time;
+    int opt;
+
+    while((opt = getopt(argc, argv, "2n:e:v")) != -1) {
+        switch(opt) {
+            case '2': http2 = TRUE; break;
+            case 'n': count = atoi(optarg); break;
+            case 'e': echo_len = atol(optarg); break;
+            case 'v': debug = TRUE; break;
+            default: _usage();
+        }
+    }
+    if(optind != argc - 1 || count == 0)
+        _usage();
+    url = argv[optind];
+    if(strstr(url, "://") == NULL)
+        _usage();
+
+    user_dir = g_dir_make_tmp("test-http-XXXXXX", &error);
+    if(user_dir == NULL) {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    purple_stubs_init(user_dir, debug);
+    pc = purple_stubs_connect("@me:localhost");
+    purple_account_set_bool(pc->account, PRPL_ACCOUNT_OPT_HTTP2, http2);
+    pool = matrix_http_pool_new(pc->account);
+
+    /* a mix of classes, so that more than one is in progress at once */
+    gets = g_new0(TestRequest, count);
+    for(i = 0; i < count; i++) {
+        gets[i].name = "GET";
+        _start(pool, &gets[i], url, "GET", NULL, 0,
+                i % 2 == 0 ? MATRIX_HTTP_CLASS_SEND : MATRIX_HTTP_CLASS_MEDIA);
+    }
+    if(echo_len > 0) {
+        upload = g_string_sized_new(echo_len);
+        for(i = 0; i < echo_len; i++)
+            g_string_append_c(upload, (gchar)g_random_int());
+        _start(pool, &echo, url, "POST", upload->str, upload->len,
+                MATRIX_HTTP_CLASS_MEDIA);
+    }
+
+    start_time = g_get_monotonic_time();
+    g_timeout_add_seconds(TIMEOUT, _timeout_cb, NULL);
+    while(_outstanding > 0 && !_timed_out)
+        g_main_context_iteration(NULL, TRUE);
+
+    for(i = 0; i < count; i++)
+        ok = _check(&gets[i], gets[0].body) && ok;
+    if(upload != NULL)
+        ok = _check(&echo, upload) && ok;
+
+    printf("%u GETs of %" G_GSIZE_FORMAT " bytes", count, gets[0].body->len);
+    if(upload != NULL)
+        printf(", a POST of %" G_GSIZE_FORMAT " bytes", upload->len);
+    printf(" in %.1f ms, over %u connections: %s\n",
+            (g_get_monotonic_time() - start_time) / 1000.0,
+            purple_stubs_counts.connections, ok ? "ok" : "FAILED");
+
+    /* completes anything which timed out */
+    matrix_http_pool_free(pool);
+
+    for(i = 0; i < count; i++) {
+        g_string_free(gets[i].body, TRUE);
+        g_free(gets[i].error_message);
+    }
+    g_free(gets);
+    if(upload != NULL) {
+        g_string_free(echo.body, TRUE);
+        g_free(echo.error_message);
+        g_string_free(upload, TRUE);
+    }
+    purple_stubs_disconnect(pc);
+    g_rmdir(user_dir);
+    g_free(user_dir);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+#
+# test-http.py: run tests/test-http against local servers
+#
+#   test-http.py [--no-http2] [PROGRAM]
+#
+# Starts fake-homeserver.py, which only speaks HTTP/1.1, and nghttpd (from
+# nghttp2), which speaks HTTP/2 without TLS, each on a free port, and checks
+# that:
+#   - over HTTP/2, concurrent requests, large downloads and an upload all
+#     share one connection;
+#   - a connection to an HTTP/2 server which is reset before the server has
+#     said anything is retried over HTTP/2, not taken as a sign that the
+#     server only speaks HTTP/1.1;
+#   - with HTTP/2 turned on, a server which doesn't speak it gets the
+#     requests over HTTP/1.1 instead;
+#   - with it turned off, HTTP/1.1 works as before.
+# If nghttpd isn't on the PATH (or in $NGHTTPD), the HTTP/2 test is skipped.
+# With --no-http2 (for a build with MATRIX_NO_HTTP2), only the last test is
+# run.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+
+import argparse
+import os
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import struct
+import tempfile
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# bigger than the HTTP/2 flow control windows in matrix-http.c, so that the
+# server has to wait for us to ask for more
+BIG_FILE_SIZE = 3 * 1024 * 1024
+
+
+def free_port():
+    with socket.socket() as sock:
+        sock.bind(("127.0.0.1", 0))
+        return sock.getsockname()[1]
+
+
+def wait_for_port(port, proc):
+    for _ in range(100):
+        if proc.poll() is not None:
+            raise RuntimeError("server exited with %d" % proc.returncode)
+        try:
+            socket.create_connection(("127.0.0.1", port), 0.1).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    raise RuntimeError("server didn't start on port %d" % port)
+
+
+def _pipe(src, dst):
+    try:
+        while True:
+            data = src.recv(65536)
+            if not data:
+                break
+            dst.sendall(data)
+    except OSError:
+        pass
+    finally:
+        for sock in (src, dst):
+            try:
+                sock.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+
+def reset_first_proxy(upstream_port):
+    """Listen on a free port, and forward connections to upstream_port, but
+    reset the first one as soon as the client has sent something, before the
+    server can answer. Returns the port."""
+    listener = socket.socket()
+    listener.bind(("127.0.0.1", 0))
+    listener.listen(16)
+
+    def serve():
+        first = True
+        while True:
+            client, _ = listener.accept()
+            if first:
+                first = False
+                client.recv(65536)
+                client.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER,
+                                  struct.pack("ii", 1, 0))
+                client.close()
+                continue
+            server = socket.create_connection(("127.0.0.1", upstream_port))
+            for src, dst in ((client, server), (server, client)):
+                threading.Thread(target=_pipe, args=(src, dst),
+                                 daemon=True).start()
+
+    threading.Thread(target=serve, daemon=True).start()
+    return listener.getsockname()[1]
+
+
+def run(program, args):
+    """Run test-http, and return how many connections it opened, or None if
+    it failed"""
+    cmd = [program] + args
+    result = subprocess.run(cmd, stdout=subprocess.PIPE,
+                            universal_newlines=True, timeout=60)
+    sys.stdout.write("%s\n  %s" % (" ".join(cmd), result.stdout))
+    match = re.search(r"over (\d+) connections", result.stdout)
+    if result.returncode != 0 or match is None:
+        return None
+    return int(match.group(1))
+
+
+def check(name, ok):
+    print("%s: %s" % (name, "ok" if ok else "FAILED"))
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Test the HTTP transport against local servers")
+    parser.add_argument("--no-http2", action="store_true",
+                        help="the plugin was built without HTTP/2")
+    parser.add_argument("program", nargs="?",
+                        default=os.path.join(HERE, "test-http"))
+    args = parser.parse_args()
+
+    nghttpd = os.environ.get("NGHTTPD") or shutil.which("nghttpd")
+    servers = []
+    ok = True
+
+    try:
+        port = free_port()
+        servers.append(subprocess.Popen(
+            [sys.executable, os.path.join(HERE, "fake-homeserver.py"),
+             "serve", "--port", str(port), "--rooms", "1"],
+            stderr=subprocess.DEVNULL))
+        wait_for_port(port, servers[-1])
+        http1_url = ("http://127.0.0.1:%d/_matrix/client/r0/account/whoami"
+                     % port)
+
+        ok = check("HTTP/1.1", run(args.program, ["-n", "10", http1_url])
+                   is not None) and ok
+        if args.no_http2:
+            return 0 if ok else 1
+
+        # the first connection finds out that the server doesn't speak
+        # HTTP/2; the rest are HTTP/1.1
+        connections = run(args.program, ["-2", "-n", "10", http1_url])
+        ok = check("fallback to HTTP/1.1",
+                   connections is not None and connections > 1) and ok
+
+        if nghttpd is None:
+            print("HTTP/2: skipped (no nghttpd)")
+            return 0 if ok else 1
+
+        with tempfile.TemporaryDirectory() as docroot:
+            with open(os.path.join(docroot, "big"), "wb") as f:
+                f.write(os.urandom(BIG_FILE_SIZE))
+            port = free_port()
+            servers.append(subprocess.Popen(
+                [nghttpd, "--no-tls", "--echo-upload", "-d", docroot,
+                 str(port)], stdout=subprocess.DEVNULL))
+            wait_for_port(port, servers[-1])
+
+            connections = run(args.program,
+                              ["-2", "-n", "20", "-e", str(BIG_FILE_SIZE),
+                               "http://127.0.0.1:%d/big" % port])
+            ok = check("HTTP/2", connections == 1) and ok
+
+            # the reset connection, then one more for all of the requests
+            proxy_port = reset_first_proxy(port)
+            connections = run(args.program,
+                              ["-2", "-n", "10",
+                               "http://127.0.0.1:%d/big" % proxy_port])
+            ok = check("HTTP/2 after a reset", connections == 2) and ok
+    finally:
+        for server in servers:
+            server.terminate()
+            server.wait()
+
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
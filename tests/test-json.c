@@ -0,0 +1,647 @@
+/**
+ * test-json.c: check the vector scanning in matrix-json.c against the scalar
+ *
+ *   test-json [-n COUNT] [-s SEED] [FILE...]
+ *
+ * COUNT (500 by default) made-up documents, each in several damaged forms,
+ * and then each FILE (a recorded /sync response, say), are indexed with
+ * matrix_json_tape_new using each way of scanning which this machine
+ * supports, at several depths; the tapes must all come out the same as the
+ * byte-at-a-time one. Likewise matrix_json_validate_text, on made-up text
+ * with and without broken UTF-8, must agree with g_utf8_validate.
+ * matrix_canonical_json must give the known answers for a few documents.
+ * Finally, what MatrixJsonWriter writes (for COUNT more made-up documents,
+ * and a few by hand) must parse back with json-glib to what went in, with
+ * null for doubles which aren't finite.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+/* libmatrix */
+#include "matrix-json.h"
+
+#include "bench.h"
+
+static const guint _depths[] = {0, 1, 2, 4, 6, G_MAXUINT};
+
+static GRand *_rand;
+static guint _failures;
+
+
+static void _usage(void)
+{
+    fprintf(stderr, "usage: test-json [-n COUNT] [-s SEED] [FILE...]\n");
+    exit(2);
+}
+
+
+/******************************************************************************
+ *
+ * made-up documents
+ */
+
+/* string contents, with runs long enough to cross vector boundaries, and
+ * the characters the scanners look for in awkward places */
+static void _random_string(GString *out)
+{
+    static const gchar *pieces[] = {"\\\"", "\\\\", "\\n", "\\u00e9",
+            "\\ud83d\\ude00", "{", "}", "[", "]", ":", ",", "\xc3\xa9",
+            "\xe2\x82\xac", "\xf0\x9f\x98\x80", " "};
+    gint len = g_rand_int_range(_rand, 0, 80), i;
+
+    g_string_append_c(out, '"');
+    for(i = 0; i < len; i++) {
+        if(g_rand_int_range(_rand, 0, 8) == 0)
+            g_string_append(out, pieces[g_rand_int_range(_rand, 0,
+                    G_N_ELEMENTS(pieces))]);
+        else
+            g_string_append_c(out, 'a' + g_rand_int_range(_rand, 0, 26));
+    }
+    g_string_append_c(out, '"');
+}
+
+static void _random_space(GString *out)
+{
+    static const gchar spaces[] = " \t\r\n";
+
+    while(g_rand_int_range(_rand, 0, 4) == 0)
+        g_string_append_c(out, spaces[g_rand_int_range(_rand, 0, 4)]);
+}
+
+static void _random_value(GString *out, guint depth)
+{
+    gint kind = g_rand_int_range(_rand, 0, depth < 6 ? 8 : 5), count, i;
+
+    switch(kind) {
+        case 0: case 1:
+            _random_string(out);
+            break;
+        case 2:
+            g_string_append_printf(out, "%d",
+                    g_rand_int_range(_rand, -100000, 100000));
+            break;
+        case 3:
+            g_string_append(out, g_rand_boolean(_rand) ? "true" : "false");
+            break;
+        case 4:
+            g_string_append(out, "null");
+            break;
+        case 5: case 6:
+            g_string_append_c(out, '{');
+            count = g_rand_int_range(_rand, 0, 6);
+            for(i = 0; i < count; i++) {
+                if(i > 0)
+                    g_string_append_c(out, ',');
+                _random_space(out);
+                _random_string(out);
+                _random_space(out);
+                g_string_append_c(out, ':');
+                _random_space(out);
+                _random_value(out, depth + 1);
+                _random_space(out);
+            }
+            g_string_append_c(out, '}');
+            break;
+        default:
+            g_string_append_c(out, '[');
+            count = g_rand_int_range(_rand, 0, 6);
+            for(i = 0; i < count; i++) {
+                if(i > 0)
+                    g_string_append_c(out, ',');
+                _random_space(out);
+                _random_value(out, depth + 1);
+                _random_space(out);
+            }
+            g_string_append_c(out, ']');
+            break;
+    }
+}
+
+static GString *_random_document(void)
+{
+    GString *doc = g_string_new(NULL);
+
+    /* the root is always an object, as for the responses we index */
+    do {
+        g_string_truncate(doc, 0);
+        _random_value(doc, 0);
+    } while(doc->str[0] != '{');
+    return doc;
+}
+
+
+/******************************************************************************
+ *
+ * comparing tapes
+ */
+
+/* everything the tape tells us, depth first */
+static void _describe(const MatrixJsonTape *tape, const gchar *json,
+        guint index, GString *out)
+{
+    const gchar *span;
+    gsize len;
+    gchar *name = matrix_json_tape_get_name(tape, index);
+    guint child;
+
+    span = matrix_json_tape_get_span(tape, index, &len);
+    g_string_append_printf(out, "%s@%" G_GSIZE_FORMAT "+%" G_GSIZE_FORMAT
+            "%s(", name == NULL ? "" : name, (gsize)(span - json), len,
+            matrix_json_tape_is_array(tape, index) ? "[]" : "");
+    g_free(name);
+    for(child = matrix_json_tape_first_child(tape, index);
+            child != MATRIX_JSON_TAPE_NONE;
+            child = matrix_json_tape_next_sibling(tape, child))
+        _describe(tape, json, child, out);
+    g_string_append_c(out, ')');
+}
+
+static gchar *_index(const gchar *json, gsize len, guint depth)
+{
+    MatrixJsonTape *tape = matrix_json_tape_new(json, len, depth);
+    GString *out;
+
+    if(tape == NULL)
+        return g_strdup("malformed");
+    out = g_string_new(NULL);
+    _describe(tape, json, 0, out);
+    matrix_json_tape_free(tape);
+    return g_string_free(out, FALSE);
+}
+
+static void _check_document(const gchar *what, const gchar *json, gsize len)
+{
+    guint d;
+
+    for(d = 0; d < G_N_ELEMENTS(_depths); d++) {
+        gchar *expected;
+        MatrixJsonScan scan;
+
+        matrix_json_set_scan(MATRIX_JSON_SCAN_SCALAR);
+        expected = _index(json, len, _depths[d]);
+        for(scan = MATRIX_JSON_SCAN_SCALAR + 1; scan < MATRIX_JSON_SCAN_COUNT;
+                scan++) {
+            gchar *got;
+
+            if(!matrix_json_set_scan(scan))
+                continue;
+            got = _index(json, len, _depths[d]);
+            if(strcmp(got, expected) != 0) {
+                printf("%s, depth %u: %s index differs from scalar\n", what,
+                        _depths[d], matrix_json_scan_name(scan));
+                _failures++;
+            }
+            g_free(got);
+        }
+        g_free(expected);
+    }
+}
+
+/* the document, and the same cut short or with a byte changed */
+static void _check_random_document(guint n)
+{
+    GString *doc = _random_document();
+    gchar *what = g_strdup_printf("document %u", n);
+    gchar *damaged;
+    gsize pos;
+
+    _check_document(what, doc->str, doc->len);
+
+    pos = g_rand_int_range(_rand, 0, doc->len);
+    _check_document(what, doc->str, pos);
+
+    damaged = g_strndup(doc->str, doc->len);
+    damaged[pos] = "\"\\{}[],: x"[g_rand_int_range(_rand, 0, 10)];
+    _check_document(what, damaged, doc->len);
+
+    g_free(damaged);
+    g_free(what);
+    g_string_free(doc, TRUE);
+}
+
+
+/******************************************************************************
+ *
+ * UTF-8
+ */
+
+static void _check_text(const gchar *what, const gchar *text, gsize len)
+{
+    gboolean expected = g_utf8_validate(text, len, NULL) &&
+            memchr(text, '\0', len) == NULL;
+    MatrixJsonScan scan;
+
+    for(scan = MATRIX_JSON_SCAN_SCALAR; scan < MATRIX_JSON_SCAN_COUNT;
+            scan++) {
+        if(!matrix_json_set_scan(scan))
+            continue;
+        if(matrix_json_validate_text(text, len) != expected) {
+            printf("%s: %s says %s\n", what, matrix_json_scan_name(scan),
+                    expected ? "invalid" : "valid");
+            _failures++;
+        }
+    }
+}
+
+static void _check_random_text(guint n)
+{
+    static const gchar *pieces[] = {"\xc3\xa9", "\xe2\x82\xac",
+            "\xf0\x9f\x98\x80", "\xed\x9f\xbf", "\xef\xbf\xbd",
+            /* broken: stray continuation, overlong, surrogate, too big,
+             * cut short, NUL */
+            "\x80", "\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xe2\x82",
+            "\0"};
+    GString *text = g_string_new(NULL);
+    gchar *what = g_strdup_printf("text %u", n);
+    gboolean broken = g_rand_boolean(_rand);
+    gint len = g_rand_int_range(_rand, 0, 200), i;
+
+    for(i = 0; i < len; i++) {
+        if(g_rand_int_range(_rand, 0, 16) == 0) {
+            gint piece = g_rand_int_range(_rand, 0,
+                    broken ? G_N_ELEMENTS(pieces) : 5);
+            /* the NUL is a string of its own */
+            g_string_append_len(text, pieces[piece],
+                    piece == G_N_ELEMENTS(pieces) - 1 ? 1 :
+                    strlen(pieces[piece]));
+        } else {
+            g_string_append_c(text, ' ' + g_rand_int_range(_rand, 0, 95));
+        }
+    }
+    _check_text(what, text->str, text->len);
+    /* and cut short, which may split a character */
+    if(text->len > 0)
+        _check_text(what, text->str, g_rand_int_range(_rand, 0, text->len));
+
+    g_free(what);
+    g_string_free(text, TRUE);
+}
+
+
+/******************************************************************************
+ *
+ * canonical JSON
+ */
+
+/* Input, and what matrix_canonical_json should make of it: the examples in
+ * the spec's appendix, then escapes and values it doesn't cover. Python's
+ * json.dumps(..., ensure_ascii=False, separators=(',', ':'),
+ * sort_keys=True) agrees with each of these.
+ */
+static const struct {
+    const gchar *json, *canonical;
+} _canonical_vectors[] = {
+    {"{}", "{}"},
+    {"{\"one\": 1, \"two\": \"Two\"}", "{\"one\":1,\"two\":\"Two\"}"},
+    {"{\"b\": \"2\", \"a\": \"1\"}", "{\"a\":\"1\",\"b\":\"2\"}"},
+    {"{\"auth\": {\"success\": true, \"mxid\": \"@john.doe:example.com\", "
+            "\"profile\": {\"display_name\": \"John Doe\", \"three_pids\": "
+            "[{\"medium\": \"email\", \"address\": \"john.doe@example.org\"}, "
+            "{\"medium\": \"msisdn\", \"address\": \"123456789\"}]}}}",
+     "{\"auth\":{\"mxid\":\"@john.doe:example.com\",\"profile\":"
+            "{\"display_name\":\"John Doe\",\"three_pids\":"
+            "[{\"address\":\"john.doe@example.org\",\"medium\":\"email\"},"
+            "{\"address\":\"123456789\",\"medium\":\"msisdn\"}]},"
+            "\"success\":true}}"},
+    {"{\"a\": \"\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\"}",
+     "{\"a\":\"\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\"}"},
+    {"{\"\xe6\x9c\xac\": 2, \"\xe6\x97\xa5\": 1}",
+     "{\"\xe6\x97\xa5\":1,\"\xe6\x9c\xac\":2}"},
+    {"{\"a\": \"\\u65E5\"}", "{\"a\":\"\xe6\x97\xa5\"}"},
+    {"{\"a\": null}", "{\"a\":null}"},
+    /* the short escapes; other control characters as \u00XX, in lower
+     * case; '/' and DEL as themselves */
+    {"{\"a\": \"\\\"\\\\\\/\\b\\f\\n\\r\\t\\u0001\\u001F\\u007f\"}",
+     "{\"a\":\"\\\"\\\\/\\b\\f\\n\\r\\t\\u0001\\u001f\x7f\"}"},
+    {"{\"\\n\\u0002\": \"\", \"\\\"\": \"\"}",
+     "{\"\\n\\u0002\":\"\",\"\\\"\":\"\"}"},
+    {"{\"n\": [-9007199254740991, -1, 0, 9007199254740991], "
+            "\"t\": true, \"f\": false}",
+     "{\"f\":false,\"n\":[-9007199254740991,-1,0,9007199254740991],"
+            "\"t\":true}"},
+    /* members are sorted by bytes, at every level */
+    {"{\"ab\": 1, \"a\": {\"c\": [], \"b\": [{\"z\": 1, \"y\": [[], {}]}]}, "
+            "\"B\": 0, \"\": 2}",
+     "{\"\":2,\"B\":0,\"a\":{\"b\":[{\"y\":[[],{}],\"z\":1}],\"c\":[]},"
+            "\"ab\":1}"},
+    /* more members than canonical_json_object sorts on the stack */
+    {"{\"k19\": 0, \"k18\": 1, \"k17\": 2, \"k16\": 3, \"k15\": 4, "
+            "\"k14\": 5, \"k13\": 6, \"k12\": 7, \"k11\": 8, \"k10\": 9, "
+            "\"k09\": 10, \"k08\": 11, \"k07\": 12, \"k06\": 13, "
+            "\"k05\": 14, \"k04\": 15, \"k03\": 16, \"k02\": 17, "
+            "\"k01\": 18, \"k00\": 19}",
+     "{\"k00\":19,\"k01\":18,\"k02\":17,\"k03\":16,\"k04\":15,"
+            "\"k05\":14,\"k06\":13,\"k07\":12,\"k08\":11,\"k09\":10,"
+            "\"k10\":9,\"k11\":8,\"k12\":7,\"k13\":6,\"k14\":5,\"k15\":4,"
+            "\"k16\":3,\"k17\":2,\"k18\":1,\"k19\":0}"},
+};
+
+static void _check_canonical(void)
+{
+    guint i;
+
+    for(i = 0; i < G_N_ELEMENTS(_canonical_vectors); i++) {
+        JsonParser *parser = json_parser_new();
+        GString *got;
+
+        if(!json_parser_load_from_data(parser, _canonical_vectors[i].json, -1,
+                NULL)) {
+            printf("canonical %u: can't parse the input\n", i);
+            _failures++;
+            g_object_unref(parser);
+            continue;
+        }
+        got = matrix_canonical_json(json_node_get_object(
+                json_parser_get_root(parser)));
+        if(strcmp(got->str, _canonical_vectors[i].canonical) != 0) {
+            printf("canonical %u: got %s, not %s\n", i, got->str,
+                    _canonical_vectors[i].canonical);
+            _failures++;
+        }
+        g_string_free(got, TRUE);
+        g_object_unref(parser);
+    }
+}
+
+
+
+/******************************************************************************
+ *
+ * writing JSON
+ */
+
+static gboolean _same_node(JsonNode *a, JsonNode *b);
+
+static gboolean _same_object(JsonObject *a, JsonObject *b)
+{
+    JsonObjectIter iter;
+    const gchar *name;
+    JsonNode *node;
+
+    if(json_object_get_size(a) != json_object_get_size(b))
+        return FALSE;
+    json_object_iter_init(&iter, a);
+    while(json_object_iter_next(&iter, &name, &node)) {
+        JsonNode *other = json_object_get_member(b, name);
+        if(other == NULL || !_same_node(node, other))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* TRUE if the trees hold the same values. A double with nothing after the
+ * point is written without one, and so comes back as an integer. */
+static gboolean _same_node(JsonNode *a, JsonNode *b)
+{
+    JsonArray *array_a, *array_b;
+    GType type_a, type_b;
+    guint i;
+
+    if(json_node_get_node_type(a) != json_node_get_node_type(b))
+        return FALSE;
+
+    switch(json_node_get_node_type(a)) {
+        case JSON_NODE_OBJECT:
+            return _same_object(json_node_get_object(a),
+                    json_node_get_object(b));
+
+        case JSON_NODE_ARRAY:
+            array_a = json_node_get_array(a);
+            array_b = json_node_get_array(b);
+            if(json_array_get_length(array_a) !=
+                    json_array_get_length(array_b))
+                return FALSE;
+            for(i = 0; i < json_array_get_length(array_a); i++)
+                if(!_same_node(json_array_get_element(array_a, i),
+                        json_array_get_element(array_b, i)))
+                    return FALSE;
+            return TRUE;
+
+        case JSON_NODE_NULL:
+            return TRUE;
+
+        case JSON_NODE_VALUE:
+            break;
+    }
+
+    type_a = json_node_get_value_type(a);
+    type_b = json_node_get_value_type(b);
+    if(type_a == G_TYPE_DOUBLE || type_b == G_TYPE_DOUBLE) {
+        gdouble value_a = type_a == G_TYPE_DOUBLE ? json_node_get_double(a)
+                : json_node_get_int(a);
+        gdouble value_b = type_b == G_TYPE_DOUBLE ? json_node_get_double(b)
+                : json_node_get_int(b);
+        return (type_a == G_TYPE_DOUBLE || type_a == G_TYPE_INT64) &&
+                (type_b == G_TYPE_DOUBLE || type_b == G_TYPE_INT64) &&
+                value_a == value_b;
+    }
+    if(type_a != type_b)
+        return FALSE;
+    switch(type_a) {
+        case G_TYPE_STRING:
+            return strcmp(json_node_get_string(a),
+                    json_node_get_string(b)) == 0;
+        case G_TYPE_INT64:
+            return json_node_get_int(a) == json_node_get_int(b);
+        case G_TYPE_BOOLEAN:
+            return !json_node_get_boolean(a) == !json_node_get_boolean(b);
+        default:
+            return FALSE;
+    }
+}
+
+/* Parse what the writer wrote with json-glib, and compare it with
+ * expected, which is JSON text too */
+static void _check_written(const gchar *what, const GString *written,
+        const gchar *expected)
+{
+    JsonParser *got_parser = json_parser_new();
+    JsonParser *expected_parser = json_parser_new();
+
+    if(!json_parser_load_from_data(expected_parser, expected, -1, NULL)) {
+        printf("%s: can't parse the expected value\n", what);
+        _failures++;
+    } else if(!json_parser_load_from_data(got_parser, written->str,
+            written->len, NULL)) {
+        printf("%s: wrote %s, which json-glib can't parse\n", what,
+                written->str);
+        _failures++;
+    } else if(!_same_node(json_parser_get_root(got_parser),
+            json_parser_get_root(expected_parser))) {
+        printf("%s: wrote %s, not %s\n", what, written->str, expected);
+        _failures++;
+    }
+    g_object_unref(got_parser);
+    g_object_unref(expected_parser);
+}
+
+/* each of the writer's own calls, with the characters which need escapes */
+static void _check_writer_calls(void)
+{
+    GString *out = g_string_new(NULL);
+    MatrixJsonWriter writer;
+
+    matrix_json_writer_init(&writer, out);
+    matrix_json_writer_begin_object(&writer);
+    matrix_json_writer_member(&writer, "body");
+    matrix_json_writer_string(&writer,
+            "\"quoted\" \\ / \b\f\n\r\t\x01\x1f\x7f \xc3\xa9 "
+            "\xf0\x9f\x98\x80");
+    matrix_json_writer_member(&writer, "\n\"");
+    matrix_json_writer_string(&writer, "");
+    matrix_json_writer_member(&writer, "ints");
+    matrix_json_writer_begin_object(&writer);
+    matrix_json_writer_member(&writer, "min");
+    matrix_json_writer_int(&writer, G_MININT64);
+    matrix_json_writer_member(&writer, "zero");
+    matrix_json_writer_int(&writer, 0);
+    matrix_json_writer_member(&writer, "max");
+    matrix_json_writer_int(&writer, G_MAXINT64);
+    matrix_json_writer_end_object(&writer);
+    matrix_json_writer_member(&writer, "empty");
+    matrix_json_writer_begin_object(&writer);
+    matrix_json_writer_end_object(&writer);
+    matrix_json_writer_member(&writer, "true");
+    matrix_json_writer_boolean(&writer, TRUE);
+    matrix_json_writer_member(&writer, "false");
+    matrix_json_writer_boolean(&writer, FALSE);
+    matrix_json_writer_end_object(&writer);
+
+    _check_written("writer calls", out,
+            "{\"body\": \"\\\"quoted\\\" \\\\ \\/ \\b\\f\\n\\r\\t"
+            "\\u0001\\u001F\\u007F \\u00e9 \\ud83d\\ude00\", "
+            "\"\\n\\\"\": \"\", "
+            "\"ints\": {\"min\": -9223372036854775808, \"zero\": 0, "
+            "\"max\": 9223372036854775807}, "
+            "\"empty\": {}, \"true\": true, \"false\": false}");
+    g_string_free(out, TRUE);
+}
+
+/* doubles, which JSON can hold only when they are finite */
+static void _check_writer_doubles(void)
+{
+    JsonObject *object = json_object_new();
+    JsonArray *array = json_array_new();
+    GString *out = g_string_new(NULL);
+    MatrixJsonWriter writer;
+
+    json_object_set_double_member(object, "half", 0.5);
+    json_object_set_double_member(object, "tenth", 0.1);
+    json_object_set_double_member(object, "third", -1.0 / 3);
+    json_object_set_double_member(object, "whole", 2.0);
+    json_object_set_double_member(object, "big", 1.7976931348623157e308);
+    json_object_set_double_member(object, "tiny", 5e-324);
+    json_object_set_double_member(object, "nan", NAN);
+    json_object_set_double_member(object, "inf", INFINITY);
+    json_object_set_double_member(object, "-inf", -INFINITY);
+    json_array_add_double_element(array, NAN);
+    json_array_add_double_element(array, 1.5);
+    json_array_add_double_element(array, -INFINITY);
+    json_object_set_array_member(object, "list", array);
+
+    matrix_json_writer_init(&writer, out);
+    matrix_json_writer_object(&writer, object);
+    _check_written("doubles", out,
+            "{\"half\": 0.5, \"tenth\": 0.1, "
+            "\"third\": -0.33333333333333331, \"whole\": 2, "
+            "\"big\": 1.7976931348623157e308, \"tiny\": 5e-324, "
+            "\"nan\": null, \"inf\": null, \"-inf\": null, "
+            "\"list\": [null, 1.5, null]}");
+
+    g_string_free(out, TRUE);
+    json_object_unref(object);
+}
+
+/* made-up documents, parsed with json-glib and written out again */
+static void _check_writer_random(guint n)
+{
+    GString *doc = _random_document(), *out = g_string_new(NULL);
+    JsonParser *parser = json_parser_new();
+    MatrixJsonWriter writer;
+    gchar *what = g_strdup_printf("written document %u", n);
+
+    if(!json_parser_load_from_data(parser, doc->str, doc->len, NULL)) {
+        printf("%s: json-glib can't parse %s\n", what, doc->str);
+        _failures++;
+    } else {
+        matrix_json_writer_init(&writer, out);
+        matrix_json_writer_object(&writer, json_node_get_object(
+                json_parser_get_root(parser)));
+        _check_written(what, out, doc->str);
+    }
+    g_free(what);
+    g_object_unref(parser);
+    g_string_free(out, TRUE);
+    g_string_free(doc, TRUE);
+}
+
+
+int main(int argc, char *argv[])
+{
+    guint count = 500, seed = 1, i;
+    MatrixJsonScan scan;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch(opt) {
+            case 'n': count = atoi(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            default: _usage();
+        }
+    }
+
+    printf("scanning with:");
+    for(scan = MATRIX_JSON_SCAN_SCALAR; scan < MATRIX_JSON_SCAN_COUNT; scan++)
+        if(matrix_json_set_scan(scan))
+            printf(" %s", matrix_json_scan_name(scan));
+    printf("\n");
+
+    _rand = g_rand_new_with_seed(seed);
+    for(i = 0; i < count; i++) {
+        _check_random_document(i);
+        _check_random_text(i);
+    }
+    g_rand_free(_rand);
+
+    for(i = optind; i < (guint)argc; i++) {
+        gsize len;
+        gchar *json = bench_read_file(argv[i], &len);
+        _check_document(argv[i], json, len);
+        _check_text(argv[i], json, len);
+        g_free(json);
+    }
+
+    _check_canonical();
+
+    _check_writer_calls();
+    _check_writer_doubles();
+    _rand = g_rand_new_with_seed(seed);
+    for(i = 0; i < count; i++)
+        _check_writer_random(i);
+    g_rand_free(_rand);
+
+    printf("%u documents, %u texts, %d files, %u canonical, %u written: "
+            "%u failures\n", count, count, argc - optind,
+            (guint)G_N_ELEMENTS(_canonical_vectors), count + 2, _failures);
+    return _failures == 0 ? 0 : 1;
+}
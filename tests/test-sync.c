@@ -0,0 +1,268 @@
+/**
+ * test-sync.c: log in to a homeserver and sync, as the plugin does
+ *
+ *   test-sync [-l] [-s] [-m MEMBERS] [-v] URL
+ *
+ * We log in to the homeserver at URL (fake-homeserver.py, for instance) with
+ * a made-up access token, and run the sync loop until the first response
+ * has been applied. Then, as if the user had started typing in one of the
+ * rooms, we wait for its full member list to be fetched, and check that
+ * MEMBERS (21 by default, as fake-homeserver.py makes) are in it, however
+ * few the sync itself told us about.
+ *
+ *   -l  then leave the room, as another client would, and check that the
+ *       plugin sees that we have left, and that the room isn't restored
+ *       from disk when we connect again
+ *   -s  use sliding sync (see PRPL_ACCOUNT_OPT_SLIDING_SYNC)
+ *   -v  write the debug log to stderr
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+/* libpurple */
+#include "account.h"
+#include "connection.h"
+#include "conversation.h"
+
+/* libmatrix */
+#include "libmatrix.h"
+#include "matrix-api.h"
+#include "matrix-connection.h"
+#include "matrix-room.h"
+
+#include "purple-stubs.h"
+
+/* how long to wait for each step (seconds) */
+#define TIMEOUT 30
+
+static gboolean _timed_out;
+static guint _members;
+static gchar *_next_batch;
+
+
+static void _usage(void)
+{
+    fprintf(stderr, "usage: test-sync [-l] [-s] [-m MEMBERS] [-v] URL\n");
+    exit(2);
+}
+
+
+static gboolean _timeout_cb(gpointer user_data)
+{
+    _timed_out = TRUE;
+    return FALSE;
+}
+
+
+/* run the main loop until done(pc, conv), or something goes wrong */
+static gboolean _wait(const gchar *what,
+        gboolean (*done)(PurpleConnection *, PurpleConversation *),
+        PurpleConnection *pc, PurpleConversation *conv)
+{
+    guint timeout = g_timeout_add_seconds(TIMEOUT, _timeout_cb, NULL);
+
+    _timed_out = FALSE;
+    while(!done(pc, conv) && !_timed_out && purple_stubs_counts.errors == 0)
+        g_main_context_iteration(NULL, TRUE);
+    if(!_timed_out)
+        g_source_remove(timeout);
+
+    if(done(pc, conv))
+        return TRUE;
+    printf("%s: %s\n", what, _timed_out ? "timed out" : "connection error");
+    return FALSE;
+}
+
+
+/* the token is saved once the first response has been applied */
+static gboolean _first_sync_done(PurpleConnection *pc,
+        PurpleConversation *conv)
+{
+    return purple_account_get_string(pc->account,
+            PRPL_ACCOUNT_OPT_NEXT_BATCH, NULL) != NULL;
+}
+
+
+static gboolean _members_arrived(PurpleConnection *pc,
+        PurpleConversation *conv)
+{
+    return purple_stubs_chat_user_count(conv) >= _members;
+}
+
+
+/* the chat is marked as left, and the sync which said so has been saved */
+static gboolean _chat_left(PurpleConnection *pc, PurpleConversation *conv)
+{
+    return purple_conv_chat_has_left(PURPLE_CONV_CHAT(conv)) &&
+            g_strcmp0(_next_batch, purple_account_get_string(pc->account,
+                    PRPL_ACCOUNT_OPT_NEXT_BATCH, NULL)) != 0;
+}
+
+
+static gboolean _rooms_restored(PurpleConnection *pc,
+        PurpleConversation *conv)
+{
+    return purple_get_conversations() != NULL;
+}
+
+
+static PurpleConnection *_connect(const gchar *url, gboolean sliding_sync)
+{
+    PurpleConnection *pc = purple_stubs_connect("@me:localhost");
+
+    purple_account_set_string(pc->account, PRPL_ACCOUNT_OPT_HOME_SERVER, url);
+    purple_account_set_string(pc->account, PRPL_ACCOUNT_OPT_ACCESS_TOKEN,
+            "token");
+    purple_account_set_bool(pc->account, PRPL_ACCOUNT_OPT_SLIDING_SYNC,
+            sliding_sync);
+    return pc;
+}
+
+
+/**
+ * leave conv's room behind the plugin's back, then connect again with the
+ * same sync token and state store
+ */
+static gboolean _leave_and_reconnect(PurpleConnection **pcp,
+        PurpleConversation *conv, gboolean sliding_sync)
+{
+    PurpleConnection *pc = *pcp;
+    const gchar *url = purple_account_get_string(pc->account,
+            PRPL_ACCOUNT_OPT_HOME_SERVER, NULL);
+    gchar *room_id = g_strdup(conv->name), *saved_url = g_strdup(url);
+    guint rooms = g_list_length(purple_get_conversations()) - 1, restored;
+    gboolean ok = FALSE;
+
+    _next_batch = g_strdup(purple_account_get_string(pc->account,
+            PRPL_ACCOUNT_OPT_NEXT_BATCH, NULL));
+    matrix_api_leave_room(purple_connection_get_protocol_data(pc), room_id,
+            NULL, NULL, NULL, NULL);
+    if(!_wait("leaving", _chat_left, pc, conv))
+        goto out;
+    g_free(_next_batch);
+    _next_batch = g_strdup(purple_account_get_string(pc->account,
+            PRPL_ACCOUNT_OPT_NEXT_BATCH, NULL));
+
+    matrix_connection_free(pc);
+    purple_stubs_disconnect(pc);
+    *pcp = pc = _connect(saved_url, sliding_sync);
+    purple_account_set_string(pc->account, PRPL_ACCOUNT_OPT_NEXT_BATCH,
+            _next_batch);
+    matrix_connection_new(pc);
+    matrix_connection_start_login(pc);
+    if(!_wait("reconnecting", _rooms_restored, pc, NULL))
+        goto out;
+
+    restored = g_list_length(purple_get_conversations());
+    printf("%s: left; %u of %u rooms restored\n", room_id, restored,
+            rooms + 1);
+    ok = restored == rooms && purple_find_conversation_with_account(
+            PURPLE_CONV_TYPE_CHAT, room_id, pc->account) == NULL;
+
+out:
+    g_free(room_id);
+    g_free(saved_url);
+    return ok;
+}
+
+
+/* the state store is the only thing we leave in there */
+static void _remove_dir(const gchar *dirname)
+{
+    GDir *dir = g_dir_open(dirname, 0, NULL);
+    const gchar *name;
+
+    if(dir == NULL)
+        return;
+    while((name = g_dir_read_name(dir)) != NULL) {
+        gchar *path = g_build_filename(dirname, name, NULL);
+        g_remove(path);
+        g_free(path);
+    }
+    g_dir_close(dir);
+    g_rmdir(dirname);
+}
+
+
+int main(int argc, char *argv[])
+{
+    gboolean sliding_sync = FALSE, leave = FALSE, debug = FALSE, ok = FALSE;
+    PurpleConnection *pc;
+    PurpleConversation *conv;
+    gchar *user_dir;
+    GError *error = NULL;
+    guint synced_members;
+    int opt;
+
+    _members = 21;
+    while((opt = getopt(argc, argv, "lsm:v")) != -1) {
+        switch(opt) {
+            case 'l': leave = TRUE; break;
+            case 's': sliding_sync = TRUE; break;
+            case 'm': _members = atoi(optarg); break;
+            case 'v': debug = TRUE; break;
+            default: _usage();
+        }
+    }
+    if(optind != argc - 1 || _members == 0)
+        _usage();
+
+    user_dir = g_dir_make_tmp("test-sync-XXXXXX", &error);
+    if(user_dir == NULL) {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    purple_stubs_init(user_dir, debug);
+    pc = _connect(argv[optind], sliding_sync);
+    matrix_connection_new(pc);
+    matrix_connection_start_login(pc);
+
+    if(!_wait("first sync", _first_sync_done, pc, NULL))
+        goto out;
+    if(purple_get_conversations() == NULL) {
+        printf("first sync: no rooms\n");
+        goto out;
+    }
+
+    /* the user starts typing in a room */
+    conv = purple_get_conversations()->data;
+    synced_members = purple_stubs_chat_user_count(conv);
+    matrix_room_send_typing(conv, TRUE);
+    if(!_wait(conv->name, _members_arrived, pc, conv))
+        goto out;
+
+    printf("%s: %u members after the first sync, %u after fetching them\n",
+            conv->name, synced_members, purple_stubs_chat_user_count(conv));
+    ok = purple_stubs_chat_user_count(conv) == _members;
+    if(ok && leave)
+        ok = _leave_and_reconnect(&pc, conv, sliding_sync);
+
+out:
+    printf("%s: %s\n", sliding_sync ? "sliding sync" : "sync",
+            ok ? "ok" : "FAILED");
+    matrix_connection_free(pc);
+    purple_stubs_disconnect(pc);
+    _remove_dir(user_dir);
+    g_free(user_dir);
+    g_free(_next_batch);
+    return ok ? 0 : 1;
+}